@@ -0,0 +1,151 @@
+#include <stdexcept>
+
+#include "attention.h"
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/attention_kernel.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<AttentionKernelFn> attention_stub(ATTENTION_KERNEL);
+
+AttentionOperand make_operand(const core::TensorView& view,
+                              size_t dim,
+                              const char* name)
+{
+  LEGRAD_CHECK_AND_THROW(
+      view.dtype == TypeInfo::Float32 || view.dtype == TypeInfo::Float16,
+      std::invalid_argument, "Attention does not support {} {}",
+      core::TypeInfoToString(view.dtype), name);
+  LEGRAD_CHECK_AND_THROW(view.dim() == dim, std::invalid_argument,
+                         "Attention {} has {} dims, expected {}", name,
+                         view.dim(), dim);
+  AttentionOperand op;
+  op.data = view.data;
+  op.dtype = view.dtype;
+  // Without a batch dim every operand has a single entry
+  const size_t d = dim - 3;
+  op.batch_stride = dim == 4 ? view.stride_at(0) : 0;
+  op.head_stride = view.stride_at(d);
+  op.seq_stride = view.stride_at(d + 1);
+  op.dim_stride = view.stride_at(d + 2);
+  return op;
+}
+
+AttentionArgs make_args(const core::TensorView& out,
+                        const core::TensorView& q,
+                        const core::TensorView& k,
+                        const core::TensorView& v,
+                        float scale,
+                        bool causal)
+{
+  const size_t dim = q.dim();
+  LEGRAD_CHECK_AND_THROW(
+      dim == 3 || dim == 4, std::invalid_argument,
+      "Attention expects [batch,] heads, seq, dim operands, got q {}",
+      IntArrayView::numerical_view_2str(q.shape()));
+
+  AttentionArgs args;
+  args.q = make_operand(q, dim, "q");
+  args.k = make_operand(k, dim, "k");
+  args.v = make_operand(v, dim, "v");
+  args.out = make_operand(out, dim, "out");
+  const size_t d = dim - 3;
+  args.batch = dim == 4 ? q.shape_at(0) : 1;
+  args.q_heads = q.shape_at(d);
+  args.kv_heads = k.shape_at(d);
+  args.q_len = q.shape_at(d + 1);
+  args.kv_len = k.shape_at(d + 1);
+  args.head_dim = q.shape_at(d + 2);
+  args.v_dim = v.shape_at(d + 2);
+  args.scale = scale;
+  args.causal = causal;
+  args.causal_offset = args.kv_len - args.q_len;
+
+  const bool batch_ok = dim == 3
+                        || (k.shape_at(0) == args.batch
+                            && v.shape_at(0) == args.batch
+                            && out.shape_at(0) == args.batch);
+  LEGRAD_CHECK_AND_THROW(
+      batch_ok && args.kv_heads > 0 && args.q_heads % args.kv_heads == 0
+          && k.shape_at(d + 2) == args.head_dim
+          && v.shape_at(d) == args.kv_heads && v.shape_at(d + 1) == args.kv_len
+          && out.shape_at(d) == args.q_heads
+          && out.shape_at(d + 1) == args.q_len
+          && out.shape_at(d + 2) == args.v_dim,
+      std::invalid_argument,
+      "Attention shape mismatch: q {}, k {}, v {}, out {}",
+      IntArrayView::numerical_view_2str(q.shape()),
+      IntArrayView::numerical_view_2str(k.shape()),
+      IntArrayView::numerical_view_2str(v.shape()),
+      IntArrayView::numerical_view_2str(out.shape()));
+  LEGRAD_CHECK_AND_THROW(k.dtype == v.dtype, std::invalid_argument,
+                         "Attention expects K and V of the same dtype, got {} "
+                         "and {}",
+                         core::TypeInfoToString(k.dtype),
+                         core::TypeInfoToString(v.dtype));
+  return args;
+}
+
+// The kernel over the first *kv_len keys, read when it runs
+void run_cached(AttentionKernelFn fn,
+                const AttentionArgs& args,
+                const Int* kv_len)
+{
+  AttentionArgs step = args;
+  step.kv_len = *kv_len;
+  step.causal_offset = step.kv_len - step.q_len;
+  fn(step);
+}
+}  // namespace
+
+void attention(const core::TensorView& out,
+               const core::TensorView& q,
+               const core::TensorView& k,
+               const core::TensorView& v,
+               float scale,
+               bool causal)
+{
+  const AttentionArgs args = make_args(out, q, k, v, scale, causal);
+  if (out.numel() == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("Attention {} x {} q heads / {} kv heads, {} queries, {} "
+                   "keys{}",
+                   args.batch, args.q_heads, args.kv_heads, args.q_len,
+                   args.kv_len, causal ? ", causal" : "");
+  launch(attention_stub.get(k.dtype), args);
+}
+
+void attention(const core::TensorView& out,
+               const core::TensorView& q,
+               const core::TensorView& k,
+               const core::TensorView& v,
+               float scale,
+               bool causal,
+               const Int* kv_len)
+{
+  const AttentionArgs args = make_args(out, q, k, v, scale, causal);
+  LEGRAD_CHECK_AND_THROW(
+      kv_len != nullptr && *kv_len >= args.q_len && *kv_len <= args.kv_len,
+      std::invalid_argument,
+      "Attention over a cache of {} keys needs {} to {} of them, got {}",
+      args.kv_len, args.q_len, args.kv_len, kv_len ? *kv_len : -1);
+  if (out.numel() == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("Attention {} x {} q heads / {} kv heads, {} queries, up "
+                   "to {} cached keys",
+                   args.batch, args.q_heads, args.kv_heads, args.q_len,
+                   args.kv_len);
+  launch(run_cached, attention_stub.get(k.dtype), args, kv_len);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "core/tensor_view.h"
+
+namespace legrad::cpu
+{
+/*
+ * out = softmax(q @ k^T * scale [+ causal mask]) @ v without the score
+ * matrix: keys are processed in tiles and every query keeps a running max,
+ * sum and output (flash attention), so the working set is a K/V tile and a
+ * block of queries whatever the context length.
+ *   q   [batch, q_heads, q_len, head_dim]
+ *   k   [batch, kv_heads, kv_len, head_dim]
+ *   v   [batch, kv_heads, kv_len, v_dim]
+ *   out [batch, q_heads, q_len, v_dim]
+ * The batch dim is optional. kv_heads has to divide q_heads (GQA/MQA), the
+ * q heads of a group are processed together so each K/V tile (Float16 KV
+ * cache included) is read and converted once for all of them. Every operand
+ * can be Float32 or Float16 with any strides, e.g. [seq, heads, dim] memory
+ * permuted to [heads, seq, dim].
+ * With `causal`, the queries are the last q_len tokens: query i sees the keys
+ * up to i + kv_len - q_len.
+ */
+void attention(const core::TensorView& out,
+               const core::TensorView& q,
+               const core::TensorView& k,
+               const core::TensorView& v,
+               float scale,
+               bool causal);
+
+/*
+ * attention() over the first *kv_len keys of `k` and `v`, views of a whole KV
+ * cache. *kv_len is read when the kernel runs: a decode step captured once
+ * (see KernelCapture) sees the keys cached so far at every replay. It must
+ * stay between q_len and the cache length.
+ */
+void attention(const core::TensorView& out,
+               const core::TensorView& q,
+               const core::TensorView& k,
+               const core::TensorView& v,
+               float scale,
+               bool causal,
+               const Int* kv_len);
+}  // namespace legrad::cpu
@@ -0,0 +1,31 @@
+#include <stdexcept>
+
+#include "capture.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+thread_local KernelCapture* current_capture_ = nullptr;
+}  // namespace
+
+KernelCapture::KernelCapture(CapturedKernels* kernels)
+    : kernels_(kernels)
+    , prev_(current_capture_)
+{
+  LEGRAD_CHECK_AND_THROW(kernels_ != nullptr, std::invalid_argument,
+                         "KernelCapture needs somewhere to record", 0);
+  current_capture_ = this;
+}
+
+KernelCapture::~KernelCapture()
+{
+  current_capture_ = prev_;
+}
+
+KernelCapture* KernelCapture::current()
+{
+  return current_capture_;
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace legrad::cpu
+{
+/*
+ * Kernel calls recorded once and replayed many times: the op front-ends did
+ * all their work (checks, loop plans, kernel lookup) when they were recorded,
+ * a replay is a plain loop over kernel function pointers and their arguments.
+ * The views of the recorded ops must stay valid, the values behind them can
+ * change between replays.
+ */
+class CapturedKernels
+{
+public:
+  using Call = std::function<void()>;
+
+  void replay() const
+  {
+    for (const Call& call : calls_) {
+      call();
+    }
+  }
+
+  size_t size() const { return calls_.size(); }
+  bool empty() const { return calls_.empty(); }
+
+private:
+  friend class KernelCapture;
+
+  std::vector<Call> calls_;
+  // Scratch the calls point to (see capture_scratch)
+  std::vector<std::shared_ptr<void>> scratch_;
+};
+
+/*
+ * For its scope, the op front-ends called on this thread record their kernel
+ * calls instead of running them (see launch), nothing is computed:
+ *
+ *   CapturedKernels step;
+ *   {
+ *     KernelCapture capture(&step);
+ *     rms_norm(h, x, w, eps);
+ *     gemm(q, h, wq);
+ *   }
+ *   step.replay();  // every token
+ *
+ * Front-ends called by a parallel_for body run on other threads and are not
+ * recorded, so a front-end launches its parallel work as one call.
+ */
+class KernelCapture
+{
+public:
+  explicit KernelCapture(CapturedKernels* kernels);
+  ~KernelCapture();
+
+  KernelCapture(const KernelCapture&) = delete;
+  KernelCapture& operator=(const KernelCapture&) = delete;
+
+  // The capture of this thread, nullptr when kernels run right away
+  static KernelCapture* current();
+
+  void record(CapturedKernels::Call call)
+  {
+    kernels_->calls_.push_back(std::move(call));
+  }
+
+  // A copy of `values` that lives as long as the captured kernels
+  template <typename T>
+  T* keep(const std::vector<T>& values)
+  {
+    auto kept = std::make_shared<std::vector<T>>(values);
+    kernels_->scratch_.push_back(kept);
+    return kept->data();
+  }
+
+  // A copy of `value` that lives as long as the captured kernels
+  template <typename T>
+  T* keep(const T& value)
+  {
+    auto kept = std::make_shared<T>(value);
+    kernels_->scratch_.push_back(kept);
+    return kept.get();
+  }
+
+private:
+  CapturedKernels* kernels_;
+  KernelCapture* prev_;
+};
+
+/*
+ * fn(args...) now, or recorded with copies of `args` under a KernelCapture.
+ * Front-ends call their kernel through it.
+ */
+template <typename Fn, typename... Args>
+void launch(Fn fn, const Args&... args)
+{
+  KernelCapture* capture = KernelCapture::current();
+  if (capture == nullptr) {
+    fn(args...);
+    return;
+  }
+  capture->record([fn, args...] { fn(args...); });
+}
+
+/*
+ * Data of a local buffer a kernel argument points to (a workspace, offsets):
+ * `values` itself, or a copy kept with the capture
+ */
+template <typename T>
+T* capture_scratch(std::vector<T>& values)
+{
+  KernelCapture* capture = KernelCapture::current();
+  return capture == nullptr ? values.data() : capture->keep(values);
+}
+
+// Same for a single local value (a scalar operand)
+template <typename T>
+T* capture_scratch(T& value)
+{
+  KernelCapture* capture = KernelCapture::current();
+  return capture == nullptr ? &value : capture->keep(value);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,46 @@
+#include <stdexcept>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/cast_kernel.h"
+#include "backend/cpu/loops.h"
+#include "cast.h"
+#include "core/kernel_registry.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+core::KernelStub<CastKernelFn> cast_stub(CAST_KERNEL);
+
+void run_cast(const core::TensorView& out,
+              const core::TensorView& in,
+              const CastParams& params)
+{
+  if (out.numel() == 0) {
+    return;
+  }
+
+  const LoopPlan<2> plan = make_loop_plan<2>({&out, &in});
+  LEGRAD_LOG_TRACE("Cast {} -> {} over {} elements in {} dims",
+                   core::TypeInfoToString(in.dtype),
+                   core::TypeInfoToString(out.dtype), plan.numel, plan.dim());
+  launch(cast_stub.get(in.dtype), out.dtype, plan, params);
+}
+}  // namespace
+
+void cast(const core::TensorView& out,
+          const core::TensorView& in,
+          RoundMode mode)
+{
+  run_cast(out, in, CastParams{false, 1.0f, mode});
+}
+
+void cast_scaled(const core::TensorView& out,
+                 const core::TensorView& in,
+                 float scale,
+                 RoundMode mode)
+{
+  run_cast(out, in, CastParams{true, scale, mode});
+}
+}  // namespace legrad::cpu
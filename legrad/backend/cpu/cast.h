@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+#include "core/tensor_view.h"
+#include "internal/enum_impl.h"
+
+namespace legrad::cpu
+{
+LEGRAD_ENUM(RoundMode, uint8_t, Truncate, Nearest, Truncate, Nearest, COUNT)
+
+/*
+ * out = in converted to out.dtype, `in` is broadcast to the shape of `out`.
+ * Every pair of TypeInfo is supported:
+ * - integer narrowing wraps around (same as static_cast)
+ * - float to integer saturates to the integer range, NaN becomes 0, the
+ *   fractional part is truncated or rounded to nearest even (`mode`)
+ * - anything to Bool is `value != 0`
+ */
+void cast(const core::TensorView& out,
+          const core::TensorView& in,
+          RoundMode mode = RoundMode::Truncate);
+
+/*
+ * out = convert(float(in) * scale), computed in float. This is dequantization
+ * (e.g. Int8 -> Float32 with the block scale) or quantization (Float32 ->
+ * Int8 with 1 / scale, saturated and rounded to nearest).
+ */
+void cast_scaled(const core::TensorView& out,
+                 const core::TensorView& in,
+                 float scale,
+                 RoundMode mode = RoundMode::Nearest);
+}  // namespace legrad::cpu
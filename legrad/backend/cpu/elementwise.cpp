@@ -0,0 +1,85 @@
+#include <stdexcept>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/elementwise_kernel.h"
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "elementwise.h"
+#include "fused.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<BinaryKernelFn> binary_stub(BINARY_KERNEL);
+core::KernelStub<ActivationKernelFn> activation_stub(ACTIVATION_KERNEL);
+}  // namespace
+
+void binary(BinaryOp op,
+            const core::TensorView& out,
+            const core::TensorView& a,
+            const core::TensorView& b)
+{
+  LEGRAD_CHECK_AND_THROW(
+      out.dtype == a.dtype && out.dtype == b.dtype, std::invalid_argument,
+      "BinaryOp {} expects the same dtype, got out: {}, a: {}, b: {}",
+      BinaryOpToString(op), core::TypeInfoToString(out.dtype),
+      core::TypeInfoToString(a.dtype), core::TypeInfoToString(b.dtype));
+
+  if (out.numel() == 0) {
+    return;
+  }
+
+  const LoopPlan<3> plan = make_loop_plan<3>({&out, &a, &b});
+  LEGRAD_LOG_TRACE("BinaryOp {} over {} elements in {} dims",
+                   BinaryOpToString(op), plan.numel, plan.dim());
+
+  launch(binary_stub.get(out.dtype), op, plan);
+}
+
+void binary_scalar(BinaryOp op,
+                   const core::TensorView& out,
+                   const core::TensorView& a,
+                   double scalar)
+{
+  CALL_DISPATCH_TYPE_INFO(a.dtype,
+                          [&]
+                          {
+                            scalar_t value = static_cast<scalar_t>(scalar);
+                            const core::TensorView b(capture_scratch(value),
+                                                     a.dtype, IntArrayView());
+                            binary(op, out, a, b);
+                          });
+}
+
+void activation(Activation act,
+                const core::TensorView& out,
+                const core::TensorView& in)
+{
+  // A cast on the way is left to the fused interpreter
+  if (out.dtype != in.dtype) {
+    FusedProgram program(1);
+    program.activation(act, 0);
+    fused_elementwise(program, out, {in});
+    return;
+  }
+  LEGRAD_CHECK_AND_THROW(
+      out.dtype == TypeInfo::Float32 || out.dtype == TypeInfo::Float16,
+      std::invalid_argument, "Activation {} does not support {}",
+      ActivationToString(act), core::TypeInfoToString(out.dtype));
+
+  if (out.numel() == 0) {
+    return;
+  }
+
+  const LoopPlan<2> plan = make_loop_plan<2>({&out, &in});
+  LEGRAD_LOG_TRACE("Activation {} over {} elements in {} dims",
+                   ActivationToString(act), plan.numel, plan.dim());
+
+  launch(activation_stub.get(out.dtype), act, plan);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+
+#include "core/tensor_view.h"
+#include "internal/enum_impl.h"
+
+namespace legrad::cpu
+{
+LEGRAD_ENUM(BinaryOp, uint8_t, Add, Min, Add, Sub, Mul, Div, Max, Min, COUNT)
+
+// Gelu is the tanh approximation
+LEGRAD_ENUM(Activation,
+            uint8_t,
+            None,
+            Sigmoid,
+            None,
+            Relu,
+            Silu,
+            Gelu,
+            Sigmoid,
+            COUNT)
+
+/*
+ * out = op(a, b) with NumPy-style broadcasting of `a` and `b` to the shape of
+ * `out`. All operands must have the same dtype (use a cast first otherwise).
+ * Operands may be arbitrary strided views, `out` may alias an input as long
+ * as they have the same view (e.g. an in-place residual add).
+ * For Bool tensors Add/Max are logical or, Mul/Min are logical and.
+ */
+void binary(BinaryOp op,
+            const core::TensorView& out,
+            const core::TensorView& a,
+            const core::TensorView& b);
+
+// out = op(a, scalar), the scalar is converted to the dtype of `a`
+void binary_scalar(BinaryOp op,
+                   const core::TensorView& out,
+                   const core::TensorView& a,
+                   double scalar);
+
+/*
+ * out = activation(in), Float32 or Float16 (the math is in float) with
+ * broadcasting of `in` like binary
+ */
+void activation(Activation act,
+                const core::TensorView& out,
+                const core::TensorView& in);
+
+inline void add(const core::TensorView& out,
+                const core::TensorView& a,
+                const core::TensorView& b)
+{
+  binary(BinaryOp::Add, out, a, b);
+}
+
+inline void sub(const core::TensorView& out,
+                const core::TensorView& a,
+                const core::TensorView& b)
+{
+  binary(BinaryOp::Sub, out, a, b);
+}
+
+inline void mul(const core::TensorView& out,
+                const core::TensorView& a,
+                const core::TensorView& b)
+{
+  binary(BinaryOp::Mul, out, a, b);
+}
+
+inline void div(const core::TensorView& out,
+                const core::TensorView& a,
+                const core::TensorView& b)
+{
+  binary(BinaryOp::Div, out, a, b);
+}
+
+inline void scale(const core::TensorView& out,
+                  const core::TensorView& a,
+                  double alpha)
+{
+  binary_scalar(BinaryOp::Mul, out, a, alpha);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,366 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/loops.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+
+/*
+ * Expression templates for elementwise kernels: an expression written as
+ * plain math compiles into a single vectorized loop, without a temporary
+ * tensor or a kernel call per op. The leaves are the operands of a LoopPlan
+ * after the output, left to right:
+ *
+ *   // plan = make_loop_plan<4>({&out, &a, &b, &c})
+ *   using namespace legrad::cpu::expr;
+ *   run_expression<scalar_t>(arg() * sigmoid(arg()) + arg() * scale, plan);
+ *
+ * It is the compile time counterpart of FusedProgram, for the math written
+ * by hand (samplers, custom layers) that does not go through a graph.
+ * Expressions are vectorized with the flags of the file that includes this
+ * header, so they belong in backend/cpu/kernels: the kernel is built per ISA
+ * and registered, its front-end checks the views, makes the plan and calls
+ * it through a KernelStub like binary (see activation).
+ */
+namespace legrad::cpu::expr
+{
+inline namespace LEGRAD_CPU_KERNEL_NAMESPACE
+{
+using Vec = vec::Vectorized<float>;
+
+// Base of every node, the operators below only match expressions
+template <typename Derived>
+struct Expr
+{
+  const Derived& self() const { return static_cast<const Derived&>(*this); }
+};
+
+/*
+ * Every node has LEAVES, its number of tensor operands, and is evaluated on
+ * a vector of each leaf (loaded once before the math). `I` is the index of
+ * the first leaf below the node, the leaves are numbered left to right.
+ */
+struct Arg : Expr<Arg>
+{
+  static constexpr size_t LEAVES = 1;
+
+  template <size_t I, size_t N>
+  LEGRAD_INLINE Vec eval(const std::array<Vec, N>& leaves) const
+  {
+    return leaves[I];
+  }
+};
+
+struct Scalar : Expr<Scalar>
+{
+  static constexpr size_t LEAVES = 0;
+
+  float value = 0.0f;
+
+  explicit Scalar(float value)
+      : value(value)
+  {
+  }
+
+  template <size_t I, size_t N>
+  LEGRAD_INLINE Vec eval(const std::array<Vec, N>&) const
+  {
+    return Vec(value);
+  }
+};
+
+template <typename Op, typename A>
+struct Unary : Expr<Unary<Op, A>>
+{
+  static constexpr size_t LEAVES = A::LEAVES;
+
+  A a;
+
+  explicit Unary(const A& a)
+      : a(a)
+  {
+  }
+
+  template <size_t I, size_t N>
+  LEGRAD_INLINE Vec eval(const std::array<Vec, N>& leaves) const
+  {
+    return Op::apply(a.template eval<I>(leaves));
+  }
+};
+
+template <typename Op, typename A, typename B>
+struct Binary : Expr<Binary<Op, A, B>>
+{
+  static constexpr size_t LEAVES = A::LEAVES + B::LEAVES;
+
+  A a;
+  B b;
+
+  Binary(const A& a, const B& b)
+      : a(a)
+      , b(b)
+  {
+  }
+
+  template <size_t I, size_t N>
+  LEGRAD_INLINE Vec eval(const std::array<Vec, N>& leaves) const
+  {
+    return Op::apply(a.template eval<I>(leaves),
+                     b.template eval<I + A::LEAVES>(leaves));
+  }
+};
+
+// The ops, the same math as binary and activation
+struct AddOp
+{
+  static Vec apply(const Vec& a, const Vec& b) { return a + b; }
+};
+
+struct SubOp
+{
+  static Vec apply(const Vec& a, const Vec& b) { return a - b; }
+};
+
+struct MulOp
+{
+  static Vec apply(const Vec& a, const Vec& b) { return a * b; }
+};
+
+struct DivOp
+{
+  static Vec apply(const Vec& a, const Vec& b) { return a / b; }
+};
+
+struct MaxOp
+{
+  static Vec apply(const Vec& a, const Vec& b) { return maximum(a, b); }
+};
+
+struct MinOp
+{
+  static Vec apply(const Vec& a, const Vec& b) { return minimum(a, b); }
+};
+
+struct NegOp
+{
+  static Vec apply(const Vec& x) { return Vec(0.0f) - x; }
+};
+
+struct ExpOp
+{
+  static Vec apply(const Vec& x) { return vec::exp(x); }
+};
+
+struct ReluOp
+{
+  static Vec apply(const Vec& x) { return maximum(x, Vec(0.0f)); }
+};
+
+struct SigmoidOp
+{
+  static Vec apply(const Vec& x) { return vec::sigmoid(x); }
+};
+
+struct SiluOp
+{
+  static Vec apply(const Vec& x) { return vec::silu(x); }
+};
+
+struct GeluOp
+{
+  static Vec apply(const Vec& x) { return vec::gelu(x); }
+};
+
+// The next leaf of the plan
+inline Arg arg()
+{
+  return Arg();
+}
+
+// clang-format off
+#define LEGRAD_EXPR_BINARY(NAME, OP)                                       \
+  template <typename A, typename B>                                        \
+  Binary<OP, A, B> NAME(const Expr<A>& a, const Expr<B>& b)                \
+  {                                                                        \
+    return Binary<OP, A, B>(a.self(), b.self());                           \
+  }                                                                        \
+  template <typename A>                                                    \
+  Binary<OP, A, Scalar> NAME(const Expr<A>& a, float b)                    \
+  {                                                                        \
+    return Binary<OP, A, Scalar>(a.self(), Scalar(b));                     \
+  }                                                                        \
+  template <typename B>                                                    \
+  Binary<OP, Scalar, B> NAME(float a, const Expr<B>& b)                    \
+  {                                                                        \
+    return Binary<OP, Scalar, B>(Scalar(a), b.self());                     \
+  }
+
+#define LEGRAD_EXPR_UNARY(NAME, OP)                                        \
+  template <typename A>                                                    \
+  Unary<OP, A> NAME(const Expr<A>& a)                                      \
+  {                                                                        \
+    return Unary<OP, A>(a.self());                                         \
+  }
+// clang-format on
+
+LEGRAD_EXPR_BINARY(operator+, AddOp)
+LEGRAD_EXPR_BINARY(operator-, SubOp)
+LEGRAD_EXPR_BINARY(operator*, MulOp)
+LEGRAD_EXPR_BINARY(operator/, DivOp)
+LEGRAD_EXPR_BINARY(maximum, MaxOp)
+LEGRAD_EXPR_BINARY(minimum, MinOp)
+
+LEGRAD_EXPR_UNARY(operator-, NegOp)
+// exp, sigmoid, silu and gelu are the vec approximations (see vec.h)
+LEGRAD_EXPR_UNARY(exp, ExpOp)
+LEGRAD_EXPR_UNARY(relu, ReluOp)
+LEGRAD_EXPR_UNARY(sigmoid, SigmoidOp)
+LEGRAD_EXPR_UNARY(silu, SiluOp)
+LEGRAD_EXPR_UNARY(gelu, GeluOp)
+
+#undef LEGRAD_EXPR_BINARY
+#undef LEGRAD_EXPR_UNARY
+
+/*
+ * `count` elements of a run as floats, the other lanes are zero. UNIT runs
+ * have every stride equal to the element size, or 0 for a broadcast leaf
+ * (a loop invariant branch), the others are gathered lane by lane.
+ */
+template <typename T, bool UNIT>
+LEGRAD_INLINE Vec load(const char* ptr, Int stride, Int count)
+{
+  if constexpr (UNIT && std::is_same_v<T, float>) {
+    const float* src = reinterpret_cast<const float*>(ptr);
+    if (stride == 0) {
+      return Vec(*src);
+    }
+    return count == Vec::size() ? Vec::loadu(src) : Vec::loadu(src, count);
+  } else if constexpr (UNIT) {
+    const uint16_t* src = reinterpret_cast<const uint16_t*>(ptr);
+    if (stride == 0) {
+      return Vec(fp16_ieee_to_fp32_value(*src));
+    }
+    if (count == Vec::size()) {
+      return vec::loadu_half(src);
+    }
+    float values[Vec::size()] = {};
+    vec::cvt_f16_to_f32(src, values, count);
+    return Vec::loadu(values);
+  } else {
+    float values[Vec::size()] = {};
+    if constexpr (std::is_same_v<T, float>) {
+      for (Int i = 0; i < count; ++i) {
+        values[i] = *reinterpret_cast<const float*>(ptr + i * stride);
+      }
+    } else {
+      vec::load_half(ptr, stride, count, values);
+    }
+    return Vec::loadu(values);
+  }
+}
+
+template <typename T, bool UNIT>
+LEGRAD_INLINE void store(const Vec& v, char* ptr, Int stride, Int count)
+{
+  if constexpr (UNIT && std::is_same_v<T, float>) {
+    float* dst = reinterpret_cast<float*>(ptr);
+    if (count == Vec::size()) {
+      v.store(dst);
+    } else {
+      v.store(dst, count);
+    }
+  } else {
+    float values[Vec::size()];
+    v.store(values);
+    if constexpr (std::is_same_v<T, float>) {
+      for (Int i = 0; i < count; ++i) {
+        *reinterpret_cast<float*>(ptr + i * stride) = values[i];
+      }
+    } else {
+      vec::store_half(values, ptr, stride, count);
+    }
+  }
+}
+
+/*
+ * One run of `n` elements: every leaf of a vector is loaded before the
+ * output is stored, so `out` may alias a leaf with the same view
+ */
+template <typename T, bool UNIT, typename E, size_t N>
+LEGRAD_INLINE void assign_vectors(const E& e,
+                                  const std::array<char*, N>& ptrs,
+                                  const std::array<Int, N>& strides,
+                                  Int n)
+{
+  std::array<Vec, N - 1> leaves;
+  const auto step = [&](Int i, Int count)
+  {
+    for (size_t k = 1; k < N; ++k) {
+      leaves[k - 1] =
+          load<T, UNIT>(ptrs[k] + i * strides[k], strides[k], count);
+    }
+    store<T, UNIT>(e.template eval<0>(leaves), ptrs[0] + i * strides[0],
+                   strides[0], count);
+  };
+  Int i = 0;
+  for (; i + Vec::size() <= n; i += Vec::size()) {
+    step(i, Vec::size());
+  }
+  if (i < n) {
+    step(i, n - i);
+  }
+}
+
+template <typename T, typename E, size_t N>
+void assign_run(const E& e,
+                const std::array<char*, N>& ptrs,
+                const std::array<Int, N>& strides,
+                Int n)
+{
+  bool unit = strides[0] == sizeof(T);
+  for (size_t k = 1; k < N; ++k) {
+    unit = unit && (strides[k] == sizeof(T) || strides[k] == 0);
+  }
+  if (unit) {
+    assign_vectors<T, true>(e, ptrs, strides, n);
+  } else {
+    assign_vectors<T, false>(e, ptrs, strides, n);
+  }
+}
+
+/*
+ * out = e over `plan` (out then one operand per leaf), Float32 or Float16
+ * with the math in float. Every operand has the dtype T, `out` may alias a
+ * leaf with the same view.
+ */
+template <typename T, typename E, size_t N>
+void run_expression(const Expr<E>& expr, const LoopPlan<N>& plan)
+{
+  static_assert(N == E::LEAVES + 1, "The plan needs an operand per leaf");
+  static_assert(std::is_same_v<T, float> || std::is_same_v<T, half_float>,
+                "Expressions run on Float32 or Float16");
+  const E& e = expr.self();
+  dispatch_rank(plan.dim(),
+                [&](auto rank_tag)
+                {
+                  constexpr size_t RANK = decltype(rank_tag)::value;
+                  parallel_for(
+                      0, plan.numel, GRAIN_SIZE,
+                      [&](Int begin, Int end)
+                      {
+                        for_each_run<RANK>(
+                            plan, begin, end,
+                            [&](const std::array<char*, N>& ptrs,
+                                const std::array<Int, N>& strides, Int n)
+                            { assign_run<T>(e, ptrs, strides, n); });
+                      });
+                });
+}
+}  // namespace LEGRAD_CPU_KERNEL_NAMESPACE
+}  // namespace legrad::cpu::expr
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/gemm.h"
+#include "backend/cpu/gemv.h"
+#include "core/dtype.h"
+#include "ffn.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+/*
+ * Max floats of the [tokens, ffn_dim] activation of one chunk (16 MB). The
+ * weights are read again for every chunk, so a chunk has to stay tall enough
+ * (~290 tokens for ffn_dim 14336) for the GEMMs to be compute bound.
+ */
+constexpr Int FFN_CHUNK_FLOATS = Int(1) << 22;
+
+// Rows [begin, end) of a 2-D view
+core::TensorView row_range(const core::TensorView& view, Int begin, Int end)
+{
+  char* data = static_cast<char*>(view.data)
+             + begin * view.stride_at(0) * static_cast<Int>(view.elem_size());
+  return core::TensorView(data, view.dtype, {end - begin, view.shape_at(1)},
+                          {view.stride_at(0), view.stride_at(1)});
+}
+
+/*
+ * fn(out rows, x rows, hidden) over chunks of tokens, `hidden` is a
+ * [chunk, ffn_dim] Float32 workspace reused by every chunk
+ */
+template <typename Fn>
+void for_chunks(const core::TensorView& out,
+                const core::TensorView& x,
+                Int ffn_dim,
+                const Fn& fn)
+{
+  LEGRAD_CHECK_AND_THROW(
+      x.dim() == 2 && out.dim() == 2 && x.shape_at(0) == out.shape_at(0),
+      std::invalid_argument,
+      "FFN expects x [tokens, dim] and out [tokens, dim_out], got {} and {}",
+      IntArrayView::numerical_view_2str(x.shape()),
+      IntArrayView::numerical_view_2str(out.shape()));
+  const Int tokens = x.shape_at(0);
+  if (tokens == 0) {
+    return;
+  }
+
+  const Int chunk =
+      std::max<Int>(1, FFN_CHUNK_FLOATS / std::max<Int>(ffn_dim, 1));
+  std::vector<float> hidden(std::min(tokens, chunk) * ffn_dim);
+  float* hidden_data = capture_scratch(hidden);
+  for (Int begin = 0; begin < tokens; begin += chunk) {
+    const Int end = std::min(tokens, begin + chunk);
+    fn(row_range(out, begin, end), row_range(x, begin, end),
+       core::TensorView(hidden_data, TypeInfo::Float32,
+                        {end - begin, ffn_dim}));
+  }
+}
+}  // namespace
+
+void swiglu_ffn(const core::TensorView& out,
+                const core::TensorView& x,
+                const core::TensorView& gate,
+                const core::TensorView& up,
+                const core::TensorView& down)
+{
+  LEGRAD_CHECK_AND_THROW(gate.dim() == 2, std::invalid_argument,
+                         "FFN expects a 2-D gate weight, got {} dims",
+                         gate.dim());
+  LEGRAD_LOG_TRACE("SwiGLU FFN {} tokens, dim {} -> {}", x.shape_at(0),
+                   gate.shape_at(0), gate.shape_at(1));
+  for_chunks(out, x, gate.shape_at(1),
+             [&](const core::TensorView& out_rows,
+                 const core::TensorView& x_rows,
+                 const core::TensorView& hidden)
+             {
+               swiglu(hidden, x_rows, gate, up);
+               gemm(out_rows, hidden, down);
+             });
+}
+
+void swiglu_ffn(const core::TensorView& out,
+                const core::TensorView& x,
+                const core::QuantMatrix& gate,
+                const core::QuantMatrix& up,
+                const core::QuantMatrix& down)
+{
+  LEGRAD_LOG_TRACE("SwiGLU FFN {} tokens, dim {} -> {} ({} weights)",
+                   x.shape_at(0), gate.cols, gate.rows,
+                   core::QuantTypeToString(gate.type));
+  for_chunks(out, x, gate.rows,
+             [&](const core::TensorView& out_rows,
+                 const core::TensorView& x_rows,
+                 const core::TensorView& hidden)
+             {
+               gemv_swiglu(hidden, gate, up, x_rows);
+               gemv(out_rows, down, hidden);
+             });
+}
+}  // namespace legrad::cpu
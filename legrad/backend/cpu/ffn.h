@@ -0,0 +1,34 @@
+#pragma once
+
+#include "core/quant.h"
+#include "core/tensor_view.h"
+
+namespace legrad::cpu
+{
+/*
+ * LLaMA feed-forward block: out = (silu(x @ gate) * (x @ up)) @ down with
+ *   x    [tokens, dim]
+ *   gate [dim, ffn_dim], up [dim, ffn_dim] (e.g. x @ W^T views of GGUF
+ *        [ffn_dim, dim] weights), down [ffn_dim, dim_out]
+ *   out  [tokens, dim_out]
+ * The gate and up products only exist inside the fused swiglu GEMM, and the
+ * tokens go through in chunks so the [tokens, ffn_dim] activation it feeds
+ * to `down` stays a bounded (cache friendly) workspace whatever the prompt
+ * length. Decode rows stream each weight once (gemv). Float32 or Float16.
+ */
+void swiglu_ffn(const core::TensorView& out,
+                const core::TensorView& x,
+                const core::TensorView& gate,
+                const core::TensorView& up,
+                const core::TensorView& down);
+
+/*
+ * Same with block quantized GGUF weights: gate and up [ffn_dim, dim], down
+ * [dim_out, ffn_dim], dequantized on the fly by gemv.
+ */
+void swiglu_ffn(const core::TensorView& out,
+                const core::TensorView& x,
+                const core::QuantMatrix& gate,
+                const core::QuantMatrix& up,
+                const core::QuantMatrix& down);
+}  // namespace legrad::cpu
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/fused_kernel.h"
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "fused.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<FusedKernelFn> fused_stub(FUSED_ELEMENTWISE_KERNEL);
+
+// Never written, it stands for the inputs a program does not have
+float unused_input = 0.0f;
+
+void check_operand(const core::TensorView& view, const char* name)
+{
+  LEGRAD_CHECK_AND_THROW(
+      view.dtype == TypeInfo::Float32 || view.dtype == TypeInfo::Float16,
+      std::invalid_argument, "Fused elementwise does not support {} {}",
+      core::TypeInfoToString(view.dtype), name);
+}
+}  // namespace
+
+uint16_t FusedProgram::binary(BinaryOp op, uint16_t a, uint16_t b)
+{
+  FusedInstr instr;
+  instr.kind = FusedOpKind::Binary;
+  instr.binary = op;
+  instr.a = a;
+  instr.b = b;
+  instr.dst = num_registers++;
+  instrs.push_back(instr);
+  return result = instr.dst;
+}
+
+uint16_t FusedProgram::binary_scalar(BinaryOp op, uint16_t a, float scalar)
+{
+  FusedInstr instr;
+  instr.kind = FusedOpKind::BinaryScalar;
+  instr.binary = op;
+  instr.a = a;
+  instr.scalar = scalar;
+  instr.dst = num_registers++;
+  instrs.push_back(instr);
+  return result = instr.dst;
+}
+
+uint16_t FusedProgram::activation(Activation act, uint16_t a)
+{
+  FusedInstr instr;
+  instr.kind = FusedOpKind::Activation;
+  instr.activation = act;
+  instr.a = a;
+  instr.dst = num_registers++;
+  instrs.push_back(instr);
+  return result = instr.dst;
+}
+
+uint16_t FusedProgram::append(const FusedProgram& other,
+                              const std::vector<uint16_t>& inputs)
+{
+  LEGRAD_CHECK_AND_THROW(inputs.size() == other.num_inputs,
+                         std::invalid_argument,
+                         "Fused program takes {} inputs, got {}",
+                         other.num_inputs, inputs.size());
+  // Register of `other` -> register of this program
+  std::vector<uint16_t> map(other.num_registers);
+  std::copy(inputs.begin(), inputs.end(), map.begin());
+  for (FusedInstr instr : other.instrs) {
+    instr.a = map[instr.a];
+    instr.b = map[instr.b];
+    map[instr.dst] = num_registers;
+    instr.dst = num_registers++;
+    instrs.push_back(instr);
+  }
+  return result = map[other.result];
+}
+
+void FusedProgram::compact()
+{
+  // Last instruction reading each register, the result is read at the end
+  const size_t end = instrs.size();
+  std::vector<size_t> last_read(num_registers, 0);
+  for (size_t i = 0; i < end; ++i) {
+    last_read[instrs[i].a] = i;
+    if (instrs[i].kind == FusedOpKind::Binary) {
+      last_read[instrs[i].b] = i;
+    }
+  }
+  last_read[result] = end;
+
+  std::vector<uint16_t> map(num_registers);
+  std::vector<uint16_t> free_registers;
+  for (uint16_t r = 0; r < num_inputs; ++r) {
+    map[r] = r;
+  }
+  uint16_t used = num_inputs;
+  for (size_t i = 0; i < end; ++i) {
+    FusedInstr& instr = instrs[i];
+    const uint16_t a = instr.a;
+    const uint16_t b = instr.b;
+    instr.a = map[a];
+    instr.b = map[b];
+    // Elementwise: the destination can be an operand read for the last time
+    if (last_read[a] == i) {
+      free_registers.push_back(map[a]);
+    }
+    if (instr.kind == FusedOpKind::Binary && b != a && last_read[b] == i) {
+      free_registers.push_back(map[b]);
+    }
+    if (free_registers.empty()) {
+      map[instr.dst] = used++;
+    } else {
+      const auto lowest =
+          std::min_element(free_registers.begin(), free_registers.end());
+      map[instr.dst] = *lowest;
+      free_registers.erase(lowest);
+    }
+    instr.dst = map[instr.dst];
+  }
+  result = map[result];
+  num_registers = used;
+}
+
+std::string FusedProgram::to_string() const
+{
+  std::string str;
+  for (const FusedInstr& instr : instrs) {
+    str += "r" + std::to_string(instr.dst) + " = ";
+    switch (instr.kind) {
+      case FusedOpKind::Binary:
+        str += std::string(BinaryOpToString(instr.binary)) + "(r"
+             + std::to_string(instr.a) + ", r" + std::to_string(instr.b) + ")";
+        break;
+      case FusedOpKind::BinaryScalar:
+        str += std::string(BinaryOpToString(instr.binary)) + "(r"
+             + std::to_string(instr.a) + ", " + std::to_string(instr.scalar)
+             + ")";
+        break;
+      default:
+        str += std::string(ActivationToString(instr.activation)) + "(r"
+             + std::to_string(instr.a) + ")";
+    }
+    str += "; ";
+  }
+  return str + "-> r" + std::to_string(result);
+}
+
+void fused_elementwise(const FusedProgram& program,
+                       const core::TensorView& out,
+                       const std::vector<core::TensorView>& inputs)
+{
+  LEGRAD_CHECK_AND_THROW(
+      inputs.size() == program.num_inputs && inputs.size() <= FUSED_MAX_INPUTS,
+      std::invalid_argument,
+      "Fused program takes {} inputs (at most {}), got {}", program.num_inputs,
+      FUSED_MAX_INPUTS, inputs.size());
+  check_operand(out, "out");
+  for (const core::TensorView& input : inputs) {
+    check_operand(input, "input");
+  }
+  if (out.numel() == 0) {
+    return;
+  }
+
+  // Unused operands are a scalar, broadcast with stride 0
+  const core::TensorView scalar(&unused_input, TypeInfo::Float32,
+                                IntArrayView());
+  std::array<const core::TensorView*, FUSED_OPERANDS> operands;
+  std::array<TypeInfo, FUSED_OPERANDS> dtypes;
+  operands[0] = &out;
+  for (size_t i = 1; i < FUSED_OPERANDS; ++i) {
+    operands[i] = i <= inputs.size() ? &inputs[i - 1] : &scalar;
+  }
+  for (size_t i = 0; i < FUSED_OPERANDS; ++i) {
+    dtypes[i] = operands[i]->dtype;
+  }
+
+  const LoopPlan<FUSED_OPERANDS> plan =
+      make_loop_plan<FUSED_OPERANDS>(operands);
+  LEGRAD_LOG_TRACE("Fused elementwise {} over {} elements in {} dims",
+                   program.to_string(), plan.numel, plan.dim());
+  launch(fused_stub.get(out.dtype), program, plan, dtypes);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "backend/cpu/elementwise.h"
+#include "core/tensor_view.h"
+#include "internal/enum_impl.h"
+
+namespace legrad::cpu
+{
+/*
+ * One step of a FusedProgram, on float registers:
+ * - Binary: dst = binary(a, b)
+ * - BinaryScalar: dst = binary(a, scalar)
+ * - Activation: dst = activation(a)
+ */
+LEGRAD_ENUM(FusedOpKind,
+            uint8_t,
+            Binary,
+            Activation,
+            Binary,
+            BinaryScalar,
+            Activation,
+            COUNT)
+
+struct FusedInstr
+{
+  FusedOpKind kind = FusedOpKind::Binary;
+  BinaryOp binary = BinaryOp::Add;
+  Activation activation = Activation::None;
+  uint16_t dst = 0;
+  uint16_t a = 0;
+  uint16_t b = 0;
+  float scalar = 0.0f;
+};
+
+// Inputs of one fused_elementwise call
+constexpr size_t FUSED_MAX_INPUTS = 4;
+
+/*
+ * A chain of elementwise ops run as one kernel. Registers 0 .. num_inputs - 1
+ * hold the inputs, every instruction writes a new register and `result` is
+ * stored to the output. Build it with the helpers, which return the register
+ * they wrote, then compact() it so dead registers are reused:
+ *
+ *   FusedProgram p(3);  // out = a * sigmoid(b) + c * 0.5
+ *   const auto gate = p.activation(Activation::Sigmoid, 1);
+ *   const auto scaled = p.binary_scalar(BinaryOp::Mul, 2, 0.5f);
+ *   p.binary(BinaryOp::Add, p.binary(BinaryOp::Mul, 0, gate), scaled);
+ *   p.compact();
+ */
+struct FusedProgram
+{
+  std::vector<FusedInstr> instrs;
+  uint16_t num_inputs = 0;
+  uint16_t num_registers = 0;
+  uint16_t result = 0;
+
+  FusedProgram() = default;
+  explicit FusedProgram(uint16_t num_inputs)
+      : num_inputs(num_inputs)
+      , num_registers(num_inputs)
+  {
+  }
+
+  uint16_t binary(BinaryOp op, uint16_t a, uint16_t b);
+  uint16_t binary_scalar(BinaryOp op, uint16_t a, float scalar);
+  uint16_t activation(Activation act, uint16_t a);
+
+  /*
+   * Append `other` reading its inputs from `inputs` (registers of this
+   * program), returns the register of its result
+   */
+  uint16_t append(const FusedProgram& other,
+                  const std::vector<uint16_t>& inputs);
+
+  // Give a register that is not read anymore to the next instruction
+  void compact();
+
+  std::string to_string() const;
+};
+
+/*
+ * out = program(inputs...) in a single pass: each block of elements is
+ * converted to float once, goes through every instruction while it is in L1
+ * and is written once, instead of one pass over memory per op. Inputs are
+ * broadcast to `out` like binary, every operand is Float32 or Float16 and
+ * `out` may alias an input with the same view.
+ */
+void fused_elementwise(const FusedProgram& program,
+                       const core::TensorView& out,
+                       const std::vector<core::TensorView>& inputs);
+}  // namespace legrad::cpu
@@ -0,0 +1,418 @@
+#include <stdexcept>
+#include <vector>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/gemm_kernel.h"
+#include "backend/cpu/kernels/gemv_kernel.h"
+#include "backend/cpu/parallel.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "fused.h"
+#include "gemm.h"
+#include "gemv.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<GemmKernelFn> gemm_stub(GEMM_KERNEL);
+core::KernelStub<BatchedGemmKernelFn> batched_gemm_stub(BATCHED_GEMM_KERNEL);
+core::KernelStub<SwigluGemmKernelFn> swiglu_gemm_stub(SWIGLU_GEMM_KERNEL);
+core::KernelStub<GemvKernelFn> gemv_stub(GEMV_KERNEL);
+
+// Matrix of `view` made of its dims `dim` and `dim + 1`
+GemmOperand make_operand(const core::TensorView& view,
+                         size_t dim,
+                         const char* name)
+{
+  LEGRAD_CHECK_AND_THROW(
+      view.dtype == TypeInfo::Float32 || view.dtype == TypeInfo::Float16,
+      std::invalid_argument, "GEMM does not support {} {}",
+      core::TypeInfoToString(view.dtype), name);
+  return GemmOperand{view.data, view.dtype, view.stride_at(dim),
+                     view.stride_at(dim + 1)};
+}
+
+// GEMM of the last two dims of c, a and b
+GemmArgs make_args(const core::TensorView& c,
+                   const core::TensorView& a,
+                   const core::TensorView& b,
+                   float alpha,
+                   float beta)
+{
+  const size_t dim = c.dim() - 2;
+  GemmArgs args;
+  args.a = make_operand(a, dim, "a");
+  args.b = make_operand(b, dim, "b");
+  args.c = make_operand(c, dim, "c");
+  args.m = a.shape_at(dim);
+  args.k = a.shape_at(dim + 1);
+  args.n = b.shape_at(dim + 1);
+  args.alpha = alpha;
+  args.beta = beta;
+
+  LEGRAD_CHECK_AND_THROW(
+      b.shape_at(dim) == args.k && c.shape_at(dim) == args.m
+          && c.shape_at(dim + 1) == args.n,
+      std::invalid_argument, "GEMM shape mismatch: a {} @ b {} -> c {}",
+      IntArrayView::numerical_view_2str(a.shape()),
+      IntArrayView::numerical_view_2str(b.shape()),
+      IntArrayView::numerical_view_2str(c.shape()));
+  return args;
+}
+
+/*
+ * Up to this many vectors GEMV reads each weight row once for all of them and
+ * beats packing, which would only add another pass over the weight.
+ */
+constexpr Int GEMV_MAX_VECTORS = 8;
+
+// The x @ W^T form of is_gemv_shape: W is b, the vectors are rows of a and c
+bool is_row_gemv(const GemmArgs& args)
+{
+  return args.m <= GEMV_MAX_VECTORS && args.b.rs == 1;
+}
+
+/*
+ * Matrix-vector shapes (batch-1 decode, grouped query heads) are memory
+ * bound. GEMV wants contiguous weight rows:
+ * - x @ W^T with W [N, K] row-major: c[v, :] = W @ a[v, :]
+ * - W @ x with W [M, K] row-major: c[:, v] = W @ b[:, v]
+ */
+bool is_gemv_shape(const GemmArgs& args)
+{
+  return is_row_gemv(args) || (args.n <= GEMV_MAX_VECTORS && args.a.cs == 1);
+}
+
+// The kernel arguments of a GEMV shape, make_args checked the operands
+GemvArgs make_gemv_args(const GemmArgs& args)
+{
+  const GemmOperand& a = args.a;
+  const GemmOperand& b = args.b;
+  const GemmOperand& c = args.c;
+  GemvArgs gemv;
+  if (is_row_gemv(args)) {
+    gemv.m = args.m;
+    gemv.n = args.n;
+    gemv.w = b.data;
+    gemv.w_rs = b.cs;
+    gemv.x = a.data;
+    gemv.x_dtype = a.dtype;
+    gemv.x_stride = a.cs;
+    gemv.x_vector_stride = a.rs;
+    gemv.y_stride = c.cs;
+    gemv.y_vector_stride = c.rs;
+  } else {
+    gemv.m = args.n;
+    gemv.n = args.m;
+    gemv.w = a.data;
+    gemv.w_rs = a.rs;
+    gemv.x = b.data;
+    gemv.x_dtype = b.dtype;
+    gemv.x_stride = b.rs;
+    gemv.x_vector_stride = b.cs;
+    gemv.y_stride = c.rs;
+    gemv.y_vector_stride = c.cs;
+  }
+  gemv.k = args.k;
+  gemv.y = c.data;
+  gemv.y_dtype = c.dtype;
+  gemv.alpha = args.alpha;
+  gemv.beta = args.beta;
+  return gemv;
+}
+
+// The GEMV kernel for the weight dtype of make_gemv_args
+GemvKernelFn gemv_kernel(const GemmArgs& args)
+{
+  return gemv_stub.get(is_row_gemv(args) ? args.b.dtype : args.a.dtype);
+}
+
+// One GEMV per head, the heads are split across threads
+void run_batched_gemv(GemvKernelFn fn, const GemvArgs* heads, Int batch)
+{
+  parallel_for(0, batch, 1,
+               [&](Int begin, Int end)
+               {
+                 for (Int i = begin; i < end; ++i) {
+                   fn(heads[i]);
+                 }
+               });
+}
+
+GemmEpilogueArgs make_epilogue(const GemmEpilogue& epilogue,
+                               const GemmArgs& args)
+{
+  GemmEpilogueArgs ep;
+  ep.activation = epilogue.activation;
+  if (epilogue.bias.data) {
+    const core::TensorView& bias = epilogue.bias;
+    LEGRAD_CHECK_AND_THROW(bias.dim() == 1 && bias.shape_at(0) == args.n,
+                           std::invalid_argument,
+                           "GEMM bias must be [{}], got {}", args.n,
+                           IntArrayView::numerical_view_2str(bias.shape()));
+    ep.bias = make_operand(bias, 0, "bias");
+    ep.bias.rs = 0;
+    ep.bias.cs = bias.stride_at(0);
+  }
+  if (epilogue.residual.data) {
+    const core::TensorView& residual = epilogue.residual;
+    LEGRAD_CHECK_AND_THROW(
+        residual.dim() == 2 && residual.shape_at(0) == args.m
+            && residual.shape_at(1) == args.n,
+        std::invalid_argument, "GEMM residual must be [{}, {}], got {}",
+        args.m, args.n, IntArrayView::numerical_view_2str(residual.shape()));
+    LEGRAD_CHECK_AND_THROW(residual.data != args.c.data, std::invalid_argument,
+                           "GEMM residual cannot be c, use beta = 1", 0);
+    ep.residual = make_operand(residual, 0, "residual");
+  }
+  return ep;
+}
+
+/*
+ * The epilogue after a GEMV: c is a few rows (decode), one more pass over it
+ * costs nothing next to streaming the weight
+ */
+void run_epilogue(const core::TensorView& c, const GemmEpilogue& epilogue)
+{
+  std::vector<core::TensorView> inputs = {c};
+  if (epilogue.bias.data) {
+    inputs.push_back(epilogue.bias);
+  }
+  if (epilogue.residual.data) {
+    inputs.push_back(epilogue.residual);
+  }
+  FusedProgram program(static_cast<uint16_t>(inputs.size()));
+  uint16_t x = 0;
+  uint16_t next_input = 1;
+  if (epilogue.bias.data) {
+    x = program.binary(BinaryOp::Add, x, next_input++);
+  }
+  if (epilogue.activation != Activation::None) {
+    x = program.activation(epilogue.activation, x);
+  }
+  if (epilogue.residual.data) {
+    program.binary(BinaryOp::Add, x, next_input++);
+  }
+  program.compact();
+  fused_elementwise(program, c, inputs);
+}
+}  // namespace
+
+void gemm(const core::TensorView& c,
+          const core::TensorView& a,
+          const core::TensorView& b,
+          float alpha,
+          float beta)
+{
+  gemm(c, a, b, GemmEpilogue(), alpha, beta);
+}
+
+void gemm(const core::TensorView& c,
+          const core::TensorView& a,
+          const core::TensorView& b,
+          const GemmEpilogue& epilogue,
+          float alpha,
+          float beta)
+{
+  for (const core::TensorView* view : {&c, &a, &b}) {
+    LEGRAD_CHECK_AND_THROW(view->dim() == 2, std::invalid_argument,
+                           "GEMM expects 2-D operands, got {} dims",
+                           view->dim());
+  }
+  GemmArgs args = make_args(c, a, b, alpha, beta);
+  args.epilogue = make_epilogue(epilogue, args);
+  if (args.m == 0 || args.n == 0) {
+    return;
+  }
+  if (is_gemv_shape(args)) {
+    launch(gemv_kernel(args), make_gemv_args(args));
+    if (!args.epilogue.empty()) {
+      run_epilogue(c, epilogue);
+    }
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("GEMM [{}, {}] @ [{}, {}] ({} @ {} -> {})", args.m, args.k,
+                   args.k, args.n, core::TypeInfoToString(a.dtype),
+                   core::TypeInfoToString(b.dtype),
+                   core::TypeInfoToString(c.dtype));
+  launch(gemm_stub.get(a.dtype), args);
+}
+
+void swiglu(const core::TensorView& c,
+            const core::TensorView& a,
+            const core::TensorView& gate,
+            const core::TensorView& up)
+{
+  for (const core::TensorView* view : {&c, &a, &gate, &up}) {
+    LEGRAD_CHECK_AND_THROW(view->dim() == 2, std::invalid_argument,
+                           "SwiGLU expects 2-D operands, got {} dims",
+                           view->dim());
+  }
+  SwigluGemmArgs args;
+  args.gemm = make_args(c, a, gate, 1.0f, 0.0f);
+  args.up = make_operand(up, 0, "up");
+  LEGRAD_CHECK_AND_THROW(
+      up.dtype == gate.dtype && up.shape() == gate.shape(),
+      std::invalid_argument,
+      "SwiGLU expects gate and up of the same dtype and shape, got {} {} and "
+      "{} {}",
+      core::TypeInfoToString(gate.dtype),
+      IntArrayView::numerical_view_2str(gate.shape()),
+      core::TypeInfoToString(up.dtype),
+      IntArrayView::numerical_view_2str(up.shape()));
+  const GemmArgs& gemm = args.gemm;
+  if (gemm.m == 0 || gemm.n == 0) {
+    return;
+  }
+  // Decode: the weight rows ([N, K] memory) are streamed once for all rows
+  if (gemm.m <= GEMV_MAX_VECTORS && gemm.b.rs == 1 && args.up.rs == 1
+      && args.up.cs == gemm.b.cs)
+  {
+    gemv_swiglu(
+        c,
+        core::TensorView(gate.data, gate.dtype, {gemm.n, gemm.k},
+                         {gemm.b.cs, gemm.b.rs}),
+        core::TensorView(up.data, up.dtype, {gemm.n, gemm.k},
+                         {args.up.cs, args.up.rs}),
+        a);
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("SwiGLU GEMM [{}, {}] @ 2 x [{}, {}] ({} @ {} -> {})",
+                   gemm.m, gemm.k, gemm.k, gemm.n,
+                   core::TypeInfoToString(a.dtype),
+                   core::TypeInfoToString(gate.dtype),
+                   core::TypeInfoToString(c.dtype));
+  launch(swiglu_gemm_stub.get(a.dtype), args);
+}
+
+void batched_gemm(const core::TensorView& c,
+                  const core::TensorView& a,
+                  const core::TensorView& b,
+                  float alpha,
+                  float beta)
+{
+  LEGRAD_CHECK_AND_THROW(
+      c.dim() >= 2 && a.dim() == c.dim() && b.dim() == c.dim(),
+      std::invalid_argument,
+      "Batched GEMM expects a, b and c with the same rank (>= 2), got {}, {} "
+      "and {}",
+      a.dim(), b.dim(), c.dim());
+  const size_t rank = c.dim() - 2;
+  BatchedGemmArgs batched;
+  GemmArgs& args = batched.gemm;
+  args = make_args(c, a, b, alpha, beta);
+
+  /*
+   * Element strides of the batch dims, 0 for a broadcast dim. `group[d]`
+   * consecutive entries of c along d share one entry of b.
+   */
+  std::vector<Int> shape(rank), group(rank, 1);
+  std::vector<Int> a_stride(rank), b_stride(rank), c_stride(rank);
+  for (size_t d = 0; d < rank; ++d) {
+    const Int size = c.shape_at(d);
+    const Int a_size = a.shape_at(d);
+    const Int b_size = b.shape_at(d);
+    LEGRAD_CHECK_AND_THROW(
+        (a_size == size || a_size == 1)
+            && (b_size == 1 || (b_size > 0 && size % b_size == 0)),
+        std::invalid_argument,
+        "Batched GEMM cannot broadcast a {} and b {} to c {}",
+        IntArrayView::numerical_view_2str(a.shape()),
+        IntArrayView::numerical_view_2str(b.shape()),
+        IntArrayView::numerical_view_2str(c.shape()));
+    shape[d] = size;
+    a_stride[d] = a_size == 1 ? 0 : a.stride_at(d);
+    b_stride[d] = b_size == 1 ? 0 : b.stride_at(d);
+    c_stride[d] = c.stride_at(d);
+    group[d] = b_size == 1 ? 1 : size / b_size;
+  }
+
+  /*
+   * Decode (a single query row) with grouped KV heads: the query heads that
+   * share a KV head become the rows of one GEMM, so every K / V head is read
+   * once per group instead of once per query head.
+   */
+  if (args.m == 1) {
+    for (size_t d = 0; d < rank; ++d) {
+      if (group[d] > 1) {
+        args.m = group[d];
+        args.a.rs = a_stride[d];
+        args.c.rs = c_stride[d];
+        a_stride[d] *= group[d];
+        c_stride[d] *= group[d];
+        shape[d] /= group[d];
+        group[d] = 1;
+        break;
+      }
+    }
+  }
+
+  Int batch = 1;
+  for (const Int size : shape) {
+    batch *= size;
+  }
+  if (batch == 0 || args.m == 0 || args.n == 0) {
+    return;
+  }
+
+  // Offsets of every batch entry, walking the batch dims in row-major order
+  std::vector<Int> offsets(3 * batch);
+  std::vector<Int> index(rank, 0);
+  for (Int i = 0; i < batch; ++i) {
+    Int a_offset = 0, b_offset = 0, c_offset = 0;
+    for (size_t d = 0; d < rank; ++d) {
+      a_offset += index[d] * a_stride[d];
+      b_offset += index[d] / group[d] * b_stride[d];
+      c_offset += index[d] * c_stride[d];
+    }
+    offsets[i] = a_offset;
+    offsets[batch + i] = b_offset;
+    offsets[2 * batch + i] = c_offset;
+    for (size_t d = rank; d > 0; --d) {
+      if (++index[d - 1] < shape[d - 1]) {
+        break;
+      }
+      index[d - 1] = 0;
+    }
+  }
+
+  /*
+   * Matrix-vector entries (decode) go to GEMV head by head, their kernel
+   * arguments are made here so a replay only runs the kernel
+   */
+  if (is_gemv_shape(args)) {
+    std::vector<GemvArgs> heads(batch);
+    for (Int i = 0; i < batch; ++i) {
+      GemmArgs head = args;
+      head.a = offset_operand(args.a, offsets[i]);
+      head.b = offset_operand(args.b, offsets[batch + i]);
+      head.c = offset_operand(args.c, offsets[2 * batch + i]);
+      heads[i] = make_gemv_args(head);
+    }
+    LEGRAD_LOG_TRACE("Batched GEMV {} x [{}, {}] @ [{}, {}]", batch, args.m,
+                     args.k, args.k, args.n);
+    launch(run_batched_gemv, gemv_kernel(args), capture_scratch(heads),
+           batch);
+    return;
+  }
+
+  const Int* offset_data = capture_scratch(offsets);
+  batched.batch = batch;
+  batched.a_offsets = offset_data;
+  batched.b_offsets = offset_data + batch;
+  batched.c_offsets = offset_data + 2 * batch;
+
+  LEGRAD_LOG_TRACE("Batched GEMM {} x [{}, {}] @ [{}, {}] ({} @ {} -> {})",
+                   batch, args.m, args.k, args.k, args.n,
+                   core::TypeInfoToString(a.dtype),
+                   core::TypeInfoToString(b.dtype),
+                   core::TypeInfoToString(c.dtype));
+  launch(batched_gemm_stub.get(a.dtype), batched);
+}
+}  // namespace legrad::cpu
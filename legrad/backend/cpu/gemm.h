@@ -0,0 +1,83 @@
+#pragma once
+
+#include "backend/cpu/elementwise.h"
+#include "core/tensor_view.h"
+
+namespace legrad::cpu
+{
+/*
+ * c = alpha * a @ b + beta * c with a: [M, K], b: [K, N] and c: [M, N].
+ * Operands are 2-D views with any strides, a transposed matrix is just a view
+ * with swapped strides (e.g. x @ W^T for a row-major [N, K] weight).
+ * Every operand can be Float32 or Float16, products are always accumulated
+ * in float. When beta is 0, c is not read (it can be uninitialized).
+ */
+void gemm(const core::TensorView& c,
+          const core::TensorView& a,
+          const core::TensorView& b,
+          float alpha = 1.0f,
+          float beta = 0.0f);
+
+/*
+ * What gemm does to c once a @ b is summed, while each tile is still in
+ * cache: c = activation(alpha * a @ b + beta * c + bias) + residual, instead
+ * of one more pass over c for each of them
+ */
+struct GemmEpilogue
+{
+  core::TensorView bias;  // [N], none when it has no data
+  Activation activation = Activation::None;
+  core::TensorView residual;  // [M, N], none when it has no data, not c
+};
+
+void gemm(const core::TensorView& c,
+          const core::TensorView& a,
+          const core::TensorView& b,
+          const GemmEpilogue& epilogue,
+          float alpha = 1.0f,
+          float beta = 0.0f);
+
+inline void matmul(const core::TensorView& out,
+                   const core::TensorView& a,
+                   const core::TensorView& b)
+{
+  gemm(out, a, b);
+}
+
+/*
+ * c = silu(a @ gate) * (a @ up), the first half of a SwiGLU FFN, with a:
+ * [M, K], gate and up: [K, N] (same dtype, e.g. x @ W^T views of two [N, K]
+ * weights) and c: [M, N]. Every packed block of a is multiplied with both
+ * weights and the tiles are combined in the GEMM epilogue, so neither
+ * [M, N] product is ever written out. A few rows go to gemv_swiglu.
+ */
+void swiglu(const core::TensorView& c,
+            const core::TensorView& a,
+            const core::TensorView& gate,
+            const core::TensorView& up);
+
+/*
+ * Batched gemm over the leading dims: c[..., M, N] = alpha * a[..., M, K] @
+ * b[..., K, N] + beta * c, e.g. Q @ K^T and P @ V over [batch, heads, seq,
+ * dim]. a, b and c have the same rank (>= 2), each batch dim of a and b has
+ * the size of c's or 1 (broadcast), for b it can also divide it: that is
+ * grouped-query attention, b [B, Hkv, K, N] with c [B, H, M, N] gives query
+ * head h the KV head h / (H / Hkv).
+ * Operands are used with their strides as they are (K^T is the KV cache view
+ * with the last two strides swapped), nothing is copied into contiguous
+ * temporaries. The work is split over batch x heads, and over each matrix
+ * when there are fewer heads than threads.
+ */
+void batched_gemm(const core::TensorView& c,
+                  const core::TensorView& a,
+                  const core::TensorView& b,
+                  float alpha = 1.0f,
+                  float beta = 0.0f);
+
+inline void batched_matmul(const core::TensorView& out,
+                           const core::TensorView& a,
+                           const core::TensorView& b)
+{
+  batched_gemm(out, a, b);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,249 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/gemv_kernel.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "gemv.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<GemvKernelFn> gemv_stub(GEMV_KERNEL);
+core::KernelStub<GemvKernelFn> gemv_quant_stub(GEMV_QUANT_KERNEL);
+core::KernelStub<StreamReadKernelFn> stream_read_stub(STREAM_READ_KERNEL);
+
+GemvArgs make_args(const core::TensorView& y,
+                   const core::TensorView& x,
+                   Int n,
+                   Int k,
+                   float alpha,
+                   float beta)
+{
+  for (const core::TensorView* view : {&y, &x}) {
+    LEGRAD_CHECK_AND_THROW(
+        view->dtype == TypeInfo::Float32 || view->dtype == TypeInfo::Float16,
+        std::invalid_argument, "GEMV does not support {} vectors",
+        core::TypeInfoToString(view->dtype));
+  }
+  LEGRAD_CHECK_AND_THROW(
+      x.dim() == y.dim() && (x.dim() == 1 || x.dim() == 2),
+      std::invalid_argument,
+      "GEMV expects x and y both 1-D or both 2-D, got {} and {} dims", x.dim(),
+      y.dim());
+  // Dim of the vector elements, dim 0 of 2-D operands counts the vectors
+  const size_t dim = x.dim() - 1;
+  LEGRAD_CHECK_AND_THROW(
+      x.shape_at(dim) == k && y.shape_at(dim) == n
+          && (dim == 0 || x.shape_at(0) == y.shape_at(0)),
+      std::invalid_argument, "GEMV shape mismatch: w [{}, {}] @ x {} -> y {}",
+      n, k, IntArrayView::numerical_view_2str(x.shape()),
+      IntArrayView::numerical_view_2str(y.shape()));
+
+  GemvArgs args;
+  args.m = dim == 0 ? 1 : x.shape_at(0);
+  args.n = n;
+  args.k = k;
+  args.x = x.data;
+  args.x_dtype = x.dtype;
+  args.x_stride = x.stride_at(dim);
+  args.x_vector_stride = dim == 0 ? 0 : x.stride_at(0);
+  args.y = y.data;
+  args.y_dtype = y.dtype;
+  args.y_stride = y.stride_at(dim);
+  args.y_vector_stride = dim == 0 ? 0 : y.stride_at(0);
+  args.alpha = alpha;
+  args.beta = beta;
+  return args;
+}
+
+// A dense weight gemv can stream: Float32 or Float16 with contiguous rows
+void check_weight(const core::TensorView& w)
+{
+  LEGRAD_CHECK_AND_THROW(w.dim() == 2, std::invalid_argument,
+                         "GEMV expects a 2-D weight, got {} dims", w.dim());
+  LEGRAD_CHECK_AND_THROW(
+      w.dtype == TypeInfo::Float32 || w.dtype == TypeInfo::Float16,
+      std::invalid_argument, "GEMV does not support {} weights",
+      core::TypeInfoToString(w.dtype));
+  LEGRAD_CHECK_AND_THROW(w.stride_at(1) == 1 || w.shape_at(1) <= 1,
+                         std::invalid_argument,
+                         "GEMV weight rows must be contiguous, got stride {}",
+                         w.stride_at(1));
+}
+
+// Average seconds of `fn` over `iterations` runs, after one warm up run
+template <typename Fn>
+double time_it(int iterations, const Fn& fn)
+{
+  fn();
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    fn();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+template <typename Fn>
+GemvBenchmark run_benchmark(const std::vector<char>& weights,
+                            int iterations,
+                            const Fn& run_gemv)
+{
+  LEGRAD_CHECK_AND_THROW(iterations > 0, std::invalid_argument,
+                         "Benchmark needs at least one iteration, got {}",
+                         iterations);
+  const double bytes = static_cast<double>(weights.size());
+
+  GemvBenchmark result;
+  result.seconds = time_it(iterations, run_gemv);
+  result.gemv_gbps = bytes / result.seconds * 1e-9;
+
+  std::atomic<uint32_t> sink{0};
+  const double read_seconds = time_it(
+      iterations,
+      [&]
+      {
+        sink += stream_read_stub.get(TypeInfo::UInt8)(
+            weights.data(), static_cast<Int>(weights.size()));
+      });
+  result.read_gbps = bytes / read_seconds * 1e-9;
+
+  LEGRAD_LOG_INFO(
+      "GEMV {} bytes: {:.3f} ms, {:.2f} GB/s ({:.0f}% of {:.2f} GB/s read)",
+      weights.size(), result.seconds * 1e3, result.gemv_gbps,
+      100.0 * result.gemv_gbps / result.read_gbps, result.read_gbps);
+  return result;
+}
+}  // namespace
+
+void gemv(const core::TensorView& y,
+          const core::TensorView& w,
+          const core::TensorView& x,
+          float alpha,
+          float beta)
+{
+  check_weight(w);
+  GemvArgs args = make_args(y, x, w.shape_at(0), w.shape_at(1), alpha, beta);
+  args.w = w.data;
+  args.w_rs = w.stride_at(0);
+  if (args.m == 0 || args.n == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("GEMV [{}, {}] {} weight, {} vectors", args.n, args.k,
+                   core::TypeInfoToString(w.dtype), args.m);
+  launch(gemv_stub.get(w.dtype), args);
+}
+
+void gemv(const core::TensorView& y,
+          const core::QuantMatrix& w,
+          const core::TensorView& x,
+          float alpha,
+          float beta)
+{
+  GemvArgs args = make_args(y, x, w.rows, w.cols, alpha, beta);
+  args.w = w.data;
+  args.quant = w.type;
+  if (args.m == 0 || args.n == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("GEMV [{}, {}] {} weight, {} vectors", args.n, args.k,
+                   core::QuantTypeToString(w.type), args.m);
+  launch(gemv_quant_stub.get(TypeInfo::Float32), args);
+}
+
+void gemv_swiglu(const core::TensorView& y,
+                 const core::TensorView& w_gate,
+                 const core::TensorView& w_up,
+                 const core::TensorView& x)
+{
+  check_weight(w_gate);
+  check_weight(w_up);
+  LEGRAD_CHECK_AND_THROW(
+      w_gate.dtype == w_up.dtype && w_gate.shape() == w_up.shape()
+          && w_gate.stride_at(0) == w_up.stride_at(0),
+      std::invalid_argument,
+      "SwiGLU expects gate and up weights of the same dtype and layout, got "
+      "{} {} and {} {}",
+      core::TypeInfoToString(w_gate.dtype),
+      IntArrayView::numerical_view_2str(w_gate.shape()),
+      core::TypeInfoToString(w_up.dtype),
+      IntArrayView::numerical_view_2str(w_up.shape()));
+
+  GemvArgs args =
+      make_args(y, x, w_gate.shape_at(0), w_gate.shape_at(1), 1.0f, 0.0f);
+  args.w = w_gate.data;
+  args.w_up = w_up.data;
+  args.w_rs = w_gate.stride_at(0);
+  if (args.m == 0 || args.n == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("GEMV SwiGLU [{}, {}] {} weights, {} vectors", args.n,
+                   args.k, core::TypeInfoToString(w_gate.dtype), args.m);
+  launch(gemv_stub.get(w_gate.dtype), args);
+}
+
+void gemv_swiglu(const core::TensorView& y,
+                 const core::QuantMatrix& w_gate,
+                 const core::QuantMatrix& w_up,
+                 const core::TensorView& x)
+{
+  LEGRAD_CHECK_AND_THROW(
+      w_gate.type == w_up.type && w_gate.rows == w_up.rows
+          && w_gate.cols == w_up.cols,
+      std::invalid_argument,
+      "SwiGLU expects gate and up weights of the same format, got {} [{}, {}] "
+      "and {} [{}, {}]",
+      core::QuantTypeToString(w_gate.type), w_gate.rows, w_gate.cols,
+      core::QuantTypeToString(w_up.type), w_up.rows, w_up.cols);
+
+  GemvArgs args = make_args(y, x, w_gate.rows, w_gate.cols, 1.0f, 0.0f);
+  args.w = w_gate.data;
+  args.w_up = w_up.data;
+  args.quant = w_gate.type;
+  if (args.m == 0 || args.n == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("GEMV SwiGLU [{}, {}] {} weights, {} vectors", args.n,
+                   args.k, core::QuantTypeToString(w_gate.type), args.m);
+  launch(gemv_quant_stub.get(TypeInfo::Float32), args);
+}
+
+GemvBenchmark benchmark_gemv(TypeInfo dtype, Int rows, Int cols, int iterations)
+{
+  std::vector<char> weights(rows * cols * core::type_size(dtype));
+  std::vector<float> x(cols, 1.0f), y(rows);
+  const core::TensorView w_view(weights.data(), dtype, {rows, cols});
+  const core::TensorView x_view(x.data(), TypeInfo::Float32, {cols});
+  const core::TensorView y_view(y.data(), TypeInfo::Float32, {rows});
+  return run_benchmark(weights, iterations,
+                       [&] { gemv(y_view, w_view, x_view); });
+}
+
+GemvBenchmark benchmark_gemv(core::QuantType type,
+                             Int rows,
+                             Int cols,
+                             int iterations)
+{
+  std::vector<char> weights(rows * (cols / core::quant_block_size(type))
+                            * core::quant_block_bytes(type));
+  std::vector<float> x(cols, 1.0f), y(rows);
+  const core::QuantMatrix w(weights.data(), type, rows, cols);
+  const core::TensorView x_view(x.data(), TypeInfo::Float32, {cols});
+  const core::TensorView y_view(y.data(), TypeInfo::Float32, {rows});
+  return run_benchmark(weights, iterations, [&] { gemv(y_view, w, x_view); });
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "core/dtype.h"
+#include "core/quant.h"
+#include "core/tensor_view.h"
+
+namespace legrad::cpu
+{
+/*
+ * y = alpha * w @ x + beta * y for a single vector, the batch-1 decode case.
+ * w: [N, K] with contiguous rows (Float32 or Float16), x: [K], y: [N] (Float32
+ * or Float16, any stride). There is no packing: each weight row is streamed
+ * exactly once and rows are split across threads, so the speed is bound by
+ * memory bandwidth. cpu::gemm sends matrix-vector shapes here.
+ * x and y can also hold a few vectors, x: [M, K] and y: [M, N] (e.g. the
+ * query heads sharing a KV head), every weight row is then read once for all
+ * of them.
+ * When beta is 0, y is not read.
+ */
+void gemv(const core::TensorView& y,
+          const core::TensorView& w,
+          const core::TensorView& x,
+          float alpha = 1.0f,
+          float beta = 0.0f);
+
+// Same with a block quantized weight, blocks are dequantized on the fly
+void gemv(const core::TensorView& y,
+          const core::QuantMatrix& w,
+          const core::TensorView& x,
+          float alpha = 1.0f,
+          float beta = 0.0f);
+
+/*
+ * y = silu(w_gate @ x) * (w_up @ x), the gate and up projections of a SwiGLU
+ * FFN for one or a few vectors (decode). Both weights have the same shape
+ * and the layout gemv expects, the rows of the two are streamed side by side
+ * and only y is written.
+ */
+void gemv_swiglu(const core::TensorView& y,
+                 const core::TensorView& w_gate,
+                 const core::TensorView& w_up,
+                 const core::TensorView& x);
+
+void gemv_swiglu(const core::TensorView& y,
+                 const core::QuantMatrix& w_gate,
+                 const core::QuantMatrix& w_up,
+                 const core::TensorView& x);
+
+struct GemvBenchmark
+{
+  double seconds = 0.0;  // average time of one gemv
+  double gemv_gbps = 0.0;  // weight bytes read per second by gemv
+  double read_gbps = 0.0;  // plain parallel read of the same bytes
+};
+
+/*
+ * Time gemv on a [rows, cols] weight and compare it with a plain parallel
+ * read of the same number of bytes, which is about the best DRAM bandwidth
+ * the process can get. Use a weight much larger than the last level cache
+ * (e.g. 4096 x 8192) or the numbers measure the cache instead.
+ */
+GemvBenchmark benchmark_gemv(core::TypeInfo dtype,
+                             Int rows,
+                             Int cols,
+                             int iterations = 10);
+GemvBenchmark benchmark_gemv(core::QuantType type,
+                             Int rows,
+                             Int cols,
+                             int iterations = 10);
+}  // namespace legrad::cpu
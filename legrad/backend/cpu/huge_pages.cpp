@@ -0,0 +1,182 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/mman.h>
+
+#include "backend/cpu_mgr.h"
+#include "huge_pages.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+size_t round_up(size_t nbytes, size_t multiple)
+{
+  return (nbytes + multiple - 1) / multiple * multiple;
+}
+
+// Log a failed fallback step once, it would repeat for every buffer
+void warn_once(std::atomic<bool>& warned, const char* what)
+{
+  if (!warned.exchange(true)) {
+    LEGRAD_LOG_WARN("{} ({}), fall back", what, std::strerror(errno));
+  }
+}
+
+std::atomic<bool> hugetlb_warned{false};
+std::atomic<bool> thp_warned{false};
+std::atomic<bool> lock_warned{false};
+}  // namespace
+
+HugePageAllocator::HugePageAllocator(HugePageConfig config)
+    : config_(config)
+{
+  LEGRAD_CHECK_AND_THROW(
+      config_.page_size == HUGE_PAGE_2M || config_.page_size == HUGE_PAGE_1G,
+      std::invalid_argument, "Huge pages are 2 MB or 1 GB, got {} bytes",
+      config_.page_size);
+}
+
+void* HugePageAllocator::map_huge(size_t size)
+{
+#if defined(__linux__) && defined(MAP_HUGETLB)
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+  flags |= (config_.page_size == HUGE_PAGE_1G ? 30 : 21) << MAP_HUGE_SHIFT;
+#endif
+  if (config_.populate) {
+    flags |= MAP_POPULATE;
+  }
+  void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (ptr == MAP_FAILED) {
+    warn_once(hugetlb_warned, "No explicit huge pages, see vm.nr_hugepages");
+    return nullptr;
+  }
+  return ptr;
+#else
+  (void)size;
+  return nullptr;
+#endif
+}
+
+void* HugePageAllocator::map_transparent(size_t size)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  // Map one more huge page and cut the ends so the buffer starts on one
+  const size_t page = config_.page_size;
+  void* raw = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return nullptr;
+  }
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(raw);
+  const uintptr_t aligned = round_up(begin, page);
+  if (aligned > begin) {
+    munmap(raw, aligned - begin);
+  }
+  const size_t tail = begin + page - aligned;
+  if (tail > 0) {
+    munmap(reinterpret_cast<void*>(aligned + size), tail);
+  }
+  void* ptr = reinterpret_cast<void*>(aligned);
+  if (madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+    warn_once(thp_warned, "No transparent huge pages");
+  }
+  if (config_.populate) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(ptr, size, MADV_POPULATE_WRITE) == 0) {
+      return ptr;
+    }
+#endif
+    std::memset(ptr, 0, size);
+  }
+  return ptr;
+#else
+  (void)size;
+  return nullptr;
+#endif
+}
+
+void* HugePageAllocator::map_normal(size_t size)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+  if (config_.populate) {
+    flags |= MAP_POPULATE;
+  }
+#endif
+  void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return nullptr;
+  }
+#ifndef MAP_POPULATE
+  if (config_.populate) {
+    std::memset(ptr, 0, size);
+  }
+#endif
+  return ptr;
+}
+
+core::Buffer HugePageAllocator::malloc(size_t nbytes)
+{
+  if (nbytes == 0) {
+    LEGRAD_LOG_WARN("Allocator create buffer with 0 size", 0);
+    return core::Buffer();
+  }
+
+  void* ptr = nullptr;
+  size_t size = 0;
+  if (nbytes >= config_.page_size / 2) {
+    size = round_up(nbytes, config_.page_size);
+    ptr = map_huge(size);
+    if (ptr == nullptr) {
+      ptr = map_transparent(size);
+    }
+  }
+  if (ptr == nullptr) {
+    size = round_up(nbytes, Manager::instance().page_size());
+    ptr = map_normal(size);
+  }
+  if (ptr == nullptr) {
+    LEGRAD_LOG_ERR("Cannot map memory with size: {}", nbytes);
+    return core::Buffer();
+  }
+
+  if (config_.lock && mlock(ptr, size) != 0) {
+    warn_once(lock_warned, "Cannot mlock buffers, see ulimit -l");
+  }
+
+  LEGRAD_LOG_TRACE("Allocate buffer with size {} in a mapping of {}", nbytes,
+                   size);
+  auto* ctx = new HugePageAllocator::Context{ptr, size, this};
+  return core::Buffer(ptr, ctx, HugePageAllocator::deallocate);
+}
+
+void HugePageAllocator::free(void* ctx)
+{
+  LEGRAD_CHECK_AND_THROW(ctx != nullptr, std::invalid_argument,
+                         "HugePageAllocator::free called with nullptr", 0);
+  auto* huge_ctx = static_cast<HugePageAllocator::Context*>(ctx);
+  // Unmapping also unlocks
+  munmap(huge_ctx->ptr, huge_ctx->size);
+  delete huge_ctx;
+}
+
+void HugePageAllocator::deallocate(void* ctx)
+{
+  if (ctx == nullptr) {
+    return;
+  }
+  auto* huge_ctx = static_cast<HugePageAllocator::Context*>(ctx);
+  if (huge_ctx->allocator == nullptr) {
+    delete huge_ctx;
+    LEGRAD_THROW_ERROR(std::runtime_error,
+                       "The context pointer has empty allocator", 0);
+  }
+  huge_ctx->allocator->free(huge_ctx);
+}
+}  // namespace legrad::cpu
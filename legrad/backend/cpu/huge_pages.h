@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+
+#include "core/allocator.h"
+#include "core/buffer.h"
+
+namespace legrad::cpu
+{
+constexpr size_t HUGE_PAGE_2M = size_t(2) << 20;
+constexpr size_t HUGE_PAGE_1G = size_t(1) << 30;
+
+struct HugePageConfig
+{
+  size_t page_size = HUGE_PAGE_2M;  // HUGE_PAGE_2M or HUGE_PAGE_1G
+  bool populate = true;  // fault every page in at malloc
+  bool lock = false;     // mlock, the pages are never swapped out
+};
+
+/*
+ * Allocator for the weights and the KV cache: buffers of half a huge page or
+ * more are mapped with huge pages, a TLB entry then covers 2 MB (or 1 GB)
+ * instead of 4 KB and a matmul streaming GBs of weights stops missing in the
+ * TLB.
+ * Explicit huge pages (MAP_HUGETLB) need pages reserved by the admin
+ * (vm.nr_hugepages), without them the buffer is aligned to a huge page and
+ * madvise'd for transparent huge pages. Smaller buffers use normal pages.
+ * With `populate` every page is faulted in up front and with `lock` it is
+ * mlock'ed as well, so no token ever waits on a page fault or on swap.
+ * Outside of Linux buffers are normal pages, populated and locked alike.
+ */
+class HugePageAllocator : public core::Allocator
+{
+public:
+  struct Context
+  {
+    void* ptr;
+    size_t size;  // of the mapping
+    HugePageAllocator* allocator;
+  };
+
+  explicit HugePageAllocator(HugePageConfig config = {});
+  ~HugePageAllocator() {}
+
+  const HugePageConfig& config() const { return config_; }
+
+  core::Buffer malloc(size_t nbytes) override;
+  // Takes a Context and unmaps its pages
+  void free(void* ctx) override;
+
+  static void deallocate(void* ctx);
+
+private:
+  // Mapping of `size` bytes (a multiple of the page size) or nullptr
+  void* map_huge(size_t size);
+  void* map_transparent(size_t size);
+  void* map_normal(size_t size);
+
+  HugePageConfig config_;
+};
+}  // namespace legrad::cpu
@@ -0,0 +1,296 @@
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/index_kernel.h"
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "index.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<IndexKernelFn> index_select_stub(INDEX_SELECT_KERNEL);
+core::KernelStub<IndexKernelFn> index_add_stub(INDEX_ADD_KERNEL);
+core::KernelStub<IndexQuantKernelFn> index_select_quant_stub(
+    INDEX_SELECT_QUANT_KERNEL);
+core::KernelStub<GatherKernelFn> gather_stub(GATHER_KERNEL);
+core::KernelStub<ScatterKernelFn> scatter_stub(SCATTER_KERNEL);
+
+void check_values(const char* op, const core::TensorView& view)
+{
+  LEGRAD_CHECK_AND_THROW(
+      view.dtype == TypeInfo::Float32 || view.dtype == TypeInfo::Float16,
+      std::invalid_argument, "{} does not support {} tensors", op,
+      core::TypeInfoToString(view.dtype));
+}
+
+void check_dim(const char* op, Int dim, const core::TensorView& view)
+{
+  LEGRAD_CHECK_AND_THROW(dim >= 0 && dim < static_cast<Int>(view.dim()),
+                         std::invalid_argument,
+                         "{} dim {} is invalid for {}", op, dim,
+                         IntArrayView::numerical_view_2str(view.shape()));
+}
+
+// Every index is in [0, size), a wrong one would write anywhere
+void check_indices(const char* op, const core::TensorView& index, Int size)
+{
+  LEGRAD_CHECK_AND_THROW(index.dtype == TypeInfo::Int32,
+                         std::invalid_argument,
+                         "{} expects Int32 indices, got {}", op,
+                         core::TypeInfoToString(index.dtype));
+  const LoopPlan<1> plan = make_loop_plan<1>({&index});
+  for_each_run<0>(plan, 0, plan.numel,
+                  [&](const std::array<char*, 1>& ptrs,
+                      const std::array<Int, 1>& strides,
+                      Int n)
+                  {
+                    for (Int i = 0; i < n; ++i) {
+                      const Int idx = *reinterpret_cast<const int32_t*>(
+                          ptrs[0] + i * strides[0]);
+                      LEGRAD_CHECK_AND_THROW(
+                          idx >= 0 && idx < size, std::out_of_range,
+                          "{} index {} is out of range for size {}", op, idx,
+                          size);
+                    }
+                  });
+}
+
+/*
+ * index_select / index_add: `dense` has the shape of `indexed` with dim
+ * replaced by the shape of `index`
+ */
+IndexArgs make_index_args(const char* op,
+                          const core::TensorView& dense,
+                          const core::TensorView& indexed,
+                          Int dim,
+                          const core::TensorView& index)
+{
+  check_values(op, dense);
+  check_values(op, indexed);
+  check_dim(op, dim, indexed);
+  check_indices(op, index, indexed.shape_at(dim));
+
+  const size_t index_dims = index.dim();
+  std::vector<Int> shape, slot_stride, slice_shape, slice_stride,
+      indexed_stride;
+  for (size_t d = 0; d < indexed.dim(); ++d) {
+    if (static_cast<Int>(d) == dim) {
+      shape.insert(shape.end(), index.shape().begin(), index.shape().end());
+      continue;
+    }
+    shape.push_back(indexed.shape_at(d));
+    slice_shape.push_back(indexed.shape_at(d));
+    indexed_stride.push_back(indexed.stride_at(d));
+  }
+  LEGRAD_CHECK_AND_THROW(
+      dense.shape() == IntArrayView(shape), std::invalid_argument,
+      "{} of {} along dim {} by {} indices expects {}, got {}", op,
+      IntArrayView::numerical_view_2str(indexed.shape()), dim,
+      IntArrayView::numerical_view_2str(index.shape()),
+      IntArrayView::numerical_view_2str(shape),
+      IntArrayView::numerical_view_2str(dense.shape()));
+  for (size_t d = 0; d < dense.dim(); ++d) {
+    const bool slot = static_cast<Int>(d) >= dim
+                   && d < static_cast<size_t>(dim) + index_dims;
+    (slot ? slot_stride : slice_stride).push_back(dense.stride_at(d));
+  }
+
+  const core::TensorView dense_slots(dense.data, dense.dtype, index.shape(),
+                                     slot_stride);
+  const core::TensorView dense_slice(dense.data, dense.dtype, slice_shape,
+                                     slice_stride);
+  const core::TensorView indexed_slice(indexed.data, indexed.dtype,
+                                       slice_shape, indexed_stride);
+  IndexArgs args;
+  args.slots = make_loop_plan<2>({&dense_slots, &index});
+  args.slice = make_loop_plan<2>({&dense_slice, &indexed_slice});
+  args.indexed = static_cast<char*>(indexed.data);
+  args.indexed_stride =
+      indexed.stride_at(dim) * static_cast<Int>(indexed.elem_size());
+  args.dense_dtype = dense.dtype;
+  return args;
+}
+
+/*
+ * gather / scatter: `index` has the shape of `dense`, `indexed` is at least
+ * as large in the other dims
+ */
+GatherArgs make_gather_args(const char* op,
+                            const core::TensorView& dense,
+                            const core::TensorView& indexed,
+                            Int dim,
+                            const core::TensorView& index)
+{
+  check_values(op, dense);
+  check_values(op, indexed);
+  check_dim(op, dim, indexed);
+  bool shape_ok = dense.shape() == index.shape()
+               && dense.dim() == indexed.dim();
+  for (size_t d = 0; d < dense.dim() && shape_ok; ++d) {
+    shape_ok = static_cast<Int>(d) == dim
+            || dense.shape_at(d) <= indexed.shape_at(d);
+  }
+  LEGRAD_CHECK_AND_THROW(
+      shape_ok, std::invalid_argument,
+      "{} along dim {} of {} with {} indices and a {} tensor", op, dim,
+      IntArrayView::numerical_view_2str(indexed.shape()),
+      IntArrayView::numerical_view_2str(index.shape()),
+      IntArrayView::numerical_view_2str(dense.shape()));
+  check_indices(op, index, indexed.shape_at(dim));
+
+  // The lines along dim start at the elements of the other dims
+  std::vector<Int> shape, dense_stride, index_stride, indexed_stride;
+  for (size_t d = 0; d < dense.dim(); ++d) {
+    if (static_cast<Int>(d) != dim) {
+      shape.push_back(dense.shape_at(d));
+      dense_stride.push_back(dense.stride_at(d));
+      index_stride.push_back(index.stride_at(d));
+      indexed_stride.push_back(indexed.stride_at(d));
+    }
+  }
+  const core::TensorView dense_lines(dense.data, dense.dtype, shape,
+                                     dense_stride);
+  const core::TensorView index_lines(index.data, index.dtype, shape,
+                                     index_stride);
+  const core::TensorView indexed_lines(indexed.data, indexed.dtype, shape,
+                                       indexed_stride);
+  GatherArgs args;
+  args.lines = make_loop_plan<3>({&dense_lines, &index_lines, &indexed_lines});
+  args.length = dense.shape_at(dim);
+  args.dense_stride =
+      dense.stride_at(dim) * static_cast<Int>(dense.elem_size());
+  args.index_stride =
+      index.stride_at(dim) * static_cast<Int>(index.elem_size());
+  args.indexed_stride =
+      indexed.stride_at(dim) * static_cast<Int>(indexed.elem_size());
+  args.dense_dtype = dense.dtype;
+  return args;
+}
+
+void run_scatter(const char* op,
+                 const core::TensorView& out,
+                 Int dim,
+                 const core::TensorView& index,
+                 const core::TensorView& src,
+                 bool add)
+{
+  const GatherArgs args = make_gather_args(op, src, out, dim, index);
+  if (args.lines.numel == 0 || args.length == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("{} {} -> {} along dim {}", op,
+                   IntArrayView::numerical_view_2str(src.shape()),
+                   IntArrayView::numerical_view_2str(out.shape()), dim);
+  launch(scatter_stub.get(out.dtype), args, add);
+}
+}  // namespace
+
+void index_select(const core::TensorView& out,
+                  const core::TensorView& in,
+                  Int dim,
+                  const core::TensorView& index)
+{
+  const IndexArgs args =
+      make_index_args("IndexSelect", out, in, dim, index);
+  if (args.slots.numel == 0 || args.slice.numel == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("IndexSelect {} slices of {} elements from {}",
+                   args.slots.numel, args.slice.numel,
+                   IntArrayView::numerical_view_2str(in.shape()));
+  launch(index_select_stub.get(in.dtype), args);
+}
+
+void index_select(const core::TensorView& out,
+                  const core::QuantMatrix& table,
+                  const core::TensorView& index)
+{
+  check_values("IndexSelect", out);
+  check_indices("IndexSelect", index, table.rows);
+  std::vector<Int> shape(index.shape().begin(), index.shape().end());
+  shape.push_back(table.cols);
+  LEGRAD_CHECK_AND_THROW(
+      out.shape() == IntArrayView(shape), std::invalid_argument,
+      "IndexSelect of {} rows of {} values expects {}, got {}",
+      IntArrayView::numerical_view_2str(index.shape()), table.cols,
+      IntArrayView::numerical_view_2str(shape),
+      IntArrayView::numerical_view_2str(out.shape()));
+
+  const size_t last = out.dim() - 1;
+  const std::vector<Int> slot_stride(out.stride().begin(),
+                                     out.stride().begin() + last);
+  const core::TensorView out_slots(out.data, out.dtype, index.shape(),
+                                   slot_stride);
+  IndexQuantArgs args;
+  args.slots = make_loop_plan<2>({&out_slots, &index});
+  args.table = table;
+  args.out_dtype = out.dtype;
+  args.out_stride = out.stride_at(last);
+  if (args.slots.numel == 0 || table.cols == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("IndexSelect {} rows of a {} [{}, {}] table",
+                   args.slots.numel, core::QuantTypeToString(table.type),
+                   table.rows, table.cols);
+  launch(index_select_quant_stub.get(TypeInfo::Float32), args);
+}
+
+void index_add(const core::TensorView& out,
+               Int dim,
+               const core::TensorView& index,
+               const core::TensorView& src)
+{
+  const IndexArgs args = make_index_args("IndexAdd", src, out, dim, index);
+  if (args.slots.numel == 0 || args.slice.numel == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("IndexAdd {} slices of {} elements into {}",
+                   args.slots.numel, args.slice.numel,
+                   IntArrayView::numerical_view_2str(out.shape()));
+  launch(index_add_stub.get(out.dtype), args);
+}
+
+void gather(const core::TensorView& out,
+            const core::TensorView& in,
+            Int dim,
+            const core::TensorView& index)
+{
+  const GatherArgs args = make_gather_args("Gather", out, in, dim, index);
+  if (args.lines.numel == 0 || args.length == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("Gather {} from {} along dim {}",
+                   IntArrayView::numerical_view_2str(out.shape()),
+                   IntArrayView::numerical_view_2str(in.shape()), dim);
+  launch(gather_stub.get(in.dtype), args);
+}
+
+void scatter(const core::TensorView& out,
+             Int dim,
+             const core::TensorView& index,
+             const core::TensorView& src)
+{
+  run_scatter("Scatter", out, dim, index, src, false);
+}
+
+void scatter_add(const core::TensorView& out,
+                 Int dim,
+                 const core::TensorView& index,
+                 const core::TensorView& src)
+{
+  run_scatter("ScatterAdd", out, dim, index, src, true);
+}
+}  // namespace legrad::cpu
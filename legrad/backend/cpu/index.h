@@ -0,0 +1,92 @@
+#pragma once
+
+#include "core/quant.h"
+#include "core/tensor_view.h"
+
+namespace legrad::cpu
+{
+/*
+ * Indexing ops. Indices are Int32 tensors of any shape and strides, they are
+ * checked to be in range before anything is written (std::out_of_range).
+ * Values are Float32 or Float16 with any strides, converted when the dtypes
+ * differ.
+ */
+
+/*
+ * out = the slices of `in` along `dim` picked by `index` (numpy.take):
+ * out.shape = in.shape[:dim] + index.shape + in.shape[dim + 1:]. Only the
+ * selected slices are read, copies are split across threads by slices and
+ * within a slice.
+ */
+void index_select(const core::TensorView& out,
+                  const core::TensorView& in,
+                  Int dim,
+                  const core::TensorView& index);
+
+/*
+ * Rows of a quantized table, out.shape = index.shape + [table.cols]: only the
+ * selected rows are dequantized
+ */
+void index_select(const core::TensorView& out,
+                  const core::QuantMatrix& table,
+                  const core::TensorView& index);
+
+/*
+ * out slice index[i] += src slice i along `dim`, the reverse of index_select
+ * (src has its shape). Repeated indices accumulate in index order: threads
+ * split the slices, not the indices, so the result is deterministic.
+ */
+void index_add(const core::TensorView& out,
+               Int dim,
+               const core::TensorView& index,
+               const core::TensorView& src);
+
+/*
+ * out[..., i, ...] = in[..., index[..., i, ...], ...] along `dim`
+ * (torch.gather): index has the shape of out, in is at least as large in
+ * the other dims.
+ */
+void gather(const core::TensorView& out,
+            const core::TensorView& in,
+            Int dim,
+            const core::TensorView& index);
+
+/*
+ * out[..., index[..., i, ...], ...] = src[..., i, ...] along `dim`, the
+ * reverse of gather (index has the shape of src). A repeated index keeps the
+ * last value of its line.
+ */
+void scatter(const core::TensorView& out,
+             Int dim,
+             const core::TensorView& index,
+             const core::TensorView& src);
+
+// Same as scatter but adds to out, repeated indices accumulate in order
+void scatter_add(const core::TensorView& out,
+                 Int dim,
+                 const core::TensorView& index,
+                 const core::TensorView& src);
+
+// Token embeddings: out [..., dim] = rows `ids` [...] of table [vocab, dim]
+inline void embedding(const core::TensorView& out,
+                      const core::TensorView& table,
+                      const core::TensorView& ids)
+{
+  index_select(out, table, 0, ids);
+}
+
+inline void embedding(const core::TensorView& out,
+                      const core::QuantMatrix& table,
+                      const core::TensorView& ids)
+{
+  index_select(out, table, ids);
+}
+
+// Gradient of embedding: grad_table [vocab, dim] += rows of grad_out at ids
+inline void embedding_backward(const core::TensorView& grad_table,
+                               const core::TensorView& ids,
+                               const core::TensorView& grad_out)
+{
+  index_add(grad_table, 0, ids, grad_out);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <initializer_list>
+
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "macros/expr.h"
+
+/*
+ * Every file in backend/cpu/kernels is compiled once per ISA level with the
+ * matching compiler flags (see legrad/CMakeLists.txt), CMake defines
+ * LEGRAD_CPU_CAPABILITY to the IsaLevel name of the current build.
+ * Files compiled without it (or outside CMake) are the Default level.
+ */
+#ifndef LEGRAD_CPU_CAPABILITY
+#define LEGRAD_CPU_CAPABILITY Default
+#endif
+
+/*
+ * Code compiled with ISA specific flags must live in its own namespace:
+ * inline functions and templates with external linkage from two builds would
+ * otherwise be merged by the linker (ODR) and e.g. the AVX-512 version of
+ * Vectorized<float>::loadu could be called on an AVX2 only CPU.
+ * Headers shared by kernels wrap their code in
+ *   inline namespace LEGRAD_CPU_KERNEL_NAMESPACE { ... }
+ * kernels themselves live in an anonymous namespace.
+ * That only covers our own vectorized code: the std, fmt and legrad headers
+ * included by a kernel (std::vector, view_pack, LEGRAD_LOG_*, ...) are not
+ * namespaced and their inline code is emitted by every ISA build too. The
+ * ISA objects are therefore linked after the Default ones and without LTO
+ * (see legrad/CMakeLists.txt), so the copies the linker keeps are the Default
+ * ones.
+ */
+#define LEGRAD_CPU_KERNEL_NAMESPACE LEGRAD_CONCAT(isa_, LEGRAD_CPU_CAPABILITY)
+
+namespace legrad::cpu
+{
+inline namespace LEGRAD_CPU_KERNEL_NAMESPACE
+{
+/*
+ * Register `&Kernel<scalar_t>::run` for every dtype in `dtypes` (all of them
+ * by default) at the ISA level of this translation unit:
+ *   static const CpuKernelRegistrar<BinaryKernel> registrar("binary");
+ * NOTE: CALL_DISPATCH_TYPE_INFO instantiates Kernel for every dtype, so
+ * Kernel<T> must compile for all of them.
+ */
+template <template <typename> class Kernel>
+struct CpuKernelRegistrar
+{
+  explicit CpuKernelRegistrar(const char* op)
+  {
+    for (auto dtype : core::TypeInfoIter()) {
+      register_dtype(op, dtype);
+    }
+  }
+
+  CpuKernelRegistrar(const char* op,
+                     std::initializer_list<core::TypeInfo> dtypes)
+  {
+    for (auto dtype : dtypes) {
+      register_dtype(op, dtype);
+    }
+  }
+
+private:
+  static void register_dtype(const char* op, core::TypeInfo dtype)
+  {
+    using core::TypeInfo;
+    CALL_DISPATCH_TYPE_INFO(
+        dtype,
+        [&]
+        {
+          core::KernelRegistry::instance().register_kernel(
+              core::KernelKey{op, dtype, core::Backend::CPU,
+                              core::IsaLevel::LEGRAD_CPU_CAPABILITY},
+              reinterpret_cast<core::KernelRegistry::KernelFn>(
+                  &Kernel<scalar_t>::run));
+        });
+  }
+};
+}  // namespace LEGRAD_CPU_KERNEL_NAMESPACE
+}  // namespace legrad::cpu
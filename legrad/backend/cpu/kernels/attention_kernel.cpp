@@ -0,0 +1,458 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/attention_kernel.h"
+#include "backend/cpu/kernels/row_impl.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+using Vec = vec::Vectorized<float>;
+
+constexpr float LOWEST = std::numeric_limits<float>::lowest();
+
+/*
+ * A tile of 64 keys of 128 dims is 32 KiB of K and as much of V (as floats),
+ * it stays in L2 while every query row of the block goes over it. A block
+ * has up to 64 query rows (the q heads of a GQA group times consecutive
+ * queries): converting and transposing a tile costs about as much as scoring
+ * it for a few rows, so the more rows share it the better, as long as their
+ * queries and outputs (32 KiB each) stay in L2 too.
+ */
+constexpr Int ATTN_TILE_KEYS = 64;
+constexpr Int ATTN_BLOCK_ROWS = 64;
+
+// Below this many keys per split, splitting the keys costs more than it gives
+constexpr Int ATTN_MIN_SPLIT_KEYS = 4 * ATTN_TILE_KEYS;
+
+// Per thread buffers, reused for every block
+struct AttentionWorkspace
+{
+  std::vector<float> q;  // [rows, head_dim], already scaled
+  std::vector<float> row;  // [head_dim] a converted K row
+  std::vector<float> k;  // [head_dim, ATTN_TILE_KEYS] transposed
+  std::vector<float> v;  // [ATTN_TILE_KEYS, v_dim]
+  std::vector<float> p;  // [rows, ATTN_TILE_KEYS] scores, then probabilities
+  std::vector<float> acc;  // [rows, v_dim]
+  std::vector<float> max;  // [rows]
+  std::vector<float> sum;  // [rows]
+  std::vector<float> correction;  // [rows] rescale of acc for the tile
+  std::vector<float> out;  // [v_dim]
+};
+
+// Which query rows a block covers and the keys it reads
+struct AttentionBlock
+{
+  Int batch = 0;
+  Int kv_head = 0;
+  Int q_begin = 0;  // queries [q_begin, q_end) of every head of the group
+  Int q_end = 0;
+  Int k_begin = 0;  // keys [k_begin, k_end)
+  Int k_end = 0;
+};
+
+LEGRAD_INLINE char* element(const AttentionOperand& op,
+                            Int batch,
+                            Int head,
+                            Int pos)
+{
+  return static_cast<char*>(op.data)
+         + (batch * op.batch_stride + head * op.head_stride
+            + pos * op.seq_stride)
+               * core::type_size(op.dtype);
+}
+
+/*
+ * Keys [begin, begin + n) of a V head as [n, dim] floats, used in place when
+ * they already are
+ */
+const float* load_tile(const AttentionOperand& op,
+                       Int batch,
+                       Int head,
+                       Int begin,
+                       Int n,
+                       Int dim,
+                       std::vector<float>& buffer)
+{
+  const char* ptr = element(op, batch, head, begin);
+  if (is_direct(op.dtype, op.dim_stride) && (op.seq_stride == dim || n == 1)) {
+    return reinterpret_cast<const float*>(ptr);
+  }
+  const Int row_bytes = op.seq_stride * core::type_size(op.dtype);
+  for (Int j = 0; j < n; ++j) {
+    copy_row(ptr + j * row_bytes, op.dtype, op.dim_stride, dim,
+             buffer.data() + j * dim);
+  }
+  return buffer.data();
+}
+
+/*
+ * Keys [begin, begin + n) of a K head transposed into kt [dim, ATTN_TILE_KEYS]
+ * so scores are computed for a vector of keys at once, without a horizontal
+ * sum per key. Columns past n keep whatever they had, their scores are never
+ * used.
+ */
+void load_tile_transposed(const AttentionOperand& op,
+                          Int batch,
+                          Int head,
+                          Int begin,
+                          Int n,
+                          Int dim,
+                          float* row,
+                          float* kt)
+{
+  const char* ptr = element(op, batch, head, begin);
+  const Int row_bytes = op.seq_stride * core::type_size(op.dtype);
+  for (Int j = 0; j < n; ++j) {
+    const char* src = ptr + j * row_bytes;
+    const float* k = reinterpret_cast<const float*>(src);
+    if (!is_direct(op.dtype, op.dim_stride)) {
+      copy_row(src, op.dtype, op.dim_stride, dim, row);
+      k = row;
+    }
+    for (Int d = 0; d < dim; ++d) {
+      kt[d * ATTN_TILE_KEYS + j] = k[d];
+    }
+  }
+}
+
+/*
+ * s[R, ATTN_TILE_KEYS] = q[R, dim] @ kt for the first n keys (rounded up to
+ * whole vectors). R rows x 4 vectors of keys stay in registers while dim is
+ * walked, the tile width is a multiple of 4 vectors on every ISA.
+ */
+template <Int R>
+void score_rows(const float* q, Int dim, const float* kt, Int n, float* s)
+{
+  constexpr Int V = Vec::size();
+  constexpr Int C = 4;
+  LEGRAD_STATIC_ASSERT(ATTN_TILE_KEYS % (C * V) == 0,
+                       "Tile width must be a multiple of 4 vectors");
+  for (Int j0 = 0; j0 < n; j0 += C * V) {
+    Vec acc[R][C];
+    for (Int r = 0; r < R; ++r) {
+      for (Int c = 0; c < C; ++c) {
+        acc[r][c] = Vec(0.0f);
+      }
+    }
+    for (Int d = 0; d < dim; ++d) {
+      Vec k[C];
+      for (Int c = 0; c < C; ++c) {
+        k[c] = Vec::loadu(kt + d * ATTN_TILE_KEYS + j0 + c * V);
+      }
+      for (Int r = 0; r < R; ++r) {
+        const Vec qv(q[r * dim + d]);
+        for (Int c = 0; c < C; ++c) {
+          acc[r][c] = acc[r][c] + qv * k[c];
+        }
+      }
+    }
+    for (Int r = 0; r < R; ++r) {
+      for (Int c = 0; c < C; ++c) {
+        acc[r][c].store(s + r * ATTN_TILE_KEYS + j0 + c * V);
+      }
+    }
+  }
+}
+
+/*
+ * acc[r] = acc[r] * correction[r] + p[r] @ v for R rows, one vector of each
+ * row in registers so every vector of V is loaded once for all of them
+ */
+template <Int R>
+void accumulate_rows(float* acc,
+                     const float* correction,
+                     const float* p,
+                     const float* v,
+                     Int n,
+                     Int dim)
+{
+  for (Int d = 0; d < dim; d += Vec::size()) {
+    const Int count = std::min(Vec::size(), dim - d);
+    Vec a[R];
+    for (Int r = 0; r < R; ++r) {
+      a[r] = Vec::loadu(acc + r * dim + d, count) * Vec(correction[r]);
+    }
+    for (Int j = 0; j < n; ++j) {
+      const Vec vj = count == Vec::size() ? Vec::loadu(v + j * dim + d)
+                                          : Vec::loadu(v + j * dim + d, count);
+      for (Int r = 0; r < R; ++r) {
+        a[r] = a[r] + Vec(p[r * ATTN_TILE_KEYS + j]) * vj;
+      }
+    }
+    for (Int r = 0; r < R; ++r) {
+      a[r].store(acc + r * dim + d, count);
+    }
+  }
+}
+
+// p = exp(p - max) in place, returns the sum
+float exp_sum(float* p, Int n, float max)
+{
+  const Vec m(max);
+  Vec acc(0.0f);
+  Int i = 0;
+  for (; i + Vec::size() <= n; i += Vec::size()) {
+    const Vec e = vec::exp(Vec::loadu(p + i) - m);
+    e.store(p + i);
+    acc = acc + e;
+  }
+  if (i < n) {
+    const Int count = n - i;
+    const Vec e = vec::exp(Vec::loadu(p + i, count) - m);
+    e.store(p + i, count);
+    acc = acc + Vec::loadu(p + i, count);
+  }
+  return vec::reduce_add(acc);
+}
+
+// Rows of a block 4 at a time, then one by one
+template <typename Fn>
+void for_row_groups(Int rows, const Fn& fn)
+{
+  Int r = 0;
+  for (; r + 4 <= rows; r += 4) {
+    fn(r, std::integral_constant<Int, 4>());
+  }
+  for (; r < rows; ++r) {
+    fn(r, std::integral_constant<Int, 1>());
+  }
+}
+
+/*
+ * Running max, sum and output of the rows of `block` over its keys, left in
+ * ws.max / ws.sum / ws.acc. Row r is q head kv_head * group + r / queries,
+ * query q_begin + r % queries.
+ */
+void attend(const AttentionArgs& args,
+            const AttentionBlock& block,
+            AttentionWorkspace& ws)
+{
+  const Int group = args.q_heads / args.kv_heads;
+  const Int queries = block.q_end - block.q_begin;
+  const Int rows = group * queries;
+  const Int hd = args.head_dim;
+  const Int vd = args.v_dim;
+
+  for (Int r = 0; r < rows; ++r) {
+    const Int head = block.kv_head * group + r / queries;
+    float* q = ws.q.data() + r * hd;
+    copy_row(element(args.q, block.batch, head, block.q_begin + r % queries),
+             args.q.dtype, args.q.dim_stride, hd, q);
+    for (Int d = 0; d < hd; ++d) {
+      q[d] *= args.scale;
+    }
+  }
+  std::fill(ws.max.begin(), ws.max.begin() + rows, LOWEST);
+  std::fill(ws.sum.begin(), ws.sum.begin() + rows, 0.0f);
+  std::fill(ws.acc.begin(), ws.acc.begin() + rows * vd, 0.0f);
+
+  // Keys past the last query of the block are masked for all of its rows
+  Int k_end = block.k_end;
+  if (args.causal) {
+    k_end = std::min(k_end, block.q_end + args.causal_offset);
+  }
+  for (Int t = block.k_begin; t < k_end; t += ATTN_TILE_KEYS) {
+    const Int n = std::min(ATTN_TILE_KEYS, k_end - t);
+    load_tile_transposed(args.k, block.batch, block.kv_head, t, n, hd,
+                         ws.row.data(), ws.k.data());
+    const float* v =
+        load_tile(args.v, block.batch, block.kv_head, t, n, vd, ws.v);
+
+    for_row_groups(rows,
+                   [&](Int r, auto rows_tag)
+                   {
+                     constexpr Int R = decltype(rows_tag)::value;
+                     score_rows<R>(ws.q.data() + r * hd, hd, ws.k.data(), n,
+                                   ws.p.data() + r * ATTN_TILE_KEYS);
+                   });
+
+    // Online softmax of every row, masked keys get a probability of 0
+    Int used = 0;
+    for (Int r = 0; r < rows; ++r) {
+      Int visible = n;
+      if (args.causal) {
+        const Int query = block.q_begin + r % queries;
+        visible = std::clamp<Int>(query + args.causal_offset + 1 - t, 0, n);
+      }
+      float* p = ws.p.data() + r * ATTN_TILE_KEYS;
+      float tile_max = LOWEST;
+      for (Int j = 0; j < visible; ++j) {
+        tile_max = std::max(tile_max, p[j]);
+      }
+      const float max = std::max(ws.max[r], tile_max);
+      ws.correction[r] = std::exp(ws.max[r] - max);
+      ws.sum[r] = ws.sum[r] * ws.correction[r] + exp_sum(p, visible, max);
+      ws.max[r] = max;
+      std::fill(p + visible, p + n, 0.0f);
+      used = std::max(used, visible);
+    }
+
+    for_row_groups(rows,
+                   [&](Int r, auto rows_tag)
+                   {
+                     constexpr Int R = decltype(rows_tag)::value;
+                     accumulate_rows<R>(ws.acc.data() + r * vd,
+                                        ws.correction.data() + r,
+                                        ws.p.data() + r * ATTN_TILE_KEYS, v,
+                                        used, vd);
+                   });
+  }
+}
+
+// out rows of `block` = acc / sum, rows without a visible key are 0
+void write_block(const AttentionArgs& args,
+                 const AttentionBlock& block,
+                 AttentionWorkspace& ws)
+{
+  const Int group = args.q_heads / args.kv_heads;
+  const Int queries = block.q_end - block.q_begin;
+  for (Int r = 0; r < group * queries; ++r) {
+    const float inv = ws.sum[r] > 0.0f ? 1.0f / ws.sum[r] : 0.0f;
+    const float* acc = ws.acc.data() + r * args.v_dim;
+    for (Int d = 0; d < args.v_dim; ++d) {
+      ws.out[d] = acc[d] * inv;
+    }
+    const Int head = block.kv_head * group + r / queries;
+    write_row(ws.out.data(),
+              element(args.out, block.batch, head, block.q_begin + r % queries),
+              args.out.dtype, args.out.dim_stride, args.v_dim);
+  }
+}
+
+void init_workspace(const AttentionArgs& args, AttentionWorkspace& ws)
+{
+  // A group bigger than a block still makes a block of a single query
+  const Int rows = std::max(ATTN_BLOCK_ROWS, args.q_heads / args.kv_heads);
+  ws.q.resize(rows * args.head_dim);
+  ws.row.resize(args.head_dim);
+  ws.k.resize(ATTN_TILE_KEYS * args.head_dim);
+  ws.v.resize(ATTN_TILE_KEYS * args.v_dim);
+  ws.p.resize(rows * ATTN_TILE_KEYS);
+  ws.acc.resize(rows * args.v_dim);
+  ws.max.resize(rows);
+  ws.sum.resize(rows);
+  ws.correction.resize(rows);
+  ws.out.resize(args.v_dim);
+}
+
+/*
+ * Tasks are (batch, kv head, block of queries, split of the keys). Prefill has
+ * plenty of query blocks. Decode has a single query per head, so when there
+ * are fewer blocks than threads the keys are split too (flash decoding): each
+ * split keeps its own max/sum/output and they are merged at the end exactly
+ * like the tiles of one split are.
+ */
+void run_attention(const AttentionArgs& args)
+{
+  const Int group = args.q_heads / args.kv_heads;
+  const Int block_queries = std::max<Int>(1, ATTN_BLOCK_ROWS / group);
+  const Int q_blocks = (args.q_len + block_queries - 1) / block_queries;
+  const Int blocks = args.batch * args.kv_heads * q_blocks;
+  const Int num_threads = static_cast<Int>(get_num_threads());
+  const Int splits =
+      in_parallel_region()
+          ? 1
+          : std::max<Int>(1, std::min(num_threads / blocks,
+                                      args.kv_len / ATTN_MIN_SPLIT_KEYS));
+  const Int split_keys = (args.kv_len + splits - 1) / splits;
+
+  const auto make_block = [&](Int task)
+  {
+    const Int split = task % splits;
+    const Int b = task / splits;
+    AttentionBlock block;
+    block.batch = b / (args.kv_heads * q_blocks);
+    block.kv_head = (b / q_blocks) % args.kv_heads;
+    block.q_begin = (b % q_blocks) * block_queries;
+    block.q_end = std::min(args.q_len, block.q_begin + block_queries);
+    block.k_begin = split * split_keys;
+    block.k_end = std::min(args.kv_len, block.k_begin + split_keys);
+    return block;
+  };
+
+  if (splits == 1) {
+    parallel_for(0, blocks, 1,
+                 [&](Int begin, Int end)
+                 {
+                   AttentionWorkspace ws;
+                   init_workspace(args, ws);
+                   for (Int task = begin; task < end; ++task) {
+                     const AttentionBlock block = make_block(task);
+                     attend(args, block, ws);
+                     write_block(args, block, ws);
+                   }
+                 });
+    return;
+  }
+
+  // Partial results of every (block, split): rows x {acc, max, sum}
+  const Int rows = group * block_queries;
+  std::vector<float> acc(blocks * splits * rows * args.v_dim);
+  std::vector<float> max(blocks * splits * rows), sum(blocks * splits * rows);
+  parallel_for(0, blocks * splits, 1,
+               [&](Int begin, Int end)
+               {
+                 AttentionWorkspace ws;
+                 init_workspace(args, ws);
+                 for (Int task = begin; task < end; ++task) {
+                   attend(args, make_block(task), ws);
+                   std::copy_n(ws.acc.begin(), rows * args.v_dim,
+                               acc.begin() + task * rows * args.v_dim);
+                   std::copy_n(ws.max.begin(), rows, max.begin() + task * rows);
+                   std::copy_n(ws.sum.begin(), rows, sum.begin() + task * rows);
+                 }
+               });
+  parallel_for(
+      0, blocks, 1,
+      [&](Int begin, Int end)
+      {
+        AttentionWorkspace ws;
+        init_workspace(args, ws);
+        for (Int b = begin; b < end; ++b) {
+          const Int first = b * splits;
+          for (Int r = 0; r < rows; ++r) {
+            float m = LOWEST;
+            for (Int s = 0; s < splits; ++s) {
+              m = std::max(m, max[(first + s) * rows + r]);
+            }
+            float total = 0.0f;
+            float* out = ws.acc.data() + r * args.v_dim;
+            std::fill(out, out + args.v_dim, 0.0f);
+            for (Int s = 0; s < splits; ++s) {
+              const Int idx = (first + s) * rows + r;
+              const float weight = std::exp(max[idx] - m);
+              total += sum[idx] * weight;
+              const float* part = acc.data() + idx * args.v_dim;
+              for (Int d = 0; d < args.v_dim; ++d) {
+                out[d] += part[d] * weight;
+              }
+            }
+            ws.sum[r] = total;
+          }
+          AttentionBlock block = make_block(first);
+          write_block(args, block, ws);
+        }
+      });
+}
+
+// The math is in float for every dtype, T only selects the registry entry
+template <typename T>
+struct AttentionKernel
+{
+  static void run(const AttentionArgs& args) { run_attention(args); }
+};
+
+const CpuKernelRegistrar<AttentionKernel> attention_registrar(
+    ATTENTION_KERNEL, {core::TypeInfo::Float32, core::TypeInfo::Float16});
+}  // namespace
+}  // namespace legrad::cpu
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "core/dtype.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+// Registered per dtype of K and V (Float32, Float16)
+constexpr const char* ATTENTION_KERNEL = "attention";
+
+// [batch, heads, seq, dim] operand, strides are in elements
+struct AttentionOperand
+{
+  void* data = nullptr;
+  core::TypeInfo dtype = core::TypeInfo::Float32;
+  Int batch_stride = 0;
+  Int head_stride = 0;
+  Int seq_stride = 0;
+  Int dim_stride = 1;
+};
+
+struct AttentionArgs
+{
+  AttentionOperand q, k, v, out;
+  Int batch = 1;
+  Int q_heads = 1;
+  Int kv_heads = 1;  // divides q_heads, a group of q heads shares a KV head
+  Int q_len = 0;
+  Int kv_len = 0;
+  Int head_dim = 0;  // of Q and K
+  Int v_dim = 0;  // of V and out
+  float scale = 1.0f;
+  bool causal = false;
+  Int causal_offset = 0;  // query i sees keys <= i + causal_offset
+};
+
+using AttentionKernelFn = void (*)(const AttentionArgs& args);
+}  // namespace legrad::cpu
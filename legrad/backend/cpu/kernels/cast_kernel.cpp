@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/cast_kernel.h"
+#include "backend/cpu/loops.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+/*
+ * A conversion step works on LANES elements, one float register worth.
+ * Source and destination vectors have the same number of lanes (and a
+ * different width) so __builtin_convertvector can turn e.g. 16 int8 into 16
+ * floats, the compiler picks the widening/narrowing instructions
+ * (vpmovsxbd + vcvtdq2ps, vcvttps2dq + vpmovdb, ...), see
+ * vec::convert_to_float.
+ */
+constexpr Int LANES = vec::Vectorized<float>::size();
+
+using vec::lanes_t;
+
+using float_lanes = lanes_t<float>;
+using mask_lanes = lanes_t<int32_t>;
+
+/*
+ * Type the kernels actually compute with: halfs are converted to float block
+ * by block, bools are 0/1 bytes.
+ */
+template <typename T>
+struct work_type
+{
+  using type = T;
+};
+
+template <>
+struct work_type<half_float>
+{
+  using type = float;
+};
+
+template <>
+struct work_type<bool>
+{
+  using type = uint8_t;
+};
+
+template <typename T>
+using work_t = typename work_type<T>::type;
+
+template <typename T>
+constexpr bool is_float_v =
+    std::is_same_v<T, float> || std::is_same_v<T, half_float>;
+
+LEGRAD_INLINE float_lanes select(mask_lanes mask, float_lanes a, float_lanes b)
+{
+  return (float_lanes)(((mask_lanes)a & mask) | ((mask_lanes)b & ~mask));
+}
+
+LEGRAD_INLINE float_lanes broadcast(float value)
+{
+  return value - float_lanes{};
+}
+
+/*
+ * Round to nearest even without touching MXCSR/FPCR: adding 2^23 to |x| < 2^23
+ * pushes the fraction out of the mantissa and the FPU rounds it (ties to
+ * even), bigger values are integers already. NaN compares false and is kept.
+ */
+LEGRAD_INLINE float_lanes round_nearest(float_lanes x)
+{
+  const float_lanes magic = broadcast(8388608.0f);  // 2^23
+  const mask_lanes bits = (mask_lanes)x;
+  const mask_lanes sign = bits & std::numeric_limits<int32_t>::min();
+  const float_lanes abs =
+      (float_lanes)(bits & std::numeric_limits<int32_t>::max());
+  const float_lanes rounded =
+      (float_lanes)((mask_lanes)((abs + magic) - magic) | sign);
+  return select(abs < magic, rounded, x);
+}
+
+/*
+ * Largest float that still fits in T. For 32-bit integers the max itself is
+ * not representable and would round up (out of range), use the float right
+ * below it instead.
+ */
+template <typename T>
+constexpr float saturate_upper()
+{
+  if constexpr (std::is_same_v<T, int32_t>) {
+    return 2147483520.0f;  // 2^31 - 2^7
+  } else if constexpr (std::is_same_v<T, uint32_t>) {
+    return 4294967040.0f;  // 2^32 - 2^8
+  } else {
+    return static_cast<float>(std::numeric_limits<T>::max());
+  }
+}
+
+// Float lanes to the work type of To: saturate and round for integers
+template <typename To>
+LEGRAD_INLINE lanes_t<work_t<To>> from_float(float_lanes x, RoundMode mode)
+{
+  if constexpr (is_float_v<To>) {
+    return x;
+  } else if constexpr (std::is_same_v<To, bool>) {
+    return __builtin_convertvector(x != 0, lanes_t<uint8_t>) & 1;
+  } else {
+    if (mode == RoundMode::Nearest) {
+      x = round_nearest(x);
+    }
+    const float_lanes lo =
+        broadcast(static_cast<float>(std::numeric_limits<To>::min()));
+    const float_lanes hi = broadcast(saturate_upper<To>());
+    x = select(x < lo, lo, x);
+    x = select(x > hi, hi, x);
+    x = select(x == x, x, float_lanes{});  // NaN -> 0
+    return vec::convert_from_float<To>(x);
+  }
+}
+
+/*
+ * Convert one step of LANES elements. From is a work type (never half or
+ * bool), To is the logical destination type.
+ * Integer to integer casts stay in the integer domain (int32 does not fit in a
+ * float mantissa) and wrap around like static_cast; everything else goes
+ * through float, where the optional scale is applied.
+ */
+template <typename From, typename To, bool SCALED>
+LEGRAD_INLINE lanes_t<work_t<To>> convert_lanes(lanes_t<From> x,
+                                                const CastParams& params)
+{
+  if constexpr (!SCALED && !is_float_v<From> && !is_float_v<To>) {
+    if constexpr (std::is_same_v<To, bool>) {
+      return __builtin_convertvector(x != 0, lanes_t<uint8_t>) & 1;
+    } else {
+      return __builtin_convertvector(x, lanes_t<To>);
+    }
+  } else {
+    float_lanes f = vec::convert_to_float<From>(x);
+    if constexpr (SCALED) {
+      f *= params.scale;
+    }
+    return from_float<To>(f, params.mode);
+  }
+}
+
+template <typename From, typename To, bool SCALED>
+void convert_contiguous(const From* src,
+                        work_t<To>* dst,
+                        Int n,
+                        const CastParams& params)
+{
+  using ToW = work_t<To>;
+  Int i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    lanes_t<From> x;
+    std::memcpy(&x, src + i, sizeof(x));
+    const lanes_t<ToW> y = convert_lanes<From, To, SCALED>(x, params);
+    std::memcpy(dst + i, &y, sizeof(y));
+  }
+  if (i < n) {
+    // Tail goes through the same lanes so results don't depend on position
+    lanes_t<From> x = {};
+    std::memcpy(&x, src + i, (n - i) * sizeof(From));
+    const lanes_t<ToW> y = convert_lanes<From, To, SCALED>(x, params);
+    std::memcpy(dst + i, &y, (n - i) * sizeof(ToW));
+  }
+}
+
+template <typename T>
+void copy_run(const char* src, Int src_stride, char* dst, Int dst_stride, Int n)
+{
+  if (src_stride == sizeof(T) && dst_stride == sizeof(T)) {
+    std::memcpy(dst, src, n * sizeof(T));
+  } else {
+    for (Int i = 0; i < n; ++i) {
+      std::memcpy(dst + i * dst_stride, src + i * src_stride, sizeof(T));
+    }
+  }
+}
+
+/*
+ * Inner loop over one run of `n` elements, in blocks of BLOCK elements:
+ * 1. the source is used in place when contiguous, otherwise gathered (or
+ *    converted from half) into a buffer
+ * 2. the block is converted LANES elements at a time
+ * 3. the result is written in place when contiguous, otherwise scattered (or
+ *    converted to half)
+ */
+template <typename Src, typename Dst, bool SCALED>
+void cast_loop(const std::array<char*, 2>& ptrs,
+               const std::array<Int, 2>& strides,
+               Int n,
+               const CastParams& params)
+{
+  using SrcW = work_t<Src>;
+  using DstW = work_t<Dst>;
+
+  if constexpr (!SCALED && std::is_same_v<Src, Dst>) {
+    copy_run<Src>(ptrs[1], strides[1], ptrs[0], strides[0], n);
+  } else {
+    constexpr Int BLOCK = 256;
+    SrcW src_buf[BLOCK];
+    DstW dst_buf[BLOCK];
+
+    for (Int start = 0; start < n; start += BLOCK) {
+      const Int len = std::min(BLOCK, n - start);
+      const char* src = ptrs[1] + start * strides[1];
+      char* dst = ptrs[0] + start * strides[0];
+
+      const SrcW* src_work = src_buf;
+      if constexpr (std::is_same_v<Src, half_float>) {
+        vec::load_half(src, strides[1], len, src_buf);
+      } else if (strides[1] == sizeof(Src)) {
+        src_work = reinterpret_cast<const SrcW*>(src);
+      } else {
+        for (Int i = 0; i < len; ++i) {
+          std::memcpy(src_buf + i, src + i * strides[1], sizeof(Src));
+        }
+      }
+
+      const bool dst_in_place =
+          !std::is_same_v<Dst, half_float> && strides[0] == sizeof(Dst);
+      DstW* dst_work = dst_in_place ? reinterpret_cast<DstW*>(dst) : dst_buf;
+      convert_contiguous<SrcW, Dst, SCALED>(src_work, dst_work, len, params);
+
+      if constexpr (std::is_same_v<Dst, half_float>) {
+        vec::store_half(dst_buf, dst, strides[0], len);
+      } else if (!dst_in_place) {
+        for (Int i = 0; i < len; ++i) {
+          std::memcpy(dst + i * strides[0], dst_buf + i, sizeof(Dst));
+        }
+      }
+    }
+  }
+}
+
+template <typename Src, typename Dst, size_t RANK>
+void run_cast(const LoopPlan<2>& plan, const CastParams& params)
+{
+  parallel_for(0, plan.numel, GRAIN_SIZE,
+               [&](Int begin, Int end)
+               {
+                 for_each_run<RANK>(plan, begin, end,
+                                    [&](const std::array<char*, 2>& ptrs,
+                                        const std::array<Int, 2>& strides,
+                                        Int n)
+                                    {
+                                      if (params.scaled) {
+                                        cast_loop<Src, Dst, true>(
+                                            ptrs, strides, n, params);
+                                      } else {
+                                        cast_loop<Src, Dst, false>(
+                                            ptrs, strides, n, params);
+                                      }
+                                    });
+               });
+}
+
+template <typename T>
+struct CastKernel
+{
+  static void run(core::TypeInfo dst_dtype,
+                  const LoopPlan<2>& plan,
+                  const CastParams& params)
+  {
+    using core::TypeInfo;
+    CALL_DISPATCH_TYPE_INFO_AND_RANK(
+        dst_dtype, plan.dim(),
+        [&] { run_cast<T, scalar_t, loop_rank>(plan, params); });
+  }
+};
+
+const CpuKernelRegistrar<CastKernel> cast_registrar(CAST_KERNEL);
+}  // namespace
+}  // namespace legrad::cpu
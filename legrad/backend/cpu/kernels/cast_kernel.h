@@ -0,0 +1,25 @@
+#pragma once
+
+#include "backend/cpu/cast.h"
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+
+namespace legrad::cpu
+{
+constexpr const char* CAST_KERNEL = "cast";
+
+struct CastParams
+{
+  bool scaled = false;
+  float scale = 1.0f;
+  RoundMode mode = RoundMode::Truncate;
+};
+
+/*
+ * Kernels are registered per source dtype, the destination dtype is a
+ * parameter. The plan is built by make_loop_plan({out, in}).
+ */
+using CastKernelFn = void (*)(core::TypeInfo dst_dtype,
+                              const LoopPlan<2>& plan,
+                              const CastParams& params);
+}  // namespace legrad::cpu
@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <type_traits>
+
+#include "backend/cpu/expr.h"
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/elementwise_kernel.h"
+#include "backend/cpu/loops.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+/*
+ * Op functors are templates so the same functor works on scalars (tails and
+ * strided loops) and on vec::Vectorized (contiguous loops).
+ */
+struct AddFn
+{
+  template <typename V>
+  LEGRAD_INLINE V operator()(const V& a, const V& b) const
+  {
+    return a + b;
+  }
+};
+
+struct SubFn
+{
+  template <typename V>
+  LEGRAD_INLINE V operator()(const V& a, const V& b) const
+  {
+    return a - b;
+  }
+};
+
+struct MulFn
+{
+  template <typename V>
+  LEGRAD_INLINE V operator()(const V& a, const V& b) const
+  {
+    return a * b;
+  }
+};
+
+struct DivFn
+{
+  template <typename V>
+  LEGRAD_INLINE V operator()(const V& a, const V& b) const
+  {
+    return a / b;
+  }
+};
+
+struct MaxFn
+{
+  template <typename V>
+  LEGRAD_INLINE V operator()(const V& a, const V& b) const
+  {
+    using vec::maximum;
+    return maximum(a, b);
+  }
+};
+
+struct MinFn
+{
+  template <typename V>
+  LEGRAD_INLINE V operator()(const V& a, const V& b) const
+  {
+    using vec::minimum;
+    return minimum(a, b);
+  }
+};
+
+template <typename T>
+LEGRAD_INLINE T& at(char* ptr, Int stride, Int idx)
+{
+  return *reinterpret_cast<T*>(ptr + idx * stride);
+}
+
+/*
+ * Inner loop over one run of `n` elements. There are three fast paths, all of
+ * them with a contiguous output:
+ * - both inputs contiguous (same shape add, residual add)
+ * - `b` is broadcast along the run (scale by scalar, bias add on columns)
+ * - `a` is broadcast along the run
+ * Everything else falls back to a scalar strided loop.
+ */
+template <typename T, typename Op>
+void binary_loop(const std::array<char*, 3>& ptrs,
+                 const std::array<Int, 3>& strides,
+                 Int n,
+                 const Op& op)
+{
+  using Vec = vec::Vectorized<T>;
+  constexpr Int es = sizeof(T);
+
+  T* out = reinterpret_cast<T*>(ptrs[0]);
+  const T* a = reinterpret_cast<const T*>(ptrs[1]);
+  const T* b = reinterpret_cast<const T*>(ptrs[2]);
+
+  if (strides[0] == es && strides[1] == es && strides[2] == es) {
+    Int i = 0;
+    for (; i + Vec::size() <= n; i += Vec::size()) {
+      op(Vec::loadu(a + i), Vec::loadu(b + i)).store(out + i);
+    }
+    for (; i < n; ++i) {
+      out[i] = op(a[i], b[i]);
+    }
+  } else if (strides[0] == es && strides[1] == es && strides[2] == 0) {
+    const T sb = *b;
+    const Vec vb(sb);
+    Int i = 0;
+    for (; i + Vec::size() <= n; i += Vec::size()) {
+      op(Vec::loadu(a + i), vb).store(out + i);
+    }
+    for (; i < n; ++i) {
+      out[i] = op(a[i], sb);
+    }
+  } else if (strides[0] == es && strides[1] == 0 && strides[2] == es) {
+    const T sa = *a;
+    const Vec va(sa);
+    Int i = 0;
+    for (; i + Vec::size() <= n; i += Vec::size()) {
+      op(va, Vec::loadu(b + i)).store(out + i);
+    }
+    for (; i < n; ++i) {
+      out[i] = op(sa, b[i]);
+    }
+  } else {
+    for (Int i = 0; i < n; ++i) {
+      at<T>(ptrs[0], strides[0], i) =
+          op(at<T>(ptrs[1], strides[1], i), at<T>(ptrs[2], strides[2], i));
+    }
+  }
+}
+
+/*
+ * There is no half arithmetic on most CPUs, so Float16 is converted block by
+ * block to float, computed with the float kernel and converted back.
+ */
+template <typename Op>
+void binary_loop_half(const std::array<char*, 3>& ptrs,
+                      const std::array<Int, 3>& strides,
+                      Int n,
+                      const Op& op)
+{
+  constexpr Int BLOCK = 256;
+  float buf_out[BLOCK], buf_a[BLOCK], buf_b[BLOCK];
+  const std::array<char*, 3> buf_ptrs = {reinterpret_cast<char*>(buf_out),
+                                         reinterpret_cast<char*>(buf_a),
+                                         reinterpret_cast<char*>(buf_b)};
+  const std::array<Int, 3> buf_strides = {sizeof(float), sizeof(float),
+                                          sizeof(float)};
+
+  for (Int start = 0; start < n; start += BLOCK) {
+    const Int len = std::min(BLOCK, n - start);
+    vec::load_half(ptrs[1] + start * strides[1], strides[1], len, buf_a);
+    vec::load_half(ptrs[2] + start * strides[2], strides[2], len, buf_b);
+    binary_loop<float>(buf_ptrs, buf_strides, len, op);
+    vec::store_half(buf_out, ptrs[0] + start * strides[0], strides[0], len);
+  }
+}
+
+template <typename T, size_t RANK, typename Op>
+void run_binary(const LoopPlan<3>& plan, const Op& op)
+{
+  parallel_for(0, plan.numel, GRAIN_SIZE,
+               [&](Int begin, Int end)
+               {
+                 for_each_run<RANK>(plan, begin, end,
+                                    [&](const std::array<char*, 3>& ptrs,
+                                        const std::array<Int, 3>& strides,
+                                        Int n)
+                                    {
+                                      if constexpr (std::is_same_v<T,
+                                                                   half_float>)
+                                      {
+                                        binary_loop_half(ptrs, strides, n, op);
+                                      } else {
+                                        binary_loop<T>(ptrs, strides, n, op);
+                                      }
+                                    });
+               });
+}
+
+template <typename T, size_t RANK>
+void dispatch_binary_op(BinaryOp op, const LoopPlan<3>& plan)
+{
+  switch (op) {
+    case BinaryOp::Add:
+      return run_binary<T, RANK>(plan, AddFn{});
+    case BinaryOp::Sub:
+      return run_binary<T, RANK>(plan, SubFn{});
+    case BinaryOp::Mul:
+      return run_binary<T, RANK>(plan, MulFn{});
+    case BinaryOp::Div:
+      return run_binary<T, RANK>(plan, DivFn{});
+    case BinaryOp::Max:
+      return run_binary<T, RANK>(plan, MaxFn{});
+    case BinaryOp::Min:
+      return run_binary<T, RANK>(plan, MinFn{});
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument, "Unsupported BinaryOp {}",
+                         ToIntEnum(op));
+  }
+}
+
+/*
+ * Booleans are stored as 0/1 bytes, so logical or/and are max/min on uint8_t
+ * and we can reuse the vectorized uint8_t kernels
+ */
+BinaryOp bool_equivalent_op(BinaryOp op)
+{
+  switch (op) {
+    case BinaryOp::Add:
+    case BinaryOp::Max:
+      return BinaryOp::Max;
+    case BinaryOp::Mul:
+    case BinaryOp::Min:
+      return BinaryOp::Min;
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument,
+                         "BinaryOp {} is not supported for Bool tensors",
+                         BinaryOpToString(op));
+  }
+}
+
+template <typename T>
+struct BinaryKernel
+{
+  static void run(BinaryOp op, const LoopPlan<3>& plan)
+  {
+    if constexpr (std::is_same_v<T, bool>) {
+      BinaryKernel<uint8_t>::run(bool_equivalent_op(op), plan);
+    } else {
+      dispatch_rank(plan.dim(),
+                    [&](auto rank)
+                    {
+                      constexpr size_t loop_rank = decltype(rank)::value;
+                      dispatch_binary_op<T, loop_rank>(op, plan);
+                    });
+    }
+  }
+};
+
+// An activation is an expression of its input, see expr.h
+template <typename T>
+struct ActivationKernel
+{
+  static void run(Activation act, const LoopPlan<2>& plan)
+  {
+    if constexpr (std::is_same_v<T, float> || std::is_same_v<T, half_float>) {
+      using namespace expr;
+      switch (act) {
+        case Activation::None:
+          return run_expression<T>(arg(), plan);
+        case Activation::Relu:
+          return run_expression<T>(relu(arg()), plan);
+        case Activation::Silu:
+          return run_expression<T>(silu(arg()), plan);
+        case Activation::Gelu:
+          return run_expression<T>(gelu(arg()), plan);
+        case Activation::Sigmoid:
+          return run_expression<T>(sigmoid(arg()), plan);
+        default:
+          LEGRAD_THROW_ERROR(std::invalid_argument,
+                             "Activation {} is not supported",
+                             ActivationToString(act));
+      }
+    }
+  }
+};
+
+const CpuKernelRegistrar<BinaryKernel> binary_registrar(BINARY_KERNEL);
+const CpuKernelRegistrar<ActivationKernel> activation_registrar(
+    ACTIVATION_KERNEL,
+    {core::TypeInfo::Float32, core::TypeInfo::Float16});
+}  // namespace
+}  // namespace legrad::cpu
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "backend/cpu/elementwise.h"
+#include "backend/cpu/loops.h"
+
+namespace legrad::cpu
+{
+constexpr const char* BINARY_KERNEL = "binary";
+// Registered for Float32 and Float16
+constexpr const char* ACTIVATION_KERNEL = "activation";
+
+// out = op(a, b) over a plan built by make_loop_plan({out, a, b})
+using BinaryKernelFn = void (*)(BinaryOp op, const LoopPlan<3>& plan);
+// out = act(in) over a plan built by make_loop_plan({out, in})
+using ActivationKernelFn = void (*)(Activation act, const LoopPlan<2>& plan);
+}  // namespace legrad::cpu
@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/fused_kernel.h"
+#include "backend/cpu/kernels/row_impl.h"
+#include "backend/cpu/loops.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+using Vec = vec::Vectorized<float>;
+
+// Elements of a register, 1 KB: every register of a program stays in L1
+constexpr Int FUSED_BLOCK = 256;
+
+template <typename Op>
+LEGRAD_INLINE void map_binary(const float* a,
+                              const float* b,
+                              float* dst,
+                              Int n,
+                              const Op& op)
+{
+  Int i = 0;
+  for (; i + Vec::size() <= n; i += Vec::size()) {
+    op(Vec::loadu(a + i), Vec::loadu(b + i)).store(dst + i);
+  }
+  if (i < n) {
+    op(Vec::loadu(a + i, n - i), Vec::loadu(b + i, n - i))
+        .store(dst + i, n - i);
+  }
+}
+
+template <typename Op>
+LEGRAD_INLINE void map_scalar(const float* a,
+                              float scalar,
+                              float* dst,
+                              Int n,
+                              const Op& op)
+{
+  const Vec b(scalar);
+  map_row(a, dst, n, [&](const Vec& v) { return op(v, b); });
+}
+
+/*
+ * dst = op(a, b) with b a register or a scalar. The padding lanes of a tail
+ * are zero, a division there is never stored.
+ */
+template <typename B>
+void run_binary(BinaryOp op, const float* a, B b, float* dst, Int n)
+{
+  const auto apply = [&](const auto& fn)
+  {
+    if constexpr (std::is_same_v<B, float>) {
+      map_scalar(a, b, dst, n, fn);
+    } else {
+      map_binary(a, b, dst, n, fn);
+    }
+  };
+  switch (op) {
+    case BinaryOp::Add:
+      return apply([](const Vec& x, const Vec& y) { return x + y; });
+    case BinaryOp::Sub:
+      return apply([](const Vec& x, const Vec& y) { return x - y; });
+    case BinaryOp::Mul:
+      return apply([](const Vec& x, const Vec& y) { return x * y; });
+    case BinaryOp::Div:
+      return apply([](const Vec& x, const Vec& y) { return x / y; });
+    case BinaryOp::Max:
+      return apply([](const Vec& x, const Vec& y) { return maximum(x, y); });
+    case BinaryOp::Min:
+      return apply([](const Vec& x, const Vec& y) { return minimum(x, y); });
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument, "Unsupported BinaryOp {}",
+                         ToIntEnum(op));
+  }
+}
+
+/*
+ * Input of `n` elements as floats: read in place when it already is a
+ * contiguous Float32 run, otherwise converted (or broadcast) into `reg`
+ */
+const float* load_input(const char* ptr,
+                        core::TypeInfo dtype,
+                        Int stride,
+                        Int n,
+                        float* reg)
+{
+  if (dtype == core::TypeInfo::Float32 && stride == sizeof(float)) {
+    return reinterpret_cast<const float*>(ptr);
+  }
+  if (dtype == core::TypeInfo::Float16) {
+    vec::load_half(ptr, stride, n, reg);
+  } else if (stride == 0) {
+    std::fill_n(reg, n, *reinterpret_cast<const float*>(ptr));
+  } else {
+    for (Int i = 0; i < n; ++i) {
+      reg[i] = *reinterpret_cast<const float*>(ptr + i * stride);
+    }
+  }
+  return reg;
+}
+
+void store_output(const float* src,
+                  char* ptr,
+                  core::TypeInfo dtype,
+                  Int stride,
+                  Int n)
+{
+  if (dtype == core::TypeInfo::Float16) {
+    vec::store_half(src, ptr, stride, n);
+  } else if (stride == sizeof(float)) {
+    std::memcpy(ptr, src, n * sizeof(float));
+  } else {
+    for (Int i = 0; i < n; ++i) {
+      *reinterpret_cast<float*>(ptr + i * stride) = src[i];
+    }
+  }
+}
+
+// One run of the plan, FUSED_BLOCK elements at a time
+void fused_run(const FusedProgram& program,
+               const std::array<core::TypeInfo, FUSED_OPERANDS>& dtypes,
+               const std::array<char*, FUSED_OPERANDS>& ptrs,
+               const std::array<Int, FUSED_OPERANDS>& strides,
+               Int n,
+               std::vector<float>& registers,
+               std::vector<const float*>& values)
+{
+  for (Int start = 0; start < n; start += FUSED_BLOCK) {
+    const Int len = std::min(FUSED_BLOCK, n - start);
+    for (uint16_t i = 0; i < program.num_inputs; ++i) {
+      values[i] = load_input(ptrs[i + 1] + start * strides[i + 1],
+                             dtypes[i + 1], strides[i + 1], len,
+                             registers.data() + i * FUSED_BLOCK);
+    }
+    for (const FusedInstr& instr : program.instrs) {
+      float* dst = registers.data() + instr.dst * FUSED_BLOCK;
+      const float* a = values[instr.a];
+      switch (instr.kind) {
+        case FusedOpKind::Binary:
+          run_binary(instr.binary, a, values[instr.b], dst, len);
+          break;
+        case FusedOpKind::BinaryScalar:
+          run_binary(instr.binary, a, instr.scalar, dst, len);
+          break;
+        default:
+          activation_row(instr.activation, a, dst, len);
+      }
+      values[instr.dst] = dst;
+    }
+    store_output(values[program.result], ptrs[0] + start * strides[0],
+                 dtypes[0], strides[0], len);
+  }
+}
+
+template <size_t RANK>
+void run_fused(const FusedProgram& program,
+               const LoopPlan<FUSED_OPERANDS>& plan,
+               const std::array<core::TypeInfo, FUSED_OPERANDS>& dtypes)
+{
+  parallel_for(
+      0, plan.numel, GRAIN_SIZE,
+      [&](Int begin, Int end)
+      {
+        thread_local std::vector<float> registers;
+        registers.resize(std::max<size_t>(
+            registers.size(), program.num_registers * FUSED_BLOCK));
+        std::vector<const float*> values(program.num_registers);
+        for_each_run<RANK>(
+            plan, begin, end,
+            [&](const std::array<char*, FUSED_OPERANDS>& ptrs,
+                const std::array<Int, FUSED_OPERANDS>& strides,
+                Int n)
+            {
+              fused_run(program, dtypes, ptrs, strides, n, registers,
+                        values);
+            });
+      });
+}
+
+// The math is in float for every dtype, T only selects the registry entry
+template <typename T>
+struct FusedKernel
+{
+  static void run(const FusedProgram& program,
+                  const LoopPlan<FUSED_OPERANDS>& plan,
+                  const std::array<core::TypeInfo, FUSED_OPERANDS>& dtypes)
+  {
+    dispatch_rank(plan.dim(),
+                  [&](auto rank_tag)
+                  {
+                    constexpr size_t RANK = decltype(rank_tag)::value;
+                    run_fused<RANK>(program, plan, dtypes);
+                  });
+  }
+};
+
+const CpuKernelRegistrar<FusedKernel> fused_registrar(
+    FUSED_ELEMENTWISE_KERNEL,
+    {core::TypeInfo::Float32, core::TypeInfo::Float16});
+}  // namespace
+}  // namespace legrad::cpu
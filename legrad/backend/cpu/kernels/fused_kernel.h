@@ -0,0 +1,21 @@
+#pragma once
+
+#include <array>
+
+#include "backend/cpu/fused.h"
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+
+namespace legrad::cpu
+{
+// Registered per dtype of the output (Float32, Float16)
+constexpr const char* FUSED_ELEMENTWISE_KERNEL = "fused_elementwise";
+
+// Operand 0 is the output, then the inputs (a stride 0 scalar when unused)
+constexpr size_t FUSED_OPERANDS = FUSED_MAX_INPUTS + 1;
+
+using FusedKernelFn =
+    void (*)(const FusedProgram& program,
+             const LoopPlan<FUSED_OPERANDS>& plan,
+             const std::array<core::TypeInfo, FUSED_OPERANDS>& dtypes);
+}  // namespace legrad::cpu
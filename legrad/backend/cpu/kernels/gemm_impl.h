@@ -0,0 +1,626 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/gemm_kernel.h"
+#include "backend/cpu/kernels/row_impl.h"
+#include "backend/cpu/vec.h"
+#include "backend/cpu_mgr.h"
+#include "core/dtype.h"
+
+/*
+ * BLIS-style GEMM building blocks shared by the GEMM kernels (only include it
+ * from backend/cpu/kernels). C is computed in MR x NR tiles by a micro-kernel
+ * that keeps the tile in registers and streams packed panels of A and B:
+ *
+ *   for jc in N step NC:        B panel    KC x NC  -> L3
+ *     for pc in K step KC:      pack B
+ *       for ic in M step MC:    A block    MC x KC  -> L2, pack A
+ *         for jr in NC step NR: B sliver   KC x NR  -> L1
+ *           for ir in MC step MR:
+ *             micro-kernel (MR x NR tile of C)
+ *
+ * Packing also converts halfs to float, so there is one float micro-kernel per
+ * ISA and strided or transposed operands cost nothing more than a copy.
+ */
+namespace legrad::cpu
+{
+inline namespace LEGRAD_CPU_KERNEL_NAMESPACE
+{
+/*
+ * MR x NR accumulators + one row of B + a broadcast of A must fit in the
+ * register file: 16 zmm on AVX-512 (of 32), 12 ymm on AVX2 (of 16), 16 q
+ * registers on NEON (of 32) and 8 xmm on SSE2 (of 16).
+ * MC, KC and NC are the blocking used when the caches are unknown, see
+ * gemm_blocking.
+ */
+// clang-format off
+#if LEGRAD_VEC_BYTES == 64
+constexpr Int GEMM_MR = 8;
+constexpr Int GEMM_NR = 32;
+constexpr Int GEMM_MC = 256;
+constexpr Int GEMM_KC = 192;
+constexpr Int GEMM_NC = 4096;
+#elif LEGRAD_VEC_BYTES == 32
+constexpr Int GEMM_MR = 6;
+constexpr Int GEMM_NR = 16;
+constexpr Int GEMM_MC = 144;
+constexpr Int GEMM_KC = 256;
+constexpr Int GEMM_NC = 4080;
+#elif defined(__aarch64__)
+constexpr Int GEMM_MR = 8;
+constexpr Int GEMM_NR = 8;
+constexpr Int GEMM_MC = 128;
+constexpr Int GEMM_KC = 256;
+constexpr Int GEMM_NC = 4096;
+#else
+constexpr Int GEMM_MR = 4;
+constexpr Int GEMM_NR = 8;
+constexpr Int GEMM_MC = 128;
+constexpr Int GEMM_KC = 256;
+constexpr Int GEMM_NC = 4096;
+#endif
+// clang-format on
+
+struct GemmBlocking
+{
+  Int mc;
+  Int kc;
+  Int nc;
+};
+
+/*
+ * Blocking for the caches of a performance core (cpu::Manager): KC keeps a
+ * KC x NR sliver of B within half of L1, MC a MC x KC block of A within half
+ * of the L2 share of the core and NC a KC x NC panel of B within half of its
+ * L3 share.
+ */
+inline const GemmBlocking& gemm_blocking()
+{
+  static const GemmBlocking blocking = []
+  {
+    const Manager& mgr = Manager::instance();
+    const Int bytes = sizeof(float);
+    GemmBlocking blocking{GEMM_MC, GEMM_KC, GEMM_NC};
+    if (mgr.l1d().size > 0) {
+      const Int l1 = static_cast<Int>(mgr.l1d().size);
+      blocking.kc =
+          std::clamp<Int>(l1 / 2 / (GEMM_NR * bytes) / 8 * 8, 64, 512);
+    }
+    if (mgr.l2().size > 0) {
+      const Int l2 = static_cast<Int>(mgr.l2().size / mgr.l2().shared_cores);
+      blocking.mc =
+          std::clamp<Int>(l2 / 2 / (blocking.kc * bytes) / GEMM_MR * GEMM_MR,
+                          GEMM_MR, 512 / GEMM_MR * GEMM_MR);
+    }
+    if (mgr.l3().size > 0) {
+      const Int l3 = static_cast<Int>(mgr.l3().size / mgr.l3().shared_cores);
+      blocking.nc =
+          std::clamp<Int>(l3 / 2 / (blocking.kc * bytes) / GEMM_NR * GEMM_NR,
+                          16 * GEMM_NR, 8192 / GEMM_NR * GEMM_NR);
+    }
+    return blocking;
+  }();
+  return blocking;
+}
+
+// Max floats of the C workspace used for Float16 output (4 MB)
+constexpr Int GEMM_C_WORKSPACE = Int(1) << 20;
+
+// Per thread buffers, they only grow so a thread reuses them across calls
+struct GemmWorkspace
+{
+  std::vector<float> a;
+  std::vector<float> b;
+  std::vector<float> c;
+};
+
+LEGRAD_INLINE Int gemm_round_up(Int value, Int multiple)
+{
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+// Element of A/B as float, uint16_t is the storage of Float16
+LEGRAD_INLINE float gemm_load(const float* ptr)
+{
+  return *ptr;
+}
+
+LEGRAD_INLINE float gemm_load(const uint16_t* ptr)
+{
+  return fp16_ieee_to_fp32_value(*ptr);
+}
+
+/*
+ * Pack a [mc, kc] block of A into MR-row micro-panels, each one stored column
+ * by column (MR values per column). Rows past mc are zero so the micro-kernel
+ * always computes a full tile.
+ */
+template <typename T>
+void gemm_pack_a(const T* a, Int rs, Int cs, Int mc, Int kc, float* buf)
+{
+  for (Int i0 = 0; i0 < mc; i0 += GEMM_MR) {
+    const Int mr = std::min(GEMM_MR, mc - i0);
+    const T* panel = a + i0 * rs;
+    if (mr < GEMM_MR) {
+      std::fill_n(buf, GEMM_MR * kc, 0.0f);
+    }
+    if (cs == 1) {
+      for (Int i = 0; i < mr; ++i) {
+        for (Int p = 0; p < kc; ++p) {
+          buf[p * GEMM_MR + i] = gemm_load(panel + i * rs + p);
+        }
+      }
+    } else {
+      for (Int p = 0; p < kc; ++p) {
+        for (Int i = 0; i < mr; ++i) {
+          buf[p * GEMM_MR + i] = gemm_load(panel + i * rs + p * cs);
+        }
+      }
+    }
+    buf += GEMM_MR * kc;
+  }
+}
+
+/*
+ * Pack a [kc, nc] panel of B into NR-column slivers, each one stored row by
+ * row (NR values per row), columns past nc are zero.
+ */
+template <typename T>
+void gemm_pack_b(const T* b, Int rs, Int cs, Int kc, Int nc, float* buf)
+{
+  for (Int j0 = 0; j0 < nc; j0 += GEMM_NR) {
+    const Int nr = std::min(GEMM_NR, nc - j0);
+    const T* sliver = b + j0 * cs;
+    if (nr < GEMM_NR) {
+      std::fill_n(buf, GEMM_NR * kc, 0.0f);
+    }
+    if (cs == 1) {
+      for (Int p = 0; p < kc; ++p) {
+        if constexpr (std::is_same_v<T, float>) {
+          std::memcpy(buf + p * GEMM_NR, sliver + p * rs, nr * sizeof(float));
+        } else {
+          vec::cvt_f16_to_f32(sliver + p * rs, buf + p * GEMM_NR, nr);
+        }
+      }
+    } else if (rs == 1) {
+      // Transposed B (e.g. a row-major weight in x @ W^T)
+      for (Int j = 0; j < nr; ++j) {
+        for (Int p = 0; p < kc; ++p) {
+          buf[p * GEMM_NR + j] = gemm_load(sliver + j * cs + p);
+        }
+      }
+    } else {
+      for (Int p = 0; p < kc; ++p) {
+        for (Int j = 0; j < nr; ++j) {
+          buf[p * GEMM_NR + j] = gemm_load(sliver + p * rs + j * cs);
+        }
+      }
+    }
+    buf += GEMM_NR * kc;
+  }
+}
+
+/*
+ * tile = A micro-panel @ B sliver, a full MR x NR tile (row-major).
+ * The accumulators only live in registers: the loops have constant bounds and
+ * are fully unrolled, `acc + a * b` is contracted to FMA when available.
+ */
+LEGRAD_INLINE void gemm_micro_kernel(Int kc,
+                                     const float* ap,
+                                     const float* bp,
+                                     float* tile)
+{
+  using Vec = vec::Vectorized<float>;
+  constexpr Int NV = GEMM_NR / Vec::size();
+
+  Vec acc[GEMM_MR][NV];
+#pragma GCC unroll 16
+  for (Int i = 0; i < GEMM_MR; ++i) {
+#pragma GCC unroll 4
+    for (Int j = 0; j < NV; ++j) {
+      acc[i][j] = Vec(0.0f);
+    }
+  }
+
+  for (Int p = 0; p < kc; ++p) {
+    Vec b[NV];
+#pragma GCC unroll 4
+    for (Int j = 0; j < NV; ++j) {
+      b[j] = Vec::loadu(bp + j * Vec::size());
+    }
+#pragma GCC unroll 16
+    for (Int i = 0; i < GEMM_MR; ++i) {
+      const Vec a(ap[i]);
+#pragma GCC unroll 4
+      for (Int j = 0; j < NV; ++j) {
+        acc[i][j] = acc[i][j] + a * b[j];
+      }
+    }
+    ap += GEMM_MR;
+    bp += GEMM_NR;
+  }
+
+#pragma GCC unroll 16
+  for (Int i = 0; i < GEMM_MR; ++i) {
+#pragma GCC unroll 4
+    for (Int j = 0; j < NV; ++j) {
+      acc[i][j].store(tile + i * GEMM_NR + j * Vec::size());
+    }
+  }
+}
+
+// c[0:mr, 0:nr] = alpha * tile + beta * c, c is not read when beta is 0
+LEGRAD_INLINE void gemm_store_tile(const float* tile,
+                                   Int mr,
+                                   Int nr,
+                                   float* c,
+                                   Int rs,
+                                   Int cs,
+                                   float alpha,
+                                   float beta)
+{
+  using Vec = vec::Vectorized<float>;
+  if (cs == 1 && nr == GEMM_NR) {
+    const Vec valpha(alpha), vbeta(beta);
+    for (Int i = 0; i < mr; ++i) {
+      float* row = c + i * rs;
+      for (Int j = 0; j < GEMM_NR; j += Vec::size()) {
+        Vec value = valpha * Vec::loadu(tile + i * GEMM_NR + j);
+        if (beta != 0.0f) {
+          value = value + vbeta * Vec::loadu(row + j);
+        }
+        value.store(row + j);
+      }
+    }
+  } else {
+    for (Int i = 0; i < mr; ++i) {
+      for (Int j = 0; j < nr; ++j) {
+        float& out = c[i * rs + j * cs];
+        const float value = alpha * tile[i * GEMM_NR + j];
+        out = beta != 0.0f ? value + beta * out : value;
+      }
+    }
+  }
+}
+
+/*
+ * x += `n` elements of `op` from element `offset` on, `op.cs` apart (a row
+ * segment of a Float32/Float16 operand)
+ */
+inline void gemm_add_operand(float* x, const GemmOperand& op, Int offset, Int n)
+{
+  using Vec = vec::Vectorized<float>;
+  const Int elem_size = static_cast<Int>(core::type_size(op.dtype));
+  const char* ptr = static_cast<const char*>(op.data) + offset * elem_size;
+  alignas(64) float buf[GEMM_NR];
+  for (Int j = 0; j < n; j += GEMM_NR) {
+    const Int count = std::min(GEMM_NR, n - j);
+    const char* at = ptr + j * op.cs * elem_size;
+    const float* src = reinterpret_cast<const float*>(at);
+    if (!is_direct(op.dtype, op.cs)) {
+      copy_row(at, op.dtype, op.cs, count, buf);
+      src = buf;
+    }
+    for (Int l = 0; l < count; l += Vec::size()) {
+      const Int lanes = std::min(Vec::size(), count - l);
+      (Vec::loadu(x + j + l, lanes) + Vec::loadu(src + l, lanes))
+          .store(x + j + l, lanes);
+    }
+  }
+}
+
+// Epilogue of the `n` floats of row `row` of c from column `col` on
+inline void gemm_epilogue_row(const GemmEpilogueArgs& epilogue,
+                              float* x,
+                              Int row,
+                              Int col,
+                              Int n)
+{
+  if (epilogue.bias.data) {
+    gemm_add_operand(x, epilogue.bias, col * epilogue.bias.cs, n);
+  }
+  if (epilogue.activation != Activation::None) {
+    activation_row(epilogue.activation, x, x, n);
+  }
+  const GemmOperand& residual = epilogue.residual;
+  if (residual.data) {
+    gemm_add_operand(x, residual, row * residual.rs + col * residual.cs, n);
+  }
+}
+
+// gemm_epilogue_row over a Float32 tile c[0:mr, 0:nr] at (row, col) of c
+inline void gemm_epilogue_tile(const GemmEpilogueArgs& epilogue,
+                               float* c,
+                               Int rs,
+                               Int cs,
+                               Int row,
+                               Int col,
+                               Int mr,
+                               Int nr)
+{
+  alignas(64) float buf[GEMM_NR];
+  for (Int i = 0; i < mr; ++i) {
+    float* x = c + i * rs;
+    if (cs != 1) {
+      for (Int j = 0; j < nr; ++j) {
+        buf[j] = x[j * cs];
+      }
+    }
+    gemm_epilogue_row(epilogue, cs == 1 ? x : buf, row + i, col, nr);
+    if (cs != 1) {
+      for (Int j = 0; j < nr; ++j) {
+        x[j * cs] = buf[j];
+      }
+    }
+  }
+}
+
+/*
+ * Float16 c = epilogue(work + beta * c), with work a row-major [m, n] float
+ * block at (row, col) of c
+ */
+inline void gemm_store_half(float* work,
+                            Int m,
+                            Int n,
+                            uint16_t* c,
+                            Int rs,
+                            Int cs,
+                            float beta,
+                            const GemmEpilogueArgs& epilogue,
+                            Int row,
+                            Int col)
+{
+  const bool has_epilogue = !epilogue.empty();
+  for (Int i = 0; i < m; ++i) {
+    float* src = work + i * n;
+    uint16_t* out = c + i * rs;
+    if (beta != 0.0f) {
+      for (Int j = 0; j < n; ++j) {
+        src[j] += beta * fp16_ieee_to_fp32_value(out[j * cs]);
+      }
+    }
+    if (has_epilogue) {
+      gemm_epilogue_row(epilogue, src, row + i, col, n);
+    }
+    if (cs == 1) {
+      vec::cvt_f32_to_f16(src, out, n);
+      continue;
+    }
+    for (Int j = 0; j < n; ++j) {
+      out[j * cs] = fp16_ieee_from_fp32_value(src[j]);
+    }
+  }
+}
+
+/*
+ * Serial GEMM on the block C[m0:m1, n0:n1] (see the loop nest above).
+ * TA/TB are the storage types of A/B (float or uint16_t for Float16). A
+ * Float16 C is accumulated in a float workspace over the whole K and
+ * converted once at the end, so precision is the same as for Float32.
+ */
+template <typename TA, typename TB>
+void gemm_block(const GemmArgs& args,
+                Int m0,
+                Int m1,
+                Int n0,
+                Int n1,
+                GemmWorkspace& ws)
+{
+  const TA* a = static_cast<const TA*>(args.a.data);
+  const TB* b = static_cast<const TB*>(args.b.data);
+  const Int m = m1 - m0;
+  const Int k = args.k;
+  const GemmBlocking& blocking = gemm_blocking();
+  const bool half_c = args.c.dtype == core::TypeInfo::Float16;
+  const bool has_epilogue = !args.epilogue.empty();
+
+  Int nc_max = std::min(blocking.nc, gemm_round_up(n1 - n0, GEMM_NR));
+  if (half_c) {
+    nc_max = std::min(
+        nc_max, std::max(GEMM_NR, GEMM_C_WORKSPACE / m / GEMM_NR * GEMM_NR));
+    ws.c.resize(std::max<size_t>(ws.c.size(), m * nc_max));
+  }
+  const Int kc_max = std::max<Int>(std::min(blocking.kc, k), 1);
+  const Int mc_max = std::min(blocking.mc, gemm_round_up(m, GEMM_MR));
+  ws.a.resize(std::max<size_t>(ws.a.size(), mc_max * kc_max));
+  ws.b.resize(std::max<size_t>(ws.b.size(), nc_max * kc_max));
+
+  alignas(64) float tile[GEMM_MR * GEMM_NR];
+  for (Int jc = n0; jc < n1; jc += nc_max) {
+    const Int nc = std::min(nc_max, n1 - jc);
+
+    float* c;
+    Int rs_c, cs_c;
+    if (half_c) {
+      c = ws.c.data();
+      rs_c = nc;
+      cs_c = 1;
+    } else {
+      c = static_cast<float*>(args.c.data) + m0 * args.c.rs + jc * args.c.cs;
+      rs_c = args.c.rs;
+      cs_c = args.c.cs;
+    }
+
+    // K == 0 still runs once (with empty panels) to apply beta
+    Int pc = 0;
+    do {
+      const Int kc = std::min(blocking.kc, k - pc);
+      gemm_pack_b(b + pc * args.b.rs + jc * args.b.cs, args.b.rs, args.b.cs,
+                  kc, nc, ws.b.data());
+      // The first K block applies beta, the next ones accumulate
+      const float beta = pc > 0 ? 1.0f : (half_c ? 0.0f : args.beta);
+      // The Float32 tiles are final in the last K block, Float16 at the end
+      const bool epilogue = has_epilogue && !half_c && pc + kc >= k;
+
+      for (Int ic = 0; ic < m; ic += blocking.mc) {
+        const Int mc = std::min(blocking.mc, m - ic);
+        gemm_pack_a(a + (m0 + ic) * args.a.rs + pc * args.a.cs, args.a.rs,
+                    args.a.cs, mc, kc, ws.a.data());
+
+        for (Int jr = 0; jr < nc; jr += GEMM_NR) {
+          const Int nr = std::min(GEMM_NR, nc - jr);
+          for (Int ir = 0; ir < mc; ir += GEMM_MR) {
+            const Int mr = std::min(GEMM_MR, mc - ir);
+            gemm_micro_kernel(kc, ws.a.data() + ir * kc,
+                              ws.b.data() + jr * kc, tile);
+            float* c_tile = c + (ic + ir) * rs_c + jr * cs_c;
+            gemm_store_tile(tile, mr, nr, c_tile, rs_c, cs_c, args.alpha,
+                            beta);
+            if (epilogue) {
+              gemm_epilogue_tile(args.epilogue, c_tile, rs_c, cs_c,
+                                 m0 + ic + ir, jc + jr, mr, nr);
+            }
+          }
+        }
+      }
+      pc += kc;
+    } while (pc < k);
+
+    if (half_c) {
+      gemm_store_half(
+          ws.c.data(), m, nc,
+          static_cast<uint16_t*>(args.c.data) + m0 * args.c.rs + jc * args.c.cs,
+          args.c.rs, args.c.cs, args.beta, args.epilogue, m0, jc);
+    }
+  }
+}
+
+/*
+ * c[0:mr, 0:nr] = silu(gate) * up with gate/up row-major blocks `ld` floats
+ * apart, TC is the storage type of c (float or uint16_t for Float16)
+ */
+template <typename TC>
+LEGRAD_INLINE void gemm_store_swiglu(const float* gate,
+                                     const float* up,
+                                     Int ld,
+                                     Int mr,
+                                     Int nr,
+                                     TC* c,
+                                     Int rs,
+                                     Int cs)
+{
+  using Vec = vec::Vectorized<float>;
+  alignas(64) float row[GEMM_NR];
+  for (Int i = 0; i < mr; ++i) {
+    for (Int j = 0; j < nr; j += Vec::size()) {
+      const Int count = std::min(Vec::size(), nr - j);
+      const Vec h = vec::silu(Vec::loadu(gate + i * ld + j, count))
+                  * Vec::loadu(up + i * ld + j, count);
+      h.store(row + j, count);
+    }
+    TC* out = c + i * rs;
+    if constexpr (std::is_same_v<TC, float>) {
+      if (cs == 1) {
+        std::memcpy(out, row, nr * sizeof(float));
+        continue;
+      }
+      for (Int j = 0; j < nr; ++j) {
+        out[j * cs] = row[j];
+      }
+    } else {
+      if (cs == 1) {
+        vec::cvt_f32_to_f16(row, out, nr);
+        continue;
+      }
+      for (Int j = 0; j < nr; ++j) {
+        out[j * cs] = fp16_ieee_from_fp32_value(row[j]);
+      }
+    }
+  }
+}
+
+/*
+ * gemm_block for the two products of a SwiGLU on the block C[m0:m1, n0:n1]:
+ * every packed block of A serves the gate and the up panels, their sums
+ * over K live in the float workspace (at most GEMM_C_WORKSPACE, nc shrinks
+ * for tall blocks) and the last K block turns each tile into
+ * silu(gate) * up while it is still in L1. Neither product is written out.
+ */
+template <typename TA, typename TB, typename TC>
+void gemm_swiglu_block(const SwigluGemmArgs& args,
+                       Int m0,
+                       Int m1,
+                       Int n0,
+                       Int n1,
+                       GemmWorkspace& ws)
+{
+  const GemmArgs& gemm = args.gemm;
+  const TA* a = static_cast<const TA*>(gemm.a.data);
+  const TB* gate = static_cast<const TB*>(gemm.b.data);
+  const TB* up = static_cast<const TB*>(args.up.data);
+  const Int m = m1 - m0;
+  const Int k = gemm.k;
+  const GemmBlocking& blocking = gemm_blocking();
+
+  /*
+   * Two B panels take the L3 share of one. A multiple of NR: gemm_pack_b
+   * writes whole slivers, a ragged panel would run into the next one.
+   */
+  const Int nc_max = std::min(
+      {std::max(GEMM_NR, blocking.nc / 2 / GEMM_NR * GEMM_NR),
+       gemm_round_up(n1 - n0, GEMM_NR),
+       std::max(GEMM_NR, GEMM_C_WORKSPACE / (2 * m) / GEMM_NR * GEMM_NR)});
+  const Int kc_max = std::max<Int>(std::min(blocking.kc, k), 1);
+  const Int mc_max = std::min(blocking.mc, gemm_round_up(m, GEMM_MR));
+  ws.a.resize(std::max<size_t>(ws.a.size(), mc_max * kc_max));
+  ws.b.resize(std::max<size_t>(ws.b.size(), 2 * nc_max * kc_max));
+  ws.c.resize(std::max<size_t>(ws.c.size(), 2 * m * nc_max));
+  float* gate_panel = ws.b.data();
+  float* up_panel = ws.b.data() + nc_max * kc_max;
+
+  alignas(64) float gate_tile[GEMM_MR * GEMM_NR];
+  alignas(64) float up_tile[GEMM_MR * GEMM_NR];
+  for (Int jc = n0; jc < n1; jc += nc_max) {
+    const Int nc = std::min(nc_max, n1 - jc);
+    float* gate_sum = ws.c.data();
+    float* up_sum = ws.c.data() + m * nc;
+    TC* c = static_cast<TC*>(gemm.c.data) + m0 * gemm.c.rs + jc * gemm.c.cs;
+
+    Int pc = 0;
+    do {
+      const Int kc = std::min(blocking.kc, k - pc);
+      const bool last = pc + kc >= k;
+      gemm_pack_b(gate + pc * gemm.b.rs + jc * gemm.b.cs, gemm.b.rs,
+                  gemm.b.cs, kc, nc, gate_panel);
+      gemm_pack_b(up + pc * args.up.rs + jc * args.up.cs, args.up.rs,
+                  args.up.cs, kc, nc, up_panel);
+      const float beta = pc > 0 ? 1.0f : 0.0f;
+
+      for (Int ic = 0; ic < m; ic += blocking.mc) {
+        const Int mc = std::min(blocking.mc, m - ic);
+        gemm_pack_a(a + (m0 + ic) * gemm.a.rs + pc * gemm.a.cs, gemm.a.rs,
+                    gemm.a.cs, mc, kc, ws.a.data());
+
+        for (Int jr = 0; jr < nc; jr += GEMM_NR) {
+          const Int nr = std::min(GEMM_NR, nc - jr);
+          for (Int ir = 0; ir < mc; ir += GEMM_MR) {
+            const Int mr = std::min(GEMM_MR, mc - ir);
+            const Int offset = (ic + ir) * nc + jr;
+            gemm_micro_kernel(kc, ws.a.data() + ir * kc,
+                              gate_panel + jr * kc, gate_tile);
+            gemm_micro_kernel(kc, ws.a.data() + ir * kc, up_panel + jr * kc,
+                              up_tile);
+            gemm_store_tile(gate_tile, mr, nr, gate_sum + offset, nc, 1, 1.0f,
+                            beta);
+            gemm_store_tile(up_tile, mr, nr, up_sum + offset, nc, 1, 1.0f,
+                            beta);
+            if (last) {
+              gemm_store_swiglu(gate_sum + offset, up_sum + offset, nc, mr,
+                                nr, c + (ic + ir) * gemm.c.rs + jr * gemm.c.cs,
+                                gemm.c.rs, gemm.c.cs);
+            }
+          }
+        }
+      }
+      pc += kc;
+    } while (pc < k);
+  }
+}
+}  // namespace LEGRAD_CPU_KERNEL_NAMESPACE
+}  // namespace legrad::cpu
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/gemm_impl.h"
+#include "backend/cpu/kernels/gemm_kernel.h"
+#include "backend/cpu/parallel.h"
+#include "core/dtype.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+// Below this many multiply-adds per thread, threading costs more than it gives
+constexpr Int GEMM_MIN_WORK_PER_THREAD = Int(1) << 18;
+
+/*
+ * Split `num_threads` into a tm x tn grid over C. Each thread gets its own
+ * [M / tm, N / tn] block (rounded up to whole tiles) and packs its own panels,
+ * so threads never synchronize. Pick the grid with the smallest block, then
+ * the most square one (least packing per flop).
+ */
+std::pair<Int, Int> gemm_thread_grid(Int m, Int n, Int num_threads)
+{
+  std::pair<Int, Int> best = {1, 1};
+  Int best_area = -1;
+  Int best_perimeter = -1;
+  for (Int tm = 1; tm <= num_threads; ++tm) {
+    const Int tn = num_threads / tm;
+    const Int mb = gemm_round_up((m + tm - 1) / tm, GEMM_MR);
+    const Int nb = gemm_round_up((n + tn - 1) / tn, GEMM_NR);
+    const Int area = mb * nb;
+    if (best_area < 0 || area < best_area
+        || (area == best_area && mb + nb < best_perimeter))
+    {
+      best = {tm, tn};
+      best_area = area;
+      best_perimeter = mb + nb;
+    }
+  }
+  return best;
+}
+
+/*
+ * Tasks are (batch entry, C block) pairs: a big batch (heads) is split over
+ * threads as it is, a small one also splits every matrix into a grid so all
+ * threads get work.
+ */
+template <typename TA, typename TB>
+void run_gemm(const BatchedGemmArgs& batched)
+{
+  const GemmArgs& args = batched.gemm;
+  const Int work = batched.batch * args.m * args.n * std::max<Int>(args.k, 1);
+  const Int num_threads =
+      std::clamp<Int>(work / GEMM_MIN_WORK_PER_THREAD, 1,
+                      static_cast<Int>(get_num_threads()));
+  const Int threads_per_matrix =
+      (num_threads + batched.batch - 1) / batched.batch;
+  const auto [tm, tn] = gemm_thread_grid(args.m, args.n, threads_per_matrix);
+  const Int mb = gemm_round_up((args.m + tm - 1) / tm, GEMM_MR);
+  const Int nb = gemm_round_up((args.n + tn - 1) / tn, GEMM_NR);
+
+  parallel_for(0, batched.batch * tm * tn, 1,
+               [&](Int begin, Int end)
+               {
+                 thread_local GemmWorkspace workspace;
+                 for (Int task = begin; task < end; ++task) {
+                   const Int entry = task / (tm * tn);
+                   const Int block = task % (tm * tn);
+                   const Int m0 = (block / tn) * mb;
+                   const Int n0 = (block % tn) * nb;
+                   if (m0 >= args.m || n0 >= args.n) {
+                     continue;
+                   }
+                   GemmArgs matrix = args;
+                   if (batched.batch > 1) {
+                     matrix.a =
+                         offset_operand(args.a, batched.a_offsets[entry]);
+                     matrix.b =
+                         offset_operand(args.b, batched.b_offsets[entry]);
+                     matrix.c =
+                         offset_operand(args.c, batched.c_offsets[entry]);
+                   }
+                   gemm_block<TA, TB>(matrix, m0, std::min(args.m, m0 + mb),
+                                      n0, std::min(args.n, n0 + nb),
+                                      workspace);
+                 }
+               });
+}
+
+/*
+ * Same grid as run_gemm over the single C of a SwiGLU, each block computes
+ * both of its products
+ */
+template <typename TA, typename TB, typename TC>
+void run_swiglu(const SwigluGemmArgs& args)
+{
+  const GemmArgs& gemm = args.gemm;
+  const Int work = 2 * gemm.m * gemm.n * std::max<Int>(gemm.k, 1);
+  const Int num_threads =
+      std::clamp<Int>(work / GEMM_MIN_WORK_PER_THREAD, 1,
+                      static_cast<Int>(get_num_threads()));
+  const auto [tm, tn] = gemm_thread_grid(gemm.m, gemm.n, num_threads);
+  const Int mb = gemm_round_up((gemm.m + tm - 1) / tm, GEMM_MR);
+  const Int nb = gemm_round_up((gemm.n + tn - 1) / tn, GEMM_NR);
+
+  parallel_for(0, tm * tn, 1,
+               [&](Int begin, Int end)
+               {
+                 thread_local GemmWorkspace workspace;
+                 for (Int block = begin; block < end; ++block) {
+                   const Int m0 = (block / tn) * mb;
+                   const Int n0 = (block % tn) * nb;
+                   if (m0 >= gemm.m || n0 >= gemm.n) {
+                     continue;
+                   }
+                   gemm_swiglu_block<TA, TB, TC>(
+                       args, m0, std::min(gemm.m, m0 + mb), n0,
+                       std::min(gemm.n, n0 + nb), workspace);
+                 }
+               });
+}
+
+template <typename TA, typename TB>
+void dispatch_swiglu_c(const SwigluGemmArgs& args)
+{
+  switch (args.gemm.c.dtype) {
+    case core::TypeInfo::Float32:
+      return run_swiglu<TA, TB, float>(args);
+    case core::TypeInfo::Float16:
+      return run_swiglu<TA, TB, uint16_t>(args);
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument, "SwiGLU does not support {} c",
+                         core::TypeInfoToString(args.gemm.c.dtype));
+  }
+}
+
+template <typename TA>
+void dispatch_swiglu_b(const SwigluGemmArgs& args)
+{
+  switch (args.gemm.b.dtype) {
+    case core::TypeInfo::Float32:
+      return dispatch_swiglu_c<TA, float>(args);
+    case core::TypeInfo::Float16:
+      return dispatch_swiglu_c<TA, uint16_t>(args);
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument,
+                         "SwiGLU does not support {} weights",
+                         core::TypeInfoToString(args.gemm.b.dtype));
+  }
+}
+
+template <typename TA>
+void dispatch_gemm_b(const BatchedGemmArgs& args)
+{
+  switch (args.gemm.b.dtype) {
+    case core::TypeInfo::Float32:
+      return run_gemm<TA, float>(args);
+    case core::TypeInfo::Float16:
+      return run_gemm<TA, uint16_t>(args);
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument, "GEMM does not support {} b",
+                         core::TypeInfoToString(args.gemm.b.dtype));
+  }
+}
+
+template <typename T>
+void dispatch_gemm(const BatchedGemmArgs& args)
+{
+  if constexpr (std::is_same_v<T, float>) {
+    dispatch_gemm_b<float>(args);
+  } else if constexpr (std::is_same_v<T, half_float>) {
+    dispatch_gemm_b<uint16_t>(args);
+  } else {
+    LEGRAD_THROW_ERROR(std::invalid_argument, "GEMM does not support {} a",
+                       core::TypeInfoToString(args.gemm.a.dtype));
+  }
+}
+
+template <typename T>
+struct GemmKernel
+{
+  static void run(const GemmArgs& args)
+  {
+    BatchedGemmArgs batched;
+    batched.gemm = args;
+    dispatch_gemm<T>(batched);
+  }
+};
+
+template <typename T>
+struct BatchedGemmKernel
+{
+  static void run(const BatchedGemmArgs& args) { dispatch_gemm<T>(args); }
+};
+
+template <typename T>
+struct SwigluGemmKernel
+{
+  static void run(const SwigluGemmArgs& args)
+  {
+    if constexpr (std::is_same_v<T, float>) {
+      dispatch_swiglu_b<float>(args);
+    } else if constexpr (std::is_same_v<T, half_float>) {
+      dispatch_swiglu_b<uint16_t>(args);
+    } else {
+      LEGRAD_THROW_ERROR(std::invalid_argument, "SwiGLU does not support {} a",
+                         core::TypeInfoToString(args.gemm.a.dtype));
+    }
+  }
+};
+
+const CpuKernelRegistrar<GemmKernel> gemm_registrar(
+    GEMM_KERNEL, {core::TypeInfo::Float32, core::TypeInfo::Float16});
+const CpuKernelRegistrar<BatchedGemmKernel> batched_gemm_registrar(
+    BATCHED_GEMM_KERNEL, {core::TypeInfo::Float32, core::TypeInfo::Float16});
+const CpuKernelRegistrar<SwigluGemmKernel> swiglu_gemm_registrar(
+    SWIGLU_GEMM_KERNEL, {core::TypeInfo::Float32, core::TypeInfo::Float16});
+}  // namespace
+}  // namespace legrad::cpu
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "backend/cpu/elementwise.h"
+#include "core/dtype.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+constexpr const char* GEMM_KERNEL = "gemm";
+constexpr const char* BATCHED_GEMM_KERNEL = "batched_gemm";
+constexpr const char* SWIGLU_GEMM_KERNEL = "swiglu_gemm";
+
+// One matrix of a GEMM: strides are in elements, like TensorView
+struct GemmOperand
+{
+  void* data = nullptr;
+  core::TypeInfo dtype = core::TypeInfo::Float32;
+  Int rs = 0;  // row stride
+  Int cs = 0;  // column stride
+};
+
+// `op` moved `offset` elements further
+inline GemmOperand offset_operand(const GemmOperand& op, Int offset)
+{
+  GemmOperand moved = op;
+  moved.data = static_cast<char*>(op.data)
+             + offset * static_cast<Int>(core::type_size(op.dtype));
+  return moved;
+}
+
+/*
+ * Applied to each tile of c once its sum over K is done, while it is still
+ * in L1: c = activation(c + bias) + residual. No bias or residual when their
+ * data is null, the residual must not alias c.
+ */
+struct GemmEpilogueArgs
+{
+  GemmOperand bias;  // [1, n], only cs is used
+  Activation activation = Activation::None;
+  GemmOperand residual;  // [m, n]
+
+  bool empty() const
+  {
+    return bias.data == nullptr && activation == Activation::None
+        && residual.data == nullptr;
+  }
+};
+
+struct GemmArgs
+{
+  Int m = 0;
+  Int n = 0;
+  Int k = 0;
+  GemmOperand a;  // [m, k]
+  GemmOperand b;  // [k, n]
+  GemmOperand c;  // [m, n]
+  float alpha = 1.0f;
+  float beta = 0.0f;
+  GemmEpilogueArgs epilogue;  // not used by batched GEMMs
+};
+
+/*
+ * A batch of GEMMs with the same shapes and strides: matrix i of an operand
+ * starts `offsets[i]` elements after its `data` pointer (several entries can
+ * share one matrix, e.g. grouped KV heads).
+ */
+struct BatchedGemmArgs
+{
+  GemmArgs gemm;
+  Int batch = 1;
+  const Int* a_offsets = nullptr;
+  const Int* b_offsets = nullptr;
+  const Int* c_offsets = nullptr;
+};
+
+/*
+ * c = silu(a @ b) * (a @ up): the gate (b) and up projections of a SwiGLU
+ * FFN computed side by side, `up` has the dtype and the strides of b. alpha
+ * and beta of `gemm` are not used.
+ */
+struct SwigluGemmArgs
+{
+  GemmArgs gemm;
+  GemmOperand up;  // [k, n]
+};
+
+// Kernels are registered per dtype of `a`
+using GemmKernelFn = void (*)(const GemmArgs& args);
+using BatchedGemmKernelFn = void (*)(const BatchedGemmArgs& args);
+using SwigluGemmKernelFn = void (*)(const SwigluGemmArgs& args);
+}  // namespace legrad::cpu
@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/gemv_kernel.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+#include "core/quant.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+using Vec = vec::Vectorized<float>;
+
+// Dense rows computed together, they share every load of x
+constexpr Int GEMV_ROWS = 4;
+
+// Below this many weight bytes per thread, threading costs more than it gives
+constexpr Int GEMV_MIN_BYTES_PER_THREAD = Int(1) << 17;
+
+/*
+ * NOTE: there is no software prefetch. Rows are streamed front to back, which
+ * the hardware prefetchers follow on their own; prefetchnta on top (to keep
+ * the weights out of the caches) measured 5x slower for Q8_0 and 2x slower
+ * for f32, the lines it fetches skip L2 and the L2 streamer stops helping.
+ */
+
+LEGRAD_INLINE Vec load_weights(const float* ptr)
+{
+  return Vec::loadu(ptr);
+}
+
+LEGRAD_INLINE Vec load_weights(const uint16_t* ptr)
+{
+  return vec::loadu_half(ptr);
+}
+
+LEGRAD_INLINE float load_weight(const float* ptr)
+{
+  return *ptr;
+}
+
+LEGRAD_INLINE float load_weight(const uint16_t* ptr)
+{
+  return fp16_ieee_to_fp32_value(*ptr);
+}
+
+/*
+ * dot[v * R + r] = W[r, :] . x_v for R consecutive rows and V vectors (x_v
+ * starts at x + v * x_ld): every weight load serves V vectors and every load
+ * of x serves R rows.
+ */
+template <Int R, Int V, typename T>
+LEGRAD_INLINE void dot_rows(const T* w,
+                            Int rs,
+                            Int k,
+                            const float* x,
+                            Int x_ld,
+                            float* dot)
+{
+  Vec acc[R * V];
+#pragma GCC unroll 8
+  for (Int i = 0; i < R * V; ++i) {
+    acc[i] = Vec(0.0f);
+  }
+
+  Int p = 0;
+  for (; p + Vec::size() <= k; p += Vec::size()) {
+    Vec wv[R];
+#pragma GCC unroll 4
+    for (Int r = 0; r < R; ++r) {
+      wv[r] = load_weights(w + r * rs + p);
+    }
+#pragma GCC unroll 2
+    for (Int v = 0; v < V; ++v) {
+      const Vec xv = Vec::loadu(x + v * x_ld + p);
+#pragma GCC unroll 4
+      for (Int r = 0; r < R; ++r) {
+        acc[v * R + r] = acc[v * R + r] + wv[r] * xv;
+      }
+    }
+  }
+
+#pragma GCC unroll 2
+  for (Int v = 0; v < V; ++v) {
+#pragma GCC unroll 4
+    for (Int r = 0; r < R; ++r) {
+      float sum = vec::reduce_add(acc[v * R + r]);
+      for (Int q = p; q < k; ++q) {
+        sum += load_weight(w + r * rs + q) * x[v * x_ld + q];
+      }
+      dot[v * R + r] = sum;
+    }
+  }
+}
+
+// dot_rows for all m vectors, two at a time
+template <Int R, typename T>
+void dot_vectors(const T* w,
+                 Int rs,
+                 Int k,
+                 const float* x,
+                 Int x_ld,
+                 Int m,
+                 float* dot)
+{
+  Int v = 0;
+  for (; v + 2 <= m; v += 2) {
+    dot_rows<R, 2>(w, rs, k, x + v * x_ld, x_ld, dot + v * R);
+  }
+  if (v < m) {
+    dot_rows<R, 1>(w, rs, k, x + v * x_ld, x_ld, dot + v * R);
+  }
+}
+
+LEGRAD_INLINE Vec int8_to_float(const int8_t* ptr)
+{
+  vec::lanes_t<int8_t> q;
+  std::memcpy(&q, ptr, sizeof(q));
+  return vec::convert_to_float<int8_t>(q);
+}
+
+float dot_row(const core::BlockQ8_0* blocks, Int num_blocks, const float* x)
+{
+  Vec acc(0.0f);
+  for (Int b = 0; b < num_blocks; ++b, x += core::QK8_0) {
+    const core::BlockQ8_0& block = blocks[b];
+    Vec sum(0.0f);
+#pragma GCC unroll 8
+    for (Int i = 0; i < core::QK8_0; i += Vec::size()) {
+      sum = sum + int8_to_float(block.qs + i) * Vec::loadu(x + i);
+    }
+    acc = acc + sum * Vec(fp16_ieee_to_fp32_value(block.d));
+  }
+  return vec::reduce_add(acc);
+}
+
+float dot_row(const core::BlockQ4_0* blocks, Int num_blocks, const float* x)
+{
+  constexpr Int HALF = core::QK4_0 / 2;
+  const Vec offset(8.0f);
+  Vec acc(0.0f);
+  for (Int b = 0; b < num_blocks; ++b, x += core::QK4_0) {
+    const core::BlockQ4_0& block = blocks[b];
+    Vec sum(0.0f);
+#pragma GCC unroll 4
+    for (Int i = 0; i < HALF; i += Vec::size()) {
+      vec::lanes_t<uint8_t> q;
+      std::memcpy(&q, block.qs + i, sizeof(q));
+      const Vec lo = vec::convert_to_float<uint8_t>(q & uint8_t(0x0F));
+      const Vec hi = vec::convert_to_float<uint8_t>(q >> uint8_t(4));
+      sum = sum + (lo - offset) * Vec::loadu(x + i)
+          + (hi - offset) * Vec::loadu(x + HALF + i);
+    }
+    acc = acc + sum * Vec(fp16_ieee_to_fp32_value(block.d));
+  }
+  return vec::reduce_add(acc);
+}
+
+/*
+ * The vectors of x as contiguous float arrays `ld` floats apart: used in place
+ * when they already are, otherwise converted into `buffer` (x is small next
+ * to the weights)
+ */
+const float* contiguous_x(const GemvArgs& args,
+                          std::vector<float>& buffer,
+                          Int& ld)
+{
+  if (args.x_dtype == core::TypeInfo::Float32 && args.x_stride == 1) {
+    ld = args.x_vector_stride;
+    return static_cast<const float*>(args.x);
+  }
+  ld = args.k;
+  buffer.resize(args.m * args.k);
+  for (Int v = 0; v < args.m; ++v) {
+    float* dst = buffer.data() + v * args.k;
+    if (args.x_dtype == core::TypeInfo::Float16) {
+      const uint16_t* x =
+          static_cast<const uint16_t*>(args.x) + v * args.x_vector_stride;
+      vec::load_half(reinterpret_cast<const char*>(x),
+                     args.x_stride * sizeof(uint16_t), args.k, dst);
+    } else {
+      const float* x =
+          static_cast<const float*>(args.x) + v * args.x_vector_stride;
+      for (Int i = 0; i < args.k; ++i) {
+        dst[i] = x[i * args.x_stride];
+      }
+    }
+  }
+  return buffer.data();
+}
+
+// gate = silu(gate) * up for n values
+void apply_swiglu(float* gate, const float* up, Int n)
+{
+  for (Int i = 0; i < n; i += Vec::size()) {
+    const Int count = std::min(Vec::size(), n - i);
+    const Vec h =
+        vec::silu(Vec::loadu(gate + i, count)) * Vec::loadu(up + i, count);
+    h.store(gate + i, count);
+  }
+}
+
+/*
+ * y_v[row0 + r] = alpha * dot[r] + beta * y_v[row0 + r] for vector v, y is
+ * not read for beta 0
+ */
+void store_y(const GemvArgs& args,
+             Int v,
+             Int row0,
+             Int rows,
+             const float* dot)
+{
+  for (Int r = 0; r < rows; ++r) {
+    const Int idx = v * args.y_vector_stride + (row0 + r) * args.y_stride;
+    float value = args.alpha * dot[r];
+    if (args.y_dtype == core::TypeInfo::Float16) {
+      uint16_t* y = static_cast<uint16_t*>(args.y) + idx;
+      if (args.beta != 0.0f) {
+        value += args.beta * fp16_ieee_to_fp32_value(*y);
+      }
+      *y = fp16_ieee_from_fp32_value(value);
+    } else {
+      float* y = static_cast<float*>(args.y) + idx;
+      if (args.beta != 0.0f) {
+        value += args.beta * *y;
+      }
+      *y = value;
+    }
+  }
+}
+
+// Split `num_tasks` tasks of `task_bytes` weight bytes each across threads
+template <typename Fn>
+void parallel_rows(Int num_tasks, Int task_bytes, const Fn& fn)
+{
+  const Int grain = std::max<Int>(
+      1, GEMV_MIN_BYTES_PER_THREAD / std::max<Int>(task_bytes, 1));
+  parallel_for(0, num_tasks, grain, fn);
+}
+
+template <typename T>
+void run_gemv(const GemvArgs& args)
+{
+  thread_local std::vector<float> x_buffer;
+  Int x_ld = 0;
+  const float* x = contiguous_x(args, x_buffer, x_ld);
+  const T* w = static_cast<const T*>(args.w);
+  const T* up = static_cast<const T*>(args.w_up);
+  const Int num_weights = up != nullptr ? 2 : 1;
+
+  const Int num_blocks = (args.n + GEMV_ROWS - 1) / GEMV_ROWS;
+  parallel_rows(
+      num_blocks, num_weights * GEMV_ROWS * args.k * sizeof(T),
+      [&](Int begin, Int end)
+      {
+        // Per thread, they only grow: no allocation on the decode path
+        thread_local std::vector<float> dot;
+        thread_local std::vector<float> up_dot;
+        dot.resize(std::max<size_t>(dot.size(), GEMV_ROWS * args.m));
+        if (up != nullptr) {
+          up_dot.resize(std::max<size_t>(up_dot.size(), GEMV_ROWS * args.m));
+        }
+        for (Int b = begin; b < end; ++b) {
+          const Int row0 = b * GEMV_ROWS;
+          const Int rows = std::min(GEMV_ROWS, args.n - row0);
+          if (rows == GEMV_ROWS) {
+            dot_vectors<GEMV_ROWS>(w + row0 * args.w_rs, args.w_rs, args.k, x,
+                                   x_ld, args.m, dot.data());
+            if (up != nullptr) {
+              dot_vectors<GEMV_ROWS>(up + row0 * args.w_rs, args.w_rs, args.k,
+                                     x, x_ld, args.m, up_dot.data());
+              apply_swiglu(dot.data(), up_dot.data(), GEMV_ROWS * args.m);
+            }
+            for (Int v = 0; v < args.m; ++v) {
+              store_y(args, v, row0, rows, dot.data() + v * GEMV_ROWS);
+            }
+          } else {
+            for (Int r = 0; r < rows; ++r) {
+              dot_vectors<1>(w + (row0 + r) * args.w_rs, args.w_rs, args.k, x,
+                             x_ld, args.m, dot.data());
+              if (up != nullptr) {
+                dot_vectors<1>(up + (row0 + r) * args.w_rs, args.w_rs, args.k,
+                               x, x_ld, args.m, up_dot.data());
+                apply_swiglu(dot.data(), up_dot.data(), args.m);
+              }
+              for (Int v = 0; v < args.m; ++v) {
+                store_y(args, v, row0 + r, 1, dot.data() + v);
+              }
+            }
+          }
+        }
+      });
+}
+
+// Quantized rows are dotted with every vector while the row is in L1
+template <typename Block>
+void run_gemv_quant(const GemvArgs& args, Int block_size)
+{
+  thread_local std::vector<float> x_buffer;
+  Int x_ld = 0;
+  const float* x = contiguous_x(args, x_buffer, x_ld);
+  const Int num_blocks = args.k / block_size;
+  const Block* w = static_cast<const Block*>(args.w);
+  const Block* up = static_cast<const Block*>(args.w_up);
+  const Int num_weights = up != nullptr ? 2 : 1;
+
+  parallel_rows(args.n, num_weights * num_blocks * sizeof(Block),
+                [&](Int begin, Int end)
+                {
+                  thread_local std::vector<float> dot;
+                  thread_local std::vector<float> up_dot;
+                  dot.resize(std::max<size_t>(dot.size(), args.m));
+                  up_dot.resize(std::max<size_t>(up_dot.size(), args.m));
+                  for (Int row = begin; row < end; ++row) {
+                    for (Int v = 0; v < args.m; ++v) {
+                      dot[v] = dot_row(w + row * num_blocks, num_blocks,
+                                       x + v * x_ld);
+                      if (up != nullptr) {
+                        up_dot[v] = dot_row(up + row * num_blocks, num_blocks,
+                                            x + v * x_ld);
+                      }
+                    }
+                    if (up != nullptr) {
+                      apply_swiglu(dot.data(), up_dot.data(), args.m);
+                    }
+                    for (Int v = 0; v < args.m; ++v) {
+                      store_y(args, v, row, 1, dot.data() + v);
+                    }
+                  }
+                });
+}
+
+/*
+ * Read `bytes` bytes in GEMV_ROWS interleaved streams of full vectors, like
+ * dot_rows does: one sequential stream leaves a single core well below what
+ * the memory system delivers (too few misses in flight).
+ */
+uint32_t stream_read(const void* data, Int bytes)
+{
+  using Words = vec::Vectorized<uint32_t>;
+  constexpr Int STEP = Words::size() * sizeof(uint32_t);
+  const char* base = static_cast<const char*>(data);
+  const Int num_steps = bytes / (GEMV_ROWS * STEP);
+  std::atomic<uint32_t> checksum{0};
+  parallel_rows(num_steps, GEMV_ROWS * STEP,
+                [&](Int begin, Int end)
+                {
+                  Words acc[GEMV_ROWS];
+#pragma GCC unroll 4
+                  for (Int r = 0; r < GEMV_ROWS; ++r) {
+                    acc[r] = Words(0u);
+                  }
+                  for (Int i = begin; i < end; ++i) {
+#pragma GCC unroll 4
+                    for (Int r = 0; r < GEMV_ROWS; ++r) {
+                      const uint32_t* ptr = reinterpret_cast<const uint32_t*>(
+                          base + (r * num_steps + i) * STEP);
+                      acc[r] = acc[r] + Words::loadu(ptr);
+                    }
+                  }
+                  uint32_t sum = 0;
+                  for (Int r = 0; r < GEMV_ROWS; ++r) {
+                    sum += vec::reduce_add(acc[r]);
+                  }
+                  checksum.fetch_add(sum, std::memory_order_relaxed);
+                });
+  return checksum.load();
+}
+
+template <typename T>
+struct GemvKernel
+{
+  static void run(const GemvArgs& args)
+  {
+    if constexpr (std::is_same_v<T, float>) {
+      run_gemv<float>(args);
+    } else if constexpr (std::is_same_v<T, half_float>) {
+      run_gemv<uint16_t>(args);
+    } else {
+      LEGRAD_THROW_ERROR(std::invalid_argument,
+                         "GEMV does not support this weight dtype", 0);
+    }
+  }
+};
+
+template <typename T>
+struct GemvQuantKernel
+{
+  static void run(const GemvArgs& args)
+  {
+    switch (args.quant) {
+      case core::QuantType::Q4_0:
+        return run_gemv_quant<core::BlockQ4_0>(args, core::QK4_0);
+      case core::QuantType::Q8_0:
+        return run_gemv_quant<core::BlockQ8_0>(args, core::QK8_0);
+      default:
+        LEGRAD_THROW_ERROR(std::invalid_argument,
+                           "GEMV does not support {} weights",
+                           core::QuantTypeToString(args.quant));
+    }
+  }
+};
+
+template <typename T>
+struct StreamReadKernel
+{
+  static uint32_t run(const void* data, Int bytes)
+  {
+    return stream_read(data, bytes);
+  }
+};
+
+const CpuKernelRegistrar<GemvKernel> gemv_registrar(
+    GEMV_KERNEL, {core::TypeInfo::Float32, core::TypeInfo::Float16});
+const CpuKernelRegistrar<GemvQuantKernel> gemv_quant_registrar(
+    GEMV_QUANT_KERNEL, {core::TypeInfo::Float32});
+const CpuKernelRegistrar<StreamReadKernel> stream_read_registrar(
+    STREAM_READ_KERNEL, {core::TypeInfo::UInt8});
+}  // namespace
+}  // namespace legrad::cpu
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+#include "core/dtype.h"
+#include "core/quant.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+// Registered per dtype of the weight (Float32, Float16)
+constexpr const char* GEMV_KERNEL = "gemv";
+// Registered for Float32 (products are computed in float), see args.quant
+constexpr const char* GEMV_QUANT_KERNEL = "gemv_quant";
+// Registered for UInt8, the read baseline of cpu::benchmark_gemv
+constexpr const char* STREAM_READ_KERNEL = "stream_read";
+
+/*
+ * y_v = alpha * W @ x_v + beta * y_v for the m vectors x_v, strides are in
+ * elements
+ */
+struct GemvArgs
+{
+  Int m = 1;  // number of vectors
+  Int n = 0;  // rows of W, size of y
+  Int k = 0;  // columns of W, size of x
+  const void* w = nullptr;
+  Int w_rs = 0;  // row stride of a dense W (rows are contiguous)
+  core::QuantType quant = core::QuantType::Q8_0;  // format of a quantized W
+  /*
+   * Up projection of a SwiGLU, laid out like W: when set, the rows of both
+   * are read side by side and y_v = silu(W @ x_v) * (W_up @ x_v) is stored
+   * (alpha / beta still apply to it)
+   */
+  const void* w_up = nullptr;
+  const void* x = nullptr;
+  core::TypeInfo x_dtype = core::TypeInfo::Float32;
+  Int x_stride = 1;
+  Int x_vector_stride = 0;
+  void* y = nullptr;
+  core::TypeInfo y_dtype = core::TypeInfo::Float32;
+  Int y_stride = 1;
+  Int y_vector_stride = 0;
+  float alpha = 1.0f;
+  float beta = 0.0f;
+};
+
+using GemvKernelFn = void (*)(const GemvArgs& args);
+// Reads `bytes` bytes the way the dense GEMV does, returns a checksum
+using StreamReadKernelFn = uint32_t (*)(const void* data, Int bytes);
+}  // namespace legrad::cpu
@@ -0,0 +1,485 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/index_kernel.h"
+#include "backend/cpu/kernels/row_impl.h"
+#include "backend/cpu/loops.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+#include "core/quant.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+using core::TypeInfo;
+using Vec = vec::Vectorized<float>;
+
+// Runs that need a conversion go through float buffers of this many elements
+constexpr Int INDEX_BUFFER = 256;
+
+LEGRAD_INLINE Int elem_bytes(TypeInfo dtype)
+{
+  return dtype == TypeInfo::Float16 ? 2 : 4;
+}
+
+LEGRAD_INLINE float to_float(float x)
+{
+  return x;
+}
+
+LEGRAD_INLINE float to_float(uint16_t x)
+{
+  return fp16_ieee_to_fp32_value(x);
+}
+
+// Storage type S from float or from the same storage type (bit exact)
+template <typename S, typename T>
+LEGRAD_INLINE S convert(T x)
+{
+  if constexpr (std::is_same_v<S, T>) {
+    return x;
+  } else if constexpr (std::is_same_v<S, float>) {
+    return to_float(x);
+  } else {
+    return fp16_ieee_from_fp32_value(to_float(x));
+  }
+}
+
+template <typename S>
+LEGRAD_INLINE S& at(char* ptr, Int stride, Int idx)
+{
+  return *reinterpret_cast<S*>(ptr + idx * stride);
+}
+
+LEGRAD_INLINE Int index_at(const char* ptr, Int stride, Int idx)
+{
+  return *reinterpret_cast<const int32_t*>(ptr + idx * stride);
+}
+
+template <typename S>
+void copy_strided(char* dst, Int dst_stride, const char* src, Int src_stride,
+                  Int n)
+{
+  for (Int i = 0; i < n; ++i) {
+    std::memcpy(dst + i * dst_stride, src + i * src_stride, sizeof(S));
+  }
+}
+
+// Copy n elements `stride` bytes apart, converting Float32 <-> Float16
+void copy_run(char* dst,
+              TypeInfo dst_dtype,
+              Int dst_stride,
+              const char* src,
+              TypeInfo src_dtype,
+              Int src_stride,
+              Int n)
+{
+  const Int dst_size = elem_bytes(dst_dtype);
+  const Int src_size = elem_bytes(src_dtype);
+  if (dst_dtype == src_dtype) {
+    if (dst_stride == dst_size && src_stride == src_size) {
+      std::memcpy(dst, src, n * dst_size);
+    } else if (dst_size == 2) {
+      copy_strided<uint16_t>(dst, dst_stride, src, src_stride, n);
+    } else {
+      copy_strided<float>(dst, dst_stride, src, src_stride, n);
+    }
+    return;
+  }
+  float buffer[INDEX_BUFFER];
+  for (Int i = 0; i < n; i += INDEX_BUFFER) {
+    const Int m = std::min(INDEX_BUFFER, n - i);
+    copy_row(src + i * src_stride, src_dtype, src_stride / src_size, m,
+             buffer);
+    write_row(buffer, dst + i * dst_stride, dst_dtype, dst_stride / dst_size,
+              m);
+  }
+}
+
+LEGRAD_INLINE void add_floats(float* dst, const float* src, Int n)
+{
+  Int i = 0;
+  for (; i + Vec::size() <= n; i += Vec::size()) {
+    (Vec::loadu(dst + i) + Vec::loadu(src + i)).store(dst + i);
+  }
+  for (; i < n; ++i) {
+    dst[i] += src[i];
+  }
+}
+
+// dst += src over n elements `stride` bytes apart, in float
+void add_run(char* dst,
+             TypeInfo dst_dtype,
+             Int dst_stride,
+             const char* src,
+             TypeInfo src_dtype,
+             Int src_stride,
+             Int n)
+{
+  const Int dst_step = dst_stride / elem_bytes(dst_dtype);
+  const Int src_step = src_stride / elem_bytes(src_dtype);
+  float dst_buffer[INDEX_BUFFER];
+  float src_buffer[INDEX_BUFFER];
+  for (Int i = 0; i < n; i += INDEX_BUFFER) {
+    const Int m = std::min(INDEX_BUFFER, n - i);
+    char* d = dst + i * dst_stride;
+    const char* s = src + i * src_stride;
+    const bool direct = is_direct(dst_dtype, dst_step);
+    float* x = direct ? reinterpret_cast<float*>(d) : dst_buffer;
+    if (!direct) {
+      copy_row(d, dst_dtype, dst_step, m, dst_buffer);
+    }
+    const float* y = reinterpret_cast<const float*>(s);
+    if (!is_direct(src_dtype, src_step)) {
+      copy_row(s, src_dtype, src_step, m, src_buffer);
+      y = src_buffer;
+    }
+    add_floats(x, y, m);
+    if (!direct) {
+      write_row(dst_buffer, d, dst_dtype, dst_step, m);
+    }
+  }
+}
+
+/*
+ * Call fn(dense, idx, slice_begin, slice_end) for the slots covering the
+ * linear range [begin, end) of slots x slice elements
+ */
+template <typename Fn>
+void for_each_slot(const LoopPlan<2>& slots,
+                   Int slice_numel,
+                   Int begin,
+                   Int end,
+                   const Fn& fn)
+{
+  Int slot = begin / slice_numel;
+  for_each_run<0>(slots, slot, (end - 1) / slice_numel + 1,
+                  [&](const std::array<char*, 2>& ptrs,
+                      const std::array<Int, 2>& strides,
+                      Int n)
+                  {
+                    for (Int i = 0; i < n; ++i, ++slot) {
+                      const Int base = slot * slice_numel;
+                      fn(ptrs[0] + i * strides[0],
+                         index_at(ptrs[1], strides[1], i),
+                         std::max<Int>(begin - base, 0),
+                         std::min(end - base, slice_numel));
+                    }
+                  });
+}
+
+// Slices are split across threads, and so is a long slice
+template <size_t RANK>
+void run_index_select(const IndexArgs& args, TypeInfo indexed_dtype)
+{
+  const Int slice_numel = args.slice.numel;
+  parallel_for(
+      0, args.slots.numel * slice_numel, GRAIN_SIZE,
+      [&](Int begin, Int end)
+      {
+        LoopPlan<2> slice = args.slice;
+        for_each_slot(
+            args.slots, slice_numel, begin, end,
+            [&](char* dense, Int idx, Int slice_begin, Int slice_end)
+            {
+              slice.data = {dense, args.indexed + idx * args.indexed_stride};
+              for_each_run<RANK>(slice, slice_begin, slice_end,
+                                 [&](const std::array<char*, 2>& ptrs,
+                                     const std::array<Int, 2>& strides,
+                                     Int n)
+                                 {
+                                   copy_run(ptrs[0], args.dense_dtype,
+                                            strides[0], ptrs[1], indexed_dtype,
+                                            strides[1], n);
+                                 });
+            });
+      });
+}
+
+/*
+ * Threads split the slice elements and every one walks all the slots in
+ * order: repeated indices never race and always add up in the same order
+ */
+template <size_t RANK>
+void run_index_add(const IndexArgs& args, TypeInfo indexed_dtype)
+{
+  const Int slots = args.slots.numel;
+  const Int grain = std::max<Int>(1, GRAIN_SIZE / slots);
+  parallel_for(
+      0, args.slice.numel, grain,
+      [&](Int begin, Int end)
+      {
+        LoopPlan<2> slice = args.slice;
+        for_each_slot(
+            args.slots, 1, 0, slots,
+            [&](char* dense, Int idx, Int, Int)
+            {
+              slice.data = {dense, args.indexed + idx * args.indexed_stride};
+              for_each_run<RANK>(slice, begin, end,
+                                 [&](const std::array<char*, 2>& ptrs,
+                                     const std::array<Int, 2>& strides,
+                                     Int n)
+                                 {
+                                   add_run(ptrs[1], indexed_dtype, strides[1],
+                                           ptrs[0], args.dense_dtype,
+                                           strides[0], n);
+                                 });
+            });
+      });
+}
+
+void dequantize_row(const core::BlockQ8_0* blocks, Int num_blocks, float* dst)
+{
+  for (Int b = 0; b < num_blocks; ++b, dst += core::QK8_0) {
+    const Vec d(fp16_ieee_to_fp32_value(blocks[b].d));
+#pragma GCC unroll 8
+    for (Int i = 0; i < core::QK8_0; i += Vec::size()) {
+      vec::lanes_t<int8_t> q;
+      std::memcpy(&q, blocks[b].qs + i, sizeof(q));
+      (Vec(vec::convert_to_float<int8_t>(q)) * d).store(dst + i);
+    }
+  }
+}
+
+void dequantize_row(const core::BlockQ4_0* blocks, Int num_blocks, float* dst)
+{
+  constexpr Int HALF = core::QK4_0 / 2;
+  const Vec offset(8.0f);
+  for (Int b = 0; b < num_blocks; ++b, dst += core::QK4_0) {
+    const Vec d(fp16_ieee_to_fp32_value(blocks[b].d));
+#pragma GCC unroll 4
+    for (Int i = 0; i < HALF; i += Vec::size()) {
+      vec::lanes_t<uint8_t> q;
+      std::memcpy(&q, blocks[b].qs + i, sizeof(q));
+      const Vec lo = vec::convert_to_float<uint8_t>(q & uint8_t(0x0F));
+      const Vec hi = vec::convert_to_float<uint8_t>(q >> uint8_t(4));
+      ((lo - offset) * d).store(dst + i);
+      ((hi - offset) * d).store(dst + HALF + i);
+    }
+  }
+}
+
+// Each selected row is dequantized straight into out (or a row buffer)
+template <typename Block>
+void run_index_select_quant(const IndexQuantArgs& args)
+{
+  const core::QuantMatrix& table = args.table;
+  const Int cols = table.cols;
+  const Int num_blocks = cols / core::quant_block_size(table.type);
+  const Int grain = std::max<Int>(1, GRAIN_SIZE / cols);
+  parallel_for(
+      0, args.slots.numel, grain,
+      [&](Int begin, Int end)
+      {
+        std::vector<float> buffer;
+        for_each_slot(
+            args.slots, 1, begin, end,
+            [&](char* out, Int idx, Int, Int)
+            {
+              float* row = row_target(out, args.out_dtype, args.out_stride,
+                                      cols, buffer);
+              dequantize_row(reinterpret_cast<const Block*>(table.row(idx)),
+                             num_blocks, row);
+              store_row(row, out, args.out_dtype, args.out_stride, cols);
+            });
+      });
+}
+
+// Element by element, lines and the positions along them split across threads
+template <typename S, typename D>
+void run_gather(const GatherArgs& args)
+{
+  const Int length = args.length;
+  parallel_for(
+      0, args.lines.numel * length, GRAIN_SIZE,
+      [&](Int begin, Int end)
+      {
+        Int line = begin / length;
+        for_each_run<0>(
+            args.lines, line, (end - 1) / length + 1,
+            [&](const std::array<char*, 3>& ptrs,
+                const std::array<Int, 3>& strides,
+                Int n)
+            {
+              for (Int i = 0; i < n; ++i, ++line) {
+                char* dense = ptrs[0] + i * strides[0];
+                const char* index = ptrs[1] + i * strides[1];
+                char* indexed = ptrs[2] + i * strides[2];
+                const Int base = line * length;
+                const Int stop = std::min(end - base, length);
+                for (Int j = std::max<Int>(begin - base, 0); j < stop; ++j) {
+                  const Int idx = index_at(index, args.index_stride, j);
+                  at<D>(dense, args.dense_stride, j) =
+                      convert<D>(at<S>(indexed, args.indexed_stride, idx));
+                }
+              }
+            });
+      });
+}
+
+/*
+ * Lines are split across threads and each one is walked in order: the
+ * elements of two lines never collide, those of a line are written in order
+ */
+template <typename S, typename D>
+void run_scatter(const GatherArgs& args, bool add)
+{
+  const Int length = args.length;
+  const Int grain = std::max<Int>(1, GRAIN_SIZE / length);
+  parallel_for(
+      0, args.lines.numel, grain,
+      [&](Int begin, Int end)
+      {
+        for_each_run<0>(
+            args.lines, begin, end,
+            [&](const std::array<char*, 3>& ptrs,
+                const std::array<Int, 3>& strides,
+                Int n)
+            {
+              for (Int i = 0; i < n; ++i) {
+                char* dense = ptrs[0] + i * strides[0];
+                const char* index = ptrs[1] + i * strides[1];
+                char* indexed = ptrs[2] + i * strides[2];
+                for (Int j = 0; j < length; ++j) {
+                  const D value = at<D>(dense, args.dense_stride, j);
+                  S& dst = at<S>(indexed, args.indexed_stride,
+                                 index_at(index, args.index_stride, j));
+                  dst = add ? convert<S>(to_float(dst) + to_float(value))
+                            : convert<S>(value);
+                }
+              }
+            });
+      });
+}
+
+// Storage type of the values of a registered dtype (Float16 is bits)
+template <typename T>
+using storage_t = std::conditional_t<std::is_same_v<T, float>, float, uint16_t>;
+
+template <typename T>
+constexpr bool is_value_type()
+{
+  return std::is_same_v<T, float> || std::is_same_v<T, half_float>;
+}
+
+template <typename T>
+constexpr TypeInfo value_dtype()
+{
+  return std::is_same_v<T, float> ? TypeInfo::Float32 : TypeInfo::Float16;
+}
+
+template <typename T>
+struct IndexSelectKernel
+{
+  static void run(const IndexArgs& args)
+  {
+    if constexpr (is_value_type<T>()) {
+      dispatch_rank(args.slice.dim(),
+                    [&](auto rank_tag)
+                    {
+                      constexpr size_t RANK = decltype(rank_tag)::value;
+                      run_index_select<RANK>(args, value_dtype<T>());
+                    });
+    } else {
+      LEGRAD_THROW_ERROR(std::invalid_argument,
+                         "IndexSelect does not support this dtype", 0);
+    }
+  }
+};
+
+template <typename T>
+struct IndexAddKernel
+{
+  static void run(const IndexArgs& args)
+  {
+    if constexpr (is_value_type<T>()) {
+      dispatch_rank(args.slice.dim(),
+                    [&](auto rank_tag)
+                    {
+                      constexpr size_t RANK = decltype(rank_tag)::value;
+                      run_index_add<RANK>(args, value_dtype<T>());
+                    });
+    } else {
+      LEGRAD_THROW_ERROR(std::invalid_argument,
+                         "IndexAdd does not support this dtype", 0);
+    }
+  }
+};
+
+template <typename T>
+struct IndexSelectQuantKernel
+{
+  static void run(const IndexQuantArgs& args)
+  {
+    switch (args.table.type) {
+      case core::QuantType::Q4_0:
+        return run_index_select_quant<core::BlockQ4_0>(args);
+      case core::QuantType::Q8_0:
+        return run_index_select_quant<core::BlockQ8_0>(args);
+      default:
+        LEGRAD_THROW_ERROR(std::invalid_argument,
+                           "IndexSelect does not support {} tables",
+                           core::QuantTypeToString(args.table.type));
+    }
+  }
+};
+
+template <typename T>
+struct GatherKernel
+{
+  static void run(const GatherArgs& args)
+  {
+    if constexpr (is_value_type<T>()) {
+      using S = storage_t<T>;
+      if (args.dense_dtype == TypeInfo::Float16) {
+        run_gather<S, uint16_t>(args);
+      } else {
+        run_gather<S, float>(args);
+      }
+    } else {
+      LEGRAD_THROW_ERROR(std::invalid_argument,
+                         "Gather does not support this dtype", 0);
+    }
+  }
+};
+
+template <typename T>
+struct ScatterKernel
+{
+  static void run(const GatherArgs& args, bool add)
+  {
+    if constexpr (is_value_type<T>()) {
+      using S = storage_t<T>;
+      if (args.dense_dtype == TypeInfo::Float16) {
+        run_scatter<S, uint16_t>(args, add);
+      } else {
+        run_scatter<S, float>(args, add);
+      }
+    } else {
+      LEGRAD_THROW_ERROR(std::invalid_argument,
+                         "Scatter does not support this dtype", 0);
+    }
+  }
+};
+
+const CpuKernelRegistrar<IndexSelectKernel> index_select_registrar(
+    INDEX_SELECT_KERNEL, {TypeInfo::Float32, TypeInfo::Float16});
+const CpuKernelRegistrar<IndexAddKernel> index_add_registrar(
+    INDEX_ADD_KERNEL, {TypeInfo::Float32, TypeInfo::Float16});
+const CpuKernelRegistrar<IndexSelectQuantKernel> index_select_quant_registrar(
+    INDEX_SELECT_QUANT_KERNEL, {TypeInfo::Float32});
+const CpuKernelRegistrar<GatherKernel> gather_registrar(
+    GATHER_KERNEL, {TypeInfo::Float32, TypeInfo::Float16});
+const CpuKernelRegistrar<ScatterKernel> scatter_registrar(
+    SCATTER_KERNEL, {TypeInfo::Float32, TypeInfo::Float16});
+}  // namespace
+}  // namespace legrad::cpu
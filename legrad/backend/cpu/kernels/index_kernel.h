@@ -0,0 +1,65 @@
+#pragma once
+
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "core/quant.h"
+
+namespace legrad::cpu
+{
+/*
+ * Registered per dtype of the indexed tensor (Float32, Float16): `in` of
+ * index_select / gather, `out` of index_add / scatter. The other operand is
+ * the dense one, walked in order.
+ */
+constexpr const char* INDEX_SELECT_KERNEL = "index_select";
+constexpr const char* INDEX_ADD_KERNEL = "index_add";
+constexpr const char* GATHER_KERNEL = "gather";
+constexpr const char* SCATTER_KERNEL = "scatter";
+// Registered for Float32 (rows are dequantized to float), see args.table
+constexpr const char* INDEX_SELECT_QUANT_KERNEL = "index_select_quant";
+
+// index_select / index_add, indices are in range
+struct IndexArgs
+{
+  /*
+   * {dense, index} over the dims of the index: every element is one slice,
+   * dense pointing at its first element
+   */
+  LoopPlan<2> slots;
+  // {dense, indexed} over the dims of a slice, rebased on every slot
+  LoopPlan<2> slice;
+  char* indexed = nullptr;  // slice 0 of the indexed tensor
+  Int indexed_stride = 0;  // bytes from one slice to the next
+  core::TypeInfo dense_dtype = core::TypeInfo::Float32;
+};
+
+struct IndexQuantArgs
+{
+  // {out, index} over the dims of the index, out pointing at a row
+  LoopPlan<2> slots;
+  core::QuantMatrix table;
+  core::TypeInfo out_dtype = core::TypeInfo::Float32;
+  Int out_stride = 1;  // elements
+};
+
+/*
+ * gather / scatter: every element of `lines` starts a line of `length`
+ * elements along dim of {dense, index}, its index picks an element along dim
+ * of the indexed tensor. Strides are in bytes.
+ */
+struct GatherArgs
+{
+  LoopPlan<3> lines;  // {dense, index, indexed} over the other dims
+  Int length = 0;
+  Int dense_stride = 0;
+  Int index_stride = 0;
+  Int indexed_stride = 0;
+  core::TypeInfo dense_dtype = core::TypeInfo::Float32;
+};
+
+using IndexKernelFn = void (*)(const IndexArgs& args);
+using IndexQuantKernelFn = void (*)(const IndexQuantArgs& args);
+using GatherKernelFn = void (*)(const GatherArgs& args);
+// Assigns, or adds when `add`
+using ScatterKernelFn = void (*)(const GatherArgs& args, bool add);
+}  // namespace legrad::cpu
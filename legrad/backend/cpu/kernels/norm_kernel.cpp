@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/norm_kernel.h"
+#include "backend/cpu/kernels/row_impl.h"
+#include "backend/cpu/loops.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+using Vec = vec::Vectorized<float>;
+
+// Per thread rows of floats for operands that are not contiguous Float32
+struct RowBuffers
+{
+  std::vector<float> in;
+  std::vector<float> residual;
+  std::vector<float> out;
+  std::vector<float> weight;
+};
+
+// sum(x^2), two accumulators to hide the add latency
+float sum_squares(const float* x, Int n)
+{
+  Vec acc0(0.0f), acc1(0.0f);
+  Int i = 0;
+  for (; i + 2 * Vec::size() <= n; i += 2 * Vec::size()) {
+    const Vec a = Vec::loadu(x + i);
+    const Vec b = Vec::loadu(x + i + Vec::size());
+    acc0 = acc0 + a * a;
+    acc1 = acc1 + b * b;
+  }
+  for (; i < n; i += Vec::size()) {
+    const Vec a = Vec::loadu(x + i, std::min(Vec::size(), n - i));
+    acc0 = acc0 + a * a;
+  }
+  return vec::reduce_add(acc0 + acc1);
+}
+
+// sum = a + b (sum may alias a or b), returns sum(sum^2)
+float add_sum_squares(const float* a, const float* b, float* sum, Int n)
+{
+  Vec acc(0.0f);
+  Int i = 0;
+  for (; i + Vec::size() <= n; i += Vec::size()) {
+    const Vec s = Vec::loadu(a + i) + Vec::loadu(b + i);
+    s.store(sum + i);
+    acc = acc + s * s;
+  }
+  if (i < n) {
+    const Int count = n - i;
+    const Vec s = Vec::loadu(a + i, count) + Vec::loadu(b + i, count);
+    s.store(sum + i, count);
+    acc = acc + s * s;
+  }
+  return vec::reduce_add(acc);
+}
+
+// y = x * scale * weight (no weight when null)
+void scale_row(const float* x,
+               const float* weight,
+               float scale,
+               float* y,
+               Int n)
+{
+  const Vec s(scale);
+  Int i = 0;
+  for (; i + Vec::size() <= n; i += Vec::size()) {
+    Vec v = Vec::loadu(x + i) * s;
+    if (weight) {
+      v = v * Vec::loadu(weight + i);
+    }
+    v.store(y + i);
+  }
+  for (; i < n; ++i) {
+    y[i] = x[i] * scale * (weight ? weight[i] : 1.0f);
+  }
+}
+
+void norm_row(char* out,
+              const char* in,
+              char* residual,
+              const float* weight,
+              const RmsNormArgs& args,
+              RowBuffers& buffers)
+{
+  const Int n = args.cols;
+  const float* x = load_row(in, args.in_dtype, args.in_stride, n, buffers.in);
+
+  float sum;
+  if (args.residual) {
+    const float* r = load_row(residual, args.residual_dtype,
+                              args.residual_stride, n, buffers.residual);
+    float* hidden = row_target(residual, args.residual_dtype,
+                               args.residual_stride, n, buffers.residual);
+    sum = add_sum_squares(x, r, hidden, n);
+    store_row(hidden, residual, args.residual_dtype, args.residual_stride, n);
+    x = hidden;
+  } else {
+    sum = sum_squares(x, n);
+  }
+
+  const float scale = 1.0f / std::sqrt(sum / static_cast<float>(n) + args.eps);
+  float* y = row_target(out, args.out_dtype, args.out_stride, n, buffers.out);
+  scale_row(x, weight, scale, y, n);
+  store_row(y, out, args.out_dtype, args.out_stride, n);
+}
+
+template <size_t RANK>
+void run_rms_norm(const LoopPlan<3>& rows, const RmsNormArgs& args)
+{
+  const Int grain = std::max<Int>(1, GRAIN_SIZE / std::max<Int>(args.cols, 1));
+  parallel_for(
+      0, rows.numel, grain,
+      [&](Int begin, Int end)
+      {
+        RowBuffers buffers;
+        const float* weight =
+            args.weight ? load_row(static_cast<const char*>(args.weight),
+                                   args.weight_dtype, args.weight_stride,
+                                   args.cols, buffers.weight)
+                        : nullptr;
+        for_each_run<RANK>(rows, begin, end,
+                           [&](const std::array<char*, 3>& ptrs,
+                               const std::array<Int, 3>& strides,
+                               Int n)
+                           {
+                             for (Int i = 0; i < n; ++i) {
+                               norm_row(ptrs[0] + i * strides[0],
+                                        ptrs[1] + i * strides[1],
+                                        ptrs[2] + i * strides[2], weight, args,
+                                        buffers);
+                             }
+                           });
+      });
+}
+
+// The math is in float for every dtype, T only selects the registry entry
+template <typename T>
+struct RmsNormKernel
+{
+  static void run(const LoopPlan<3>& rows, const RmsNormArgs& args)
+  {
+    dispatch_rank(rows.dim(),
+                  [&](auto rank_tag)
+                  {
+                    constexpr size_t RANK = decltype(rank_tag)::value;
+                    run_rms_norm<RANK>(rows, args);
+                  });
+  }
+};
+
+const CpuKernelRegistrar<RmsNormKernel> rms_norm_registrar(
+    RMS_NORM_KERNEL, {core::TypeInfo::Float32, core::TypeInfo::Float16});
+}  // namespace
+}  // namespace legrad::cpu
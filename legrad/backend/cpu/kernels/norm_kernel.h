@@ -0,0 +1,35 @@
+#pragma once
+
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+// Registered per dtype of the input (Float32, Float16)
+constexpr const char* RMS_NORM_KERNEL = "rms_norm";
+
+// Last dim of the operands, strides are in elements
+struct RmsNormArgs
+{
+  Int cols = 0;
+  core::TypeInfo out_dtype = core::TypeInfo::Float32;
+  Int out_stride = 1;
+  core::TypeInfo in_dtype = core::TypeInfo::Float32;
+  Int in_stride = 1;
+  bool residual = false;
+  core::TypeInfo residual_dtype = core::TypeInfo::Float32;
+  Int residual_stride = 1;
+  const void* weight = nullptr;  // no weight when null
+  core::TypeInfo weight_dtype = core::TypeInfo::Float32;
+  Int weight_stride = 1;
+  float eps = 1e-6f;
+};
+
+/*
+ * `rows` walks the leading dims of {out, in, residual}: each element of the
+ * plan is one row (residual repeats `in` when args.residual is false)
+ */
+using RmsNormKernelFn = void (*)(const LoopPlan<3>& rows,
+                                 const RmsNormArgs& args);
+}  // namespace legrad::cpu
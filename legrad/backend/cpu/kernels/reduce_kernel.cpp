@@ -0,0 +1,638 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/reduce_kernel.h"
+#include "backend/cpu/loops.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+using Vec = vec::Vectorized<float>;
+
+/*
+ * Elements summed straight into vector accumulators, blocks are then added
+ * pairwise. Each lane sees at most REDUCE_BLOCK / Vec::size() values.
+ */
+constexpr Int REDUCE_BLOCK = 256;
+
+/*
+ * Longer reductions are cut into chunks of this many elements, reduced one by
+ * one (in parallel when there are few outputs) and combined in order. The
+ * cut does not depend on the number of threads, nor does the result.
+ */
+constexpr Int REDUCE_CHUNK = Int(1) << 16;
+
+// Contiguous outputs of a strided reduction are reduced this many at a time
+constexpr Int REDUCE_COLUMNS = 4 * Vec::size();
+
+constexpr float INF = std::numeric_limits<float>::infinity();
+
+LEGRAD_INLINE float to_float(float x)
+{
+  return x;
+}
+
+LEGRAD_INLINE float to_float(uint16_t x)
+{
+  return fp16_ieee_to_fp32_value(x);
+}
+
+LEGRAD_INLINE Vec load(const float* ptr)
+{
+  return Vec::loadu(ptr);
+}
+
+LEGRAD_INLINE Vec load(const uint16_t* ptr)
+{
+  return vec::loadu_half(ptr);
+}
+
+template <typename T>
+LEGRAD_INLINE float element(const char* ptr, Int stride, Int idx)
+{
+  return to_float(*reinterpret_cast<const T*>(ptr + idx * stride));
+}
+
+// What a range of elements reduces to: a value and, for ArgMax, its index
+struct Partial
+{
+  float value = 0.0f;
+  Int index = -1;
+};
+
+/*
+ * Pairwise summation of a stream of values without knowing its length:
+ * level i holds the sum of 2^i values (a binary counter), so adding n values
+ * costs O(log n) rounding error instead of O(n). V is float or Vec.
+ */
+template <typename V>
+struct CascadeSum
+{
+  static constexpr int LEVELS = 48;
+  V levels[LEVELS];
+  uint64_t count = 0;
+
+  void add(V value)
+  {
+    int level = 0;
+    for (uint64_t bits = count; bits & 1; bits >>= 1, ++level) {
+      value = levels[level] + value;
+    }
+    levels[level] = value;
+    ++count;
+  }
+
+  V total() const
+  {
+    V sum(0.0f);
+    for (int level = 0; level < LEVELS; ++level) {
+      if ((count >> level) & 1) {
+        sum = sum + levels[level];
+      }
+    }
+    return sum;
+  }
+};
+
+template <bool SQUARE, typename V>
+LEGRAD_INLINE V map_value(const V& x)
+{
+  if constexpr (SQUARE) {
+    return x * x;
+  } else {
+    return x;
+  }
+}
+
+// Pairwise sum of (the squares of) n elements `stride` bytes apart
+template <typename T, bool SQUARE>
+float sum_run(const char* ptr, Int stride, Int n)
+{
+  if (n > REDUCE_BLOCK) {
+    const Int half = n / 2 / REDUCE_COLUMNS * REDUCE_COLUMNS;
+    return sum_run<T, SQUARE>(ptr, stride, half)
+         + sum_run<T, SQUARE>(ptr + half * stride, stride, n - half);
+  }
+  float sum = 0.0f;
+  Int i = 0;
+  if (stride == sizeof(T)) {
+    constexpr Int V = Vec::size();
+    const T* x = reinterpret_cast<const T*>(ptr);
+    Vec acc[4] = {Vec(0.0f), Vec(0.0f), Vec(0.0f), Vec(0.0f)};
+    for (; i + 4 * V <= n; i += 4 * V) {
+#pragma GCC unroll 4
+      for (Int c = 0; c < 4; ++c) {
+        acc[c] = acc[c] + map_value<SQUARE>(load(x + i + c * V));
+      }
+    }
+    for (; i + V <= n; i += V) {
+      acc[0] = acc[0] + map_value<SQUARE>(load(x + i));
+    }
+    sum = vec::reduce_add((acc[0] + acc[1]) + (acc[2] + acc[3]));
+  }
+  for (; i < n; ++i) {
+    sum += map_value<SQUARE>(element<T>(ptr, stride, i));
+  }
+  return sum;
+}
+
+// Max (or min) of n elements `stride` bytes apart
+template <typename T, bool MAX>
+float extreme_run(const char* ptr, Int stride, Int n)
+{
+  using vec::maximum;
+  using vec::minimum;
+  float result = MAX ? -INF : INF;
+  Int i = 0;
+  if (stride == sizeof(T) && n >= Vec::size()) {
+    const T* x = reinterpret_cast<const T*>(ptr);
+    Vec acc(result);
+    for (; i + Vec::size() <= n; i += Vec::size()) {
+      acc = MAX ? maximum(acc, load(x + i)) : minimum(acc, load(x + i));
+    }
+    result = MAX ? vec::reduce_max(acc) : vec::reduce_min(acc);
+  }
+  for (; i < n; ++i) {
+    const float value = element<T>(ptr, stride, i);
+    result = MAX ? maximum(result, value) : minimum(result, value);
+  }
+  return result;
+}
+
+/*
+ * Max of n elements and the index of its first occurrence. Contiguous runs
+ * find the max with vectors, then scan for it (the run is in L1 by then).
+ */
+template <typename T>
+Partial argmax_run(const char* ptr, Int stride, Int n)
+{
+  Partial best;
+  if (stride == sizeof(T)) {
+    best.value = extreme_run<T, true>(ptr, stride, n);
+    best.index = 0;  // all NaN
+    for (Int i = 0; i < n; ++i) {
+      if (element<T>(ptr, stride, i) == best.value) {
+        best.index = i;
+        break;
+      }
+    }
+    return best;
+  }
+  for (Int i = 0; i < n; ++i) {
+    const float value = element<T>(ptr, stride, i);
+    if (best.index < 0 || value > best.value) {
+      best = {value, i};
+    }
+  }
+  return best;
+}
+
+/*
+ * A Reducer accumulates runs of elements (add_run) or the partials of whole
+ * chunks (add_partial), in order. COLUMNS reducers also fold single values
+ * (float or Vec) for the column walk of reduce_columns.
+ */
+template <bool SQUARE>
+struct SumReducer
+{
+  static constexpr bool COLUMNS = true;
+  static constexpr bool PAIRWISE = true;
+  static constexpr float INIT = 0.0f;
+
+  CascadeSum<float> cascade;
+
+  template <typename T>
+  void add_run(const char* ptr, Int stride, Int n, Int)
+  {
+    cascade.add(sum_run<T, SQUARE>(ptr, stride, n));
+  }
+
+  void add_partial(const Partial& partial) { cascade.add(partial.value); }
+
+  Partial result() const { return {cascade.total(), 0}; }
+
+  template <typename V>
+  static LEGRAD_INLINE V fold(const V& acc, const V& x)
+  {
+    return acc + map_value<SQUARE>(x);
+  }
+};
+
+template <bool MAX>
+struct ExtremeReducer
+{
+  static constexpr bool COLUMNS = true;
+  static constexpr bool PAIRWISE = false;
+  static constexpr float INIT = MAX ? -INF : INF;
+
+  float value = INIT;
+
+  template <typename T>
+  void add_run(const char* ptr, Int stride, Int n, Int)
+  {
+    value = fold(value, extreme_run<T, MAX>(ptr, stride, n));
+  }
+
+  void add_partial(const Partial& partial)
+  {
+    value = fold(value, partial.value);
+  }
+
+  Partial result() const { return {value, 0}; }
+
+  template <typename V>
+  static LEGRAD_INLINE V fold(const V& acc, const V& x)
+  {
+    using vec::maximum;
+    using vec::minimum;
+    return MAX ? maximum(acc, x) : minimum(acc, x);
+  }
+};
+
+struct ArgMaxReducer
+{
+  static constexpr bool COLUMNS = false;
+  static constexpr bool PAIRWISE = false;
+  static constexpr float INIT = -INF;
+
+  Partial best;
+
+  template <typename T>
+  void add_run(const char* ptr, Int stride, Int n, Int first)
+  {
+    Partial partial = argmax_run<T>(ptr, stride, n);
+    partial.index += first;
+    add_partial(partial);
+  }
+
+  // Runs come in order, ties keep the first index
+  void add_partial(const Partial& partial)
+  {
+    if (best.index < 0 || partial.value > best.value) {
+      best = partial;
+    }
+  }
+
+  Partial result() const { return {best.value, std::max<Int>(best.index, 0)}; }
+
+  template <typename V>
+  static LEGRAD_INLINE V fold(const V& acc, const V&)
+  {
+    return acc;
+  }
+};
+
+struct Output
+{
+  core::TypeInfo dtype = core::TypeInfo::Float32;
+  float divisor = 1.0f;  // element count for Mean
+};
+
+void store_output(char* ptr, const Output& output, const Partial& partial)
+{
+  switch (output.dtype) {
+    case core::TypeInfo::Int32:
+      *reinterpret_cast<int32_t*>(ptr) = static_cast<int32_t>(partial.index);
+      break;
+    case core::TypeInfo::Float16:
+      *reinterpret_cast<uint16_t*>(ptr) =
+          fp16_ieee_from_fp32_value(partial.value / output.divisor);
+      break;
+    default:
+      *reinterpret_cast<float*>(ptr) = partial.value / output.divisor;
+  }
+}
+
+// Reduce the linear range [begin, end) of `inner` (already rebased)
+template <typename T, typename Reducer, size_t RANK>
+Partial reduce_range(const LoopPlan<1>& inner, Int begin, Int end)
+{
+  Reducer reducer;
+  Int index = begin;
+  for_each_run<RANK>(
+      inner, begin, end,
+      [&](const std::array<char*, 1>& ptrs,
+          const std::array<Int, 1>& strides,
+          Int n)
+      {
+        reducer.template add_run<T>(ptrs[0], strides[0], n, index);
+        index += n;
+      });
+  return reducer.result();
+}
+
+// All `count` elements of one output starting at `in`, chunk by chunk
+template <typename T, typename Reducer, size_t RANK>
+Partial reduce_output(LoopPlan<1>& inner, const char* in, Int count)
+{
+  if (count == 0) {
+    return Reducer().result();
+  }
+  inner.data[0] = const_cast<char*>(in);
+  if (count <= REDUCE_CHUNK) {
+    return reduce_range<T, Reducer, RANK>(inner, 0, count);
+  }
+  Reducer reducer;
+  for (Int begin = 0; begin < count; begin += REDUCE_CHUNK) {
+    reducer.add_partial(reduce_range<T, Reducer, RANK>(
+        inner, begin, std::min(count, begin + REDUCE_CHUNK)));
+  }
+  return reducer.result();
+}
+
+/*
+ * Same as reduce_output with the chunks split across threads, for the few
+ * outputs of a long reduction (e.g. a whole tensor to a scalar)
+ */
+template <typename T, typename Reducer, size_t RANK>
+Partial reduce_output_parallel(const LoopPlan<1>& inner,
+                               const char* in,
+                               Int count)
+{
+  const Int num_chunks = (count + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+  std::vector<Partial> partials(num_chunks);
+  parallel_for(0, num_chunks, 1,
+               [&](Int begin, Int end)
+               {
+                 LoopPlan<1> plan = inner;
+                 plan.data[0] = const_cast<char*>(in);
+                 for (Int chunk = begin; chunk < end; ++chunk) {
+                   partials[chunk] = reduce_range<T, Reducer, RANK>(
+                       plan, chunk * REDUCE_CHUNK,
+                       std::min(count, (chunk + 1) * REDUCE_CHUNK));
+                 }
+               });
+  Reducer reducer;
+  for (const Partial& partial : partials) {
+    reducer.add_partial(partial);
+  }
+  return reducer.result();
+}
+
+/*
+ * Outputs [c0, c0 + C * Vec::size()) of a run of contiguous outputs whose
+ * reduction is strided (e.g. a sum over rows): every step of the reduction
+ * loads C vectors of consecutive outputs, so it is as vectorized as the
+ * contiguous case. Sums add REDUCE_BLOCK steps to the accumulators, then the
+ * blocks pairwise.
+ */
+template <typename T, typename Reducer, size_t RANK, Int C>
+void reduce_column_block(LoopPlan<1>& inner,
+                         Int count,
+                         const Output& output,
+                         char* out,
+                         Int out_stride,
+                         const char* in)
+{
+  constexpr Int V = Vec::size();
+  Vec acc[C];
+  CascadeSum<Vec> cascade[Reducer::PAIRWISE ? C : 1];
+  for (Int c = 0; c < C; ++c) {
+    acc[c] = Vec(Reducer::INIT);
+  }
+  Int steps = 0;
+  inner.data[0] = const_cast<char*>(in);
+  for_each_run<RANK>(inner, 0, count,
+                     [&](const std::array<char*, 1>& ptrs,
+                         const std::array<Int, 1>& strides,
+                         Int n)
+                     {
+                       const char* ptr = ptrs[0];
+                       for (Int j = 0; j < n; ++j, ptr += strides[0]) {
+                         const T* x = reinterpret_cast<const T*>(ptr);
+#pragma GCC unroll 4
+                         for (Int c = 0; c < C; ++c) {
+                           acc[c] = Reducer::fold(acc[c], load(x + c * V));
+                         }
+                         if constexpr (Reducer::PAIRWISE) {
+                           if (++steps == REDUCE_BLOCK) {
+                             for (Int c = 0; c < C; ++c) {
+                               cascade[c].add(acc[c]);
+                               acc[c] = Vec(Reducer::INIT);
+                             }
+                             steps = 0;
+                           }
+                         }
+                       }
+                     });
+
+  float values[C * V];
+  for (Int c = 0; c < C; ++c) {
+    if constexpr (Reducer::PAIRWISE) {
+      cascade[c].add(acc[c]);
+      acc[c] = cascade[c].total();
+    }
+    acc[c].store(values + c * V);
+  }
+  for (Int i = 0; i < C * V; ++i) {
+    store_output(out + i * out_stride, output, {values[i], 0});
+  }
+}
+
+// One column the way a lane of reduce_column_block does it, same rounding
+template <typename T, typename Reducer, size_t RANK>
+void reduce_column(LoopPlan<1>& inner,
+                   Int count,
+                   const Output& output,
+                   char* out,
+                   const char* in)
+{
+  float acc = Reducer::INIT;
+  CascadeSum<float> cascade;
+  Int steps = 0;
+  inner.data[0] = const_cast<char*>(in);
+  for_each_run<RANK>(inner, 0, count,
+                     [&](const std::array<char*, 1>& ptrs,
+                         const std::array<Int, 1>& strides,
+                         Int n)
+                     {
+                       for (Int j = 0; j < n; ++j) {
+                         const float x = element<T>(ptrs[0], strides[0], j);
+                         acc = Reducer::fold(acc, x);
+                         if constexpr (Reducer::PAIRWISE) {
+                           if (++steps == REDUCE_BLOCK) {
+                             cascade.add(acc);
+                             acc = Reducer::INIT;
+                             steps = 0;
+                           }
+                         }
+                       }
+                     });
+  if constexpr (Reducer::PAIRWISE) {
+    cascade.add(acc);
+    acc = cascade.total();
+  }
+  store_output(out, output, {acc, 0});
+}
+
+// n contiguous outputs starting at `in`, see reduce_column_block
+template <typename T, typename Reducer, size_t RANK>
+void reduce_columns(LoopPlan<1>& inner,
+                    Int count,
+                    const Output& output,
+                    char* out,
+                    Int out_stride,
+                    const char* in,
+                    Int n)
+{
+  constexpr Int V = Vec::size();
+  Int c0 = 0;
+  for (; c0 + REDUCE_COLUMNS <= n; c0 += REDUCE_COLUMNS) {
+    reduce_column_block<T, Reducer, RANK, REDUCE_COLUMNS / V>(
+        inner, count, output, out + c0 * out_stride, out_stride,
+        in + c0 * sizeof(T));
+  }
+  for (; c0 + V <= n; c0 += V) {
+    reduce_column_block<T, Reducer, RANK, 1>(inner, count, output,
+                                             out + c0 * out_stride, out_stride,
+                                             in + c0 * sizeof(T));
+  }
+  for (; c0 < n; ++c0) {
+    reduce_column<T, Reducer, RANK>(inner, count, output,
+                                    out + c0 * out_stride,
+                                    in + c0 * sizeof(T));
+  }
+}
+
+/*
+ * Three ways to split the work, picked from the shapes only:
+ * - contiguous outputs with a strided reduction: column walk (vectorized over
+ *   the outputs)
+ * - fewer outputs than threads and long reductions: each output in parallel
+ *   chunks
+ * - otherwise outputs are split across threads, each one reduced by
+ *   vectorized pairwise runs
+ */
+template <typename T, typename Reducer, size_t OUTER_RANK, size_t INNER_RANK>
+void run_reduce(const ReduceArgs& args, const Output& output)
+{
+  const LoopPlan<2>& outer = args.outer;
+  const LoopPlan<1>& inner = args.inner;
+  const Int outputs = outer.numel;
+  const Int count = args.count;
+  const Int outer_stride = outer.stride(1)[outer.dim() - 1];
+  const Int inner_stride = inner.stride(0)[inner.dim() - 1];
+  const bool columns = Reducer::COLUMNS && count > 1
+                    && outer_stride == sizeof(T) && inner_stride != sizeof(T)
+                    && outer.shape()[outer.dim() - 1] >= Vec::size();
+
+  if (!columns && count > REDUCE_CHUNK
+      && outputs < static_cast<Int>(get_num_threads()) && !in_parallel_region())
+  {
+    for_each_run<OUTER_RANK>(
+        outer, 0, outputs,
+        [&](const std::array<char*, 2>& ptrs,
+            const std::array<Int, 2>& strides,
+            Int n)
+        {
+          for (Int i = 0; i < n; ++i) {
+            store_output(ptrs[0] + i * strides[0], output,
+                         reduce_output_parallel<T, Reducer, INNER_RANK>(
+                             inner, ptrs[1] + i * strides[1], count));
+          }
+        });
+    return;
+  }
+
+  const Int grain = std::max<Int>(1, GRAIN_SIZE / std::max<Int>(count, 1));
+  parallel_for(
+      0, outputs, grain,
+      [&](Int begin, Int end)
+      {
+        LoopPlan<1> plan = inner;
+        for_each_run<OUTER_RANK>(
+            outer, begin, end,
+            [&](const std::array<char*, 2>& ptrs,
+                const std::array<Int, 2>& strides,
+                Int n)
+            {
+              if (columns && strides[1] == sizeof(T)) {
+                reduce_columns<T, Reducer, INNER_RANK>(
+                    plan, count, output, ptrs[0], strides[0], ptrs[1], n);
+                return;
+              }
+              for (Int i = 0; i < n; ++i) {
+                store_output(ptrs[0] + i * strides[0], output,
+                             reduce_output<T, Reducer, INNER_RANK>(
+                                 plan, ptrs[1] + i * strides[1], count));
+              }
+            });
+      });
+}
+
+/*
+ * Only rank 1 plans (every layout that coalesces) get their own loops, the
+ * rest goes through the dynamic walker
+ */
+template <typename T, typename Reducer>
+void dispatch_ranks(const ReduceArgs& args, const Output& output)
+{
+  const bool outer_flat = args.outer.dim() == 1;
+  const bool inner_flat = args.inner.dim() == 1;
+  if (outer_flat && inner_flat) {
+    run_reduce<T, Reducer, 1, 1>(args, output);
+  } else if (outer_flat) {
+    run_reduce<T, Reducer, 1, 0>(args, output);
+  } else if (inner_flat) {
+    run_reduce<T, Reducer, 0, 1>(args, output);
+  } else {
+    run_reduce<T, Reducer, 0, 0>(args, output);
+  }
+}
+
+template <typename T>
+void dispatch_op(ReduceOp op, const ReduceArgs& args)
+{
+  Output output;
+  output.dtype = args.out_dtype;
+  switch (op) {
+    case ReduceOp::Sum:
+      return dispatch_ranks<T, SumReducer<false>>(args, output);
+    case ReduceOp::Mean:
+      output.divisor = static_cast<float>(args.count);
+      return dispatch_ranks<T, SumReducer<false>>(args, output);
+    case ReduceOp::SumSquares:
+      return dispatch_ranks<T, SumReducer<true>>(args, output);
+    case ReduceOp::Max:
+      return dispatch_ranks<T, ExtremeReducer<true>>(args, output);
+    case ReduceOp::Min:
+      return dispatch_ranks<T, ExtremeReducer<false>>(args, output);
+    case ReduceOp::ArgMax:
+      return dispatch_ranks<T, ArgMaxReducer>(args, output);
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument, "Unsupported ReduceOp {}",
+                         ToIntEnum(op));
+  }
+}
+
+template <typename T>
+struct ReduceKernel
+{
+  static void run(ReduceOp op, const ReduceArgs& args)
+  {
+    if constexpr (std::is_same_v<T, float>) {
+      dispatch_op<float>(op, args);
+    } else if constexpr (std::is_same_v<T, half_float>) {
+      dispatch_op<uint16_t>(op, args);
+    } else {
+      LEGRAD_THROW_ERROR(std::invalid_argument,
+                         "Reduce does not support this input dtype", 0);
+    }
+  }
+};
+
+const CpuKernelRegistrar<ReduceKernel> reduce_registrar(
+    REDUCE_KERNEL, {core::TypeInfo::Float32, core::TypeInfo::Float16});
+}  // namespace
+}  // namespace legrad::cpu
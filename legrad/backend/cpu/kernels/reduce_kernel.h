@@ -0,0 +1,26 @@
+#pragma once
+
+#include "backend/cpu/loops.h"
+#include "backend/cpu/reduce.h"
+#include "core/dtype.h"
+
+namespace legrad::cpu
+{
+// Registered per dtype of the input (Float32, Float16)
+constexpr const char* REDUCE_KERNEL = "reduce";
+
+struct ReduceArgs
+{
+  /*
+   * (out, in) over the kept dims, `in` pointing at the first element reduced
+   * into each output
+   */
+  LoopPlan<2> outer;
+  // `in` over the reduced dims, its data is rebased on every output
+  LoopPlan<1> inner;
+  Int count = 0;  // elements reduced into each output
+  core::TypeInfo out_dtype = core::TypeInfo::Float32;
+};
+
+using ReduceKernelFn = void (*)(ReduceOp op, const ReduceArgs& args);
+}  // namespace legrad::cpu
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/rope_kernel.h"
+#include "backend/cpu/loops.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+using Vec = vec::Vectorized<float>;
+
+/*
+ * Adjacent pairs: partner(x) swaps the two lanes of every pair. Vec::size()
+ * and dim are even so pairs never straddle a vector or the tail.
+ */
+void rotate_normal(float* x, const float* cos, const float* sin, Int dim)
+{
+  Int i = 0;
+  for (; i + Vec::size() <= dim; i += Vec::size()) {
+    const Vec v = Vec::loadu(x + i);
+    const Vec y =
+        v * Vec::loadu(cos + i) + vec::swap_pairs(v) * Vec::loadu(sin + i);
+    y.store(x + i);
+  }
+  for (; i < dim; i += 2) {
+    const float x0 = x[i];
+    const float x1 = x[i + 1];
+    x[i] = x0 * cos[i] + x1 * sin[i];
+    x[i + 1] = x1 * cos[i + 1] + x0 * sin[i + 1];
+  }
+}
+
+// Halves: x[i] is rotated with x[i + dim / 2], both come from the same load
+void rotate_neox(float* x, const float* cos, const float* sin, Int dim)
+{
+  const Int half = dim / 2;
+  float* hi = x + half;
+  Int i = 0;
+  for (; i + Vec::size() <= half; i += Vec::size()) {
+    const Vec a = Vec::loadu(x + i);
+    const Vec b = Vec::loadu(hi + i);
+    const Vec ya = a * Vec::loadu(cos + i) + b * Vec::loadu(sin + i);
+    const Vec yb =
+        b * Vec::loadu(cos + half + i) + a * Vec::loadu(sin + half + i);
+    ya.store(x + i);
+    yb.store(hi + i);
+  }
+  for (; i < half; ++i) {
+    const float a = x[i];
+    const float b = hi[i];
+    x[i] = a * cos[i] + b * sin[i];
+    hi[i] = b * cos[half + i] + a * sin[half + i];
+  }
+}
+
+// HALF: x is Float16, otherwise Float32
+template <bool HALF>
+void rope_row(char* row, Int pos, const RopeArgs& args, std::vector<float>& buf)
+{
+  const float* cos = args.table + pos * 2 * args.dim;
+  const float* sin = cos + args.dim;
+  const auto rotate = args.neox ? rotate_neox : rotate_normal;
+
+  if (!HALF && args.x_stride == 1) {
+    rotate(reinterpret_cast<float*>(row), cos, sin, args.dim);
+    return;
+  }
+
+  // Strided or half rows are rotated in a float copy of the rotated part
+  buf.resize(args.dim);
+  const Int byte_stride =
+      args.x_stride * (HALF ? sizeof(uint16_t) : sizeof(float));
+  if constexpr (HALF) {
+    vec::load_half(row, byte_stride, args.dim, buf.data());
+  } else {
+    for (Int i = 0; i < args.dim; ++i) {
+      buf[i] = *reinterpret_cast<const float*>(row + i * byte_stride);
+    }
+  }
+  rotate(buf.data(), cos, sin, args.dim);
+  if constexpr (HALF) {
+    vec::store_half(buf.data(), row, byte_stride, args.dim);
+  } else {
+    for (Int i = 0; i < args.dim; ++i) {
+      *reinterpret_cast<float*>(row + i * byte_stride) = buf[i];
+    }
+  }
+}
+
+template <bool HALF, size_t RANK>
+void run_rope(const LoopPlan<2>& rows, const RopeArgs& args)
+{
+  const Int grain = std::max<Int>(1, GRAIN_SIZE / std::max<Int>(args.dim, 1));
+  parallel_for(0, rows.numel, grain,
+               [&](Int begin, Int end)
+               {
+                 std::vector<float> buf;
+                 for_each_run<RANK>(
+                     rows, begin, end,
+                     [&](const std::array<char*, 2>& ptrs,
+                         const std::array<Int, 2>& strides,
+                         Int n)
+                     {
+                       for (Int i = 0; i < n; ++i) {
+                         const Int pos = *reinterpret_cast<const int32_t*>(
+                             ptrs[1] + i * strides[1]);
+                         rope_row<HALF>(ptrs[0] + i * strides[0], pos, args,
+                                        buf);
+                       }
+                     });
+               });
+}
+
+// Only registered for Float32 and Float16, T picks the storage of the rows
+template <typename T>
+struct RopeKernel
+{
+  static void run(const LoopPlan<2>& rows, const RopeArgs& args)
+  {
+    dispatch_rank(rows.dim(),
+                  [&](auto rank_tag)
+                  {
+                    constexpr size_t RANK = decltype(rank_tag)::value;
+                    run_rope<std::is_same_v<T, half_float>, RANK>(rows, args);
+                  });
+  }
+};
+
+const CpuKernelRegistrar<RopeKernel> rope_registrar(
+    ROPE_KERNEL, {core::TypeInfo::Float32, core::TypeInfo::Float16});
+}  // namespace
+}  // namespace legrad::cpu
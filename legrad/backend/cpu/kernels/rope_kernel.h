@@ -0,0 +1,27 @@
+#pragma once
+
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+// Registered per dtype of x (Float32, Float16)
+constexpr const char* ROPE_KERNEL = "rope";
+
+struct RopeArgs
+{
+  Int head_dim = 0;
+  Int x_stride = 1;  // last dim of x, in elements
+  Int dim = 0;  // rotated elements, <= head_dim
+  bool neox = false;
+  const float* table = nullptr;  // RopeCache::table(), 2 * dim per position
+};
+
+/*
+ * `rows` walks the leading dims of {x, positions}: each element of the plan
+ * is one head of x and its Int32 position (positions are broadcast over the
+ * dims they do not index)
+ */
+using RopeKernelFn = void (*)(const LoopPlan<2>& rows, const RopeArgs& args);
+}  // namespace legrad::cpu
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "backend/cpu/elementwise.h"
+#include "backend/cpu/isa.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+
+/*
+ * Helpers for kernels working on whole rows of the last dim (norms, softmax,
+ * ...), only include it from backend/cpu/kernels. A row is handed to the math
+ * as a contiguous float array: Float32 rows with unit stride are used in
+ * place, strided or Float16 rows go through a per thread buffer.
+ */
+namespace legrad::cpu
+{
+inline namespace LEGRAD_CPU_KERNEL_NAMESPACE
+{
+// A row that can be used as a plain float array
+LEGRAD_INLINE bool is_direct(core::TypeInfo dtype, Int stride)
+{
+  return dtype == core::TypeInfo::Float32 && stride == 1;
+}
+
+// Convert a strided Float32/Float16 row of `n` elements into `dst`
+inline void copy_row(const char* ptr,
+                     core::TypeInfo dtype,
+                     Int stride,
+                     Int n,
+                     float* dst)
+{
+  if (dtype == core::TypeInfo::Float16) {
+    vec::load_half(ptr, stride * sizeof(uint16_t), n, dst);
+  } else {
+    const float* src = reinterpret_cast<const float*>(ptr);
+    for (Int i = 0; i < n; ++i) {
+      dst[i] = src[i * stride];
+    }
+  }
+}
+
+// Convert `n` floats into a strided Float32/Float16 row
+inline void write_row(const float* src,
+                      char* ptr,
+                      core::TypeInfo dtype,
+                      Int stride,
+                      Int n)
+{
+  if (dtype == core::TypeInfo::Float16) {
+    vec::store_half(src, ptr, stride * sizeof(uint16_t), n);
+  } else {
+    float* dst = reinterpret_cast<float*>(ptr);
+    for (Int i = 0; i < n; ++i) {
+      dst[i * stride] = src[i];
+    }
+  }
+}
+
+/*
+ * Row of `n` elements as contiguous floats: used in place when it already is,
+ * otherwise converted into `buffer`
+ */
+inline const float* load_row(const char* ptr,
+                             core::TypeInfo dtype,
+                             Int stride,
+                             Int n,
+                             std::vector<float>& buffer)
+{
+  if (is_direct(dtype, stride)) {
+    return reinterpret_cast<const float*>(ptr);
+  }
+  buffer.resize(n);
+  copy_row(ptr, dtype, stride, n, buffer.data());
+  return buffer.data();
+}
+
+// Where a row is computed: the row itself when possible, otherwise `buffer`
+inline float* row_target(char* ptr,
+                         core::TypeInfo dtype,
+                         Int stride,
+                         Int n,
+                         std::vector<float>& buffer)
+{
+  if (is_direct(dtype, stride)) {
+    return reinterpret_cast<float*>(ptr);
+  }
+  buffer.resize(n);
+  return buffer.data();
+}
+
+// Write back a row computed by row_target
+inline void store_row(const float* src,
+                      char* ptr,
+                      core::TypeInfo dtype,
+                      Int stride,
+                      Int n)
+{
+  if (!is_direct(dtype, stride)) {
+    write_row(src, ptr, dtype, stride, n);
+  }
+}
+
+// y = fn(x) over `n` floats, vector by vector, y may be x
+template <typename Fn>
+LEGRAD_INLINE void map_row(const float* x, float* y, Int n, const Fn& fn)
+{
+  using Vec = vec::Vectorized<float>;
+  Int i = 0;
+  for (; i + Vec::size() <= n; i += Vec::size()) {
+    fn(Vec::loadu(x + i)).store(y + i);
+  }
+  if (i < n) {
+    fn(Vec::loadu(x + i, n - i)).store(y + i, n - i);
+  }
+}
+
+// y = act(x) over `n` floats, y may be x
+inline void activation_row(Activation act, const float* x, float* y, Int n)
+{
+  using Vec = vec::Vectorized<float>;
+  switch (act) {
+    case Activation::Relu:
+      return map_row(x, y, n,
+                     [](const Vec& v) { return maximum(v, Vec(0.0f)); });
+    case Activation::Silu:
+      return map_row(x, y, n, [](const Vec& v) { return vec::silu(v); });
+    case Activation::Gelu:
+      return map_row(x, y, n, [](const Vec& v) { return vec::gelu(v); });
+    case Activation::Sigmoid:
+      return map_row(x, y, n, [](const Vec& v) { return vec::sigmoid(v); });
+    default:
+      if (x != y) {
+        std::memmove(y, x, n * sizeof(float));
+      }
+  }
+}
+}  // namespace LEGRAD_CPU_KERNEL_NAMESPACE
+}  // namespace legrad::cpu
@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "backend/cpu/isa.h"
+#include "backend/cpu/kernels/row_impl.h"
+#include "backend/cpu/kernels/softmax_kernel.h"
+#include "backend/cpu/loops.h"
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/vec.h"
+#include "core/dtype.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+using Vec = vec::Vectorized<float>;
+
+constexpr float LOWEST = std::numeric_limits<float>::lowest();
+
+/*
+ * Rows at least this long are split across threads when there are not enough
+ * rows to go around (logits of a single token over the vocabulary)
+ */
+constexpr Int SOFTMAX_SPLIT_COLS = GRAIN_SIZE;
+
+// Running max and sum of exp(x - max) of a part of a row
+struct SoftmaxStats
+{
+  float max = LOWEST;
+  float sum = 0.0f;
+};
+
+SoftmaxStats merge(const SoftmaxStats& a, const SoftmaxStats& b)
+{
+  SoftmaxStats result;
+  result.max = std::max(a.max, b.max);
+  result.sum = a.sum * std::exp(a.max - result.max)
+               + b.sum * std::exp(b.max - result.max);
+  return result;
+}
+
+// x[0, count) * scale, the other lanes are LOWEST so their exp is 0
+LEGRAD_INLINE Vec load_tail(const float* x, Int count, float scale)
+{
+  float values[Vec::size()];
+  for (Int i = 0; i < Vec::size(); ++i) {
+    values[i] = i < count ? x[i] * scale : LOWEST;
+  }
+  return Vec::loadu(values);
+}
+
+/*
+ * Online max and sum in one pass: every lane keeps its own max, the sum is
+ * rescaled when the max grows. Four vectors share one rescale so it costs
+ * about 1.25 exp per element instead of 2.
+ */
+SoftmaxStats row_stats(const float* x, Int n, float scale)
+{
+  constexpr Int V = Vec::size();
+  const Vec s(scale);
+  Vec max(LOWEST), sum(0.0f);
+  Int i = 0;
+  for (; i + 4 * V <= n; i += 4 * V) {
+    const Vec v0 = Vec::loadu(x + i) * s;
+    const Vec v1 = Vec::loadu(x + i + V) * s;
+    const Vec v2 = Vec::loadu(x + i + 2 * V) * s;
+    const Vec v3 = Vec::loadu(x + i + 3 * V) * s;
+    const Vec m = maximum(maximum(maximum(v0, v1), maximum(v2, v3)), max);
+    sum = sum * vec::exp(max - m)
+          + ((vec::exp(v0 - m) + vec::exp(v1 - m))
+             + (vec::exp(v2 - m) + vec::exp(v3 - m)));
+    max = m;
+  }
+  for (; i < n; i += V) {
+    const Vec v =
+        i + V <= n ? Vec::loadu(x + i) * s : load_tail(x + i, n - i, scale);
+    const Vec m = maximum(v, max);
+    sum = sum * vec::exp(max - m) + vec::exp(v - m);
+    max = m;
+  }
+
+  SoftmaxStats stats;
+  stats.max = vec::reduce_max(max);
+  stats.sum = vec::reduce_add(sum * vec::exp(max - Vec(stats.max)));
+  return stats;
+}
+
+// y = exp(x * scale - max) / sum, y may alias x
+void write_probs(const float* x,
+                 Int n,
+                 float scale,
+                 const SoftmaxStats& stats,
+                 float* y)
+{
+  const Vec s(scale), max(stats.max), inv(1.0f / stats.sum);
+  Int i = 0;
+  for (; i + Vec::size() <= n; i += Vec::size()) {
+    (vec::exp(Vec::loadu(x + i) * s - max) * inv).store(y + i);
+  }
+  if (i < n) {
+    const Int count = n - i;
+    (vec::exp(Vec::loadu(x + i, count) * s - max) * inv).store(y + i, count);
+  }
+}
+
+// Softmax of the first `valid` elements of a row of `cols`, the rest is 0
+void softmax_row(const float* x,
+                 Int valid,
+                 Int cols,
+                 float scale,
+                 float* y)
+{
+  if (valid > 0) {
+    write_probs(x, valid, scale, row_stats(x, valid, scale), y);
+  }
+  std::fill(y + std::max<Int>(valid, 0), y + cols, 0.0f);
+}
+
+/*
+ * One long row on all threads: the stats of fixed chunks are merged (online
+ * softmax merges exactly like its lanes do), then every chunk is written
+ */
+void softmax_row_split(const float* x,
+                       Int valid,
+                       Int cols,
+                       float scale,
+                       float* y)
+{
+  const Int chunk = SOFTMAX_SPLIT_COLS / 4;
+  const Int num_chunks = (valid + chunk - 1) / chunk;
+  std::vector<SoftmaxStats> partial(num_chunks);
+  parallel_for(0, num_chunks, 1,
+               [&](Int begin, Int end)
+               {
+                 for (Int c = begin; c < end; ++c) {
+                   const Int start = c * chunk;
+                   partial[c] = row_stats(x + start,
+                                          std::min(chunk, valid - start),
+                                          scale);
+                 }
+               });
+  SoftmaxStats stats;
+  for (const SoftmaxStats& part : partial) {
+    stats = merge(stats, part);
+  }
+  parallel_for(0, num_chunks, 1,
+               [&](Int begin, Int end)
+               {
+                 for (Int c = begin; c < end; ++c) {
+                   const Int start = c * chunk;
+                   write_probs(x + start, std::min(chunk, valid - start),
+                               scale, stats, y + start);
+                 }
+               });
+  std::fill(y + valid, y + cols, 0.0f);
+}
+
+void run_row(char* out,
+             const char* in,
+             const char* limit,
+             const SoftmaxArgs& args,
+             bool split,
+             std::vector<float>& in_buffer,
+             std::vector<float>& out_buffer)
+{
+  const Int n = args.cols;
+  const Int valid = std::min<Int>(*reinterpret_cast<const int32_t*>(limit), n);
+  const float* x = load_row(in, args.in_dtype, args.in_stride, n, in_buffer);
+  float* y = row_target(out, args.out_dtype, args.out_stride, n, out_buffer);
+  if (split && valid > 0) {
+    softmax_row_split(x, valid, n, args.scale, y);
+  } else {
+    softmax_row(x, valid, n, args.scale, y);
+  }
+  store_row(y, out, args.out_dtype, args.out_stride, n);
+}
+
+template <size_t RANK>
+void run_softmax(const LoopPlan<3>& rows, const SoftmaxArgs& args)
+{
+  const auto row_loop = [&](Int begin, Int end, bool split)
+  {
+    std::vector<float> in_buffer, out_buffer;
+    for_each_run<RANK>(rows, begin, end,
+                       [&](const std::array<char*, 3>& ptrs,
+                           const std::array<Int, 3>& strides,
+                           Int n)
+                       {
+                         for (Int i = 0; i < n; ++i) {
+                           run_row(ptrs[0] + i * strides[0],
+                                   ptrs[1] + i * strides[1],
+                                   ptrs[2] + i * strides[2], args, split,
+                                   in_buffer, out_buffer);
+                         }
+                       });
+  };
+
+  const bool split = args.cols >= SOFTMAX_SPLIT_COLS
+                     && rows.numel < static_cast<Int>(get_num_threads())
+                     && !in_parallel_region();
+  if (split) {
+    row_loop(0, rows.numel, true);
+  } else {
+    const Int grain =
+        std::max<Int>(1, GRAIN_SIZE / std::max<Int>(args.cols, 1));
+    parallel_for(0, rows.numel, grain,
+                 [&](Int begin, Int end) { row_loop(begin, end, false); });
+  }
+}
+
+// The math is in float for every dtype, T only selects the registry entry
+template <typename T>
+struct SoftmaxKernel
+{
+  static void run(const LoopPlan<3>& rows, const SoftmaxArgs& args)
+  {
+    dispatch_rank(rows.dim(),
+                  [&](auto rank_tag)
+                  {
+                    constexpr size_t RANK = decltype(rank_tag)::value;
+                    run_softmax<RANK>(rows, args);
+                  });
+  }
+};
+
+const CpuKernelRegistrar<SoftmaxKernel> softmax_registrar(
+    SOFTMAX_KERNEL, {core::TypeInfo::Float32, core::TypeInfo::Float16});
+}  // namespace
+}  // namespace legrad::cpu
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+// Registered per dtype of the input (Float32, Float16)
+constexpr const char* SOFTMAX_KERNEL = "softmax";
+
+// Last dim of the operands, strides are in elements
+struct SoftmaxArgs
+{
+  Int cols = 0;
+  core::TypeInfo out_dtype = core::TypeInfo::Float32;
+  Int out_stride = 1;
+  core::TypeInfo in_dtype = core::TypeInfo::Float32;
+  Int in_stride = 1;
+  float scale = 1.0f;
+};
+
+/*
+ * `rows` walks the leading dims of {out, in, limits}: each element of the
+ * plan is one row and the Int32 number of its leading columns that are not
+ * masked, the others are written as 0 (limits is broadcast, a single `cols`
+ * without a mask)
+ */
+using SoftmaxKernelFn = void (*)(const LoopPlan<3>& rows,
+                                 const SoftmaxArgs& args);
+}  // namespace legrad::cpu
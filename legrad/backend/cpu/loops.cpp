@@ -0,0 +1,26 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "loops.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+std::vector<Int> broadcast_shapes(IntArrayView a, IntArrayView b)
+{
+  const size_t ndim = std::max(a.size(), b.size());
+  std::vector<Int> result(ndim);
+  for (size_t i = 0; i < ndim; ++i) {
+    const Int sa = i < a.size() ? a[a.size() - 1 - i] : 1;
+    const Int sb = i < b.size() ? b[b.size() - 1 - i] : 1;
+    LEGRAD_CHECK_AND_THROW(sa == sb || sa == 1 || sb == 1,
+                           std::invalid_argument,
+                           "Shapes {} and {} cannot be broadcast together",
+                           IntArrayView::numerical_view_2str(a),
+                           IntArrayView::numerical_view_2str(b));
+    result[ndim - 1 - i] = sa == 1 ? sb : sa;
+  }
+  return result;
+}
+}  // namespace legrad::cpu
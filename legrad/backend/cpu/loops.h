@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "core/dtype.h"
+#include "core/tensor_view.h"
+#include "internal/view_pack.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+/*
+ * NumPy-style broadcast of two shapes: dimensions are aligned from the right,
+ * each pair has to be equal or one of them has to be 1.
+ */
+std::vector<Int> broadcast_shapes(IntArrayView a, IntArrayView b);
+
+/*
+ * LoopPlan describes how to walk N operands with a single index space.
+ * Operand 0 is the output and defines the iteration shape, every other operand
+ * is broadcast to it (broadcast dimensions get stride 0).
+ * Each operand has its own view_pack holding the (shared) iteration shape and
+ * its strides **in bytes**, so the loops themselves are dtype agnostic.
+ * Dimensions are coalesced when possible: a contiguous tensor always becomes a
+ * plan with a single dimension, which gives the kernels the longest possible
+ * inner loop.
+ */
+template <size_t N>
+struct LoopPlan
+{
+  std::array<char*, N> data;
+  std::array<internal::view_pack, N> views;
+  Int numel = 0;
+
+  size_t dim() const { return views[0].dim(); }
+  const Int* shape() const { return views[0].shape_data(); }
+  const Int* stride(size_t arg) const { return views[arg].stride_data(); }
+};
+
+template <size_t N>
+LoopPlan<N> make_loop_plan(const std::array<const core::TensorView*, N>& args)
+{
+  const core::TensorView& out = *args[0];
+  const size_t ndim = out.dim();
+
+  /*
+   * Byte strides of every operand aligned (from the right) to the output.
+   * They are written straight into the plan's view_packs: for ndim <=
+   * LEGRAD_VIEW_PACK_MAX_DIM this does not touch the heap at all.
+   */
+  LoopPlan<N> plan;
+  plan.numel = out.numel();
+  for (size_t k = 0; k < N; ++k) {
+    const core::TensorView& arg = *args[k];
+    LEGRAD_CHECK_AND_THROW(arg.dim() <= ndim, std::invalid_argument,
+                           "Operand {} has {} dims, more than output ({})", k,
+                           arg.dim(), ndim);
+    const Int elem_size = static_cast<Int>(arg.elem_size());
+    const size_t offset = ndim - arg.dim();
+    plan.data[k] = static_cast<char*>(arg.data);
+    plan.views[k].set_shape(out.shape());
+    Int* strides = plan.views[k].stride_data();
+    std::fill_n(strides, offset, 0);
+    for (size_t d = 0; d < arg.dim(); ++d) {
+      const Int size = arg.shape_at(d);
+      const Int out_size = out.shape_at(d + offset);
+      LEGRAD_CHECK_AND_THROW(size == out_size || size == 1,
+                             std::invalid_argument,
+                             "Operand {} with shape {} cannot be broadcast to "
+                             "output shape {}",
+                             k, IntArrayView::numerical_view_2str(arg.shape()),
+                             IntArrayView::numerical_view_2str(out.shape()));
+      strides[d + offset] = size == 1 ? 0 : arg.stride_at(d) * elem_size;
+    }
+  }
+
+  /*
+   * Coalesce (in place) from the innermost dimension: an outer dimension can
+   * be merged into the current one if for every operand it steps exactly over
+   * the whole current dimension. Dimensions of size 1 are dropped.
+   * Merged dimensions are written from the back, `w` is the first written one,
+   * since w > d all the time we never overwrite a dimension we still have to
+   * read.
+   */
+  Int* shape = plan.views[0].shape_data();
+  size_t w = ndim;
+  for (size_t d = ndim; d > 0; --d) {
+    const Int size = shape[d - 1];
+    if (size == 1) {
+      continue;
+    }
+    bool can_merge = w < ndim;
+    for (size_t k = 0; k < N && can_merge; ++k) {
+      const Int* strides = plan.views[k].stride_data();
+      can_merge = strides[d - 1] == shape[w] * strides[w];
+    }
+    if (can_merge) {
+      for (size_t k = 0; k < N; ++k) {
+        plan.views[k].shape_data()[w] *= size;
+      }
+    } else {
+      --w;
+      for (size_t k = 0; k < N; ++k) {
+        plan.views[k].shape_data()[w] = size;
+        plan.views[k].stride_data()[w] = plan.views[k].stride_data()[d - 1];
+      }
+    }
+  }
+
+  // Move the merged dimensions to the front and drop the rest
+  const size_t new_dim = ndim - w;
+  for (size_t k = 0; k < N; ++k) {
+    internal::view_pack& v = plan.views[k];
+    std::copy(v.shape_data() + w, v.shape_data() + ndim, v.shape_data());
+    std::copy(v.stride_data() + w, v.stride_data() + ndim, v.stride_data());
+    v.resize_storage(std::max<size_t>(new_dim, 1));
+    /*
+     * A scalar (or a tensor full of size 1) is a single element loop. Written
+     * after the resize: with 0 dims shape and stride share their storage.
+     */
+    if (new_dim == 0) {
+      v.shape_data()[0] = 1;
+      v.stride_data()[0] = 0;
+    }
+  }
+  return plan;
+}
+
+// Dynamic rank version of for_each_run (see below)
+template <size_t N, typename F>
+void for_each_run_dynamic(const LoopPlan<N>& plan,
+                          Int begin,
+                          Int end,
+                          const F& fn)
+{
+  const size_t ndim = plan.dim();
+  const Int* shape = plan.shape();
+  const size_t inner = ndim - 1;
+
+  std::array<Int, N> inner_strides;
+  for (size_t k = 0; k < N; ++k) {
+    inner_strides[k] = plan.stride(k)[inner];
+  }
+
+  // Unravel `begin` into coordinates and starting pointers
+  std::vector<Int> coord(ndim);
+  std::array<char*, N> ptrs = plan.data;
+  Int rem = begin;
+  for (size_t d = ndim; d > 0; --d) {
+    coord[d - 1] = rem % shape[d - 1];
+    rem /= shape[d - 1];
+    for (size_t k = 0; k < N; ++k) {
+      ptrs[k] += coord[d - 1] * plan.stride(k)[d - 1];
+    }
+  }
+
+  Int idx = begin;
+  while (idx < end) {
+    const Int n = std::min(shape[inner] - coord[inner], end - idx);
+    fn(ptrs, inner_strides, n);
+    idx += n;
+    if (idx >= end) {
+      break;
+    }
+
+    // The run always ends at the end of the inner dimension here, carry it
+    for (size_t k = 0; k < N; ++k) {
+      ptrs[k] += n * inner_strides[k];
+    }
+    coord[inner] += n;
+    for (size_t d = inner; d > 0 && coord[d] == shape[d]; --d) {
+      coord[d] = 0;
+      ++coord[d - 1];
+      for (size_t k = 0; k < N; ++k) {
+        ptrs[k] += plan.stride(k)[d - 1] - shape[d] * plan.stride(k)[d];
+      }
+    }
+  }
+}
+
+/*
+ * Walk the linear range [begin, end) of the plan and call
+ * `fn(ptrs, inner_strides, n)` for every run of `n` elements along the
+ * innermost dimension. `ptrs` point at the first element of the run.
+ *
+ * RANK is the plan rank known at compile time (1 to LEGRAD_VIEW_PACK_MAX_DIM),
+ * so shape/stride live in registers and the unravel/carry loops are fully
+ * unrolled. RANK == 0 is the dynamic fallback for out-of-line view_packs.
+ * RANK == 1 is also the "contiguous" pattern: after coalescing every operand
+ * set that can be walked linearly ends up here and the whole chunk is a single
+ * run without any index arithmetic.
+ */
+template <size_t RANK, size_t N, typename F>
+void for_each_run(const LoopPlan<N>& plan, Int begin, Int end, const F& fn)
+{
+  if constexpr (RANK == 0) {
+    for_each_run_dynamic(plan, begin, end, fn);
+  } else {
+    LEGRAD_ASSERT(plan.dim() == RANK, "Plan has rank {} but expected {}",
+                  plan.dim(), RANK);
+    std::array<Int, N> inner_strides;
+    std::array<char*, N> ptrs;
+    if constexpr (RANK == 1) {
+      for (size_t k = 0; k < N; ++k) {
+        inner_strides[k] = plan.stride(k)[0];
+        ptrs[k] = plan.data[k] + begin * inner_strides[k];
+      }
+      fn(ptrs, inner_strides, end - begin);
+      return;
+    } else {
+      std::array<Int, RANK> shape;
+      std::array<std::array<Int, RANK>, N> strides;
+      for (size_t d = 0; d < RANK; ++d) {
+        shape[d] = plan.shape()[d];
+        for (size_t k = 0; k < N; ++k) {
+          strides[k][d] = plan.stride(k)[d];
+        }
+      }
+      for (size_t k = 0; k < N; ++k) {
+        inner_strides[k] = strides[k][RANK - 1];
+      }
+
+      std::array<Int, RANK> coord;
+      ptrs = plan.data;
+      Int rem = begin;
+      for (size_t d = RANK; d > 0; --d) {
+        coord[d - 1] = rem % shape[d - 1];
+        rem /= shape[d - 1];
+        for (size_t k = 0; k < N; ++k) {
+          ptrs[k] += coord[d - 1] * strides[k][d - 1];
+        }
+      }
+
+      Int idx = begin;
+      while (true) {
+        const Int n = std::min(shape[RANK - 1] - coord[RANK - 1], end - idx);
+        fn(ptrs, inner_strides, n);
+        idx += n;
+        if (idx >= end) {
+          break;
+        }
+        for (size_t k = 0; k < N; ++k) {
+          ptrs[k] += n * inner_strides[k];
+        }
+        coord[RANK - 1] += n;
+        for (size_t d = RANK - 1; d > 0 && coord[d] == shape[d]; --d) {
+          coord[d] = 0;
+          ++coord[d - 1];
+          for (size_t k = 0; k < N; ++k) {
+            ptrs[k] += strides[k][d - 1] - shape[d] * strides[k][d];
+          }
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Call `fn(std::integral_constant<size_t, R>{})` where R is `rank` if it can
+ * be specialized (1 to LEGRAD_VIEW_PACK_MAX_DIM) and 0 (dynamic) otherwise.
+ */
+template <typename F>
+decltype(auto) dispatch_rank(size_t rank, const F& fn)
+{
+  LEGRAD_STATIC_ASSERT(internal::LEGRAD_VIEW_PACK_MAX_DIM == 5,
+                       "Update dispatch_rank when changing max inline dim");
+  switch (rank) {
+    case 1:
+      return fn(std::integral_constant<size_t, 1>{});
+    case 2:
+      return fn(std::integral_constant<size_t, 2>{});
+    case 3:
+      return fn(std::integral_constant<size_t, 3>{});
+    case 4:
+      return fn(std::integral_constant<size_t, 4>{});
+    case 5:
+      return fn(std::integral_constant<size_t, 5>{});
+    default:
+      return fn(std::integral_constant<size_t, 0>{});
+  }
+}
+}  // namespace legrad::cpu
+
+/*
+ * Same as CALL_DISPATCH_TYPE_INFO but the body also sees `loop_rank`, a
+ * constexpr rank usable as the RANK of for_each_run. Ops use it to get one
+ * instantiation per dtype x rank without writing the switches themselves:
+ *
+ *   CALL_DISPATCH_TYPE_INFO_AND_RANK(out.dtype, plan.dim(), [&] {
+ *     for_each_run<loop_rank>(plan, begin, end, my_kernel<scalar_t>);
+ *   });
+ */
+// clang-format off
+#define CALL_DISPATCH_TYPE_INFO_AND_RANK(TYPE, RANK, ...)                  \
+    CALL_DISPATCH_TYPE_INFO(TYPE, [&] {                                    \
+        return ::legrad::cpu::dispatch_rank(RANK, [&](auto rank_tag) {     \
+            constexpr size_t loop_rank = decltype(rank_tag)::value;        \
+            return __VA_ARGS__();                                          \
+        });                                                                \
+    })
+// clang-format on
@@ -0,0 +1,113 @@
+#include <stdexcept>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/norm_kernel.h"
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "macros/log.h"
+#include "norm.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<RmsNormKernelFn> rms_norm_stub(RMS_NORM_KERNEL);
+
+void check_operand(const core::TensorView& view,
+                   const core::TensorView& in,
+                   const char* name)
+{
+  LEGRAD_CHECK_AND_THROW(
+      view.dtype == TypeInfo::Float32 || view.dtype == TypeInfo::Float16,
+      std::invalid_argument, "RMSNorm does not support {} {}",
+      core::TypeInfoToString(view.dtype), name);
+  LEGRAD_CHECK_AND_THROW(view.shape() == in.shape(), std::invalid_argument,
+                         "RMSNorm {} has shape {}, expected {}", name,
+                         IntArrayView::numerical_view_2str(view.shape()),
+                         IntArrayView::numerical_view_2str(in.shape()));
+}
+
+// View of the leading dims of `view`, one element per row
+core::TensorView row_view(const core::TensorView& view)
+{
+  const size_t dim = view.dim() - 1;
+  return core::TensorView(view.data, view.dtype, view.shape().slice(0, dim),
+                          view.stride().slice(0, dim));
+}
+
+void run_rms_norm(const core::TensorView& out,
+                  const core::TensorView* residual,
+                  const core::TensorView& in,
+                  const core::TensorView& weight,
+                  float eps)
+{
+  LEGRAD_CHECK_AND_THROW(in.dim() >= 1, std::invalid_argument,
+                         "RMSNorm expects at least 1 dim, got a scalar", 0);
+  check_operand(in, in, "in");
+  check_operand(out, in, "out");
+  if (residual) {
+    check_operand(*residual, in, "residual");
+  }
+
+  RmsNormArgs args;
+  const size_t last = in.dim() - 1;
+  args.cols = in.shape_at(last);
+  args.out_dtype = out.dtype;
+  args.out_stride = out.stride_at(last);
+  args.in_dtype = in.dtype;
+  args.in_stride = in.stride_at(last);
+  args.residual = residual != nullptr;
+  args.eps = eps;
+  if (residual) {
+    args.residual_dtype = residual->dtype;
+    args.residual_stride = residual->stride_at(last);
+  }
+  if (weight.data) {
+    LEGRAD_CHECK_AND_THROW(
+        weight.dim() == 1 && weight.shape_at(0) == args.cols
+            && (weight.dtype == TypeInfo::Float32
+                || weight.dtype == TypeInfo::Float16),
+        std::invalid_argument,
+        "RMSNorm weight must be a Float32/Float16 [{}], got {} {}", args.cols,
+        core::TypeInfoToString(weight.dtype),
+        IntArrayView::numerical_view_2str(weight.shape()));
+    args.weight = weight.data;
+    args.weight_dtype = weight.dtype;
+    args.weight_stride = weight.stride_at(0);
+  }
+
+  if (in.numel() == 0) {
+    return;
+  }
+
+  const core::TensorView out_rows = row_view(out);
+  const core::TensorView in_rows = row_view(in);
+  const core::TensorView residual_rows = row_view(residual ? *residual : in);
+  const LoopPlan<3> rows =
+      make_loop_plan<3>({&out_rows, &in_rows, &residual_rows});
+  LEGRAD_LOG_TRACE("RMSNorm {} rows of {}{}", rows.numel, args.cols,
+                   residual ? " with residual" : "");
+  launch(rms_norm_stub.get(in.dtype), rows, args);
+}
+}  // namespace
+
+void rms_norm(const core::TensorView& out,
+              const core::TensorView& in,
+              const core::TensorView& weight,
+              float eps)
+{
+  run_rms_norm(out, nullptr, in, weight, eps);
+}
+
+void rms_norm_residual(const core::TensorView& out,
+                       const core::TensorView& residual,
+                       const core::TensorView& in,
+                       const core::TensorView& weight,
+                       float eps)
+{
+  run_rms_norm(out, &residual, in, weight, eps);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "core/tensor_view.h"
+
+namespace legrad::cpu
+{
+/*
+ * RMSNorm over the last dim: out = x / sqrt(mean(x^2) + eps) * weight.
+ * `weight` is a 1-D view of the last dim, an empty view (no data) skips the
+ * multiply. Every operand can be Float32 or Float16 (the math is in float)
+ * and any strided view, out may alias in.
+ * Each row is read once and normalized while it is still in L1.
+ */
+void rms_norm(const core::TensorView& out,
+              const core::TensorView& in,
+              const core::TensorView& weight,
+              float eps);
+
+/*
+ * Residual add fused into the norm of a transformer block:
+ *   residual += in
+ *   out = rms_norm(residual) * weight
+ * The updated hidden state is written back to `residual` in the same pass,
+ * instead of an add kernel followed by a norm reading it all again.
+ */
+void rms_norm_residual(const core::TensorView& out,
+                       const core::TensorView& residual,
+                       const core::TensorView& in,
+                       const core::TensorView& weight,
+                       float eps);
+}  // namespace legrad::cpu
@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "backend/cpu/parallel.h"
+#include "backend/cpu_mgr.h"
+#include "macros/log.h"
+#include "numa.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+size_t round_to_pages(size_t nbytes)
+{
+  const size_t page = Manager::instance().page_size();
+  return (nbytes + page - 1) / page * page;
+}
+
+#ifdef __linux__
+/*
+ * mbind the pages fully inside [ptr, ptr + nbytes) to `nodes` with `mode`,
+ * already touched pages move
+ */
+void bind_pages(void* ptr,
+                size_t nbytes,
+                int mode,
+                const std::vector<int>& nodes)
+{
+  const uintptr_t page = Manager::instance().page_size();
+  const uintptr_t begin =
+      (reinterpret_cast<uintptr_t>(ptr) + page - 1) / page * page;
+  const uintptr_t end =
+      (reinterpret_cast<uintptr_t>(ptr) + nbytes) / page * page;
+  if (begin >= end || nodes.empty()) {
+    return;
+  }
+
+  constexpr size_t BITS = sizeof(unsigned long) * CHAR_BIT;
+  const int max_node = *std::max_element(nodes.begin(), nodes.end());
+  std::vector<unsigned long> mask(max_node / BITS + 1, 0);
+  for (const int node : nodes) {
+    mask[node / BITS] |= 1ul << (node % BITS);
+  }
+  // The kernel drops the last bit of maxnode, libnuma passes one more too
+  const long rc =
+      syscall(SYS_mbind, begin, end - begin, mode, mask.data(),
+              mask.size() * BITS + 1, static_cast<unsigned>(MPOL_MF_MOVE));
+  static std::atomic<bool> warned{false};
+  if (rc != 0 && !warned.exchange(true)) {
+    LEGRAD_LOG_WARN("Cannot place memory on NUMA nodes ({}), leave it as is",
+                    std::strerror(errno));
+  }
+}
+#endif
+}  // namespace
+
+NumaAllocator::NumaAllocator(NumaPolicy policy, int node)
+    : policy_(policy)
+    , node_(node)
+{
+}
+
+core::Buffer NumaAllocator::malloc(size_t nbytes)
+{
+  if (nbytes == 0) {
+    LEGRAD_LOG_WARN("Allocator create buffer with 0 size", 0);
+    return core::Buffer();
+  }
+
+  const size_t size = round_to_pages(nbytes);
+#ifdef __linux__
+  void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    LEGRAD_LOG_ERR("Cannot map memory with size: {}", nbytes);
+    return core::Buffer();
+  }
+#else
+  void* ptr = std::aligned_alloc(Manager::instance().page_size(), size);
+  if (ptr == nullptr) {
+    LEGRAD_LOG_ERR("Cannot allocate memory with size: {}", nbytes);
+    return core::Buffer();
+  }
+#endif
+
+  switch (policy_) {
+    case NumaPolicy::Interleave:
+      interleave(ptr, size);
+      break;
+    case NumaPolicy::Bind:
+      bind_to_node(ptr, size, node_);
+      break;
+    default:
+      break;
+  }
+
+  LEGRAD_LOG_TRACE("Allocate NUMA buffer with size {} ({})", nbytes,
+                   NumaPolicyToString(policy_));
+  auto* ctx = new NumaAllocator::Context{ptr, size, this};
+  return core::Buffer(ptr, ctx, NumaAllocator::deallocate);
+}
+
+void NumaAllocator::free(void* ctx)
+{
+  LEGRAD_CHECK_AND_THROW(ctx != nullptr, std::invalid_argument,
+                         "NumaAllocator::free called with nullptr", 0);
+  auto* numa_ctx = static_cast<NumaAllocator::Context*>(ctx);
+#ifdef __linux__
+  munmap(numa_ctx->ptr, numa_ctx->size);
+#else
+  std::free(numa_ctx->ptr);
+#endif
+  delete numa_ctx;
+}
+
+void NumaAllocator::deallocate(void* ctx)
+{
+  if (ctx == nullptr) {
+    return;
+  }
+  auto* numa_ctx = static_cast<NumaAllocator::Context*>(ctx);
+  if (numa_ctx->allocator == nullptr) {
+    delete numa_ctx;
+    LEGRAD_THROW_ERROR(std::runtime_error,
+                       "The context pointer has empty allocator", 0);
+  }
+  numa_ctx->allocator->free(numa_ctx);
+}
+
+void bind_to_node(void* ptr, size_t nbytes, int node)
+{
+#ifdef __linux__
+  if (Manager::instance().num_nodes() > 1) {
+    bind_pages(ptr, nbytes, MPOL_BIND, {node});
+  }
+#else
+  (void)ptr;
+  (void)nbytes;
+  (void)node;
+#endif
+}
+
+void interleave(void* ptr, size_t nbytes)
+{
+#ifdef __linux__
+  const Manager& mgr = Manager::instance();
+  if (mgr.num_nodes() > 1) {
+    bind_pages(ptr, nbytes, MPOL_INTERLEAVE, mgr.nodes());
+  }
+#else
+  (void)ptr;
+  (void)nbytes;
+#endif
+}
+
+void first_touch(void* ptr, size_t nbytes)
+{
+  char* bytes = static_cast<char*>(ptr);
+  // Whole pages per chunk, a page shared by two threads goes to either node
+  const Int grain = static_cast<Int>(16 * Manager::instance().page_size());
+  parallel_for(0, static_cast<Int>(nbytes), grain,
+               [&](Int begin, Int end)
+               { std::memset(bytes + begin, 0, end - begin); });
+}
+
+std::vector<Int> split_rows_by_node(void* ptr, Int rows, size_t row_bytes)
+{
+  const Manager& mgr = Manager::instance();
+  const Int num_nodes = static_cast<Int>(mgr.num_nodes());
+  if (num_nodes < 2 || rows == 0 || row_bytes == 0) {
+    return {0, rows};
+  }
+
+  const Int page = static_cast<Int>(mgr.page_size());
+  const Int base = static_cast<Int>(reinterpret_cast<uintptr_t>(ptr));
+  const Int size = rows * static_cast<Int>(row_bytes);
+  const Int stride = static_cast<Int>(row_bytes);
+  std::vector<Int> blocks = {0};
+  Int begin = 0;  // bytes from ptr
+  for (Int i = 1; i <= num_nodes; ++i) {
+    Int end = size;
+    if (i < num_nodes) {
+      // Nearest page boundary to an even split
+      const Int split = base + rows * i / num_nodes * stride;
+      end = std::clamp((split + page / 2) / page * page - base, begin, size);
+    }
+    blocks.push_back(i < num_nodes ? (end + stride / 2) / stride : rows);
+    bind_to_node(static_cast<char*>(ptr) + begin, end - begin,
+                 mgr.nodes()[i - 1]);
+    begin = end;
+  }
+  return blocks;
+}
+
+std::vector<Int> place_weights(void* ptr,
+                               Int rows,
+                               size_t row_bytes,
+                               WeightPlacement placement)
+{
+  switch (placement) {
+    case WeightPlacement::Interleave:
+      interleave(ptr, rows * row_bytes);
+      return {0, rows};
+    case WeightPlacement::SplitRows:
+      return split_rows_by_node(ptr, rows, row_bytes);
+    default:
+      return {0, rows};
+  }
+}
+
+WeightPlacement default_weight_placement()
+{
+  if (const char* env = std::getenv("LEGRAD_CPU_NUMA")) {
+    std::string name(env);
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    for (auto placement : WeightPlacementIter()) {
+      std::string placement_name = WeightPlacementToString(placement);
+      std::transform(placement_name.begin(), placement_name.end(),
+                     placement_name.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      if (placement_name == name) {
+        return placement;
+      }
+    }
+    LEGRAD_LOG_WARN("Unknown LEGRAD_CPU_NUMA value {}, ignore it", env);
+  }
+  return Manager::instance().num_nodes() > 1 ? WeightPlacement::Interleave
+                                             : WeightPlacement::Default;
+}
+}  // namespace legrad::cpu
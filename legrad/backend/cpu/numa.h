@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "core/allocator.h"
+#include "core/buffer.h"
+#include "internal/enum_impl.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+/*
+ * Where the pages of a buffer live on a NUMA machine:
+ * - FirstTouch: the default of the kernel, on the node of the thread that
+ *   writes a page first (see first_touch)
+ * - Interleave: round robin over the nodes page by page, half the reads are
+ *   remote on two sockets but every memory controller serves its share
+ * - Bind: on one node
+ * Policies only matter with several nodes, on one node every buffer is
+ * a plain page-aligned mapping.
+ */
+LEGRAD_ENUM(NumaPolicy,
+            uint8_t,
+            FirstTouch,
+            Bind,
+            FirstTouch,
+            Interleave,
+            Bind,
+            COUNT)
+
+/*
+ * How the weights are laid over the nodes once loaded:
+ * - Default: wherever the loader touched them (all on the node of the
+ *   loading thread most of the time)
+ * - Interleave: page by page over every node
+ * - SplitRows: the rows of each matrix in one block per node, so the
+ *   threads of a node read their rows locally (tensor parallelism per node)
+ */
+LEGRAD_ENUM(WeightPlacement,
+            uint8_t,
+            Default,
+            SplitRows,
+            Default,
+            Interleave,
+            SplitRows,
+            COUNT)
+
+/*
+ * Page-aligned buffers placed by a NumaPolicy (mbind on Linux, the policy is
+ * ignored elsewhere). Memory is mapped untouched: with FirstTouch the pages
+ * land where they are first written.
+ */
+class NumaAllocator : public core::Allocator
+{
+public:
+  struct Context
+  {
+    void* ptr;
+    size_t size;
+    NumaAllocator* allocator;
+  };
+
+  // `node` is only used by NumaPolicy::Bind
+  explicit NumaAllocator(NumaPolicy policy, int node = 0);
+  ~NumaAllocator() {}
+
+  NumaPolicy policy() const { return policy_; }
+  int node() const { return node_; }
+
+  core::Buffer malloc(size_t nbytes) override;
+  // Takes a Context and unmaps its pages
+  void free(void* ctx) override;
+
+  static void deallocate(void* ctx);
+
+private:
+  NumaPolicy policy_;
+  int node_;
+};
+
+/*
+ * Move the pages inside [ptr, ptr + nbytes) to `node`, or spread them over
+ * every node. Pages already touched are migrated. Placement is a hint: a
+ * failure (no permission, no NUMA support) is logged and ignored.
+ */
+void bind_to_node(void* ptr, size_t nbytes, int node);
+void interleave(void* ptr, size_t nbytes);
+
+/*
+ * Zero [ptr, ptr + nbytes) with parallel_for so every pool thread first
+ * touches its part: the pages of a chunk land on the node of its thread
+ */
+void first_touch(void* ptr, size_t nbytes);
+
+/*
+ * Place the `rows` rows (`row_bytes` each) of a matrix at `ptr` in one block
+ * per node, in the order of Manager::nodes(). Returns the first row of every
+ * block and `rows` last; boundaries are rounded to whole pages so a block can
+ * be a few rows off an even split.
+ */
+std::vector<Int> split_rows_by_node(void* ptr, Int rows, size_t row_bytes);
+
+/*
+ * Place a weight matrix after `placement`, see split_rows_by_node for the
+ * returned row blocks (a single block unless SplitRows)
+ */
+std::vector<Int> place_weights(void* ptr,
+                               Int rows,
+                               size_t row_bytes,
+                               WeightPlacement placement);
+
+/*
+ * From LEGRAD_CPU_NUMA (a WeightPlacement name, any case), Interleave when
+ * it is unset on a machine with several nodes and Default otherwise
+ */
+WeightPlacement default_weight_placement();
+}  // namespace legrad::cpu
@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "backend/cpu/thread_pool.h"
+#include "backend/cpu_mgr.h"
+#include "macros/log.h"
+#include "parallel.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+std::atomic<size_t> num_threads_{0};
+thread_local bool in_parallel_ = false;
+thread_local ThreadPool* guarded_pool_ = nullptr;
+
+std::mutex pool_mtx_;
+std::shared_ptr<ThreadPool> pool_;
+
+/*
+ * CPUs of the workers, none unless they can all have their own, and none
+ * with LEGRAD_CPU_PIN=0. The best CPU is left to the caller, which is never
+ * pinned.
+ */
+std::vector<int> worker_cpus(size_t num_workers)
+{
+  const char* env = std::getenv("LEGRAD_CPU_PIN");
+  if (env != nullptr && std::strcmp(env, "0") == 0) {
+    return {};
+  }
+  std::vector<int> cpus = Manager::instance().pinning(num_workers + 1);
+  if (cpus.size() <= num_workers) {
+    return {};
+  }
+  cpus.erase(cpus.begin());
+  return cpus;
+}
+
+/*
+ * The pool for `num_workers` workers, rebuilt when the number of threads
+ * changed. Callers hold a reference, an old pool ends with its last job.
+ */
+std::shared_ptr<ThreadPool> get_pool(size_t num_workers)
+{
+  std::lock_guard<std::mutex> lock(pool_mtx_);
+  if (!pool_ || pool_->num_workers() != num_workers) {
+    pool_.reset();
+    pool_ = std::make_shared<ThreadPool>(num_workers, worker_cpus(num_workers));
+  }
+  return pool_;
+}
+}  // namespace
+
+size_t get_num_threads()
+{
+  if (guarded_pool_ != nullptr) {
+    return guarded_pool_->num_workers() + 1;
+  }
+  size_t n = num_threads_.load(std::memory_order_relaxed);
+  if (n == 0) {
+    // SMT siblings and E-cores slow the other threads down more than they help
+    n = std::max<size_t>(1, Manager::instance().num_performance_cores());
+  }
+  return n;
+}
+
+void set_num_threads(size_t num_threads)
+{
+  LEGRAD_CHECK_AND_THROW(num_threads > 0, std::invalid_argument,
+                         "Number of threads must be positive", 0);
+  num_threads_.store(num_threads, std::memory_order_relaxed);
+}
+
+bool in_parallel_region()
+{
+  return in_parallel_;
+}
+
+ParallelRegionGuard::ParallelRegionGuard()
+    : prev_(in_parallel_)
+{
+  in_parallel_ = true;
+}
+
+ParallelRegionGuard::~ParallelRegionGuard()
+{
+  in_parallel_ = prev_;
+}
+
+ThreadPoolGuard::ThreadPoolGuard(ThreadPool* pool)
+    : prev_(guarded_pool_)
+{
+  guarded_pool_ = pool;
+}
+
+ThreadPoolGuard::~ThreadPoolGuard()
+{
+  guarded_pool_ = prev_;
+}
+
+void parallel_for(Int begin,
+                  Int end,
+                  Int grain_size,
+                  const std::function<void(Int, Int)>& fn)
+{
+  if (begin >= end) {
+    return;
+  }
+
+  const Int range = end - begin;
+  const Int max_tasks = static_cast<Int>(get_num_threads());
+  grain_size = std::max<Int>(grain_size, 1);
+
+  if (in_parallel_ || max_tasks == 1 || range <= grain_size) {
+    fn(begin, end);
+    return;
+  }
+
+  const Int num_tasks = std::min({max_tasks, ThreadPool::MAX_TASKS,
+                                  (range + grain_size - 1) / grain_size});
+  const Int chunk = (range + num_tasks - 1) / num_tasks;
+
+  std::exception_ptr eptr;
+  std::mutex eptr_mtx;
+  auto run_chunk = [&](Int task)
+  {
+    const Int chunk_begin = begin + task * chunk;
+    const Int chunk_end = std::min(end, chunk_begin + chunk);
+    if (chunk_begin >= chunk_end) {
+      return;
+    }
+    try {
+      ParallelRegionGuard guard;
+      fn(chunk_begin, chunk_end);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(eptr_mtx);
+      if (!eptr) {
+        eptr = std::current_exception();
+      }
+    }
+  };
+  if (guarded_pool_ != nullptr) {
+    guarded_pool_->run(num_tasks, run_chunk);
+  } else {
+    get_pool(max_tasks - 1)->run(num_tasks, run_chunk);
+  }
+
+  if (eptr) {
+    std::rethrow_exception(eptr);
+  }
+}
+}  // namespace legrad::cpu
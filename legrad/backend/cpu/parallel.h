@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+class ThreadPool;
+
+/*
+ * Minimum number of elements a task has to process before it is worth to
+ * split it across threads (same value as PyTorch's at::internal::GRAIN_SIZE)
+ */
+constexpr Int GRAIN_SIZE = 32768;
+
+/*
+ * Number of threads used by parallel_for (default: physical performance
+ * cores, see cpu::Manager), the ones of the pool of a ThreadPoolGuard on
+ * this thread if any
+ */
+size_t get_num_threads();
+void set_num_threads(size_t num_threads);
+
+// True if the caller is already running inside a parallel_for body
+bool in_parallel_region();
+
+/*
+ * Marks the calling thread as inside a parallel region for its scope:
+ * parallel_for bodies and scheduler tasks, their own parallel_for calls run
+ * serially. The flag is restored even if the body throws.
+ */
+class ParallelRegionGuard
+{
+public:
+  ParallelRegionGuard();
+  ~ParallelRegionGuard();
+
+  ParallelRegionGuard(const ParallelRegionGuard&) = delete;
+  ParallelRegionGuard& operator=(const ParallelRegionGuard&) = delete;
+
+private:
+  bool prev_;
+};
+
+/*
+ * parallel_for calls of the calling thread run on `pool` (its workers and
+ * the caller) for the scope of the guard, e.g. on the threads of one NUMA
+ * node
+ */
+class ThreadPoolGuard
+{
+public:
+  explicit ThreadPoolGuard(ThreadPool* pool);
+  ~ThreadPoolGuard();
+
+  ThreadPoolGuard(const ThreadPoolGuard&) = delete;
+  ThreadPoolGuard& operator=(const ThreadPoolGuard&) = delete;
+
+private:
+  ThreadPool* prev_;
+};
+
+/*
+ * Split [begin, end) into chunks of at least `grain_size` elements and run
+ * `fn(chunk_begin, chunk_end)` on each chunk in parallel, on a persistent
+ * ThreadPool of get_num_threads() - 1 workers (pinned after
+ * cpu::Manager::pinning unless LEGRAD_CPU_PIN=0) and the calling thread.
+ * Nested calls run serially.
+ * If any chunk throws, the first exception is rethrown after all chunks end.
+ */
+void parallel_for(Int begin,
+                  Int end,
+                  Int grain_size,
+                  const std::function<void(Int, Int)>& fn);
+}  // namespace legrad::cpu
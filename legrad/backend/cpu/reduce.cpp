@@ -0,0 +1,119 @@
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/reduce_kernel.h"
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "macros/log.h"
+#include "reduce.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<ReduceKernelFn> reduce_stub(REDUCE_KERNEL);
+
+// reduced[d] is true for every dim of `in` listed in `dims`
+std::vector<bool> reduced_dims(const core::TensorView& in, IntArrayView dims)
+{
+  std::vector<bool> reduced(in.dim(), dims.empty());
+  for (const Int d : dims) {
+    LEGRAD_CHECK_AND_THROW(
+        d >= 0 && d < static_cast<Int>(in.dim()) && !reduced[d],
+        std::invalid_argument, "Reduce dims {} are invalid for {} dims",
+        IntArrayView::numerical_view_2str(dims), in.dim());
+    reduced[d] = true;
+  }
+  return reduced;
+}
+}  // namespace
+
+void reduce(ReduceOp op,
+            const core::TensorView& out,
+            const core::TensorView& in,
+            IntArrayView dims)
+{
+  LEGRAD_CHECK_AND_THROW(
+      in.dtype == TypeInfo::Float32 || in.dtype == TypeInfo::Float16,
+      std::invalid_argument, "ReduceOp {} does not support {} input",
+      ReduceOpToString(op), core::TypeInfoToString(in.dtype));
+  if (op == ReduceOp::ArgMax) {
+    LEGRAD_CHECK_AND_THROW(out.dtype == TypeInfo::Int32,
+                           std::invalid_argument,
+                           "ArgMax expects an Int32 output, got {}",
+                           core::TypeInfoToString(out.dtype));
+  } else {
+    LEGRAD_CHECK_AND_THROW(
+        out.dtype == TypeInfo::Float32 || out.dtype == TypeInfo::Float16,
+        std::invalid_argument, "ReduceOp {} does not support {} output",
+        ReduceOpToString(op), core::TypeInfoToString(out.dtype));
+  }
+
+  // Split the dims of `in` into kept ones (shared with out) and reduced ones
+  const std::vector<bool> reduced = reduced_dims(in, dims);
+  const bool keep_dims = out.dim() == in.dim();
+  std::vector<Int> kept_shape, kept_in_stride, kept_out_stride;
+  std::vector<Int> reduced_shape, reduced_stride;
+  bool shape_ok = true;
+  size_t out_dim = 0;
+  for (size_t d = 0; d < in.dim(); ++d) {
+    if (reduced[d]) {
+      reduced_shape.push_back(in.shape_at(d));
+      reduced_stride.push_back(in.stride_at(d));
+      if (keep_dims) {
+        shape_ok = shape_ok && out.shape_at(out_dim++) == 1;
+      }
+      continue;
+    }
+    shape_ok = shape_ok && out_dim < out.dim()
+            && out.shape_at(out_dim) == in.shape_at(d);
+    if (shape_ok) {
+      kept_shape.push_back(in.shape_at(d));
+      kept_in_stride.push_back(in.stride_at(d));
+      kept_out_stride.push_back(out.stride_at(out_dim++));
+    }
+  }
+  LEGRAD_CHECK_AND_THROW(
+      shape_ok && out_dim == out.dim(), std::invalid_argument,
+      "ReduceOp {} of {} over dims {} cannot write out {}",
+      ReduceOpToString(op), IntArrayView::numerical_view_2str(in.shape()),
+      IntArrayView::numerical_view_2str(dims),
+      IntArrayView::numerical_view_2str(out.shape()));
+
+  ReduceArgs args;
+  args.count = 1;
+  for (const Int size : reduced_shape) {
+    args.count *= size;
+  }
+  LEGRAD_CHECK_AND_THROW(
+      args.count > 0 || op == ReduceOp::Sum || op == ReduceOp::Mean
+          || op == ReduceOp::SumSquares,
+      std::invalid_argument, "ReduceOp {} of an empty range",
+      ReduceOpToString(op));
+  LEGRAD_CHECK_AND_THROW(
+      op != ReduceOp::ArgMax || args.count <= INT32_MAX, std::invalid_argument,
+      "ArgMax over {} elements does not fit an Int32 index", args.count);
+  const core::TensorView out_kept(out.data, out.dtype, kept_shape,
+                                  kept_out_stride);
+  const core::TensorView in_kept(in.data, in.dtype, kept_shape,
+                                 kept_in_stride);
+  const core::TensorView in_reduced(in.data, in.dtype, reduced_shape,
+                                    reduced_stride);
+  args.outer = make_loop_plan<2>({&out_kept, &in_kept});
+  args.inner = make_loop_plan<1>({&in_reduced});
+  args.out_dtype = out.dtype;
+  if (args.outer.numel == 0) {
+    return;
+  }
+
+  LEGRAD_LOG_TRACE("ReduceOp {}: {} outputs of {} elements ({} / {} dims)",
+                   ReduceOpToString(op), args.outer.numel, args.count,
+                   args.outer.dim(), args.inner.dim());
+  launch(reduce_stub.get(in.dtype), op, args);
+}
+}  // namespace legrad::cpu
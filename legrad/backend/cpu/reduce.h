@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+
+#include "core/tensor_view.h"
+#include "internal/enum_impl.h"
+
+namespace legrad::cpu
+{
+LEGRAD_ENUM(ReduceOp,
+            uint8_t,
+            Sum,
+            ArgMax,
+            Sum,
+            Mean,
+            SumSquares,
+            Max,
+            Min,
+            ArgMax,
+            COUNT)
+
+/*
+ * out = op of `in` over the dims `dims` (all of them when empty), `in` can
+ * be any strided Float32 or Float16 view. `out` has the shape of `in` with
+ * the reduced dims either removed or kept with size 1, it is Float32 or
+ * Float16 (Int32 for ArgMax, the row-major index over the reduced dims of
+ * the first maximum).
+ * Everything is accumulated in float: sums are pairwise (blocks of vector
+ * partial sums added as a tree), so the error grows with log(n) instead of
+ * n, even for f16 inputs. Independent outputs are split across threads and
+ * long reductions (e.g. everything to a scalar) are split into fixed chunks,
+ * so the result does not depend on the number of threads.
+ */
+void reduce(ReduceOp op,
+            const core::TensorView& out,
+            const core::TensorView& in,
+            IntArrayView dims);
+
+inline void sum(const core::TensorView& out,
+                const core::TensorView& in,
+                IntArrayView dims)
+{
+  reduce(ReduceOp::Sum, out, in, dims);
+}
+
+inline void mean(const core::TensorView& out,
+                 const core::TensorView& in,
+                 IntArrayView dims)
+{
+  reduce(ReduceOp::Mean, out, in, dims);
+}
+
+// Sum of x^2 (norms, L2 losses)
+inline void sum_squares(const core::TensorView& out,
+                        const core::TensorView& in,
+                        IntArrayView dims)
+{
+  reduce(ReduceOp::SumSquares, out, in, dims);
+}
+
+inline void amax(const core::TensorView& out,
+                 const core::TensorView& in,
+                 IntArrayView dims)
+{
+  reduce(ReduceOp::Max, out, in, dims);
+}
+
+inline void amin(const core::TensorView& out,
+                 const core::TensorView& in,
+                 IntArrayView dims)
+{
+  reduce(ReduceOp::Min, out, in, dims);
+}
+
+// Greedy sampling: argmax(out, logits, {logits.dim() - 1})
+inline void argmax(const core::TensorView& out,
+                   const core::TensorView& in,
+                   IntArrayView dims)
+{
+  reduce(ReduceOp::ArgMax, out, in, dims);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,333 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/rope_kernel.h"
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "macros/log.h"
+#include "rope.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<RopeKernelFn> rope_stub(ROPE_KERNEL);
+
+// Architectures rotating the two halves of a head (LLAMA_ROPE_TYPE_NEOX)
+constexpr const char* NEOX_ARCHS[] = {
+    "gptneox", "falcon",   "phi2",       "phi3",      "qwen",
+    "qwen2",   "qwen2moe", "qwen3",      "qwen3moe",  "stablelm",
+    "gemma",   "gemma2",   "gemma3",     "olmo2",     "starcoder2",
+    "orion",   "exaone",   "codeshell",  "nomic-bert",
+};
+
+const gguf::gguf_kv* find_kv(const gguf::gguf_context& ctx,
+                             const std::string& key)
+{
+  for (const gguf::gguf_kv& kv : ctx.kv) {
+    if (kv.get_key() == key) {
+      return &kv;
+    }
+  }
+  return nullptr;
+}
+
+// Scalar numeric value of `key`, or `fallback` when the key is missing
+double get_number(const gguf::gguf_context& ctx,
+                  const std::string& key,
+                  double fallback)
+{
+  const gguf::gguf_kv* kv = find_kv(ctx, key);
+  if (!kv) {
+    return fallback;
+  }
+  LEGRAD_CHECK_AND_THROW(!kv->is_array, std::invalid_argument,
+                         "GGUF key {} is an array, expected a number", key);
+  switch (kv->get_type()) {
+    case gguf::GGUF_TYPE_UINT8:
+      return kv->get_val<uint8_t>();
+    case gguf::GGUF_TYPE_INT8:
+      return kv->get_val<int8_t>();
+    case gguf::GGUF_TYPE_UINT16:
+      return kv->get_val<uint16_t>();
+    case gguf::GGUF_TYPE_INT16:
+      return kv->get_val<int16_t>();
+    case gguf::GGUF_TYPE_UINT32:
+      return kv->get_val<uint32_t>();
+    case gguf::GGUF_TYPE_INT32:
+      return kv->get_val<int32_t>();
+    case gguf::GGUF_TYPE_UINT64:
+      return static_cast<double>(kv->get_val<uint64_t>());
+    case gguf::GGUF_TYPE_INT64:
+      return static_cast<double>(kv->get_val<int64_t>());
+    case gguf::GGUF_TYPE_FLOAT32:
+      return kv->get_val<float>();
+    case gguf::GGUF_TYPE_FLOAT64:
+      return kv->get_val<double>();
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument,
+                         "GGUF key {} is a {}, expected a number", key,
+                         gguf::GGUF_TYPE_NAME.at(kv->get_type()));
+  }
+}
+
+RopeScaling parse_scaling(const std::string& name)
+{
+  if (name == "none") {
+    return RopeScaling::None;
+  } else if (name == "linear") {
+    return RopeScaling::Linear;
+  } else if (name == "ntk") {
+    return RopeScaling::NTK;
+  } else if (name == "yarn") {
+    return RopeScaling::YaRN;
+  }
+  LEGRAD_THROW_ERROR(std::invalid_argument, "Unknown RoPE scaling type {}",
+                     name);
+}
+
+/*
+ * Dims below `low` rotate fast enough to see the whole training context many
+ * times and keep their frequency, dims above `high` are interpolated, see
+ * ggml_rope_yarn_corr_dims
+ */
+double yarn_corr_dim(Int dim, Int original_context, float beta, double base)
+{
+  return dim * std::log(original_context / (beta * 2.0 * M_PI))
+         / (2.0 * std::log(base));
+}
+
+// Weight of the extrapolated (unscaled) angle of pair `i`
+double yarn_ramp(double low, double high, Int i)
+{
+  const double y = (i - low) / std::max(0.001, high - low);
+  return 1.0 - std::clamp(y, 0.0, 1.0);
+}
+}  // namespace
+
+RopeConfig rope_config_from_gguf(const gguf::gguf_context& ctx,
+                                 const std::string& arch)
+{
+  const std::string prefix = arch + ".";
+  RopeConfig config;
+
+  const double head_count = get_number(ctx, prefix + "attention.head_count", 0);
+  const double head_dim =
+      head_count > 0
+          ? get_number(ctx, prefix + "embedding_length", 0) / head_count
+          : 0;
+  config.dim = static_cast<Int>(
+      get_number(ctx, prefix + "rope.dimension_count", head_dim));
+  LEGRAD_CHECK_AND_THROW(config.dim > 0, std::invalid_argument,
+                         "GGUF has no RoPE dimension for {}", arch);
+  config.freq_base = static_cast<float>(
+      get_number(ctx, prefix + "rope.freq_base", config.freq_base));
+
+  config.layout = RopeLayout::Normal;
+  for (const char* neox : NEOX_ARCHS) {
+    if (arch == neox) {
+      config.layout = RopeLayout::NeoX;
+    }
+  }
+
+  // Older files only have rope.scale_linear
+  const double scale_linear = get_number(ctx, prefix + "rope.scale_linear", 0);
+  if (scale_linear > 0) {
+    config.scaling = RopeScaling::Linear;
+    config.factor = static_cast<float>(scale_linear);
+  }
+  if (const gguf::gguf_kv* type = find_kv(ctx, prefix + "rope.scaling.type")) {
+    LEGRAD_CHECK_AND_THROW(
+        type->get_type() == gguf::GGUF_TYPE_STRING && !type->is_array,
+        std::invalid_argument, "GGUF key {}rope.scaling.type is not a string",
+        prefix);
+    config.scaling = parse_scaling(type->get_val<std::string>());
+  }
+  config.factor = static_cast<float>(
+      get_number(ctx, prefix + "rope.scaling.factor", config.factor));
+  if (config.scaling == RopeScaling::None || config.factor <= 0) {
+    config.factor = 1.0f;
+  }
+
+  config.original_context = static_cast<Int>(
+      get_number(ctx, prefix + "rope.scaling.original_context_length",
+                 get_number(ctx, prefix + "context_length", 0)));
+  config.attn_factor = static_cast<float>(get_number(
+      ctx, prefix + "rope.scaling.attn_factor", config.attn_factor));
+  config.beta_fast = static_cast<float>(get_number(
+      ctx, prefix + "rope.scaling.yarn_beta_fast", config.beta_fast));
+  config.beta_slow = static_cast<float>(get_number(
+      ctx, prefix + "rope.scaling.yarn_beta_slow", config.beta_slow));
+
+  LEGRAD_LOG_DEBUG("RoPE {}: dim {}, base {}, {} layout, {} scaling x{}", arch,
+                   config.dim, config.freq_base,
+                   RopeLayoutToString(config.layout),
+                   RopeScalingToString(config.scaling), config.factor);
+  return config;
+}
+
+RopeCache::RopeCache(const RopeConfig& config, Int max_positions)
+    : config_(config)
+    , max_positions_(max_positions)
+{
+  const Int dim = config.dim;
+  LEGRAD_CHECK_AND_THROW(dim > 0 && dim % 2 == 0, std::invalid_argument,
+                         "RoPE dim must be positive and even, got {}", dim);
+  LEGRAD_CHECK_AND_THROW(max_positions >= 0, std::invalid_argument,
+                         "RoPE cache needs a positive size, got {}",
+                         max_positions);
+
+  double base = config.freq_base;
+  double freq_scale = 1.0;
+  double mscale = 1.0;
+  bool yarn = false;
+  switch (config.scaling) {
+    case RopeScaling::None:
+      break;
+    case RopeScaling::Linear:
+      freq_scale = 1.0 / config.factor;
+      break;
+    case RopeScaling::NTK:
+      base *= std::pow(static_cast<double>(config.factor),
+                       static_cast<double>(dim) / (dim - 2));
+      break;
+    case RopeScaling::YaRN:
+      freq_scale = 1.0 / config.factor;
+      mscale = config.attn_factor * (1.0 + 0.1 * std::log(config.factor));
+      yarn = true;
+      break;
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument, "Unknown RoPE scaling {}",
+                         static_cast<int>(config.scaling));
+  }
+
+  // Angle multiplier and extrapolation weight of every pair
+  const Int pairs = dim / 2;
+  std::vector<double> theta(pairs), ramp(pairs, 0.0);
+  for (Int i = 0; i < pairs; ++i) {
+    theta[i] = std::pow(base, -2.0 * i / dim);
+  }
+  if (yarn) {
+    const Int original_context =
+        config.original_context > 0 ? config.original_context : max_positions;
+    LEGRAD_CHECK_AND_THROW(original_context > 0, std::invalid_argument,
+                           "YaRN needs the original context length", 0);
+    const double low = std::max(
+        0.0, std::floor(yarn_corr_dim(dim, original_context, config.beta_fast,
+                                      base)));
+    const double high = std::min<double>(
+        dim - 1, std::ceil(yarn_corr_dim(dim, original_context,
+                                         config.beta_slow, base)));
+    for (Int i = 0; i < pairs; ++i) {
+      ramp[i] = yarn_ramp(low, high, i);
+    }
+  }
+
+  const bool neox = config.layout == RopeLayout::NeoX;
+  table_.resize(max_positions * 2 * dim);
+  for (Int pos = 0; pos < max_positions; ++pos) {
+    float* cos = table_.data() + pos * 2 * dim;
+    float* sin = cos + dim;
+    for (Int i = 0; i < pairs; ++i) {
+      const double extrap = pos * theta[i];
+      const double angle =
+          extrap * freq_scale * (1.0 - ramp[i]) + extrap * ramp[i];
+      const float c = static_cast<float>(std::cos(angle) * mscale);
+      const float s = static_cast<float>(std::sin(angle) * mscale);
+      // First element of the pair gets -sin, the second +sin
+      const Int a = neox ? i : 2 * i;
+      const Int b = neox ? i + pairs : 2 * i + 1;
+      cos[a] = c;
+      cos[b] = c;
+      sin[a] = -s;
+      sin[b] = s;
+    }
+  }
+  LEGRAD_LOG_DEBUG("RoPE cache: {} positions of {} dims, {} KiB",
+                   max_positions, dim, table_.size() * sizeof(float) / 1024);
+}
+
+void rope(const core::TensorView& x,
+          const core::TensorView& positions,
+          size_t pos_dim,
+          const RopeCache& cache)
+{
+  const RopeConfig& config = cache.config();
+  LEGRAD_CHECK_AND_THROW(
+      x.dtype == TypeInfo::Float32 || x.dtype == TypeInfo::Float16,
+      std::invalid_argument, "RoPE does not support {} tensors",
+      core::TypeInfoToString(x.dtype));
+  LEGRAD_CHECK_AND_THROW(x.dim() >= 2 && pos_dim < x.dim() - 1,
+                         std::invalid_argument,
+                         "RoPE position dim {} is not a leading dim of {}",
+                         pos_dim, IntArrayView::numerical_view_2str(x.shape()));
+  const size_t last = x.dim() - 1;
+  LEGRAD_CHECK_AND_THROW(x.shape_at(last) >= config.dim, std::invalid_argument,
+                         "RoPE rotates {} dims but heads have {}", config.dim,
+                         x.shape_at(last));
+  LEGRAD_CHECK_AND_THROW(
+      positions.dim() == 1 && positions.shape_at(0) == x.shape_at(pos_dim)
+          && positions.dtype == TypeInfo::Int32,
+      std::invalid_argument, "RoPE expects Int32 positions [{}], got {} {}",
+      x.shape_at(pos_dim), core::TypeInfoToString(positions.dtype),
+      IntArrayView::numerical_view_2str(positions.shape()));
+
+  // Out of range positions would read past the table
+  for (Int i = 0; i < positions.shape_at(0); ++i) {
+    const Int pos =
+        static_cast<const int32_t*>(positions.data)[i * positions.stride_at(0)];
+    LEGRAD_CHECK_AND_THROW(pos >= 0 && pos < cache.max_positions(),
+                           std::out_of_range,
+                           "RoPE position {} is outside of the {} cached ones",
+                           pos, cache.max_positions());
+  }
+  if (x.numel() == 0) {
+    return;
+  }
+
+  RopeArgs args;
+  args.head_dim = x.shape_at(last);
+  args.x_stride = x.stride_at(last);
+  args.dim = config.dim;
+  args.neox = config.layout == RopeLayout::NeoX;
+  args.table = cache.table();
+
+  // One element per head, positions repeat over every dim but pos_dim
+  const core::TensorView x_rows(x.data, x.dtype, x.shape().slice(0, last),
+                                x.stride().slice(0, last));
+  std::vector<Int> pos_stride(last, 0);
+  pos_stride[pos_dim] = positions.stride_at(0);
+  const core::TensorView pos_rows(positions.data, positions.dtype,
+                                  x.shape().slice(0, last), pos_stride);
+  const LoopPlan<2> rows = make_loop_plan<2>({&x_rows, &pos_rows});
+  LEGRAD_LOG_TRACE("RoPE {} heads of {}, {} rotated", rows.numel,
+                   args.head_dim, args.dim);
+  launch(rope_stub.get(x.dtype), rows, args);
+}
+
+void rope(const core::TensorView& x,
+          Int start_pos,
+          size_t pos_dim,
+          const RopeCache& cache)
+{
+  LEGRAD_CHECK_AND_THROW(pos_dim < x.dim(), std::invalid_argument,
+                         "RoPE position dim {} is out of range for {} dims",
+                         pos_dim, x.dim());
+  std::vector<int32_t> positions(x.shape_at(pos_dim));
+  for (size_t i = 0; i < positions.size(); ++i) {
+    positions[i] = static_cast<int32_t>(start_pos + static_cast<Int>(i));
+  }
+  rope(x,
+       core::TensorView(capture_scratch(positions), TypeInfo::Int32,
+                        {static_cast<Int>(positions.size())}),
+       pos_dim, cache);
+}
+}  // namespace legrad::cpu
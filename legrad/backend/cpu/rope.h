@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "core/tensor_view.h"
+#include "internal/enum_impl.h"
+#include "utils/gguf/gguf_file.h"
+
+namespace legrad::cpu
+{
+/*
+ * Which elements of a head are rotated together:
+ * - Normal (LLaMA): adjacent pairs (x[2i], x[2i + 1])
+ * - NeoX (GPT-NeoX, Qwen, Phi, ...): the two halves (x[i], x[i + dim / 2])
+ */
+LEGRAD_ENUM(RopeLayout, uint8_t, Normal, NeoX, Normal, NeoX, COUNT)
+
+/*
+ * Context extension of the rotation frequencies, same math as ggml:
+ * - Linear: positions are divided by `factor` (position interpolation)
+ * - NTK: the base is stretched to base * factor^(dim / (dim - 2))
+ * - YaRN: interpolate the low frequencies, keep the high ones, ramp in
+ *   between, and scale the result by the attention factor
+ */
+LEGRAD_ENUM(RopeScaling, uint8_t, None, YaRN, None, Linear, NTK, YaRN, COUNT)
+
+struct RopeConfig
+{
+  Int dim = 0;  // rotated elements of a head, the rest is left as is
+  float freq_base = 10000.0f;
+  RopeLayout layout = RopeLayout::Normal;
+  RopeScaling scaling = RopeScaling::None;
+  float factor = 1.0f;
+  Int original_context = 0;  // training context, YaRN only
+  float attn_factor = 1.0f;
+  float beta_fast = 32.0f;
+  float beta_slow = 1.0f;
+};
+
+/*
+ * RoPE parameters of an `arch` model (the general.architecture value) from
+ * the `{arch}.rope.*` GGUF keys. "ntk" is accepted as rope.scaling.type even
+ * though llama.cpp has no such value, models using it ship the stretched base
+ * in rope.freq_base instead.
+ */
+RopeConfig rope_config_from_gguf(const gguf::gguf_context& ctx,
+                                 const std::string& arch);
+
+/*
+ * cos/sin of every (position, frequency) pair up to `max_positions`, computed
+ * once per model instead of per element per token. Rows are already laid out
+ * for `config.layout` so the kernel is a plain
+ *   y = x * cos + partner(x) * sin
+ * with the sign of the rotation folded into sin.
+ */
+class RopeCache
+{
+public:
+  RopeCache(const RopeConfig& config, Int max_positions);
+
+  const RopeConfig& config() const { return config_; }
+  Int max_positions() const { return max_positions_; }
+
+  // [max_positions, 2 * dim]: cos of the dim elements, then their sin
+  const float* table() const { return table_.data(); }
+
+private:
+  RopeConfig config_;
+  Int max_positions_;
+  std::vector<float> table_;
+};
+
+/*
+ * Rotate `x` (Q or K, Float32 or Float16, any strides) in place. The last dim
+ * is the head, only its first cache.config().dim elements are rotated.
+ * `positions` is a 1-D Int32 view indexing dim `pos_dim` of x (the
+ * tokens), every other dim (batch, heads) shares it.
+ */
+void rope(const core::TensorView& x,
+          const core::TensorView& positions,
+          size_t pos_dim,
+          const RopeCache& cache);
+
+// Tokens of dim `pos_dim` are at positions start_pos, start_pos + 1, ...
+void rope(const core::TensorView& x,
+          Int start_pos,
+          size_t pos_dim,
+          const RopeCache& cache);
+}  // namespace legrad::cpu
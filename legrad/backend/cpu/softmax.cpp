@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "backend/cpu/capture.h"
+#include "backend/cpu/kernels/softmax_kernel.h"
+#include "backend/cpu/loops.h"
+#include "core/dtype.h"
+#include "core/kernel_registry.h"
+#include "macros/log.h"
+#include "softmax.h"
+
+namespace legrad::cpu
+{
+using core::TypeInfo;
+
+namespace
+{
+core::KernelStub<SoftmaxKernelFn> softmax_stub(SOFTMAX_KERNEL);
+
+void check_operand(const core::TensorView& view,
+                   const core::TensorView& in,
+                   const char* name)
+{
+  LEGRAD_CHECK_AND_THROW(
+      view.dtype == TypeInfo::Float32 || view.dtype == TypeInfo::Float16,
+      std::invalid_argument, "Softmax does not support {} {}",
+      core::TypeInfoToString(view.dtype), name);
+  LEGRAD_CHECK_AND_THROW(view.shape() == in.shape(), std::invalid_argument,
+                         "Softmax {} has shape {}, expected {}", name,
+                         IntArrayView::numerical_view_2str(view.shape()),
+                         IntArrayView::numerical_view_2str(in.shape()));
+}
+
+/*
+ * `limits` holds the unmasked columns of every query (dim -2) when causal,
+ * otherwise a single value for every row
+ */
+void run_softmax(const core::TensorView& out,
+                 const core::TensorView& in,
+                 float scale,
+                 std::vector<int32_t>& limits,
+                 bool causal)
+{
+  const size_t last = in.dim() - 1;
+  SoftmaxArgs args;
+  args.cols = in.shape_at(last);
+  args.out_dtype = out.dtype;
+  args.out_stride = out.stride_at(last);
+  args.in_dtype = in.dtype;
+  args.in_stride = in.stride_at(last);
+  args.scale = scale;
+  if (in.numel() == 0) {
+    return;
+  }
+
+  const core::TensorView out_rows(out.data, out.dtype,
+                                  out.shape().slice(0, last),
+                                  out.stride().slice(0, last));
+  const core::TensorView in_rows(in.data, in.dtype, in.shape().slice(0, last),
+                                 in.stride().slice(0, last));
+  std::vector<Int> limit_stride(last, 0);
+  if (causal) {
+    limit_stride[last - 1] = 1;
+  }
+  const core::TensorView limit_rows(capture_scratch(limits), TypeInfo::Int32,
+                                    in.shape().slice(0, last), limit_stride);
+  const LoopPlan<3> rows =
+      make_loop_plan<3>({&out_rows, &in_rows, &limit_rows});
+  LEGRAD_LOG_TRACE("Softmax {} rows of {}{}", rows.numel, args.cols,
+                   causal ? " causal" : "");
+  launch(softmax_stub.get(in.dtype), rows, args);
+}
+}  // namespace
+
+void softmax(const core::TensorView& out,
+             const core::TensorView& in,
+             float scale)
+{
+  LEGRAD_CHECK_AND_THROW(in.dim() >= 1, std::invalid_argument,
+                         "Softmax expects at least 1 dim, got a scalar", 0);
+  check_operand(in, in, "in");
+  check_operand(out, in, "out");
+  std::vector<int32_t> limits = {
+      static_cast<int32_t>(in.shape_at(in.dim() - 1))};
+  run_softmax(out, in, scale, limits, false);
+}
+
+void causal_softmax(const core::TensorView& out,
+                    const core::TensorView& in,
+                    float scale,
+                    Int offset)
+{
+  LEGRAD_CHECK_AND_THROW(in.dim() >= 2, std::invalid_argument,
+                         "Causal softmax expects [..., q, kv] scores, got {}",
+                         IntArrayView::numerical_view_2str(in.shape()));
+  check_operand(in, in, "in");
+  check_operand(out, in, "out");
+
+  const size_t q_dim = in.dim() - 2;
+  const Int kv = in.shape_at(in.dim() - 1);
+  std::vector<int32_t> limits(in.shape_at(q_dim));
+  for (size_t i = 0; i < limits.size(); ++i) {
+    limits[i] = static_cast<int32_t>(
+        std::clamp<Int>(static_cast<Int>(i) + offset + 1, 0, kv));
+  }
+  run_softmax(out, in, scale, limits, true);
+}
+}  // namespace legrad::cpu
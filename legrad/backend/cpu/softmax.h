@@ -0,0 +1,27 @@
+#pragma once
+
+#include "core/tensor_view.h"
+
+namespace legrad::cpu
+{
+/*
+ * out = softmax(in * scale) over the last dim. Float32 or Float16 operands
+ * (the math is in float) with any strides, out may alias in.
+ * Rows are read once to get their max and sum together (online softmax) and
+ * once more to write the result, a single row as long as a vocabulary is
+ * also split across threads.
+ */
+void softmax(const core::TensorView& out,
+             const core::TensorView& in,
+             float scale = 1.0f);
+
+/*
+ * Causal softmax of attention scores [..., q, kv]: query i only sees the keys
+ * up to i + offset (offset = kv - q when the queries are the last q tokens of
+ * the sequence), the masked keys are written as 0 without being read.
+ */
+void causal_softmax(const core::TensorView& out,
+                    const core::TensorView& in,
+                    float scale,
+                    Int offset);
+}  // namespace legrad::cpu
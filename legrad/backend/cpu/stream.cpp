@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "backend/cpu/parallel.h"
+#include "backend/cpu/thread_pool.h"
+#include "macros/log.h"
+#include "stream.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+/*
+ * Polls before the queue thread (no work) or the host (work not done yet)
+ * sleeps, the same order of magnitude as the pool: a layer enqueued right
+ * after the previous one, or a short op waited on, never pays for a wakeup
+ */
+constexpr int STREAM_SPIN = 1 << 12;
+
+class CpuEvent : public core::Event
+{
+public:
+  CpuEvent(std::shared_ptr<CpuStream::State> state, uint32_t seq)
+      : state_(std::move(state))
+      , seq_(seq)
+  {
+  }
+
+  bool query() const override { return state_->done(seq_); }
+
+  void synchronize() const override
+  {
+    state_->wait_done(seq_);
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    // Only the items from the failed one on are affected
+    const std::exception_ptr error = state_->error;
+    if (error != nullptr
+        && static_cast<int32_t>(seq_ - state_->error_seq) >= 0) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  std::shared_ptr<CpuStream::State> state_;
+  uint32_t seq_;
+};
+}  // namespace
+
+void CpuStream::State::wait_done(uint32_t seq)
+{
+  while (true) {
+    const uint32_t seen = completed.load();
+    if (done(seq)) {
+      break;
+    }
+    completed.wait(seen, spins);
+  }
+}
+
+CpuStream::CpuStream(ThreadPool* pool)
+    : state_(std::make_shared<State>())
+{
+  const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+  const size_t pool_threads =
+      pool != nullptr ? pool->num_workers() + 1 : get_num_threads();
+  // The queue thread is the caller of the pool, the host is one more thread
+  state_->spins = pool_threads < hardware ? STREAM_SPIN : 0;
+  thread_ = std::thread([this, pool] { queue_loop(pool); });
+}
+
+CpuStream::~CpuStream()
+{
+  {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    state_->stop = true;
+  }
+  state_->submitted.bump();
+  thread_.join();
+
+  if (state_->error != nullptr) {
+    try {
+      std::rethrow_exception(state_->error);
+    } catch (const std::exception& e) {
+      LEGRAD_LOG_ERR("CpuStream destroyed with an error: {}", e.what());
+    } catch (...) {
+      LEGRAD_LOG_ERR("CpuStream destroyed with an unknown error", 0);
+    }
+  }
+}
+
+void CpuStream::enqueue(std::function<void()> work)
+{
+  LEGRAD_CHECK_AND_THROW(work != nullptr, std::invalid_argument,
+                         "Cannot enqueue empty work", 0);
+  {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    state_->queue.push_back(std::move(work));
+    ++state_->enqueued;
+  }
+  state_->submitted.bump();
+}
+
+std::shared_ptr<core::Event> CpuStream::record()
+{
+  std::lock_guard<std::mutex> lock(state_->mtx);
+  return std::make_shared<CpuEvent>(state_, state_->enqueued);
+}
+
+void CpuStream::wait(std::shared_ptr<core::Event> event)
+{
+  LEGRAD_CHECK_AND_THROW(event != nullptr, std::invalid_argument,
+                         "Cannot wait on a null event", 0);
+  // An event of this stream is already complete when the item runs
+  enqueue([event] { event->synchronize(); });
+}
+
+void CpuStream::synchronize()
+{
+  LEGRAD_CHECK_AND_THROW(std::this_thread::get_id() != thread_.get_id(),
+                         std::logic_error,
+                         "Work of a stream cannot synchronize it", 0);
+  uint32_t seq = 0;
+  {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    seq = state_->enqueued;
+  }
+  state_->wait_done(seq);
+
+  std::exception_ptr error;
+  {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    std::swap(error, state_->error);
+  }
+  if (error != nullptr) {
+    std::rethrow_exception(error);
+  }
+}
+
+void CpuStream::queue_loop(ThreadPool* pool)
+{
+  ThreadPoolGuard guard(pool);
+  State& state = *state_;
+  while (true) {
+    const uint32_t seen = state.submitted.load();
+    std::function<void()> work;
+    bool skip = false;
+    {
+      std::lock_guard<std::mutex> lock(state.mtx);
+      if (state.queue.empty() && state.stop) {
+        return;
+      }
+      if (!state.queue.empty()) {
+        work = std::move(state.queue.front());
+        state.queue.pop_front();
+        skip = state.error != nullptr;
+      }
+    }
+    if (!work) {
+      state.submitted.wait(seen, state.spins);
+      continue;
+    }
+
+    // Skipped: it most likely reads what the failed item did not write
+    if (!skip) {
+      try {
+        work();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(state.mtx);
+        state.error = std::current_exception();
+        state.error_seq = state.completed.load() + 1;
+      }
+    }
+    // Drop the captures of the item before it is seen as done
+    work = nullptr;
+    state.completed.bump();
+  }
+}
+}  // namespace legrad::cpu
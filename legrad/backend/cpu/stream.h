@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "backend/cpu/sync.h"
+#include "core/stream.h"
+
+namespace legrad::cpu
+{
+class ThreadPool;
+
+/*
+ * A stream whose work runs in order on a dedicated queue thread, the
+ * parallel_for calls of the work go to `pool` (the default pool when it is
+ * nullptr) with the queue thread as their caller. The host enqueues a whole
+ * layer (or a CapturedKernels replay) and only waits on the event of the
+ * last op it needs.
+ * The queue thread and the host poll for a while before they sleep (like
+ * the pool workers) when there is a CPU left for them.
+ */
+class CpuStream : public core::Stream
+{
+public:
+  explicit CpuStream(ThreadPool* pool = nullptr);
+  // Runs the work still queued, an error left is logged
+  ~CpuStream() override;
+
+  CpuStream(const CpuStream&) = delete;
+  CpuStream& operator=(const CpuStream&) = delete;
+
+  core::Backend backend() const override { return core::Backend::CPU; }
+
+  void enqueue(std::function<void()> work) override;
+  std::shared_ptr<core::Event> record() override;
+  void wait(std::shared_ptr<core::Event> event) override;
+  void synchronize() override;
+
+  /*
+   * Shared with the events, which outlive the stream. Work items are
+   * numbered from 1 in enqueue order, item `seq` is done once `completed`
+   * reached it.
+   */
+  struct State
+  {
+    std::mutex mtx;
+    std::deque<std::function<void()>> queue;
+    uint32_t enqueued = 0;
+    bool stop = false;
+    std::exception_ptr error;
+    uint32_t error_seq = 0;  // item that threw `error`
+
+    WaitCounter submitted;  // bumped by enqueue and stop
+    WaitCounter completed;
+    int spins = 0;
+
+    bool done(uint32_t seq) const
+    {
+      // Wraps around after 2^32 items, they are never that far apart
+      return static_cast<int32_t>(completed.load() - seq) >= 0;
+    }
+
+    // Block until item `seq` is done
+    void wait_done(uint32_t seq);
+  };
+
+private:
+  void queue_loop(ThreadPool* pool);
+
+  std::shared_ptr<State> state_;
+  std::thread thread_;
+};
+}  // namespace legrad::cpu
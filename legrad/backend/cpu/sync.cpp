@@ -0,0 +1,83 @@
+#include <climits>
+#include <cstdint>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "sync.h"
+
+namespace legrad::cpu
+{
+uint32_t WaitCounter::bump()
+{
+  /*
+   * value_ and sleepers_ are both seq_cst: either this sees the sleeper and
+   * wakes it, or the sleeper sees the new value before it sleeps
+   */
+  const uint32_t value = value_.fetch_add(1) + 1;
+  if (sleepers_.load() != 0) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value_),
+            FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+    std::lock_guard<std::mutex> lock(mtx_);
+    cv_.notify_all();
+#endif
+  }
+  return value;
+}
+
+void WaitCounter::wait(uint32_t seen, int spins)
+{
+  for (int i = 0; i < spins; ++i) {
+    if (value_.load(std::memory_order_acquire) != seen) {
+      return;
+    }
+    cpu_relax();
+  }
+  sleepers_.fetch_add(1);
+#ifdef __linux__
+  while (value_.load() == seen) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&value_),
+            FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0);
+  }
+#else
+  {
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [&] { return value_.load() != seen; });
+  }
+#endif
+  sleepers_.fetch_sub(1);
+}
+
+bool Barrier::arrive_and_wait(int spins)
+{
+  // Read before arriving: the last thread may bump it right after
+  const uint32_t generation = generation_.load();
+  if (broken_.load()) {
+    return false;
+  }
+  if (arrived_.fetch_add(1) + 1 == num_threads_) {
+    arrived_.store(0);
+    generation_.bump();
+  } else {
+    generation_.wait(generation, spins);
+  }
+  return !broken_.load();
+}
+
+void Barrier::abort()
+{
+  broken_.store(true);
+  generation_.bump();
+}
+
+void Barrier::reset()
+{
+  arrived_.store(0);
+  broken_.store(false);
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "macros/expr.h"
+
+namespace legrad::cpu
+{
+// Hint for a spin-wait loop (pause / yield instruction)
+LEGRAD_INLINE void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+/*
+ * A counter threads can wait on until it changes: they poll it for a while,
+ * then sleep on a futex (a condition variable outside of Linux). Waiters read
+ * the counter before they look for work, and wait on that value: a bump in
+ * between (new work) makes the wait return at once, no wakeup is lost.
+ */
+class WaitCounter
+{
+public:
+  uint32_t load() const { return value_.load(std::memory_order_acquire); }
+
+  // Increment the counter and wake the sleeping threads, returns the new value
+  uint32_t bump();
+
+  // Poll up to `spins` times, then sleep until the counter is not `seen`
+  void wait(uint32_t seen, int spins);
+
+private:
+  std::atomic<uint32_t> value_{0};
+  std::atomic<uint32_t> sleepers_{0};
+#ifndef __linux__
+  std::mutex mtx_;
+  std::condition_variable cv_;
+#endif
+};
+
+/*
+ * Reusable barrier for a fixed number of threads: the last one to arrive
+ * bumps the generation the others wait on. abort() releases the waiters of
+ * a group that will never be complete (a thread failed), arrive_and_wait()
+ * then returns false until reset().
+ */
+class Barrier
+{
+public:
+  explicit Barrier(int num_threads)
+      : num_threads_(num_threads)
+  {
+  }
+
+  bool arrive_and_wait(int spins);
+  void abort();
+  // Only when no thread is in the barrier
+  void reset();
+
+private:
+  const int num_threads_;
+  std::atomic<int> arrived_{0};
+  std::atomic<bool> broken_{false};
+  WaitCounter generation_;
+};
+}  // namespace legrad::cpu
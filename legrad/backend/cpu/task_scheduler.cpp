@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+#include "backend/cpu/parallel.h"
+#include "macros/log.h"
+#include "task_scheduler.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+// Blocks up to 2^TASK_CACHE_CLASSES * 64 bytes are cached
+constexpr size_t TASK_CACHE_MIN_BYTES = 64;
+constexpr size_t TASK_CACHE_CLASSES = 15;
+constexpr size_t TASK_CACHE_MAX_BYTES = TASK_CACHE_MIN_BYTES
+                                     << (TASK_CACHE_CLASSES - 1);
+// Bytes a single cache keeps at most, the rest goes back upstream
+constexpr size_t TASK_CACHE_BYTES = size_t(8) << 20;
+
+/*
+ * Polls for new tasks before a worker sleeps, shorter than the ThreadPool:
+ * tasks come in bursts (a layer, a batch of sequences)
+ */
+constexpr int SCHEDULER_SPIN = 1 << 10;
+
+// Scheduler and index of the worker running on this thread
+thread_local const TaskScheduler* current_scheduler_ = nullptr;
+thread_local int current_worker_ = -1;
+
+size_t size_class(size_t nbytes)
+{
+  size_t cls = 0;
+  while ((TASK_CACHE_MIN_BYTES << cls) < nbytes) {
+    ++cls;
+  }
+  return cls;
+}
+}  // namespace
+
+TaskAllocator::TaskAllocator(core::Allocator* upstream,
+                             const TaskScheduler* scheduler,
+                             size_t num_workers)
+    : upstream_(upstream)
+    , scheduler_(scheduler)
+    , caches_(num_workers + 1)
+{
+  for (Cache& cache : caches_) {
+    cache.blocks.resize(TASK_CACHE_CLASSES);
+  }
+}
+
+TaskAllocator::~TaskAllocator()
+{
+  for (Cache& cache : caches_) {
+    for (std::vector<Context*>& blocks : cache.blocks) {
+      for (Context* ctx : blocks) {
+        delete ctx;
+      }
+    }
+  }
+}
+
+TaskAllocator::Cache& TaskAllocator::cache(std::unique_lock<std::mutex>& lock)
+{
+  const int worker = scheduler_->worker_index();
+  if (worker >= 0) {
+    return caches_[worker];
+  }
+  lock = std::unique_lock<std::mutex>(shared_mtx_);
+  return caches_.back();
+}
+
+core::Buffer TaskAllocator::malloc(size_t nbytes)
+{
+  if (nbytes == 0) {
+    LEGRAD_LOG_WARN("Allocator create buffer with 0 size", 0);
+    return core::Buffer();
+  }
+  if (nbytes > TASK_CACHE_MAX_BYTES) {
+    return upstream_->malloc(nbytes);
+  }
+
+  const size_t cls = size_class(nbytes);
+  std::unique_lock<std::mutex> lock;
+  Cache& cache = this->cache(lock);
+  Context* ctx = nullptr;
+  if (!cache.blocks[cls].empty()) {
+    ctx = cache.blocks[cls].back();
+    cache.blocks[cls].pop_back();
+    cache.bytes -= TASK_CACHE_MIN_BYTES << cls;
+  } else {
+    lock = {};
+    core::Buffer block = upstream_->malloc(TASK_CACHE_MIN_BYTES << cls);
+    if (!block) {
+      return core::Buffer();
+    }
+    ctx = new Context{std::move(block), cls, this};
+  }
+  LEGRAD_LOG_TRACE("Task buffer of {} bytes in class {}", nbytes, cls);
+  return core::Buffer(ctx->block.get(), ctx, TaskAllocator::deallocate);
+}
+
+void TaskAllocator::free(void* ctx)
+{
+  LEGRAD_CHECK_AND_THROW(ctx != nullptr, std::invalid_argument,
+                         "TaskAllocator::free called with nullptr", 0);
+  Context* task_ctx = static_cast<Context*>(ctx);
+  const size_t bytes = TASK_CACHE_MIN_BYTES << task_ctx->size_class;
+  std::unique_lock<std::mutex> lock;
+  Cache& cache = this->cache(lock);
+  if (cache.bytes + bytes > TASK_CACHE_BYTES) {
+    lock = {};
+    delete task_ctx;
+    return;
+  }
+  cache.blocks[task_ctx->size_class].push_back(task_ctx);
+  cache.bytes += bytes;
+}
+
+void TaskAllocator::deallocate(void* ctx)
+{
+  if (ctx == nullptr) {
+    return;
+  }
+  Context* task_ctx = static_cast<Context*>(ctx);
+  if (task_ctx->allocator == nullptr) {
+    delete task_ctx;
+    LEGRAD_THROW_ERROR(std::runtime_error,
+                       "The context pointer has empty allocator", 0);
+  }
+  task_ctx->allocator->free(task_ctx);
+}
+
+TaskScheduler::TaskScheduler(size_t num_workers)
+    : allocator_(&upstream_, this, num_workers)
+{
+  const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+  spin_ = num_workers < hardware;
+  for (size_t i = 0; i < num_workers; ++i) {
+    deques_.push_back(std::make_unique<WorkStealingDeque<Task*>>());
+  }
+  workers_.reserve(num_workers);
+  for (size_t i = 0; i < num_workers; ++i) {
+    workers_.emplace_back([this, i] { worker_loop(static_cast<int>(i)); });
+  }
+  LEGRAD_LOG_TRACE("TaskScheduler with {} workers", num_workers);
+}
+
+TaskScheduler::~TaskScheduler()
+{
+  stop_.store(true);
+  signal_.bump();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+  // Tasks of groups that were never waited for
+  for (Task* task : injected_) {
+    delete task;
+  }
+  for (auto& deque : deques_) {
+    while (Task* task = deque->steal()) {
+      delete task;
+    }
+  }
+}
+
+TaskScheduler& TaskScheduler::global()
+{
+  static TaskScheduler scheduler(get_num_threads() - 1);
+  return scheduler;
+}
+
+int TaskScheduler::worker_index() const
+{
+  return current_scheduler_ == this ? current_worker_ : -1;
+}
+
+void TaskScheduler::submit(Task* task)
+{
+  const int worker = worker_index();
+  if (worker >= 0) {
+    deques_[worker]->push(task);
+  } else {
+    std::lock_guard<std::mutex> lock(injected_mtx_);
+    injected_.push_back(task);
+    num_injected_.fetch_add(1, std::memory_order_relaxed);
+  }
+  signal_.bump();
+}
+
+TaskScheduler::Task* TaskScheduler::find_task(int worker)
+{
+  if (worker >= 0) {
+    if (Task* task = deques_[worker]->pop()) {
+      return task;
+    }
+  }
+  if (num_injected_.load(std::memory_order_relaxed) > 0) {
+    std::lock_guard<std::mutex> lock(injected_mtx_);
+    if (!injected_.empty()) {
+      Task* task = injected_.front();
+      injected_.pop_front();
+      num_injected_.fetch_sub(1, std::memory_order_relaxed);
+      return task;
+    }
+  }
+  // Victims in turn, starting next to the thief so they do not all collide
+  const size_t num_deques = deques_.size();
+  const size_t start = worker >= 0 ? static_cast<size_t>(worker) + 1 : 0;
+  for (size_t i = 0; i < num_deques; ++i) {
+    const size_t victim = (start + i) % num_deques;
+    if (static_cast<int>(victim) == worker) {
+      continue;
+    }
+    if (Task* task = deques_[victim]->steal()) {
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+void TaskScheduler::execute(Task* task)
+{
+  TaskGroup* group = task->group;
+  try {
+    ParallelRegionGuard guard;
+    task->fn();
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(group->eptr_mtx_);
+    if (!group->eptr_) {
+      group->eptr_ = std::current_exception();
+    }
+  }
+  delete task;
+  // The group may be gone right after this
+  group->pending_.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+void TaskScheduler::worker_loop(int worker)
+{
+  current_scheduler_ = this;
+  current_worker_ = worker;
+  while (true) {
+    // Read before looking for work: a task submitted since wakes the wait
+    const uint32_t seen = signal_.load();
+    if (stop_.load()) {
+      return;
+    }
+    if (Task* task = find_task(worker)) {
+      execute(task);
+      continue;
+    }
+    signal_.wait(seen, spin_ ? SCHEDULER_SPIN : 0);
+  }
+}
+
+TaskGroup::TaskGroup(TaskScheduler& scheduler)
+    : scheduler_(scheduler)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+  help_until_done();
+}
+
+void TaskGroup::run(std::function<void()> fn)
+{
+  pending_.fetch_add(1, std::memory_order_relaxed);
+  scheduler_.submit(new TaskScheduler::Task{std::move(fn), this});
+}
+
+void TaskGroup::wait()
+{
+  help_until_done();
+  std::exception_ptr eptr;
+  {
+    std::lock_guard<std::mutex> lock(eptr_mtx_);
+    std::swap(eptr, eptr_);
+  }
+  if (eptr) {
+    std::rethrow_exception(eptr);
+  }
+}
+
+void TaskGroup::help_until_done()
+{
+  const int worker = scheduler_.worker_index();
+  for (int idle = 0; pending_.load(std::memory_order_acquire) > 0;) {
+    if (TaskScheduler::Task* task = scheduler_.find_task(worker)) {
+      scheduler_.execute(task);
+      idle = 0;
+    } else if (++idle < SCHEDULER_SPIN) {
+      cpu_relax();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+}  // namespace legrad::cpu
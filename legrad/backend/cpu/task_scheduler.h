@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "backend/cpu/sync.h"
+#include "backend/cpu/work_deque.h"
+#include "core/allocator.h"
+#include "core/buffer.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+class TaskGroup;
+class TaskScheduler;
+
+/*
+ * Allocator for the buffers of tasks. Blocks up to TASK_CACHE_MAX_BYTES are
+ * rounded up to a power of 2 and, once freed, kept in a cache of the freeing
+ * thread: a worker of the scheduler reuses them without any lock, other
+ * threads share one cache behind a mutex. Bigger blocks and cache misses go
+ * to the upstream allocator.
+ */
+class TaskAllocator : public core::Allocator
+{
+public:
+  struct Context
+  {
+    core::Buffer block;  // from the upstream allocator
+    size_t size_class;
+    TaskAllocator* allocator;
+  };
+
+  TaskAllocator(core::Allocator* upstream, const TaskScheduler* scheduler,
+                size_t num_workers);
+  ~TaskAllocator();
+
+  core::Buffer malloc(size_t nbytes) override;
+  // Takes a Context, caches its block or releases it
+  void free(void* ctx) override;
+
+  static void deallocate(void* ctx);
+
+private:
+  struct alignas(64) Cache
+  {
+    std::vector<std::vector<Context*>> blocks;  // per size class
+    size_t bytes = 0;
+  };
+
+  Cache& cache(std::unique_lock<std::mutex>& lock);
+
+  core::Allocator* upstream_;
+  const TaskScheduler* scheduler_;
+  // One per worker, then the one of the other threads
+  std::vector<Cache> caches_;
+  std::mutex shared_mtx_;
+};
+
+/*
+ * Work-stealing scheduler for independent pieces of work that are each too
+ * small to keep every core busy: the Q, K and V projections of a layer, the
+ * sampling of several sequences, the dequantization of many tensors at load
+ * time, ...
+ * Every worker owns a Chase-Lev deque: tasks spawned by a task go to the
+ * deque of its worker and are run from there (newest first), idle workers
+ * steal from the others (oldest first). Tasks spawned by other threads are
+ * queued for the workers. A thread waiting on a TaskGroup runs tasks too.
+ * A task runs its ops on its own thread (as in a parallel_for body), the
+ * parallelism comes from running tasks side by side.
+ */
+class TaskScheduler
+{
+public:
+  explicit TaskScheduler(size_t num_workers);
+  ~TaskScheduler();
+
+  TaskScheduler(const TaskScheduler&) = delete;
+  TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+  // get_num_threads() - 1 workers, fixed when it is first used
+  static TaskScheduler& global();
+
+  size_t num_workers() const { return workers_.size(); }
+
+  // Index of the calling thread among the workers, -1 for other threads
+  int worker_index() const;
+
+  // Thread cached buffers for the tasks
+  core::Allocator* allocator() { return &allocator_; }
+
+private:
+  friend class TaskGroup;
+
+  struct Task
+  {
+    std::function<void()> fn;
+    TaskGroup* group;
+  };
+
+  void submit(Task* task);
+  // A task to run for `worker` (-1 for another thread), nullptr if none
+  Task* find_task(int worker);
+  void execute(Task* task);
+  void worker_loop(int worker);
+
+  std::vector<std::unique_ptr<WorkStealingDeque<Task*>>> deques_;
+  std::mutex injected_mtx_;
+  std::deque<Task*> injected_;
+  std::atomic<Int> num_injected_{0};
+  WaitCounter signal_;  // bumped for every new task
+  std::atomic<bool> stop_{false};
+  bool spin_ = true;
+  CPUAllocator upstream_;
+  TaskAllocator allocator_;
+  std::vector<std::thread> workers_;
+};
+
+/*
+ * Tasks that are waited for together:
+ *
+ *   TaskGroup group;
+ *   group.run([&] { gemm(q, x, wq); });
+ *   group.run([&] { gemm(k, x, wk); });
+ *   group.run([&] { gemm(v, x, wv); });
+ *   group.wait();
+ *
+ * Tasks can run more tasks, in their group or another one.
+ */
+class TaskGroup
+{
+public:
+  explicit TaskGroup(TaskScheduler& scheduler = TaskScheduler::global());
+  // Waits for the tasks still running, their exceptions are dropped
+  ~TaskGroup();
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  void run(std::function<void()> fn);
+
+  /*
+   * Run tasks until every task of the group ended, then rethrow the first
+   * exception one of them threw
+   */
+  void wait();
+
+private:
+  friend class TaskScheduler;
+
+  void help_until_done();
+
+  TaskScheduler& scheduler_;
+  std::atomic<Int> pending_{0};
+  std::mutex eptr_mtx_;
+  std::exception_ptr eptr_;
+};
+}  // namespace legrad::cpu
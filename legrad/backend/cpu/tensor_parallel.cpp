@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "backend/cpu/parallel.h"
+#include "backend/cpu_mgr.h"
+#include "macros/log.h"
+#include "tensor_parallel.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+// Polls before a leader sleeps or a barrier waiter does, as the ThreadPool
+constexpr int TP_SPIN = 1 << 12;
+
+// Floats summed at a time by all_reduce, they stay in L1
+constexpr Int REDUCE_CHUNK = 256;
+}  // namespace
+
+TensorParallel::Shard::Shard(int node, const std::vector<int>& cpus)
+    : node(node)
+    , leader_cpu(cpus.empty() ? -1 : cpus[0])
+    , allocator(NumaPolicy::Bind, node)
+{
+  // The leader is the caller of the pool
+  const std::vector<int> workers(cpus.empty() ? cpus.begin() : cpus.begin() + 1,
+                                 cpus.end());
+  pool = std::make_unique<ThreadPool>(workers.size(), workers);
+}
+
+TensorParallel::TensorParallel(size_t max_shards)
+{
+  const Manager& mgr = Manager::instance();
+  std::vector<int> nodes = mgr.nodes();
+  if (max_shards > 0 && nodes.size() > max_shards) {
+    nodes.resize(max_shards);
+  }
+  if (nodes.empty()) {
+    nodes.push_back(0);
+  }
+
+  for (const int node : nodes) {
+    const size_t threads = std::max<size_t>(1, mgr.num_performance_cores(node));
+    shards_.push_back(
+        std::make_unique<Shard>(node, mgr.pinning(threads, node)));
+    total_threads_ += static_cast<Int>(shards_.back()->pool->num_workers() + 1);
+  }
+  barrier_ = std::make_unique<Barrier>(static_cast<int>(shards_.size()));
+  partials_.resize(shards_.size(), nullptr);
+
+  // Once every shard exists, leaders read them all
+  for (size_t shard = 0; shard < shards_.size(); ++shard) {
+    shards_[shard]->leader = std::thread([this, shard] { leader_loop(shard); });
+  }
+  LEGRAD_LOG_INFO("Tensor parallelism over {} NUMA nodes, {} threads",
+                  shards_.size(), total_threads_);
+}
+
+TensorParallel::~TensorParallel()
+{
+  stop_.store(true);
+  job_.bump();
+  for (auto& shard : shards_) {
+    shard->leader.join();
+  }
+}
+
+std::pair<Int, Int> TensorParallel::split(Int count,
+                                          size_t shard,
+                                          Int multiple) const
+{
+  LEGRAD_CHECK_AND_THROW(shard < shards_.size(), std::out_of_range,
+                         "Shard {} out of {}", shard, shards_.size());
+  multiple = std::max<Int>(multiple, 1);
+  const Int units = (count + multiple - 1) / multiple;
+  // Threads of the shards before this one, and up to this one
+  Int before = 0;
+  for (size_t i = 0; i < shard; ++i) {
+    before += static_cast<Int>(shards_[i]->pool->num_workers() + 1);
+  }
+  const Int after =
+      before + static_cast<Int>(shards_[shard]->pool->num_workers() + 1);
+  const Int begin = units * before / total_threads_ * multiple;
+  const Int end = units * after / total_threads_ * multiple;
+  return {std::min(begin, count), std::min(end, count)};
+}
+
+core::Buffer TensorParallel::shard_rows(size_t shard,
+                                        const void* src,
+                                        Int rows,
+                                        size_t row_bytes,
+                                        Int multiple)
+{
+  const auto [begin, end] = split(rows, shard, multiple);
+  if (begin == end) {
+    return core::Buffer();
+  }
+  core::Buffer buffer = allocator(shard)->malloc((end - begin) * row_bytes);
+  LEGRAD_CHECK_AND_THROW(buffer, std::runtime_error,
+                         "Cannot allocate the rows of shard {}", shard);
+  std::memcpy(buffer.get(), static_cast<const char*>(src) + begin * row_bytes,
+              (end - begin) * row_bytes);
+  return buffer;
+}
+
+core::Buffer TensorParallel::shard_columns(size_t shard,
+                                           const void* src,
+                                           Int rows,
+                                           Int cols,
+                                           size_t elem_bytes,
+                                           Int multiple)
+{
+  const auto [begin, end] = split(cols, shard, multiple);
+  if (begin == end || rows == 0) {
+    return core::Buffer();
+  }
+  const size_t slice_bytes = (end - begin) * elem_bytes;
+  core::Buffer buffer = allocator(shard)->malloc(rows * slice_bytes);
+  LEGRAD_CHECK_AND_THROW(buffer, std::runtime_error,
+                         "Cannot allocate the columns of shard {}", shard);
+  const char* in = static_cast<const char*>(src) + begin * elem_bytes;
+  char* out = static_cast<char*>(buffer.get());
+  for (Int row = 0; row < rows; ++row) {
+    std::memcpy(out + row * slice_bytes, in + row * cols * elem_bytes,
+                slice_bytes);
+  }
+  return buffer;
+}
+
+void TensorParallel::run(const std::function<void(size_t)>& fn)
+{
+  std::lock_guard<std::mutex> lock(run_mtx_);
+  fn_ = &fn;
+  eptr_ = nullptr;
+  barrier_->reset();
+  pending_.store(static_cast<Int>(shards_.size()));
+  job_.bump();
+
+  for (int spins = 0; pending_.load(std::memory_order_acquire) > 0; ++spins) {
+    if (spins < TP_SPIN) {
+      cpu_relax();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  fn_ = nullptr;
+  if (eptr_) {
+    std::rethrow_exception(eptr_);
+  }
+}
+
+void TensorParallel::leader_loop(size_t shard)
+{
+  Shard& self = *shards_[shard];
+  if (self.leader_cpu >= 0) {
+    pin_current_thread(self.leader_cpu);
+  }
+  ThreadPoolGuard guard(self.pool.get());
+
+  uint32_t seen = 0;
+  while (true) {
+    job_.wait(seen, TP_SPIN);
+    seen = job_.load();
+    if (stop_.load()) {
+      return;
+    }
+    try {
+      (*fn_)(shard);
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(eptr_mtx_);
+        if (!eptr_) {
+          eptr_ = std::current_exception();
+        }
+      }
+      // The other shards would wait for this one forever
+      barrier_->abort();
+    }
+    pending_.fetch_sub(1, std::memory_order_release);
+  }
+}
+
+void TensorParallel::barrier()
+{
+  if (!barrier_->arrive_and_wait(TP_SPIN)) {
+    LEGRAD_THROW_ERROR(std::runtime_error,
+                       "Another shard failed, stop this one", 0);
+  }
+}
+
+void TensorParallel::all_reduce(size_t shard,
+                                const float* partial,
+                                float* out,
+                                Int n)
+{
+  partials_.at(shard) = partial;
+  barrier();
+
+  const auto [begin, end] = split(n, shard, REDUCE_CHUNK / 16);
+  alignas(64) float sum[REDUCE_CHUNK];
+  for (Int i = begin; i < end; i += REDUCE_CHUNK) {
+    const Int len = std::min(REDUCE_CHUNK, end - i);
+    std::memcpy(sum, partials_[0] + i, len * sizeof(float));
+    for (size_t s = 1; s < partials_.size(); ++s) {
+      const float* in = partials_[s] + i;
+      for (Int j = 0; j < len; ++j) {
+        sum[j] += in[j];
+      }
+    }
+    std::memcpy(out + i, sum, len * sizeof(float));
+  }
+
+  // Nobody reuses a partial or reads out before every slice is summed
+  barrier();
+}
+}  // namespace legrad::cpu
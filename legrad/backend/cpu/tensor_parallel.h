@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "backend/cpu/numa.h"
+#include "backend/cpu/sync.h"
+#include "backend/cpu/thread_pool.h"
+#include "core/buffer.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+/*
+ * Tensor parallelism over the NUMA nodes of one host. The model is split
+ * in shards, one per node: each shard owns a slice of the attention heads
+ * and of the FFN columns, with its weights in the memory of its node, and is
+ * computed by the cores of that node only (a leader thread plus a pinned
+ * ThreadPool that parallel_for uses inside the shard). Partial results are
+ * summed with all_reduce at the layer boundaries, through the memory all the
+ * shards share. Weight reads, the bulk of decode, then never leave a socket.
+ *
+ *   TensorParallel tp;
+ *   auto [h0, h1] = tp.split(num_kv_heads, shard);  // at load time
+ *   tp.run([&](size_t shard) {
+ *     for (auto& layer : layers) {
+ *       attention(partial[shard], layer.shards[shard], x);  // own heads
+ *       tp.all_reduce(shard, partial[shard], x, dim);
+ *       ...
+ *     }
+ *   });
+ */
+class TensorParallel
+{
+public:
+  // One shard per NUMA node of Manager::nodes(), at most `max_shards`
+  explicit TensorParallel(size_t max_shards = 0);
+  ~TensorParallel();
+
+  TensorParallel(const TensorParallel&) = delete;
+  TensorParallel& operator=(const TensorParallel&) = delete;
+
+  size_t num_shards() const { return shards_.size(); }
+  int node(size_t shard) const { return shards_.at(shard)->node; }
+
+  // Buffers placed on the node of `shard`
+  core::Allocator* allocator(size_t shard)
+  {
+    return &shards_.at(shard)->allocator;
+  }
+
+  /*
+   * Range of `shard` when `count` items (heads, columns) are split over the
+   * shards in units of `multiple` (a GQA group, a vector of columns), as
+   * evenly as possible in proportion to the threads of each shard
+   */
+  std::pair<Int, Int> split(Int count, size_t shard, Int multiple = 1) const;
+
+  /*
+   * Copy of the rows of `shard` of a row-major [rows, row_bytes] matrix, or
+   * of its columns for a [rows, cols] matrix of `elem_bytes` elements, in the
+   * memory of its node (see split for `multiple`)
+   */
+  core::Buffer shard_rows(size_t shard,
+                          const void* src,
+                          Int rows,
+                          size_t row_bytes,
+                          Int multiple = 1);
+  core::Buffer shard_columns(size_t shard,
+                             const void* src,
+                             Int rows,
+                             Int cols,
+                             size_t elem_bytes,
+                             Int multiple = 1);
+
+  /*
+   * Run fn(shard) for every shard at once, each on its own node, and return
+   * when all of them ended. The first exception is rethrown, collectives
+   * the other shards are blocked in then throw too.
+   */
+  void run(const std::function<void(size_t)>& fn);
+
+  /*
+   * Inside run, called by every shard: out = sum of the `n` floats of the
+   * `partial` of each shard. Each shard sums one slice of out, `out` is
+   * shared and can be any of the partials.
+   */
+  void all_reduce(size_t shard, const float* partial, float* out, Int n);
+
+  // Inside run: wait until every shard got there
+  void barrier();
+
+private:
+  struct Shard
+  {
+    Shard(int node, const std::vector<int>& cpus);
+
+    int node;
+    int leader_cpu;
+    NumaAllocator allocator;
+    std::unique_ptr<ThreadPool> pool;
+    std::thread leader;
+  };
+
+  void leader_loop(size_t shard);
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  Int total_threads_ = 0;
+
+  std::mutex run_mtx_;  // one run at a time
+  const std::function<void(size_t)>* fn_ = nullptr;
+  WaitCounter job_;
+  std::atomic<Int> pending_{0};
+  std::atomic<bool> stop_{false};
+  std::mutex eptr_mtx_;
+  std::exception_ptr eptr_;
+
+  std::unique_ptr<Barrier> barrier_;
+  std::vector<const float*> partials_;
+};
+}  // namespace legrad::cpu
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "macros/log.h"
+#include "thread_pool.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+/*
+ * Polls of the job counter before a worker goes to sleep, tens to hundreds of
+ * microseconds depending on the cost of a pause: longer than the gap between
+ * two ops of a decode step, shorter than the gap between two steps waiting on
+ * the sampler
+ */
+constexpr int POOL_SPIN = 1 << 12;
+
+constexpr uint64_t pack_claim(uint32_t epoch, Int num_tasks, Int next)
+{
+  return (uint64_t(epoch) << 32) | (uint64_t(num_tasks) << 16)
+       | uint64_t(next);
+}
+}  // namespace
+
+void pin_current_thread(int cpu)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    LEGRAD_LOG_WARN("Cannot pin a thread to CPU {}", cpu);
+  }
+#else
+  (void)cpu;
+#endif
+}
+
+ThreadPool::ThreadPool(size_t num_workers, const std::vector<int>& cpus)
+{
+  const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+  // A spinning thread would steal the core of the thread it waits for
+  spin_ = num_workers < hardware;
+
+  const bool pin = cpus.size() >= num_workers;
+  workers_.reserve(num_workers);
+  for (size_t id = 0; id < num_workers; ++id) {
+    const int cpu = pin ? cpus[id] : -1;
+    workers_.emplace_back([this, cpu] { worker_loop(cpu); });
+  }
+  LEGRAD_LOG_TRACE("ThreadPool with {} workers ({})", num_workers,
+                   pin ? "pinned" : "not pinned");
+}
+
+ThreadPool::~ThreadPool()
+{
+  stop_.store(true);
+  epoch_.bump();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::run(Int num_tasks, const std::function<void(Int)>& task)
+{
+  LEGRAD_CHECK_AND_THROW(num_tasks >= 0 && num_tasks <= MAX_TASKS,
+                         std::invalid_argument,
+                         "ThreadPool runs at most {} tasks, got {}", MAX_TASKS,
+                         num_tasks);
+  if (num_tasks == 0) {
+    return;
+  }
+  if (num_tasks == 1 || workers_.empty()) {
+    for (Int i = 0; i < num_tasks; ++i) {
+      task(i);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(run_mtx_);
+  // Every task of the previous job ended, nobody reads these anymore
+  task_ = &task;
+  done_.store(0, std::memory_order_relaxed);
+  const uint32_t epoch = epoch_.load() + 1;
+  claim_.store(pack_claim(epoch, num_tasks, 0), std::memory_order_release);
+  epoch_.bump();
+
+  run_tasks(epoch);
+  for (int spins = 0; done_.load(std::memory_order_acquire) < num_tasks;
+       ++spins)
+  {
+    if (spin_ && spins < POOL_SPIN) {
+      cpu_relax();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void ThreadPool::run_tasks(uint32_t epoch)
+{
+  uint64_t claim = claim_.load(std::memory_order_acquire);
+  while (true) {
+    const Int num_tasks = static_cast<Int>((claim >> 16) & 0xFFFF);
+    const Int next = static_cast<Int>(claim & 0xFFFF);
+    if (static_cast<uint32_t>(claim >> 32) != epoch || next >= num_tasks) {
+      return;
+    }
+    if (claim_.compare_exchange_weak(claim, claim + 1,
+                                     std::memory_order_acquire))
+    {
+      (*task_)(next);
+      done_.fetch_add(1, std::memory_order_release);
+      claim = claim_.load(std::memory_order_acquire);
+    }
+  }
+}
+
+void ThreadPool::worker_loop(int cpu)
+{
+  if (cpu >= 0) {
+    pin_current_thread(cpu);
+  }
+  uint32_t seen = 0;
+  while (true) {
+    epoch_.wait(seen, spin_ ? POOL_SPIN : 0);
+    seen = epoch_.load();
+    if (stop_.load()) {
+      return;
+    }
+    run_tasks(seen);
+  }
+}
+}  // namespace legrad::cpu
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "backend/cpu/sync.h"
+#include "internal/view_pack.h"
+
+namespace legrad::cpu
+{
+// Run the calling thread on `cpu` only (Linux, nothing elsewhere)
+void pin_current_thread(int cpu);
+
+/*
+ * Persistent workers running the tasks of one job at a time, this is what
+ * parallel_for dispatches to. Between jobs workers spin on the job counter
+ * for a while (decode runs many small ops back to back, a spinning worker
+ * picks the next one up in well under a microsecond), then sleep on a futex
+ * (a condition variable outside of Linux) so an idle process does not burn
+ * its cores.
+ * Tasks are claimed from a shared counter by whoever is awake, the caller
+ * included: a job never waits for a sleeping worker to wake up before it can
+ * start, the caller only waits for the tasks already claimed to end.
+ */
+class ThreadPool
+{
+public:
+  static constexpr Int MAX_TASKS = 0xFFFF;
+
+  /*
+   * `num_workers` threads besides the caller, worker i runs on CPU cpus[i]
+   * (Linux only). They are not pinned when there are fewer CPUs than
+   * workers.
+   */
+  ThreadPool(size_t num_workers, const std::vector<int>& cpus);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t num_workers() const { return workers_.size(); }
+
+  /*
+   * Run task(0) ... task(num_tasks - 1) on the workers and the calling
+   * thread, return when all of them ended. Tasks must not throw, there are
+   * at most MAX_TASKS. Jobs from several threads run one after the other.
+   */
+  void run(Int num_tasks, const std::function<void(Int)>& task);
+
+private:
+  void worker_loop(int cpu);
+  // Claim and run tasks of the job `epoch` until there are none left
+  void run_tasks(uint32_t epoch);
+
+  std::vector<std::thread> workers_;
+  bool spin_ = true;  // false when there are more threads than CPUs
+
+  // Serializes run(), a single job is live at a time
+  std::mutex run_mtx_;
+  // Bumped for every job (and to stop), workers wait on it
+  WaitCounter epoch_;
+  /*
+   * The live job in one word, so a late worker never reads the fields of the
+   * next one: epoch in the high 32 bits, then its number of tasks and the
+   * next unclaimed task (16 bits each)
+   */
+  std::atomic<uint64_t> claim_{0};
+  std::atomic<Int> done_{0};
+  std::atomic<bool> stop_{false};
+  // Only read by the owner of a claimed task, the job is live until it ends
+  const std::function<void(Int)>* task_ = nullptr;
+};
+}  // namespace legrad::cpu
@@ -0,0 +1,455 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "backend/cpu/isa.h"
+#include "internal/fp16/fpt16.h"
+#include "internal/view_pack.h"
+#include "macros/expr.h"
+
+#if defined(__F16C__) || defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Width (in bytes) of one SIMD register for the ISA this translation unit is
+ * compiled for. It is a compile-time constant so every kernel that includes
+ * this header is specialized for the target ISA.
+ */
+// clang-format off
+#if defined(__AVX512F__)
+  #define LEGRAD_VEC_BYTES 64
+#elif defined(__AVX__)
+  #define LEGRAD_VEC_BYTES 32
+#else
+  #define LEGRAD_VEC_BYTES 16  // SSE2, NEON and the scalar fallback
+#endif
+// clang-format on
+
+namespace legrad::cpu::vec
+{
+inline namespace LEGRAD_CPU_KERNEL_NAMESPACE
+{
+/*
+ * NOTE: the vector type has to be declared outside of Vectorized, GCC drops
+ * the attribute of a dependent typedef when it checks member overloads.
+ */
+template <typename T>
+struct native_vector
+{
+  typedef T type __attribute__((vector_size(LEGRAD_VEC_BYTES)));
+};
+
+/*
+ * Vectorized is a thin wrapper around GCC/Clang vector extensions, inspired by
+ * PyTorch's at::vec::Vectorized. Using vector extensions (instead of raw
+ * intrinsics) gives us one implementation for every arithmetic dtype in
+ * CALL_DISPATCH_TYPE_INFO and every ISA (SSE/AVX/AVX-512/NEON): the compiler
+ * lowers the operators to the widest instructions available.
+ * NOTE: bool and half_float are not valid element types, kernels handle them
+ * as uint8_t and via float conversion respectively.
+ */
+template <typename T>
+class Vectorized
+{
+  LEGRAD_STATIC_ASSERT((std::is_arithmetic_v<T> && !std::is_same_v<T, bool>),
+                       "Vectorized only supports arithmetic non-bool types");
+
+public:
+  using value_type = T;
+  using native_type = typename native_vector<T>::type;
+  // Result type of a comparison: integer lanes with all bits set or zero
+  using mask_type = decltype(native_type{} < native_type{});
+
+  static constexpr Int size() { return LEGRAD_VEC_BYTES / sizeof(T); }
+
+  Vectorized() = default;
+
+  Vectorized(native_type values)
+      : values_(values)
+  {
+  }
+
+  /*
+   * Broadcast a scalar to every lane. NOTE: `value - 0` and not `0 + value`:
+   * -0.0f + 0.0f is +0.0f so the compiler has to emit the add, the
+   * subtraction is exact and folds to a plain broadcast.
+   */
+  Vectorized(T value)
+      : values_(value - native_type{})
+  {
+  }
+
+  static Vectorized loadu(const T* ptr)
+  {
+    native_type values;
+    std::memcpy(&values, ptr, sizeof(values));
+    return values;
+  }
+
+  // Load only `count` elements, the rest of the lanes is zero
+  static Vectorized loadu(const T* ptr, Int count)
+  {
+    native_type values = {};
+    std::memcpy(&values, ptr, count * sizeof(T));
+    return values;
+  }
+
+  void store(T* ptr) const { std::memcpy(ptr, &values_, sizeof(values_)); }
+  void store(T* ptr, Int count) const
+  {
+    std::memcpy(ptr, &values_, count * sizeof(T));
+  }
+
+  T operator[](Int idx) const { return values_[idx]; }
+  native_type native() const { return values_; }
+
+  // Select lanes of `a` where mask is set, otherwise lanes of `b`
+  static Vectorized blend(mask_type mask,
+                          const Vectorized& a,
+                          const Vectorized& b)
+  {
+    return (native_type)(((mask_type)a.values_ & mask)
+                         | ((mask_type)b.values_ & ~mask));
+  }
+
+  friend Vectorized operator+(const Vectorized& a, const Vectorized& b)
+  {
+    return a.values_ + b.values_;
+  }
+  friend Vectorized operator-(const Vectorized& a, const Vectorized& b)
+  {
+    return a.values_ - b.values_;
+  }
+  friend Vectorized operator*(const Vectorized& a, const Vectorized& b)
+  {
+    return a.values_ * b.values_;
+  }
+  friend Vectorized operator/(const Vectorized& a, const Vectorized& b)
+  {
+    return a.values_ / b.values_;
+  }
+  friend Vectorized maximum(const Vectorized& a, const Vectorized& b)
+  {
+    return blend(a.values_ > b.values_, a, b);
+  }
+  friend Vectorized minimum(const Vectorized& a, const Vectorized& b)
+  {
+    return blend(a.values_ < b.values_, a, b);
+  }
+
+private:
+  native_type values_;
+};
+
+/*
+ * Vector of T with as many lanes as Vectorized<float> (narrower or wider than
+ * a register), used with __builtin_convertvector to widen e.g. 16 int8 into 16
+ * floats on AVX-512.
+ */
+template <typename T>
+struct lane_vector
+{
+  typedef T type __attribute__((vector_size(LEGRAD_VEC_BYTES / sizeof(float)
+                                            * sizeof(T))));
+};
+
+template <typename T>
+using lanes_t = typename lane_vector<T>::type;
+
+/*
+ * Lane conversions between T and float (float to T truncates, values must be
+ * in range). GCC scalarizes the direct 8-bit <-> float conversions (one
+ * vpextrb + vcvtsi2ss per lane) and does not always see through the two-step
+ * one either, so bytes are widened with vpmovsxbd/vpmovzxbd explicitly on
+ * x86 and go through int32 elsewhere.
+ */
+template <typename T>
+LEGRAD_INLINE lanes_t<float> convert_to_float(lanes_t<T> x)
+{
+#if LEGRAD_VEC_BYTES == 64 || (LEGRAD_VEC_BYTES == 32 && defined(__AVX2__))
+  if constexpr (std::is_same_v<T, int8_t> || std::is_same_v<T, uint8_t>) {
+    __m128i bytes = _mm_setzero_si128();
+    std::memcpy(&bytes, &x, sizeof(x));
+#if LEGRAD_VEC_BYTES == 64
+    const __m512i words = std::is_signed_v<T> ? _mm512_cvtepi8_epi32(bytes)
+                                              : _mm512_cvtepu8_epi32(bytes);
+    return (lanes_t<float>)_mm512_cvtepi32_ps(words);
+#else
+    const __m256i words = std::is_signed_v<T> ? _mm256_cvtepi8_epi32(bytes)
+                                              : _mm256_cvtepu8_epi32(bytes);
+    return (lanes_t<float>)_mm256_cvtepi32_ps(words);
+#endif
+  }
+#endif
+  if constexpr (std::is_integral_v<T> && sizeof(T) < sizeof(int32_t)) {
+    return __builtin_convertvector(
+        __builtin_convertvector(x, lanes_t<int32_t>), lanes_t<float>);
+  } else {
+    return __builtin_convertvector(x, lanes_t<float>);
+  }
+}
+
+template <typename T>
+LEGRAD_INLINE lanes_t<T> convert_from_float(lanes_t<float> x)
+{
+  if constexpr (std::is_integral_v<T> && sizeof(T) < sizeof(int32_t)) {
+    return __builtin_convertvector(
+        __builtin_convertvector(x, lanes_t<int32_t>), lanes_t<T>);
+  } else {
+    return __builtin_convertvector(x, lanes_t<T>);
+  }
+}
+
+/*
+ * Horizontal reductions go as a tree: the upper half of the register is
+ * folded onto the lower half (a plain extract + vector op) until one lane is
+ * left, log2(size) dependent steps instead of a chain of size - 1 scalar
+ * ops. For sums it is also pairwise summation of the lanes.
+ */
+template <typename T, size_t BYTES, typename Op>
+LEGRAD_INLINE T reduce_tree(const void* lanes, const Op& op)
+{
+  if constexpr (BYTES == sizeof(T)) {
+    T value;
+    std::memcpy(&value, lanes, sizeof(T));
+    return value;
+  } else {
+    typedef T half_type __attribute__((vector_size(BYTES / 2)));
+    half_type lo, hi;
+    std::memcpy(&lo, lanes, BYTES / 2);
+    std::memcpy(&hi, static_cast<const char*>(lanes) + BYTES / 2, BYTES / 2);
+    const half_type folded = op(lo, hi);
+    return reduce_tree<T, BYTES / 2>(&folded, op);
+  }
+}
+
+template <typename T, typename Op>
+LEGRAD_INLINE T reduce_tree(const Vectorized<T>& v, const Op& op)
+{
+  const typename Vectorized<T>::native_type values = v.native();
+  return reduce_tree<T, sizeof(values)>(&values, op);
+}
+
+template <typename T>
+LEGRAD_INLINE T reduce_add(const Vectorized<T>& v)
+{
+  return reduce_tree(v, [](auto a, auto b) { return a + b; });
+}
+
+template <typename T>
+LEGRAD_INLINE T reduce_max(const Vectorized<T>& v)
+{
+  return reduce_tree(v, [](auto a, auto b) { return b > a ? b : a; });
+}
+
+template <typename T>
+LEGRAD_INLINE T reduce_min(const Vectorized<T>& v)
+{
+  return reduce_tree(v, [](auto a, auto b) { return b < a ? b : a; });
+}
+
+/*
+ * exp(x) with the Cephes expf polynomial, about 2 ulp over the float range:
+ * x = n * ln(2) + r with |r| <= ln(2) / 2, exp(r) is a degree 7 polynomial
+ * and 2^n goes straight into the exponent bits. Underflow (and -inf) gives 0,
+ * overflow is clamped to the largest finite result, NaN lanes are not
+ * preserved. Only used where that is good enough (softmax, SiLU, ...), it is
+ * several times faster than calling std::exp per lane.
+ */
+LEGRAD_INLINE Vectorized<float> exp(const Vectorized<float>& x)
+{
+  using Vec = Vectorized<float>;
+  using int_type = native_vector<int32_t>::type;
+  const Vec lo(-87.3365447505531f);  // ln(2^-126), smallest normal
+  const Vec hi(88.3762626647949f);
+  const Vec v = minimum(maximum(x, lo), hi);
+
+  // n = round(x / ln(2)), adding 1.5 * 2^23 rounds to nearest even
+  const Vec magic(12582912.0f);
+  const Vec n = (v * Vec(1.44269504088896341f) + magic) - magic;
+  // r = x - n * ln(2), ln(2) split in two so n * hi part is exact
+  const Vec r = v - n * Vec(0.693359375f) - n * Vec(-2.12194440e-4f);
+
+  Vec p(1.9875691500e-4f);
+  p = p * r + Vec(1.3981999507e-3f);
+  p = p * r + Vec(8.3334519073e-3f);
+  p = p * r + Vec(4.1665795894e-2f);
+  p = p * r + Vec(1.6666665459e-1f);
+  p = p * r + Vec(5.0000001201e-1f);
+  p = p * (r * r) + r + Vec(1.0f);
+
+  const int_type bits =
+      (__builtin_convertvector(n.native(), int_type) + 127) << 23;
+  const Vec result = p * Vec((Vec::native_type)bits);
+  return Vec::blend(x.native() < lo.native(), Vec(0.0f), result);
+}
+
+/*
+ * silu(x) = x * sigmoid(x) = x / (1 + exp(-x)). Very negative x make exp
+ * clamp to a huge finite value, which still gives -0.
+ */
+LEGRAD_INLINE Vectorized<float> silu(const Vectorized<float>& x)
+{
+  using Vec = Vectorized<float>;
+  return x / (Vec(1.0f) + exp(Vec(0.0f) - x));
+}
+
+LEGRAD_INLINE Vectorized<float> sigmoid(const Vectorized<float>& x)
+{
+  using Vec = Vectorized<float>;
+  return Vec(1.0f) / (Vec(1.0f) + exp(Vec(0.0f) - x));
+}
+
+/*
+ * GELU with the tanh approximation of GPT-2 and most GGUF models,
+ * 0.5 * x * (1 + tanh(u)) = x * sigmoid(2 * u) with
+ * u = sqrt(2 / pi) * (x + 0.044715 * x^3)
+ */
+LEGRAD_INLINE Vectorized<float> gelu(const Vectorized<float>& x)
+{
+  using Vec = Vectorized<float>;
+  const Vec u = x * (Vec(1.5957691216057308f)
+                     + Vec(0.0713548162726009f) * x * x);
+  return x * sigmoid(u);
+}
+
+/*
+ * Swap the two floats of every pair of lanes (0 1 2 3 -> 1 0 3 2): rotating
+ * each 64-bit lane by 32 bits, a single vprolq on AVX-512, and no shuffle
+ * builtin that GCC and Clang spell differently.
+ */
+LEGRAD_INLINE Vectorized<float> swap_pairs(const Vectorized<float>& v)
+{
+  using pair_type = native_vector<uint64_t>::type;
+  const pair_type bits = (pair_type)v.native();
+  return (Vectorized<float>::native_type)((bits << 32) | (bits >> 32));
+}
+
+// Scalar overloads so the same op functor works for tails and strided loops
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+LEGRAD_INLINE T maximum(T a, T b)
+{
+  return a > b ? a : b;
+}
+
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+LEGRAD_INLINE T minimum(T a, T b)
+{
+  return a < b ? a : b;
+}
+
+/*
+ * Bulk IEEE half <-> float conversion. Use F16C/NEON when available, the
+ * remaining elements go through the scalar routines of fp16 library.
+ */
+LEGRAD_INLINE void cvt_f16_to_f32(const uint16_t* src, float* dst, Int n)
+{
+  Int i = 0;
+#if defined(__AVX512F__)
+  for (; i + 16 <= n; i += 16) {
+    __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(h));
+  }
+#endif
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 4 <= n; i += 4) {
+    float16x4_t h = vreinterpret_f16_u16(vld1_u16(src + i));
+    vst1q_f32(dst + i, vcvt_f32_f16(h));
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[i] = fp16_ieee_to_fp32_value(src[i]);
+  }
+}
+
+LEGRAD_INLINE void cvt_f32_to_f16(const float* src, uint16_t* dst, Int n)
+{
+  Int i = 0;
+#if defined(__AVX512F__)
+  for (; i + 16 <= n; i += 16) {
+    __m256i h =
+        _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), h);
+  }
+#endif
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8) {
+    __m128i h =
+        _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 4 <= n; i += 4) {
+    float16x4_t h = vcvt_f16_f32(vld1q_f32(src + i));
+    vst1_u16(dst + i, vreinterpret_u16_f16(h));
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[i] = fp16_ieee_from_fp32_value(src[i]);
+  }
+}
+
+// Load Vectorized<float>::size() halfs as floats
+LEGRAD_INLINE Vectorized<float> loadu_half(const uint16_t* ptr)
+{
+  using native_type [[maybe_unused]] = Vectorized<float>::native_type;
+#if LEGRAD_VEC_BYTES == 64
+  return (native_type)_mm512_cvtph_ps(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr)));
+#elif LEGRAD_VEC_BYTES == 32 && defined(__F16C__)
+  return (native_type)_mm256_cvtph_ps(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr)));
+#elif LEGRAD_VEC_BYTES == 16 && defined(__ARM_NEON) && defined(__aarch64__)
+  return (native_type)vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(ptr)));
+#else
+  float values[Vectorized<float>::size()];
+  cvt_f16_to_f32(ptr, values, Vectorized<float>::size());
+  return Vectorized<float>::loadu(values);
+#endif
+}
+
+// Read `n` halfs with a byte stride (0 broadcasts one value) into floats
+LEGRAD_INLINE void load_half(const char* src, Int stride, Int n, float* dst)
+{
+  const uint16_t* h = reinterpret_cast<const uint16_t*>(src);
+  if (stride == sizeof(uint16_t)) {
+    cvt_f16_to_f32(h, dst, n);
+  } else if (stride == 0) {
+    const float value = fp16_ieee_to_fp32_value(*h);
+    for (Int i = 0; i < n; ++i) {
+      dst[i] = value;
+    }
+  } else {
+    for (Int i = 0; i < n; ++i) {
+      dst[i] = fp16_ieee_to_fp32_value(
+          *reinterpret_cast<const uint16_t*>(src + i * stride));
+    }
+  }
+}
+
+// Write `n` floats as halfs with a byte stride
+LEGRAD_INLINE void store_half(const float* src, char* dst, Int stride, Int n)
+{
+  if (stride == sizeof(uint16_t)) {
+    cvt_f32_to_f16(src, reinterpret_cast<uint16_t*>(dst), n);
+  } else {
+    for (Int i = 0; i < n; ++i) {
+      *reinterpret_cast<uint16_t*>(dst + i * stride) =
+          fp16_ieee_from_fp32_value(src[i]);
+    }
+  }
+}
+}  // namespace LEGRAD_CPU_KERNEL_NAMESPACE
+}  // namespace legrad::cpu::vec
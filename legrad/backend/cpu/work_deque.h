@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "internal/view_pack.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+/*
+ * Chase-Lev work-stealing deque ("Dynamic Circular Work-Stealing Deque",
+ * SPAA 2005), with the C11 memory orders of Le et al. ("Correct and
+ * Efficient Work-Stealing for Weak Memory Models", PPoPP 2013).
+ * The owner thread pushes and pops at the bottom (LIFO, the task it just
+ * spawned is hot in its caches), any other thread steals from the top (FIFO,
+ * the oldest and usually biggest piece of work). Neither side takes a lock,
+ * they only race with a CAS on the last element.
+ * T is a pointer, nullptr means empty.
+ */
+template <typename T>
+class WorkStealingDeque
+{
+  LEGRAD_STATIC_ASSERT(std::is_pointer_v<T>, "Deque elements are pointers");
+
+public:
+  explicit WorkStealingDeque(Int capacity = 256)
+  {
+    LEGRAD_CHECK_AND_THROW(capacity > 0 && (capacity & (capacity - 1)) == 0,
+                           std::invalid_argument,
+                           "Deque capacity {} is not a power of 2", capacity);
+    arrays_.push_back(std::make_unique<Array>(capacity));
+    array_.store(arrays_.back().get(), std::memory_order_relaxed);
+  }
+
+  WorkStealingDeque(const WorkStealingDeque&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+  // Owner only
+  void push(T item)
+  {
+    const Int b = bottom_.load(std::memory_order_relaxed);
+    const Int t = top_.load(std::memory_order_acquire);
+    Array* array = array_.load(std::memory_order_relaxed);
+    if (b - t > array->capacity - 1) {
+      array = grow(array, t, b);
+    }
+    array->put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only
+  T pop()
+  {
+    const Int b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* array = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Int t = top_.load(std::memory_order_relaxed);
+    T item = nullptr;
+    if (t <= b) {
+      item = array->get(b);
+      if (t == b) {
+        // Last element, race the thieves for it
+        if (!top_.compare_exchange_strong(t, t + 1,
+                                          std::memory_order_seq_cst,
+                                          std::memory_order_relaxed))
+        {
+          item = nullptr;
+        }
+        bottom_.store(b + 1, std::memory_order_relaxed);
+      }
+    } else {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  // Any thread, nullptr when empty or when another thief won the race
+  T steal()
+  {
+    Int t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const Int b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    Array* array = array_.load(std::memory_order_acquire);
+    T item = array->get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed))
+    {
+      return nullptr;
+    }
+    return item;
+  }
+
+  // A hint, exact only for the owner
+  bool empty() const
+  {
+    return bottom_.load(std::memory_order_relaxed)
+        <= top_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Array
+  {
+    explicit Array(Int capacity)
+        : capacity(capacity)
+        , items(new std::atomic<T>[capacity])
+    {
+    }
+
+    T get(Int i) const
+    {
+      return items[i & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+
+    void put(Int i, T item)
+    {
+      items[i & (capacity - 1)].store(item, std::memory_order_relaxed);
+    }
+
+    const Int capacity;  // a power of 2
+    std::unique_ptr<std::atomic<T>[]> items;
+  };
+
+  /*
+   * Twice the capacity. The old array stays alive with the deque: a thief
+   * may still be reading from it.
+   */
+  Array* grow(Array* array, Int t, Int b)
+  {
+    arrays_.push_back(std::make_unique<Array>(array->capacity * 2));
+    Array* bigger = arrays_.back().get();
+    for (Int i = t; i < b; ++i) {
+      bigger->put(i, array->get(i));
+    }
+    array_.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+  // On their own cache lines, thieves hammer top_ while the owner uses bottom_
+  alignas(64) std::atomic<Int> top_{0};
+  alignas(64) std::atomic<Int> bottom_{0};
+  std::atomic<Array*> array_{nullptr};
+  std::vector<std::unique_ptr<Array>> arrays_;  // owner only
+};
+}  // namespace legrad::cpu
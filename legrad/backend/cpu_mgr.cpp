@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+
+#include <filesystem>
+#endif
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#include <sys/types.h>
+#endif
+
+#include "cpu_mgr.h"
+#include "macros/log.h"
+
+namespace legrad::cpu
+{
+namespace
+{
+#ifdef __linux__
+const std::string SYS_CPU = "/sys/devices/system/cpu/";
+
+// First line of a sysfs file, empty when it cannot be read
+std::string read_line(const std::string& path)
+{
+  std::ifstream file(path);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+long read_long(const std::string& path, long fallback)
+{
+  const std::string line = read_line(path);
+  if (line.empty()) {
+    return fallback;
+  }
+  try {
+    return std::stol(line);
+  } catch (const std::exception&) {
+    return fallback;
+  }
+}
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+std::vector<int> parse_cpu_list(const std::string& list)
+{
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    const std::string range = list.substr(pos, end - pos);
+    const size_t dash = range.find('-');
+    try {
+      const int first = std::stoi(range.substr(0, dash));
+      const int last =
+          dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception&) {
+      // Blank or garbled entry, skip it
+    }
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+// "48K", "2048K", "32M" -> bytes
+size_t parse_size(const std::string& text)
+{
+  if (text.empty()) {
+    return 0;
+  }
+  size_t value = 0;
+  try {
+    value = std::stoul(text);
+  } catch (const std::exception&) {
+    return 0;
+  }
+  switch (text.back()) {
+    case 'K':
+      return value << 10;
+    case 'M':
+      return value << 20;
+    case 'G':
+      return value << 30;
+    default:
+      return value;
+  }
+}
+
+// CPUs of the process affinity mask, in order
+std::vector<int> allowed_cpus()
+{
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+// NUMA node of `cpu`, its sysfs directory links to it as nodeN
+int node_of(int cpu)
+{
+  std::error_code ec;
+  const std::filesystem::directory_iterator dir(
+      SYS_CPU + "cpu" + std::to_string(cpu), ec);
+  if (ec) {
+    return 0;
+  }
+  for (const auto& entry : dir) {
+    const std::string name = entry.path().filename().string();
+    if (name.size() > 4 && name.compare(0, 4, "node") == 0) {
+      try {
+        return std::stoi(name.substr(4));
+      } catch (const std::exception&) {
+        return 0;
+      }
+    }
+  }
+  return 0;
+}
+#endif
+
+#ifdef __APPLE__
+// sysctl value, 0 when the key is missing (older macOS, Intel Macs)
+int64_t sysctl_int(const char* name)
+{
+  int64_t value = 0;
+  size_t size = sizeof(value);
+  if (sysctlbyname(name, &value, &size, nullptr, 0) != 0) {
+    return 0;
+  }
+  return value;
+}
+#endif
+}  // namespace
+
+Manager::Manager()
+{
+#if defined(__linux__)
+  read_linux();
+#elif defined(__APPLE__)
+  read_darwin();
+#endif
+  if (cpus_.empty()) {
+    const int hardware =
+        static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    for (int cpu = 0; cpu < hardware; ++cpu) {
+      CpuInfo info;
+      info.cpu = cpu;
+      info.core = cpu;
+      cpus_.push_back(info);
+    }
+  }
+  const long page_size = sysconf(_SC_PAGESIZE);
+  if (page_size > 0) {
+    page_size_ = static_cast<size_t>(page_size);
+  }
+  count();
+
+  LEGRAD_LOG_INFO(
+      "CPU topology: {} packages, {} NUMA nodes, {} cores ({} performance), "
+      "{} threads, L1d {} KB, L2 {} KB, L3 {} KB",
+      num_packages_, nodes_.size(), num_cores_, num_performance_cores_,
+      cpus_.size(), l1d_.size >> 10, l2_.size >> 10, l3_.size >> 10);
+}
+
+void Manager::read_linux()
+{
+#ifdef __linux__
+  std::vector<int> ids = allowed_cpus();
+  if (ids.empty()) {
+    return;
+  }
+
+  // Intel hybrid parts list their E-cores here
+  const std::vector<int> atoms =
+      parse_cpu_list(read_line("/sys/devices/cpu_atom/cpus"));
+  // Relative performance (ARM) or max frequency, 0 when unknown
+  std::vector<long> capacities;
+  std::map<std::pair<int, int>, int> cores;
+  for (const int id : ids) {
+    const std::string dir = SYS_CPU + "cpu" + std::to_string(id) + "/";
+    CpuInfo info;
+    info.cpu = id;
+    info.package = read_long(dir + "topology/physical_package_id", 0);
+    // core_id is only unique within a package
+    const auto key =
+        std::make_pair(info.package, read_long(dir + "topology/core_id", id));
+    const auto found = cores.find(key);
+    info.primary = found == cores.end();
+    info.core = info.primary ? static_cast<int>(cores.size()) : found->second;
+    cores.emplace(key, info.core);
+    info.node = node_of(id);
+    if (std::find(atoms.begin(), atoms.end(), id) != atoms.end()) {
+      info.kind = CoreKind::Efficiency;
+    }
+    long capacity = read_long(dir + "cpu_capacity", 0);
+    if (capacity == 0) {
+      capacity = read_long(dir + "cpufreq/cpuinfo_max_freq", 0);
+    }
+    capacities.push_back(capacity);
+    cpus_.push_back(info);
+  }
+
+  /*
+   * Elsewhere the slow cores are the ones well below the fastest: a few
+   * favored cores boost a bit higher on plain parts, that does not count
+   */
+  const long max_capacity =
+      *std::max_element(capacities.begin(), capacities.end());
+  if (atoms.empty() && max_capacity > 0) {
+    for (size_t i = 0; i < cpus_.size(); ++i) {
+      if (capacities[i] > 0 && capacities[i] * 5 < max_capacity * 4) {
+        cpus_[i].kind = CoreKind::Efficiency;
+      }
+    }
+  }
+
+  // Caches of the first performance core
+  const auto reference =
+      std::find_if(cpus_.begin(), cpus_.end(), [](const CpuInfo& info) {
+        return info.kind == CoreKind::Performance;
+      });
+  const int cpu = reference == cpus_.end() ? ids[0] : reference->cpu;
+  const std::string dir = SYS_CPU + "cpu" + std::to_string(cpu) + "/";
+  const size_t siblings = std::max<size_t>(
+      1, parse_cpu_list(read_line(dir + "topology/thread_siblings_list"))
+             .size());
+  for (int index = 0;; ++index) {
+    const std::string cache = dir + "cache/index" + std::to_string(index) + "/";
+    const std::string type = read_line(cache + "type");
+    if (type.empty()) {
+      break;
+    }
+    if (type == "Instruction") {
+      continue;
+    }
+    CacheInfo info;
+    info.size = parse_size(read_line(cache + "size"));
+    info.line_size = read_long(cache + "coherency_line_size", 64);
+    info.shared_cores = std::max<size_t>(
+        1, parse_cpu_list(read_line(cache + "shared_cpu_list")).size()
+               / siblings);
+    switch (read_long(cache + "level", 0)) {
+      case 1:
+        l1d_ = info;
+        break;
+      case 2:
+        l2_ = info;
+        break;
+      case 3:
+        l3_ = info;
+        break;
+      default:
+        break;
+    }
+  }
+#endif
+}
+
+void Manager::read_darwin()
+{
+#ifdef __APPLE__
+  // Apple silicon, perflevel0 is the performance cluster
+  int64_t performance = sysctl_int("hw.perflevel0.physicalcpu");
+  int64_t efficiency = sysctl_int("hw.perflevel1.physicalcpu");
+  if (performance == 0) {
+    performance = sysctl_int("hw.physicalcpu");
+    efficiency = 0;
+  }
+  if (performance == 0) {
+    return;
+  }
+  const int64_t logical = sysctl_int("hw.logicalcpu");
+  const int threads = static_cast<int>(
+      std::max<int64_t>(1, logical / (performance + efficiency)));
+
+  // There are no affinity masks, ids only order the CPUs
+  for (int64_t core = 0; core < performance + efficiency; ++core) {
+    for (int thread = 0; thread < threads; ++thread) {
+      CpuInfo info;
+      info.cpu = static_cast<int>(cpus_.size());
+      info.core = static_cast<int>(core);
+      info.kind =
+          core < performance ? CoreKind::Performance : CoreKind::Efficiency;
+      info.primary = thread == 0;
+      cpus_.push_back(info);
+    }
+  }
+
+  l1d_.size = sysctl_int("hw.perflevel0.l1dcachesize");
+  if (l1d_.size == 0) {
+    l1d_.size = sysctl_int("hw.l1dcachesize");
+  }
+  l2_.size = sysctl_int("hw.perflevel0.l2cachesize");
+  if (l2_.size == 0) {
+    l2_.size = sysctl_int("hw.l2cachesize");
+  }
+  l2_.shared_cores = std::max<int64_t>(
+      1, sysctl_int("hw.perflevel0.cpusperl2") / threads);
+  // Apple silicon does not report its system level cache
+  l3_.size = sysctl_int("hw.l3cachesize");
+  l3_.shared_cores = static_cast<size_t>(performance + efficiency);
+  const int64_t line_size = sysctl_int("hw.cachelinesize");
+  if (line_size > 0) {
+    l1d_.line_size = l2_.line_size = l3_.line_size = line_size;
+  }
+#endif
+}
+
+void Manager::count()
+{
+  std::set<int> packages;
+  std::set<int> nodes;
+  num_cores_ = 0;
+  num_performance_cores_ = 0;
+  for (const CpuInfo& info : cpus_) {
+    packages.insert(info.package);
+    nodes.insert(info.node);
+    if (info.primary) {
+      ++num_cores_;
+      num_performance_cores_ += info.kind == CoreKind::Performance;
+    }
+  }
+  num_packages_ = packages.size();
+  nodes_.assign(nodes.begin(), nodes.end());
+  // Only E-cores in the affinity mask, they are the fast ones then
+  if (num_performance_cores_ == 0) {
+    num_performance_cores_ = num_cores_;
+  }
+}
+
+std::vector<int> Manager::pinning(size_t num_threads, int node) const
+{
+  // Performance cores per node, then the rest in the order they come
+  std::map<int, std::vector<int>> performance;
+  std::vector<int> efficiency;
+  std::vector<int> siblings;
+  for (const CpuInfo& info : cpus_) {
+    if (node >= 0 && info.node != node) {
+      continue;
+    }
+    if (!info.primary) {
+      siblings.push_back(info.cpu);
+    } else if (info.kind == CoreKind::Performance) {
+      performance[info.node].push_back(info.cpu);
+    } else {
+      efficiency.push_back(info.cpu);
+    }
+  }
+
+  std::vector<int> cpus;
+  for (size_t i = 0;; ++i) {
+    bool any = false;
+    for (const auto& cores : performance) {
+      if (i < cores.second.size()) {
+        cpus.push_back(cores.second[i]);
+        any = true;
+      }
+    }
+    if (!any) {
+      break;
+    }
+  }
+  cpus.insert(cpus.end(), efficiency.begin(), efficiency.end());
+  cpus.insert(cpus.end(), siblings.begin(), siblings.end());
+  if (cpus.size() > num_threads) {
+    cpus.resize(num_threads);
+  }
+  return cpus;
+}
+
+size_t Manager::num_performance_cores(int node) const
+{
+  size_t count = 0;
+  for (const CpuInfo& info : cpus_) {
+    count += info.node == node && info.primary
+          && info.kind == CoreKind::Performance;
+  }
+  return count;
+}
+}  // namespace legrad::cpu
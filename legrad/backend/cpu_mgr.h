@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "internal/enum_impl.h"
+#include "internal/pattern.h"
+
+namespace legrad::cpu
+{
+/*
+ * Class of a core on hybrid parts (Intel P/E cores, ARM big.LITTLE, Apple
+ * performance/efficiency clusters), every core is Performance elsewhere
+ */
+LEGRAD_ENUM(CoreKind,
+            uint8_t,
+            Performance,
+            Efficiency,
+            Performance,
+            Efficiency,
+            COUNT)
+
+// A logical CPU the process may run on
+struct CpuInfo
+{
+  int cpu = 0;      // id for the affinity mask
+  int package = 0;  // socket
+  int core = 0;     // physical core, unique across packages
+  int node = 0;     // NUMA node
+  CoreKind kind = CoreKind::Performance;
+  bool primary = true;  // first SMT thread of its core
+};
+
+// A data (or unified) cache, size 0 when unknown
+struct CacheInfo
+{
+  size_t size = 0;
+  size_t line_size = 64;
+  size_t shared_cores = 1;  // physical cores sharing it
+};
+
+/*
+ * The CPUs of the process and their caches, read once from /sys on Linux and
+ * from sysctl on macOS. Other systems get hardware_concurrency() performance
+ * cores and unknown caches.
+ * Only the CPUs of the process affinity mask are listed: under taskset or a
+ * cgroup cpuset this is the machine as far as we are concerned.
+ */
+class Manager : public internal::Singleton<Manager>
+{
+public:
+  Manager();
+
+  // Sorted by id
+  const std::vector<CpuInfo>& cpus() const { return cpus_; }
+
+  size_t num_packages() const { return num_packages_; }
+  size_t num_nodes() const { return nodes_.size(); }
+
+  // NUMA nodes with CPUs of the process, sorted
+  const std::vector<int>& nodes() const { return nodes_; }
+
+  // Physical cores, every kind
+  size_t num_cores() const { return num_cores_; }
+
+  // Physical performance cores, the default number of threads
+  size_t num_performance_cores() const { return num_performance_cores_; }
+
+  // Caches of a performance core
+  const CacheInfo& l1d() const { return l1d_; }
+  const CacheInfo& l2() const { return l2_; }
+  const CacheInfo& l3() const { return l3_; }
+
+  size_t page_size() const { return page_size_; }
+
+  /*
+   * CPUs for `num_threads` pinned threads, best first: one per physical
+   * performance core (spread over the NUMA nodes in turn), then the
+   * efficiency cores, then the SMT siblings. Two threads on the siblings of
+   * one core, or a thread on an E-core that the others wait for at every
+   * op, roughly halve decode throughput, so those come last. Fewer CPUs are
+   * returned when there are not enough of them. Only the CPUs of `node` when
+   * it is not -1.
+   */
+  std::vector<int> pinning(size_t num_threads, int node = -1) const;
+
+  // Physical performance cores of `node`
+  size_t num_performance_cores(int node) const;
+
+private:
+  void read_linux();
+  void read_darwin();
+  void count();
+
+  std::vector<CpuInfo> cpus_;
+  size_t num_packages_ = 1;
+  std::vector<int> nodes_;
+  size_t num_cores_ = 1;
+  size_t num_performance_cores_ = 1;
+  CacheInfo l1d_;
+  CacheInfo l2_;
+  CacheInfo l3_;
+  size_t page_size_ = 4096;
+};
+}  // namespace legrad::cpu
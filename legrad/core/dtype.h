@@ -1,6 +1,10 @@
 #pragma once
 
+#include <cstddef>
+#include <stdexcept>
+
 #include "internal/enum_impl.h"
+#include "internal/half_type.h"
 
 namespace legrad::core
 {
@@ -66,4 +70,11 @@ LEGRAD_ENUM(TypeKind, uint8_t, Bool, Float, Bool, Uint, Int, Float, COUNT)
                 "Unsupported TypeInfo", 0);         \
         }                                           \
     }()
-}
\ No newline at end of file
+// clang-format on
+
+// Size in bytes of one element of `type`
+inline size_t type_size(TypeInfo type)
+{
+  return CALL_DISPATCH_TYPE_INFO(type, [&] { return sizeof(scalar_t); });
+}
+}  // namespace legrad::core
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+
+#if defined(__linux__) && defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+#include "kernel_registry.h"
+#include "macros/log.h"
+
+namespace legrad::core
+{
+IsaLevel detect_isa_level()
+{
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+      && __builtin_cpu_supports("avx512vl")
+      && __builtin_cpu_supports("avx512dq"))
+  {
+    return IsaLevel::AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+      && __builtin_cpu_supports("f16c"))
+  {
+    return IsaLevel::AVX2;
+  }
+  return IsaLevel::Default;
+#elif defined(__linux__) && defined(__aarch64__)
+  // NEON (ASIMD) is mandatory on AArch64, there is no higher level (yet)
+  LEGRAD_ASSERT(getauxval(AT_HWCAP) & HWCAP_ASIMD,
+                "AArch64 CPU without ASIMD support", 0);
+  return IsaLevel::Default;
+#else
+  return IsaLevel::Default;
+#endif
+}
+
+KernelRegistry::KernelRegistry()
+    : detected_isa_level_(detect_isa_level())
+    , isa_level_(detected_isa_level_)
+{
+  if (const char* env = std::getenv("LEGRAD_CPU_ISA")) {
+    std::string name(env);
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    bool found = false;
+    for (auto level : IsaLevelIter()) {
+      std::string level_name = IsaLevelToString(level);
+      std::transform(level_name.begin(), level_name.end(), level_name.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      if (level_name == name) {
+        set_isa_level(level);
+        found = true;
+      }
+    }
+    if (!found) {
+      LEGRAD_LOG_WARN("Unknown LEGRAD_CPU_ISA value {}, ignore it", env);
+    }
+  }
+  LEGRAD_LOG_INFO("CPU kernels use ISA level {}", IsaLevelToString(isa_level_));
+}
+
+void KernelRegistry::set_isa_level(IsaLevel level)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (RawEnumVal(level) > RawEnumVal(detected_isa_level_)) {
+    LEGRAD_LOG_WARN("ISA level {} is not supported by this CPU, use {}",
+                    IsaLevelToString(level),
+                    IsaLevelToString(detected_isa_level_));
+    level = detected_isa_level_;
+  }
+  isa_level_ = level;
+  generation_.fetch_add(1, std::memory_order_acq_rel);
+}
+
+void KernelRegistry::register_kernel(const KernelKey& key, KernelFn fn)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  LEGRAD_CHECK_AND_THROW(fn != nullptr, std::invalid_argument,
+                         "Cannot register a null kernel for {}", key.op);
+  auto [it, inserted] = kernels_.emplace(key, fn);
+  if (!inserted) {
+    LEGRAD_LOG_WARN("Kernel {} ({}, {}, {}) is registered twice, keep first",
+                    key.op, TypeInfoToString(key.dtype),
+                    BackendToString(key.backend), IsaLevelToString(key.isa));
+  }
+}
+
+KernelRegistry::KernelFn KernelRegistry::find(const std::string& op,
+                                              TypeInfo dtype,
+                                              Backend backend) const
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  // Walk down from the current level to the most portable one
+  for (int level = RawEnumVal(isa_level_); level >= 0; --level) {
+    auto it = kernels_.find(
+        KernelKey{op, dtype, backend, static_cast<IsaLevel>(level)});
+    if (it != kernels_.end()) {
+      return it->second;
+    }
+  }
+  return nullptr;
+}
+
+std::vector<KernelKey> KernelRegistry::registered_kernels() const
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  std::vector<KernelKey> keys;
+  keys.reserve(kernels_.size());
+  for (const auto& [key, fn] : kernels_) {
+    keys.push_back(key);
+  }
+  return keys;
+}
+}  // namespace legrad::core
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "core/dtype.h"
+#include "internal/enum_impl.h"
+#include "internal/pattern.h"
+#include "macros/log.h"
+
+namespace legrad::core
+{
+LEGRAD_ENUM(Backend, uint8_t, CPU, Metal, CPU, Metal, COUNT)
+
+/*
+ * Instruction set levels a kernel can be compiled for, ordered from the most
+ * portable to the most specific. On ARM, Default already means NEON.
+ */
+LEGRAD_ENUM(IsaLevel, uint8_t, Default, AVX512, Default, AVX2, AVX512, COUNT)
+
+// Best IsaLevel supported by the running CPU (CPUID on x86, HWCAP on ARM)
+IsaLevel detect_isa_level();
+
+struct KernelKey
+{
+  std::string op;
+  TypeInfo dtype;
+  Backend backend;
+  IsaLevel isa;
+
+  bool operator<(const KernelKey& other) const
+  {
+    return std::tie(op, dtype, backend, isa)
+        < std::tie(other.op, other.dtype, other.backend, other.isa);
+  }
+};
+
+/*
+ * KernelRegistry maps (op, TypeInfo, Backend, IsaLevel) to a kernel.
+ * The same kernel can be registered for several IsaLevels (the kernel source
+ * is compiled once per level, see backend/cpu/isa.h), lookups return the
+ * variant with the highest level the running CPU supports.
+ * The level is detected once at startup and can be lowered with the
+ * environment variable LEGRAD_CPU_ISA=default|avx2|avx512.
+ * Kernels are stored type-erased, callers cast them back to the exact
+ * function pointer type they were registered with.
+ */
+class KernelRegistry : public internal::Singleton<KernelRegistry>
+{
+public:
+  using KernelFn = void (*)();
+
+  KernelRegistry();
+
+  void register_kernel(const KernelKey& key, KernelFn fn);
+
+  // Best registered kernel for the running CPU, nullptr if there is none
+  KernelFn find(const std::string& op, TypeInfo dtype, Backend backend) const;
+
+  template <typename Fn>
+  Fn lookup(const std::string& op, TypeInfo dtype, Backend backend) const
+  {
+    KernelFn fn = find(op, dtype, backend);
+    LEGRAD_CHECK_AND_THROW(fn != nullptr, std::runtime_error,
+                           "No kernel {} registered for dtype {} on {}", op,
+                           TypeInfoToString(dtype), BackendToString(backend));
+    return reinterpret_cast<Fn>(fn);
+  }
+
+  IsaLevel isa_level() const { return isa_level_; }
+  /*
+   * Restrict kernels to `level` (it cannot go above the detected level). The
+   * KernelStubs drop their cached kernels on their next call, ops already
+   * running on other threads end with the kernel they had.
+   */
+  void set_isa_level(IsaLevel level);
+
+  // Bumped by set_isa_level, KernelStubs compare it with their own
+  static uint32_t generation()
+  {
+    return generation_.load(std::memory_order_acquire);
+  }
+
+  std::vector<KernelKey> registered_kernels() const;
+
+private:
+  mutable std::mutex mtx_;
+  std::map<KernelKey, KernelFn> kernels_;
+  IsaLevel detected_isa_level_;
+  IsaLevel isa_level_;
+  static inline std::atomic<uint32_t> generation_{0};
+};
+
+/*
+ * KernelStub is what an op front-end holds: it caches the kernel selected
+ * for each (Backend, TypeInfo) so dispatch is two atomic loads (the registry
+ * generation and the kernel) after the first call. Similar to PyTorch's
+ * DispatchStub.
+ */
+template <typename Fn>
+class KernelStub
+{
+public:
+  explicit KernelStub(const char* op)
+      : op_(op)
+  {
+    for (auto& per_backend : cache_) {
+      for (auto& fn : per_backend) {
+        fn.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  Fn get(TypeInfo dtype, Backend backend = Backend::CPU)
+  {
+    const uint32_t generation = KernelRegistry::generation();
+    if (LEGRAD_UNLIKELY(generation
+                        != generation_.load(std::memory_order_acquire)))
+    {
+      reset();
+      generation_.store(generation, std::memory_order_release);
+    }
+    auto& slot = cache_[RawEnumVal(backend)][RawEnumVal(dtype)];
+    Fn fn = slot.load(std::memory_order_acquire);
+    if (LEGRAD_UNLIKELY(fn == nullptr)) {
+      fn = KernelRegistry::instance().lookup<Fn>(op_, dtype, backend);
+      slot.store(fn, std::memory_order_release);
+    }
+    return fn;
+  }
+
+  // Drop cached kernels, get does it after KernelRegistry::set_isa_level
+  void reset()
+  {
+    for (auto& per_backend : cache_) {
+      for (auto& fn : per_backend) {
+        fn.store(nullptr, std::memory_order_release);
+      }
+    }
+  }
+
+private:
+  const char* op_;
+  std::atomic<uint32_t> generation_{0};
+  std::array<std::array<std::atomic<Fn>, RawEnumVal(TypeInfo::COUNT)>,
+             RawEnumVal(Backend::COUNT)>
+      cache_;
+};
+
+/*
+ * Registers a kernel at static initialization time:
+ *   LEGRAD_REGISTER_KERNEL("binary", TypeInfo::Float32, Backend::CPU,
+ *                          IsaLevel::AVX2, &binary_kernel<float>);
+ */
+struct KernelRegistrar
+{
+  template <typename Fn>
+  KernelRegistrar(const char* op,
+                  TypeInfo dtype,
+                  Backend backend,
+                  IsaLevel isa,
+                  Fn fn)
+  {
+    KernelRegistry::instance().register_kernel(
+        KernelKey{op, dtype, backend, isa},
+        reinterpret_cast<KernelRegistry::KernelFn>(fn));
+  }
+};
+}  // namespace legrad::core
+
+#define LEGRAD_REGISTER_KERNEL(op, dtype, backend, isa, fn) \
+  static ::legrad::core::KernelRegistrar LEGRAD_CONCAT( \
+      legrad_kernel_registrar_, __COUNTER__)(op, dtype, backend, isa, fn);
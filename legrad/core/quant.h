@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#include "internal/enum_impl.h"
+#include "internal/view_pack.h"
+#include "macros/log.h"
+
+namespace legrad::core
+{
+/*
+ * Block quantization formats of GGUF (same layout as ggml, so tensors can be
+ * used straight from the mmap-ed file). A row of `cols` values is cols / 32
+ * consecutive blocks, each block has one half scale `d`:
+ * - Q8_0: value = d * qs[i]
+ * - Q4_0: value = d * (nibble - 8), byte j holds value j in its low nibble
+ *   and value j + 16 in its high nibble
+ */
+LEGRAD_ENUM(QuantType, uint8_t, Q4_0, Q8_0, Q4_0, Q8_0, COUNT)
+
+constexpr Int QK4_0 = 32;
+constexpr Int QK8_0 = 32;
+
+struct BlockQ4_0
+{
+  uint16_t d;  // IEEE half
+  uint8_t qs[QK4_0 / 2];
+};
+
+struct BlockQ8_0
+{
+  uint16_t d;  // IEEE half
+  int8_t qs[QK8_0];
+};
+
+LEGRAD_STATIC_ASSERT(sizeof(BlockQ4_0) == 18, "Wrong Q4_0 block padding");
+LEGRAD_STATIC_ASSERT(sizeof(BlockQ8_0) == 34, "Wrong Q8_0 block padding");
+
+// Number of values in one block
+constexpr Int quant_block_size(QuantType type)
+{
+  return type == QuantType::Q4_0 ? QK4_0 : QK8_0;
+}
+
+// Size in bytes of one block
+constexpr size_t quant_block_bytes(QuantType type)
+{
+  return type == QuantType::Q4_0 ? sizeof(BlockQ4_0) : sizeof(BlockQ8_0);
+}
+
+/*
+ * Non-owning view of a row-major quantized matrix [rows, cols], rows are
+ * packed one after another (GGUF layout).
+ */
+struct QuantMatrix
+{
+  const void* data = nullptr;
+  QuantType type = QuantType::Q8_0;
+  Int rows = 0;
+  Int cols = 0;
+
+  QuantMatrix() = default;
+
+  QuantMatrix(const void* data, QuantType type, Int rows, Int cols)
+      : data(data)
+      , type(type)
+      , rows(rows)
+      , cols(cols)
+  {
+    LEGRAD_CHECK_AND_THROW(cols % quant_block_size(type) == 0,
+                           std::invalid_argument,
+                           "{} rows must be a multiple of {} values, got {}",
+                           QuantTypeToString(type), quant_block_size(type),
+                           cols);
+  }
+
+  size_t row_bytes() const
+  {
+    return cols / quant_block_size(type) * quant_block_bytes(type);
+  }
+
+  const char* row(Int idx) const
+  {
+    return static_cast<const char*>(data) + idx * row_bytes();
+  }
+};
+}  // namespace legrad::core
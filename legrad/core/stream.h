@@ -0,0 +1,54 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include "core/kernel_registry.h"
+
+namespace legrad::core
+{
+/*
+ * A point in a Stream, it completes once all the work enqueued on the stream
+ * before it was recorded has run
+ */
+class Event
+{
+public:
+  virtual ~Event() = default;
+
+  // True once completed, never blocks
+  virtual bool query() const = 0;
+
+  // Block until completed, rethrows the error of the stream if any
+  virtual void synchronize() const = 0;
+};
+
+/*
+ * An in-order queue of work running asynchronously from the host, what a
+ * MTL::CommandQueue is to Metal: enqueue returns at once and the host goes
+ * on (next batch, tokenization, sampling) while the work runs. The host
+ * syncs with events or synchronize().
+ * Errors are sticky: once a work item threw, the work after it is skipped
+ * and the exception is rethrown by synchronize() (which clears it) and by
+ * the events recorded after it.
+ */
+class Stream
+{
+public:
+  virtual ~Stream() = default;
+
+  virtual Backend backend() const = 0;
+
+  // Run `work` after everything enqueued before it
+  virtual void enqueue(std::function<void()> work) = 0;
+
+  // An event completing when the work enqueued so far has run
+  virtual std::shared_ptr<Event> record() = 0;
+
+  // The work enqueued from now on waits for `event`, e.g. of another stream
+  virtual void wait(std::shared_ptr<Event> event) = 0;
+
+  // Block until all the enqueued work ran
+  virtual void synchronize() = 0;
+};
+}  // namespace legrad::core
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+
+#include "core/dtype.h"
+#include "internal/array_view.h"
+#include "internal/view_pack.h"
+#include "macros/log.h"
+
+namespace legrad::core
+{
+/*
+ * TensorView is a non-owning description of a strided tensor: a data pointer,
+ * its element type and the shape/stride pair. Strides are counted in elements
+ * (not bytes), the same way PyTorch does it.
+ * Kernels take TensorView instead of Buffer so they can work on any memory
+ * (CPUAllocator buffers, mmap-ed GGUF data, Metal shared buffers, ...).
+ */
+struct TensorView
+{
+  void* data = nullptr;
+  TypeInfo dtype = TypeInfo::Float32;
+  internal::view_pack view = internal::view_pack(0);
+
+  TensorView() = default;
+
+  // Contiguous (row-major) view
+  TensorView(void* data, TypeInfo dtype, IntArrayView shape)
+      : data(data)
+      , dtype(dtype)
+  {
+    view.set_shape(shape);
+    Int stride = 1;
+    for (size_t i = shape.size(); i > 0; --i) {
+      view.stride_data()[i - 1] = stride;
+      stride *= shape[i - 1];
+    }
+  }
+
+  TensorView(void* data,
+             TypeInfo dtype,
+             IntArrayView shape,
+             IntArrayView stride)
+      : data(data)
+      , dtype(dtype)
+  {
+    LEGRAD_CHECK_AND_THROW(shape.size() == stride.size(), std::invalid_argument,
+                           "Shape has {} dims but stride has {} dims",
+                           shape.size(), stride.size());
+    view.set_shape(shape);
+    view.set_stride(stride);
+  }
+
+  size_t dim() const { return view.dim(); }
+  IntArrayView shape() const { return view.shape_view(); }
+  IntArrayView stride() const { return view.stride_view(); }
+  Int shape_at(size_t idx) const { return view.shape_at(idx); }
+  Int stride_at(size_t idx) const { return view.stride_at(idx); }
+  size_t elem_size() const { return type_size(dtype); }
+
+  Int numel() const
+  {
+    Int n = 1;
+    for (const auto& s : shape()) {
+      n *= s;
+    }
+    return n;
+  }
+
+  bool is_contiguous() const
+  {
+    Int expected = 1;
+    for (size_t i = dim(); i > 0; --i) {
+      // stride of a dimension with size 1 does not matter
+      if (shape_at(i - 1) != 1 && stride_at(i - 1) != expected) {
+        return false;
+      }
+      expected *= shape_at(i - 1);
+    }
+    return true;
+  }
+
+  template <typename T>
+  T* data_ptr() const
+  {
+    return static_cast<T*>(data);
+  }
+};
+}  // namespace legrad::core
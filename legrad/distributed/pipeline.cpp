@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "macros/log.h"
+#include "pipeline.h"
+
+namespace legrad::distributed
+{
+namespace
+{
+constexpr uint32_t MESSAGE_MAGIC = 0x4C475050;  // "LGPP"
+
+struct MessageHeader
+{
+  uint32_t magic;
+  uint32_t micro_batch;
+  uint64_t nbytes;
+};
+
+// Exit status of a waitpid, 128 + the signal for a killed child
+int exit_status(int status)
+{
+  if (WIFEXITED(status)) {
+    return WEXITSTATUS(status);
+  }
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return 1;
+}
+}  // namespace
+
+std::pair<Int, Int> stage_layers(Int num_layers,
+                                 size_t stage,
+                                 size_t num_stages)
+{
+  LEGRAD_CHECK_AND_THROW(stage < num_stages, std::invalid_argument,
+                         "Stage {} out of {} stages", stage, num_stages);
+  LEGRAD_CHECK_AND_THROW(num_layers >= static_cast<Int>(num_stages),
+                         std::invalid_argument,
+                         "Cannot split {} layers in {} stages", num_layers,
+                         num_stages);
+  const Int stages = static_cast<Int>(num_stages);
+  const Int s = static_cast<Int>(stage);
+  const Int base = num_layers / stages;
+  const Int extra = num_layers % stages;
+  const Int first = s * base + std::min(s, extra);
+  return {first, first + base + (s < extra ? 1 : 0)};
+}
+
+PipelineStage::PipelineStage(size_t stage,
+                             size_t num_stages,
+                             Transport* prev,
+                             Transport* next)
+    : stage_(stage)
+    , num_stages_(num_stages)
+    , prev_(prev)
+    , next_(next)
+{
+  LEGRAD_CHECK_AND_THROW(stage < num_stages, std::invalid_argument,
+                         "Stage {} out of {} stages", stage, num_stages);
+  LEGRAD_CHECK_AND_THROW(is_first() || prev != nullptr, std::invalid_argument,
+                         "Stage {} has no link to the stage before", stage);
+  LEGRAD_CHECK_AND_THROW(is_last() || next != nullptr, std::invalid_argument,
+                         "Stage {} has no link to the stage after", stage);
+}
+
+void PipelineStage::send(Transport* transport,
+                         size_t mb,
+                         const void* data,
+                         size_t nbytes)
+{
+  const MessageHeader header = {MESSAGE_MAGIC, static_cast<uint32_t>(mb),
+                                nbytes};
+  transport->send(&header, sizeof(header));
+  transport->send(data, nbytes);
+}
+
+void PipelineStage::recv(Transport* transport, size_t mb, Message& message)
+{
+  MessageHeader header = {};
+  transport->recv(&header, sizeof(header));
+  LEGRAD_CHECK_AND_THROW(header.magic == MESSAGE_MAGIC, std::runtime_error,
+                         "Stage {} got a corrupted message", stage_);
+  LEGRAD_CHECK_AND_THROW(header.micro_batch == mb, std::runtime_error,
+                         "Stage {} expected micro-batch {}, got {}", stage_,
+                         mb, header.micro_batch);
+  message.resize(header.nbytes);
+  transport->recv(message.data(), message.size());
+}
+
+void PipelineStage::run_step(size_t num_micro_batches, const StageFn& fn)
+{
+  for (size_t mb = 0; mb < num_micro_batches; ++mb) {
+    in_.clear();
+    out_.clear();
+    if (!is_first()) {
+      recv(prev_, mb, in_);
+    }
+    fn(mb, in_, out_);
+    // Returns once in the ring (or the socket), the next one overlaps
+    if (!is_last()) {
+      send(next_, mb, out_.data(), out_.size());
+    }
+  }
+}
+
+void PipelineStage::send_feedback(size_t mb, const void* data, size_t nbytes)
+{
+  LEGRAD_CHECK_AND_THROW(is_last() && next_ != nullptr, std::logic_error,
+                         "Only the last stage feeds back, with a link", 0);
+  send(next_, mb, data, nbytes);
+}
+
+PipelineStage::Message PipelineStage::recv_feedback(size_t mb)
+{
+  LEGRAD_CHECK_AND_THROW(is_first() && prev_ != nullptr, std::logic_error,
+                         "Only the first stage gets feedback, with a link", 0);
+  Message message;
+  recv(prev_, mb, message);
+  return message;
+}
+
+void PipelineStage::close()
+{
+  if (prev_ != nullptr) {
+    prev_->close();
+  }
+  if (next_ != nullptr) {
+    next_->close();
+  }
+}
+
+int run_local_pipeline(size_t num_stages,
+                       const std::function<void(PipelineStage&)>& stage_main,
+                       size_t ring_bytes)
+{
+  LEGRAD_CHECK_AND_THROW(num_stages > 0, std::invalid_argument,
+                         "A pipeline needs a stage", 0);
+  // links[s] goes from stage s to the next one, the last one loops back
+  std::vector<std::unique_ptr<ShmTransport>> links;
+  for (size_t s = 0; s < num_stages; ++s) {
+    links.push_back(ShmTransport::create("", ring_bytes));
+  }
+
+  // Or the children print what the parent has buffered once more
+  std::fflush(nullptr);
+  std::vector<pid_t> children;
+  for (size_t s = 0; s < num_stages; ++s) {
+    const pid_t pid = fork();
+    if (pid < 0) {
+      LEGRAD_LOG_ERR("Cannot fork stage {}: {}", s, std::strerror(errno));
+      for (auto& link : links) {
+        link->close();
+      }
+      for (pid_t child : children) {
+        waitpid(child, nullptr, 0);
+      }
+      return 1;
+    }
+    if (pid == 0) {
+      int status = 0;
+      try {
+        auto prev = links[(s + num_stages - 1) % num_stages]->peer();
+        PipelineStage stage(s, num_stages, prev.get(), links[s].get());
+        try {
+          stage_main(stage);
+        } catch (...) {
+          stage.close();
+          throw;
+        }
+      } catch (const std::exception& e) {
+        LEGRAD_LOG_ERR("Pipeline stage {} failed: {}", s, e.what());
+        status = 1;
+      } catch (...) {
+        LEGRAD_LOG_ERR("Pipeline stage {} failed", s);
+        status = 1;
+      }
+      // No destructor, no atexit: the mappings belong to the parent
+      std::fflush(nullptr);
+      _exit(status);
+    }
+    children.push_back(pid);
+  }
+
+  /*
+   * Poll our own children only, waitpid(-1) would reap the other children
+   * of the process as well
+   */
+  int result = 0;
+  while (!children.empty()) {
+    bool reaped = false;
+    for (auto it = children.begin(); it != children.end();) {
+      int status = 0;
+      const pid_t pid = waitpid(*it, &status, WNOHANG);
+      if (pid == 0) {
+        ++it;
+        continue;
+      }
+      it = children.erase(it);
+      reaped = true;
+      const int code = pid < 0 ? 1 : exit_status(status);
+      if (code != 0 && result == 0) {
+        // A killed stage closed nothing, unblock the others
+        result = code;
+        for (auto& link : links) {
+          link->close();
+        }
+      }
+    }
+    if (!reaped) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  return result;
+}
+}  // namespace legrad::distributed
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "distributed/transport.h"
+#include "internal/view_pack.h"
+
+namespace legrad::distributed
+{
+/*
+ * Layers [first, last) of `stage` when `num_layers` are cut in `num_stages`
+ * contiguous ranges, the first stages take one more layer when it does not
+ * divide evenly
+ */
+std::pair<Int, Int> stage_layers(Int num_layers,
+                                 size_t stage,
+                                 size_t num_stages);
+
+/*
+ * One stage of a pipeline: a process that runs a range of layers, takes the
+ * activations of the stage before and hands its own to the stage after.
+ * The stages form a ring, `prev` of the first stage and `next` of the last
+ * are the same link and carry what the last stage feeds back to the first
+ * (the sampled tokens of decode), it can be null when nothing is fed back.
+ *
+ * A step is cut in micro-batches (groups of sequences, chunks of a prompt)
+ * that flow through the stages one after the other: stage 1 computes the
+ * first micro-batch while stage 0 is on the second one, and with at least as
+ * many micro-batches as stages every stage is busy.
+ *
+ *   PipelineStage stage(s, n, prev, next);
+ *   auto [first, last] = stage.layers(num_layers);
+ *   stage.run_step(num_seqs, [&](size_t mb, const auto& in, auto& out) {
+ *     if (stage.is_first()) { embed(tokens[mb]); } else { load(in); }
+ *     for (Int l = first; l < last; ++l) { layers[l].forward(...); }
+ *     if (stage.is_last()) { stage.send_feedback(mb, &token, 4); }
+ *     else { store(out); }
+ *   });
+ */
+class PipelineStage
+{
+public:
+  using Message = std::vector<uint8_t>;
+  /*
+   * Compute micro-batch `mb`: `in` holds what the stage before sent for it
+   * (empty on the first stage), `out` is sent to the stage after (ignored on
+   * the last stage)
+   */
+  using StageFn = std::function<void(size_t, const Message&, Message&)>;
+
+  PipelineStage(size_t stage,
+                size_t num_stages,
+                Transport* prev,
+                Transport* next);
+
+  size_t stage() const { return stage_; }
+  size_t num_stages() const { return num_stages_; }
+  bool is_first() const { return stage_ == 0; }
+  bool is_last() const { return stage_ + 1 == num_stages_; }
+
+  std::pair<Int, Int> layers(Int num_layers) const
+  {
+    return stage_layers(num_layers, stage_, num_stages_);
+  }
+
+  // Run fn on the micro-batches 0 .. num_micro_batches - 1 in order
+  void run_step(size_t num_micro_batches, const StageFn& fn);
+
+  /*
+   * Last stage: send the result of micro-batch `mb` back to the first stage,
+   * which gets it with recv_feedback (for the next step, most of the time)
+   */
+  void send_feedback(size_t mb, const void* data, size_t nbytes);
+  Message recv_feedback(size_t mb);
+
+  // Fail the transfers of every stage this one is linked to
+  void close();
+
+private:
+  void send(Transport* transport, size_t mb, const void* data, size_t nbytes);
+  void recv(Transport* transport, size_t mb, Message& message);
+
+  size_t stage_;
+  size_t num_stages_;
+  Transport* prev_;
+  Transport* next_;
+  Message in_;
+  Message out_;
+};
+
+/*
+ * Run the `num_stages` stages of a pipeline on this machine, one forked
+ * process each, linked by anonymous shared memory rings of `ring_bytes` per
+ * direction. Every child calls stage_main with its own PipelineStage and
+ * exits. When a stage throws, the links of the others are closed so their
+ * transfers fail instead of hanging.
+ * Returns 0 when every stage returned, the exit status of the first that
+ * failed otherwise. Fork before any thread pool is started: a child only
+ * gets the thread that called this.
+ */
+int run_local_pipeline(size_t num_stages,
+                       const std::function<void(PipelineStage&)>& stage_main,
+                       size_t ring_bytes = size_t(64) << 20);
+}  // namespace legrad::distributed
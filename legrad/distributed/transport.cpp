@@ -0,0 +1,516 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "backend/cpu/sync.h"
+#include "macros/log.h"
+#include "transport.h"
+
+namespace legrad::distributed
+{
+LEGRAD_STATIC_ASSERT(std::atomic<uint64_t>::is_always_lock_free,
+                     "Rings in shared memory need lock-free atomics");
+
+/*
+ * Bytes go in at head and out at tail, both count from the start so
+ * head - tail is the fill. The sequences are bumped after every write
+ * (data) and read (space), a blocked side sleeps on them.
+ */
+struct ShmTransport::Ring
+{
+  alignas(64) std::atomic<uint64_t> head{0};
+  alignas(64) std::atomic<uint64_t> tail{0};
+  alignas(64) std::atomic<uint32_t> data_seq{0};
+  std::atomic<uint32_t> data_waiters{0};
+  alignas(64) std::atomic<uint32_t> space_seq{0};
+  std::atomic<uint32_t> space_waiters{0};
+  alignas(64) std::atomic<uint32_t> closed{0};
+  std::atomic<uint32_t> ready{0};  // set by the creator last
+  uint64_t capacity = 0;
+
+  char* data() { return reinterpret_cast<char*>(this + 1); }
+};
+
+namespace
+{
+using Ring = ShmTransport::Ring;
+
+constexpr uint32_t RING_READY = 0x4C475244;  // "LGRD"
+
+// Polls of a full or empty ring before sleeping on it
+constexpr int RING_SPIN = 1 << 12;
+
+/*
+ * Longest sleep on a ring: a peer that died without closing it never wakes
+ * us up, close() from anyone else (the harness) then gets through
+ */
+constexpr long RING_SLEEP_NS = 100 * 1000 * 1000;
+
+size_t mapping_bytes(size_t ring_bytes)
+{
+  return 2 * (sizeof(Ring) + ring_bytes);
+}
+
+Ring* ring_at(void* mapping, size_t ring_bytes, int index)
+{
+  return reinterpret_cast<Ring*>(static_cast<char*>(mapping)
+                                 + index * (sizeof(Ring) + ring_bytes));
+}
+
+void sleep_on(std::atomic<uint32_t>& seq,
+              std::atomic<uint32_t>& waiters,
+              uint32_t seen)
+{
+  waiters.fetch_add(1);
+#ifdef __linux__
+  if (seq.load() == seen) {
+    const timespec timeout = {0, RING_SLEEP_NS};
+    // Not FUTEX_PRIVATE: the word is shared with another process
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq), FUTEX_WAIT, seen,
+            &timeout, nullptr, 0);
+  }
+#else
+  (void)seen;
+  std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+  waiters.fetch_sub(1);
+}
+
+void wake(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiters)
+{
+  seq.fetch_add(1);
+#ifdef __linux__
+  if (waiters.load() != 0) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq), FUTEX_WAKE, INT_MAX,
+            nullptr, nullptr, 0);
+  }
+#else
+  (void)waiters;
+#endif
+}
+
+void check_open(const Ring* ring)
+{
+  LEGRAD_CHECK_AND_THROW(ring->closed.load() == 0, std::runtime_error,
+                         "Shared memory transport is closed", 0);
+}
+
+std::string shm_path(const std::string& name)
+{
+  return name.front() == '/' ? name : "/" + name;
+}
+
+// "unix:path" or "tcp:host:port" -> {"unix" or "tcp", rest}
+std::pair<std::string, std::string> split_address(const std::string& address)
+{
+  const size_t colon = address.find(':');
+  LEGRAD_CHECK_AND_THROW(colon != std::string::npos, std::invalid_argument,
+                         "Transport address {} has no scheme", address);
+  return {address.substr(0, colon), address.substr(colon + 1)};
+}
+
+/*
+ * Socket bound (listen) or connected to `address`, -1 if connect failed;
+ * errors of the address itself throw
+ */
+int open_socket(const std::string& address, bool listen)
+{
+  const auto [scheme, rest] = split_address(address);
+  int fd = -1;
+  if (scheme == "unix") {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    LEGRAD_CHECK_AND_THROW(rest.size() < sizeof(addr.sun_path),
+                           std::invalid_argument,
+                           "Unix socket path {} is too long", rest);
+    std::strcpy(addr.sun_path, rest.c_str());
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    LEGRAD_CHECK_AND_THROW(fd >= 0, std::runtime_error,
+                           "Cannot create socket: {}", std::strerror(errno));
+    if (listen) {
+      ::unlink(rest.c_str());
+      if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        LEGRAD_THROW_ERROR(std::runtime_error, "Cannot bind {}: {}", address,
+                           std::strerror(errno));
+      }
+    } else if (::connect(fd, reinterpret_cast<sockaddr*>(&addr),
+                         sizeof(addr))
+               != 0)
+    {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  LEGRAD_CHECK_AND_THROW(scheme == "tcp", std::invalid_argument,
+                         "Unknown transport address {}", address);
+  const size_t colon = rest.rfind(':');
+  LEGRAD_CHECK_AND_THROW(colon != std::string::npos, std::invalid_argument,
+                         "TCP address {} has no port", address);
+  const std::string host = rest.substr(0, colon);
+  const std::string port = rest.substr(colon + 1);
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listen ? AI_PASSIVE : 0;
+  addrinfo* infos = nullptr;
+  const int rc = ::getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                               port.c_str(), &hints, &infos);
+  LEGRAD_CHECK_AND_THROW(rc == 0, std::invalid_argument,
+                         "Cannot resolve {}: {}", address, gai_strerror(rc));
+  for (addrinfo* info = infos; info != nullptr; info = info->ai_next) {
+    fd = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    const int one = 1;
+    if (listen) {
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (::bind(fd, info->ai_addr, info->ai_addrlen) == 0) {
+        break;
+      }
+    } else if (::connect(fd, info->ai_addr, info->ai_addrlen) == 0) {
+      // Activations go out as soon as a stage is done with them
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      break;
+    }
+    ::close(fd);
+    fd = -1;
+  }
+  ::freeaddrinfo(infos);
+  LEGRAD_CHECK_AND_THROW(fd >= 0 || !listen, std::runtime_error,
+                         "Cannot bind {}: {}", address, std::strerror(errno));
+  return fd;
+}
+}  // namespace
+
+std::unique_ptr<ShmTransport> ShmTransport::create(const std::string& name,
+                                                   size_t ring_bytes)
+{
+  ring_bytes = std::max<size_t>((ring_bytes + 63) / 64 * 64, 64);
+  const size_t bytes = mapping_bytes(ring_bytes);
+  void* mapping = MAP_FAILED;
+  if (name.empty()) {
+    mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  } else {
+    // A stale object of a crashed run would have the wrong rings
+    shm_unlink(shm_path(name).c_str());
+    const int fd =
+        shm_open(shm_path(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    LEGRAD_CHECK_AND_THROW(fd >= 0, std::runtime_error,
+                           "Cannot create shared memory {}: {}", name,
+                           std::strerror(errno));
+    if (ftruncate(fd, static_cast<off_t>(bytes)) == 0) {
+      mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+  }
+  if (mapping == MAP_FAILED) {
+    if (!name.empty()) {
+      shm_unlink(shm_path(name).c_str());
+    }
+    LEGRAD_THROW_ERROR(std::runtime_error, "Cannot map shared memory {}: {}",
+                       name, std::strerror(errno));
+  }
+
+  for (int index = 0; index < 2; ++index) {
+    Ring* ring = new (ring_at(mapping, ring_bytes, index)) Ring();
+    ring->capacity = ring_bytes;
+  }
+  ring_at(mapping, ring_bytes, 0)->ready.store(RING_READY);
+  return std::unique_ptr<ShmTransport>(
+      new ShmTransport(mapping, bytes, name, true, true));
+}
+
+std::unique_ptr<ShmTransport> ShmTransport::open(const std::string& name)
+{
+  LEGRAD_CHECK_AND_THROW(!name.empty(), std::invalid_argument,
+                         "Only named shared memory can be opened", 0);
+  // The creator may not be there yet
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(30);
+  while (true) {
+    const int fd = shm_open(shm_path(name).c_str(), O_RDWR, 0600);
+    struct stat st = {};
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+      const size_t bytes = static_cast<size_t>(st.st_size);
+      void* mapping =
+          mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      ::close(fd);
+      LEGRAD_CHECK_AND_THROW(mapping != MAP_FAILED, std::runtime_error,
+                             "Cannot map shared memory {}: {}", name,
+                             std::strerror(errno));
+      Ring* first = static_cast<Ring*>(mapping);
+      if (first->ready.load() == RING_READY) {
+        return std::unique_ptr<ShmTransport>(
+            new ShmTransport(mapping, bytes, name, false, true));
+      }
+      munmap(mapping, bytes);
+    } else if (fd >= 0) {
+      ::close(fd);
+    }
+    LEGRAD_CHECK_AND_THROW(std::chrono::steady_clock::now() < deadline,
+                           std::runtime_error,
+                           "Shared memory {} was never created", name);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+ShmTransport::ShmTransport(void* mapping,
+                           size_t mapping_bytes,
+                           std::string name,
+                           bool creator_side,
+                           bool owner)
+    : mapping_(mapping)
+    , mapping_bytes_(mapping_bytes)
+    , name_(std::move(name))
+    , creator_side_(creator_side)
+    , owner_(owner)
+{
+  Ring* first = static_cast<Ring*>(mapping);
+  Ring* second = ring_at(mapping, first->capacity, 1);
+  tx_ = creator_side ? first : second;
+  rx_ = creator_side ? second : first;
+}
+
+ShmTransport::~ShmTransport()
+{
+  if (!owner_) {
+    return;
+  }
+  close();
+  munmap(mapping_, mapping_bytes_);
+  if (creator_side_ && !name_.empty()) {
+    shm_unlink(shm_path(name_).c_str());
+  }
+}
+
+std::unique_ptr<ShmTransport> ShmTransport::peer() const
+{
+  return std::unique_ptr<ShmTransport>(new ShmTransport(
+      mapping_, mapping_bytes_, name_, !creator_side_, false));
+}
+
+void ShmTransport::send(const void* data, size_t nbytes)
+{
+  const char* src = static_cast<const char*>(data);
+  const uint64_t capacity = tx_->capacity;
+  while (nbytes > 0) {
+    const uint64_t head = tx_->head.load(std::memory_order_relaxed);
+    uint64_t tail = 0;
+    for (int spins = 0;; ++spins) {
+      check_open(tx_);
+      const uint32_t seen = tx_->space_seq.load();
+      tail = tx_->tail.load(std::memory_order_acquire);
+      if (head - tail < capacity) {
+        break;
+      }
+      if (spins < RING_SPIN) {
+        cpu::cpu_relax();
+      } else {
+        sleep_on(tx_->space_seq, tx_->space_waiters, seen);
+      }
+    }
+
+    const size_t chunk =
+        std::min<size_t>(nbytes, capacity - (head - tail));
+    const size_t offset = head % capacity;
+    const size_t first = std::min<size_t>(chunk, capacity - offset);
+    std::memcpy(tx_->data() + offset, src, first);
+    std::memcpy(tx_->data(), src + first, chunk - first);
+    tx_->head.store(head + chunk, std::memory_order_release);
+    wake(tx_->data_seq, tx_->data_waiters);
+    src += chunk;
+    nbytes -= chunk;
+  }
+}
+
+void ShmTransport::recv(void* data, size_t nbytes)
+{
+  char* dst = static_cast<char*>(data);
+  const uint64_t capacity = rx_->capacity;
+  while (nbytes > 0) {
+    const uint64_t tail = rx_->tail.load(std::memory_order_relaxed);
+    uint64_t head = 0;
+    for (int spins = 0;; ++spins) {
+      const uint32_t seen = rx_->data_seq.load();
+      head = rx_->head.load(std::memory_order_acquire);
+      if (head > tail) {
+        break;
+      }
+      // Bytes sent before the close are still delivered
+      check_open(rx_);
+      if (spins < RING_SPIN) {
+        cpu::cpu_relax();
+      } else {
+        sleep_on(rx_->data_seq, rx_->data_waiters, seen);
+      }
+    }
+
+    const size_t chunk = std::min<size_t>(nbytes, head - tail);
+    const size_t offset = tail % capacity;
+    const size_t first = std::min<size_t>(chunk, capacity - offset);
+    std::memcpy(dst, rx_->data() + offset, first);
+    std::memcpy(dst + first, rx_->data(), chunk - first);
+    rx_->tail.store(tail + chunk, std::memory_order_release);
+    wake(rx_->space_seq, rx_->space_waiters);
+    dst += chunk;
+    nbytes -= chunk;
+  }
+}
+
+void ShmTransport::close()
+{
+  for (Ring* ring : {tx_, rx_}) {
+    ring->closed.store(1);
+    wake(ring->data_seq, ring->data_waiters);
+    wake(ring->space_seq, ring->space_waiters);
+  }
+}
+
+SocketTransport::SocketTransport(int fd)
+    : fd_(fd)
+{
+#if defined(SO_NOSIGPIPE)
+  const int one = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+std::unique_ptr<SocketTransport> SocketTransport::listen(
+    const std::string& address)
+{
+  const int server = open_socket(address, true);
+  if (::listen(server, 1) != 0) {
+    ::close(server);
+    LEGRAD_THROW_ERROR(std::runtime_error, "Cannot listen on {}: {}", address,
+                       std::strerror(errno));
+  }
+  LEGRAD_LOG_INFO("Wait for a connection on {}", address);
+  const int fd = ::accept(server, nullptr, nullptr);
+  ::close(server);
+  const auto [scheme, path] = split_address(address);
+  if (scheme == "unix") {
+    ::unlink(path.c_str());
+  }
+  LEGRAD_CHECK_AND_THROW(fd >= 0, std::runtime_error,
+                         "Cannot accept on {}: {}", address,
+                         std::strerror(errno));
+  if (scheme == "tcp") {
+    const int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return std::unique_ptr<SocketTransport>(new SocketTransport(fd));
+}
+
+std::unique_ptr<SocketTransport> SocketTransport::connect(
+    const std::string& address,
+    int timeout_ms)
+{
+  const auto deadline = std::chrono::steady_clock::now()
+                      + std::chrono::milliseconds(timeout_ms);
+  while (true) {
+    const int fd = open_socket(address, false);
+    if (fd >= 0) {
+      return std::unique_ptr<SocketTransport>(new SocketTransport(fd));
+    }
+    LEGRAD_CHECK_AND_THROW(std::chrono::steady_clock::now() < deadline,
+                           std::runtime_error, "Cannot connect to {}: {}",
+                           address, std::strerror(errno));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+}
+
+SocketTransport::~SocketTransport()
+{
+  const int fd = fd_.exchange(-1);
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+void SocketTransport::send(const void* data, size_t nbytes)
+{
+#ifdef MSG_NOSIGNAL
+  constexpr int flags = MSG_NOSIGNAL;
+#else
+  constexpr int flags = 0;
+#endif
+  const char* src = static_cast<const char*>(data);
+  while (nbytes > 0) {
+    const ssize_t sent = ::send(fd_.load(), src, nbytes, flags);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    LEGRAD_CHECK_AND_THROW(sent > 0, std::runtime_error,
+                           "Socket transport send failed: {}",
+                           std::strerror(errno));
+    src += sent;
+    nbytes -= static_cast<size_t>(sent);
+  }
+}
+
+void SocketTransport::recv(void* data, size_t nbytes)
+{
+  char* dst = static_cast<char*>(data);
+  while (nbytes > 0) {
+    const ssize_t got = ::recv(fd_.load(), dst, nbytes, 0);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    LEGRAD_CHECK_AND_THROW(got != 0, std::runtime_error,
+                           "Socket transport closed by the peer", 0);
+    LEGRAD_CHECK_AND_THROW(got > 0, std::runtime_error,
+                           "Socket transport recv failed: {}",
+                           std::strerror(errno));
+    dst += got;
+    nbytes -= static_cast<size_t>(got);
+  }
+}
+
+void SocketTransport::close()
+{
+  // Wakes up a blocked recv, the descriptor is closed with the transport
+  ::shutdown(fd_.load(), SHUT_RDWR);
+}
+
+std::unique_ptr<Transport> make_transport(const std::string& address,
+                                          bool listen,
+                                          size_t ring_bytes)
+{
+  const auto [scheme, rest] = split_address(address);
+  if (scheme == "shm") {
+    if (listen) {
+      return ShmTransport::create(rest, ring_bytes);
+    }
+    return ShmTransport::open(rest);
+  }
+  if (listen) {
+    return SocketTransport::listen(address);
+  }
+  return SocketTransport::connect(address);
+}
+}  // namespace legrad::distributed
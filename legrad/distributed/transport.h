@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace legrad::distributed
+{
+/*
+ * A reliable, ordered, bidirectional byte stream between two processes.
+ * send and recv block until all the bytes went through, they throw
+ * std::runtime_error once the other side is gone. One thread sends and one
+ * thread receives at a time.
+ */
+class Transport
+{
+public:
+  virtual ~Transport() = default;
+
+  virtual void send(const void* data, size_t nbytes) = 0;
+  virtual void recv(void* data, size_t nbytes) = 0;
+
+  // Wake and fail the pending and future calls of both sides
+  virtual void close() = 0;
+};
+
+/*
+ * Two single-producer single-consumer rings in shared memory, one per
+ * direction. A full or empty ring is polled for a while, then waited on
+ * with a futex shared between the processes (a sleep-poll outside of
+ * Linux).
+ * The side that creates it maps a POSIX shared memory object `name` (or an
+ * anonymous shared mapping that fork() hands down when `name` is empty), the
+ * other side opens it by name. The creator unlinks the name when it is
+ * destroyed.
+ */
+class ShmTransport : public Transport
+{
+public:
+  static std::unique_ptr<ShmTransport> create(const std::string& name,
+                                              size_t ring_bytes);
+  static std::unique_ptr<ShmTransport> open(const std::string& name);
+
+  ~ShmTransport() override;
+
+  void send(const void* data, size_t nbytes) override;
+  void recv(void* data, size_t nbytes) override;
+  void close() override;
+
+  /*
+   * The same rings seen from the other side, for the child of a fork of an
+   * anonymous transport. It does not own the mapping, `this` must outlive it.
+   */
+  std::unique_ptr<ShmTransport> peer() const;
+
+  struct Ring;
+
+private:
+  /*
+   * The creator side sends on the first ring. `owner` unmaps the mapping
+   * (and unlinks the name on the creator side) when destroyed.
+   */
+  ShmTransport(void* mapping,
+               size_t mapping_bytes,
+               std::string name,
+               bool creator_side,
+               bool owner);
+
+  void* mapping_;
+  size_t mapping_bytes_;
+  std::string name_;
+  bool creator_side_;
+  bool owner_;
+  Ring* tx_;
+  Ring* rx_;
+};
+
+/*
+ * A stream socket: "unix:/path/to/socket" or "tcp:host:port". listen()
+ * waits for a single connection, connect() retries until the listening side
+ * is up or `timeout_ms` passed.
+ */
+class SocketTransport : public Transport
+{
+public:
+  static std::unique_ptr<SocketTransport> listen(const std::string& address);
+  static std::unique_ptr<SocketTransport> connect(const std::string& address,
+                                                  int timeout_ms = 30000);
+
+  ~SocketTransport() override;
+
+  void send(const void* data, size_t nbytes) override;
+  void recv(void* data, size_t nbytes) override;
+  void close() override;
+
+private:
+  explicit SocketTransport(int fd);
+
+  std::atomic<int> fd_;
+};
+
+/*
+ * A transport from an address: "shm:name", "unix:path" or "tcp:host:port",
+ * `listen` is the side that creates it (the shared memory, the listening
+ * socket)
+ */
+std::unique_ptr<Transport> make_transport(const std::string& address,
+                                          bool listen,
+                                          size_t ring_bytes = size_t(64) << 20);
+}  // namespace legrad::distributed
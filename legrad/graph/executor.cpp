@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "backend/cpu/attention.h"
+#include "backend/cpu/cast.h"
+#include "backend/cpu/elementwise.h"
+#include "backend/cpu/fused.h"
+#include "backend/cpu/gemm.h"
+#include "backend/cpu/index.h"
+#include "backend/cpu/norm.h"
+#include "backend/cpu/rope.h"
+#include "backend/cpu/softmax.h"
+#include "executor.h"
+#include "macros/log.h"
+
+namespace legrad::graph
+{
+using core::TypeInfo;
+
+Executor::Executor(const Graph& graph, core::Allocator* allocator)
+    : graph_(graph)
+    , values_(graph.size())
+{
+  LEGRAD_CHECK_AND_THROW(allocator != nullptr, std::invalid_argument,
+                         "Executor needs an allocator", 0);
+  const NodeId size = static_cast<NodeId>(graph_.size());
+
+  // Rotate in place when nothing else reads the input
+  const auto users = graph_.users();
+  for (NodeId id = 0; id < size; ++id) {
+    Node& node = graph_.node(id);
+    if (node.op != OpKind::Rope) {
+      continue;
+    }
+    const NodeId in = node.inputs[0];
+    const OpKind in_op = graph_.node(in).op;
+    if (in_op != OpKind::Input && in_op != OpKind::CacheWrite
+        && in_op != OpKind::View && !graph_.is_output(in)
+        && users[in].size() == 1)
+    {
+      node.alias = in;
+    }
+  }
+
+  plan_ = plan_memory(graph_);
+  if (plan_.bytes > 0) {
+    arena_ = allocator->malloc(plan_.bytes);
+    LEGRAD_CHECK_AND_THROW(arena_.get() != nullptr, std::runtime_error,
+                           "Cannot allocate the {} bytes of a graph",
+                           plan_.bytes);
+  }
+  for (NodeId id = 0; id < size; ++id) {
+    const Node& node = graph_.node(id);
+    if (node.op == OpKind::Input) {
+      values_[id] = node.view;
+    } else if (node.alias != NO_NODE) {
+      resolve_alias(id);
+    } else if (plan_.offsets[id] != NO_OFFSET) {
+      values_[id] = core::TensorView(
+          static_cast<char*>(arena_.get()) + plan_.offsets[id], node.dtype,
+          node.shape);
+    }
+  }
+
+  // The tokens of a step and how far they can go
+  tokens_ = -1;
+  for (NodeId id = 0; id < size; ++id) {
+    const Node& node = graph_.node(id);
+    Int tokens = 0;
+    if (node.op == OpKind::Rope) {
+      tokens = node.shape[node.dim];
+      max_position_ = std::min(max_position_, node.rope->max_positions());
+    } else if (node.op == OpKind::CacheWrite) {
+      tokens = graph_.node(node.inputs[1]).shape[node.dim];
+      max_position_ = std::min(max_position_, node.shape[node.dim]);
+      max_kv_len_ = std::min(max_kv_len_, node.shape[node.dim]);
+    } else {
+      if (node.op == OpKind::Attention
+          && graph_.node(node.inputs[1]).op == OpKind::CacheWrite)
+      {
+        reads_cache_ = true;
+      }
+      continue;
+    }
+    LEGRAD_CHECK_AND_THROW(tokens_ < 0 || tokens == tokens_,
+                           std::invalid_argument,
+                           "%{} has {} tokens, other nodes have {}", id,
+                           tokens, tokens_);
+    tokens_ = tokens;
+  }
+  tokens_ = std::max<Int>(tokens_, 0);
+  positions_.assign(tokens_, 0);
+}
+
+void Executor::set_input(NodeId id, const core::TensorView& view)
+{
+  const Node& node = graph_.node(id);
+  LEGRAD_CHECK_AND_THROW(node.op == OpKind::Input, std::invalid_argument,
+                         "%{} is not an input", id);
+  LEGRAD_CHECK_AND_THROW(
+      view.dtype == node.dtype && view.shape() == node.shape,
+      std::invalid_argument, "Input %{} is {} {}, got {} {}", id,
+      core::TypeInfoToString(node.dtype),
+      IntArrayView::numerical_view_2str(node.shape),
+      core::TypeInfoToString(view.dtype),
+      IntArrayView::numerical_view_2str(view.shape()));
+  values_[id] = view;
+  for (NodeId node_id = id; node_id < static_cast<NodeId>(graph_.size());
+       ++node_id)
+  {
+    if (graph_.node(node_id).alias != NO_NODE) {
+      resolve_alias(node_id);
+    }
+  }
+  kernels_ = cpu::CapturedKernels();
+  captured_ = false;
+}
+
+void Executor::resolve_alias(NodeId id)
+{
+  const Node& node = graph_.node(id);
+  const core::TensorView& storage = values_[node.alias];
+  if (node.op == OpKind::View) {
+    values_[id] = core::TensorView(
+        static_cast<char*>(storage.data)
+            + node.offset * static_cast<Int>(core::type_size(node.dtype)),
+        node.dtype, node.shape, node.stride);
+  } else {
+    // Computed in place: same shape and dtype
+    values_[id] = storage;
+  }
+}
+
+void Executor::set_step(const StepParams& params)
+{
+  LEGRAD_CHECK_AND_THROW(
+      params.position >= 0 && params.position + tokens_ <= max_position_,
+      std::out_of_range, "A step of {} tokens cannot start at position {}",
+      tokens_, params.position);
+  LEGRAD_CHECK_AND_THROW(
+      !reads_cache_
+          || (params.kv_len >= tokens_ && params.kv_len <= max_kv_len_),
+      std::out_of_range, "A step of {} tokens cannot see {} cached keys",
+      tokens_, params.kv_len);
+  for (Int i = 0; i < tokens_; ++i) {
+    positions_[i] = static_cast<int32_t>(params.position + i);
+  }
+  kv_len_ = params.kv_len;
+}
+
+void Executor::run(const StepParams& params)
+{
+  set_step(params);
+  if (captured_) {
+    kernels_.replay();
+    return;
+  }
+  for (NodeId id = 0; id < static_cast<NodeId>(graph_.size()); ++id) {
+    run_node(id);
+  }
+}
+
+void Executor::capture(const StepParams& params)
+{
+  set_step(params);
+  cpu::CapturedKernels kernels;
+  {
+    cpu::KernelCapture capture(&kernels);
+    for (NodeId id = 0; id < static_cast<NodeId>(graph_.size()); ++id) {
+      run_node(id);
+    }
+  }
+  kernels_ = std::move(kernels);
+  captured_ = true;
+  LEGRAD_LOG_DEBUG("Captured {} kernel calls for {} nodes", kernels_.size(),
+                   graph_.size());
+}
+
+void Executor::run_node(NodeId id)
+{
+  const Node& node = graph_.node(id);
+  const core::TensorView& out = values_[id];
+  auto in = [&](size_t i) -> const core::TensorView& {
+    return values_[node.inputs[i]];
+  };
+  switch (node.op) {
+    case OpKind::Input:
+    case OpKind::View:
+    case OpKind::Nop:
+      break;
+    case OpKind::Binary:
+      cpu::binary(node.binary, out, in(0), in(1));
+      break;
+    case OpKind::BinaryScalar:
+      cpu::binary_scalar(node.binary, out, in(0), node.scalar);
+      break;
+    case OpKind::Activation:
+      cpu::activation(node.activation, out, in(0));
+      break;
+    case OpKind::RmsNorm:
+      cpu::rms_norm(out, in(0),
+                    node.inputs.size() > 1 ? in(1) : core::TensorView(),
+                    node.scalar);
+      break;
+    case OpKind::RmsNormResidual:
+      // `out` is the storage of the residual (inputs[0]), updated in place
+      cpu::rms_norm_residual(
+          values_[node.aux], out, in(1),
+          node.inputs.size() > 2 ? in(2) : core::TensorView(), node.scalar);
+      break;
+    case OpKind::MatMul: {
+      cpu::GemmEpilogue epilogue;
+      size_t next = 2;
+      if (node.has_bias) {
+        epilogue.bias = in(next++);
+      }
+      epilogue.activation = node.activation;
+      if (node.has_residual) {
+        epilogue.residual = in(next++);
+      }
+      cpu::gemm(out, in(0), in(1), epilogue);
+      break;
+    }
+    case OpKind::Softmax:
+      cpu::softmax(out, in(0), node.scalar);
+      break;
+    case OpKind::Rope:
+      if (out.data != in(0).data) {
+        cpu::cast(out, in(0));
+      }
+      cpu::rope(out,
+                core::TensorView(positions_.data(), TypeInfo::Int32,
+                                 {tokens_}),
+                node.dim, *node.rope);
+      break;
+    case OpKind::CacheWrite: {
+      // Token i goes to positions_[i], whatever the other dims
+      const core::TensorView& src = in(1);
+      std::vector<Int> stride(src.dim(), 0);
+      stride[node.dim] = 1;
+      cpu::scatter(out, node.dim,
+                   core::TensorView(positions_.data(), TypeInfo::Int32,
+                                    src.shape(), stride),
+                   src);
+      break;
+    }
+    case OpKind::Attention:
+      if (graph_.node(node.inputs[1]).op == OpKind::CacheWrite) {
+        cpu::attention(out, in(0), in(1), in(2), node.scalar, node.causal,
+                       &kv_len_);
+      } else {
+        cpu::attention(out, in(0), in(1), in(2), node.scalar, node.causal);
+      }
+      break;
+    case OpKind::FusedElementwise: {
+      std::vector<core::TensorView> inputs;
+      for (size_t i = 0; i < node.inputs.size(); ++i) {
+        inputs.push_back(in(i));
+      }
+      cpu::fused_elementwise(node.program, out, inputs);
+      break;
+    }
+    default:
+      LEGRAD_THROW_ERROR(std::invalid_argument, "Cannot run op {}",
+                         OpKindToString(node.op));
+  }
+}
+}  // namespace legrad::graph
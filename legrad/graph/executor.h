@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "backend/cpu/capture.h"
+#include "core/allocator.h"
+#include "core/buffer.h"
+#include "core/tensor_view.h"
+#include "graph/graph.h"
+#include "graph/planner.h"
+
+namespace legrad::graph
+{
+// What changes from one step (decode token) to the next
+struct StepParams
+{
+  Int position = 0;  // of the first token of the step
+  Int kv_len = 0;  // keys an attention over a cache sees, position + tokens
+};
+
+/*
+ * Runs a graph on the CPU kernels. The values live in one arena from
+ * `allocator`, at the offsets of plan_memory, inputs are read through their
+ * views. Rope and CacheWrite nodes of a graph must all have the same number
+ * of tokens.
+ *
+ * Decode runs the same ops every token, only the position moves: capture()
+ * records the kernel calls of a step once, run() then replays them with the
+ * positions and the KV length of each step read from memory the kernels
+ * point to, without any dispatch, shape check or allocation.
+ *
+ *   Executor exec(graph, &allocator);
+ *   exec.capture({0, 1});
+ *   for (Int pos = 0; pos < n; ++pos) {
+ *     write the token embedding into the x input;
+ *     exec.run({pos, pos + 1});
+ *     read exec.value(logits);
+ *   }
+ */
+class Executor
+{
+public:
+  Executor(const Graph& graph, core::Allocator* allocator);
+
+  // Captured kernels point into the executor
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  /*
+   * Point an input at another tensor of the same shape and dtype. A capture
+   * is dropped, it points to the previous tensor.
+   */
+  void set_input(NodeId id, const core::TensorView& view);
+
+  // Compute every node in order, or replay the captured step
+  void run(const StepParams& params = {});
+
+  /*
+   * Record the kernel calls of a step, nothing is computed: the next runs
+   * replay them. `params` is any valid step, the front-ends check it.
+   */
+  void capture(const StepParams& params = {});
+  bool captured() const { return captured_; }
+  size_t captured_kernels() const { return kernels_.size(); }
+
+  // The value of `id` after run, empty for a Nop without a value
+  const core::TensorView& value(NodeId id) const { return values_.at(id); }
+
+  const Graph& graph() const { return graph_; }
+  const MemoryPlan& plan() const { return plan_; }
+
+private:
+  // The value of an alias: the storage it reuses, through a View
+  void resolve_alias(NodeId id);
+  // Check `params` and store what the kernels read
+  void set_step(const StepParams& params);
+  void run_node(NodeId id);
+
+  Graph graph_;
+  MemoryPlan plan_;
+  core::Buffer arena_;
+  std::vector<core::TensorView> values_;
+
+  Int tokens_ = 0;
+  Int max_position_ = INT64_MAX;  // of the last token + 1
+  Int max_kv_len_ = INT64_MAX;
+  bool reads_cache_ = false;  // an attention reads a CacheWrite
+  std::vector<int32_t> positions_;  // of the tokens of the step
+  Int kv_len_ = 0;
+
+  cpu::CapturedKernels kernels_;
+  bool captured_ = false;
+};
+}  // namespace legrad::graph
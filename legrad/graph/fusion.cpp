@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <vector>
+
+#include "fusion.h"
+#include "macros/log.h"
+
+namespace legrad::graph
+{
+namespace
+{
+using Users = std::vector<std::vector<NodeId>>;
+
+bool is_float(core::TypeInfo dtype)
+{
+  return dtype == core::TypeInfo::Float32 || dtype == core::TypeInfo::Float16;
+}
+
+bool is_elementwise(OpKind op)
+{
+  return op == OpKind::Binary || op == OpKind::BinaryScalar
+      || op == OpKind::Activation || op == OpKind::FusedElementwise;
+}
+
+void make_nop(Node& node)
+{
+  node.op = OpKind::Nop;
+  node.inputs.clear();
+  node.program = cpu::FusedProgram();
+}
+
+// The only reader of `id`, NO_NODE if there are several or it is an output
+NodeId single_user(const Graph& graph, const Users& users, NodeId id)
+{
+  if (graph.is_output(id) || users[id].size() != 1) {
+    return NO_NODE;
+  }
+  return users[id][0];
+}
+
+// The operand of a binary node that is not `id`, NO_NODE if both are
+NodeId other_operand(const Node& node, NodeId id)
+{
+  if (node.inputs[0] == node.inputs[1]) {
+    return NO_NODE;
+  }
+  return node.inputs[0] == id ? node.inputs[1] : node.inputs[0];
+}
+
+// A later node reads the storage of `id` through a view of it
+bool has_view(const Graph& graph, const Users& users, NodeId id)
+{
+  return std::any_of(users[id].begin(), users[id].end(), [&](NodeId user)
+                     { return graph.node(user).alias == id; });
+}
+
+uint16_t index_of(const std::vector<NodeId>& ids, NodeId id)
+{
+  return static_cast<uint16_t>(std::find(ids.begin(), ids.end(), id)
+                               - ids.begin());
+}
+
+// An elementwise node as a program over its (distinct) inputs
+void to_program(const Node& node,
+                cpu::FusedProgram& program,
+                std::vector<NodeId>& inputs)
+{
+  if (node.op == OpKind::FusedElementwise) {
+    program = node.program;
+    inputs = node.inputs;
+    return;
+  }
+  inputs = {node.inputs[0]};
+  if (node.op == OpKind::Binary && node.inputs[1] != node.inputs[0]) {
+    inputs.push_back(node.inputs[1]);
+  }
+  program = cpu::FusedProgram(static_cast<uint16_t>(inputs.size()));
+  switch (node.op) {
+    case OpKind::Binary:
+      program.binary(node.binary, 0, static_cast<uint16_t>(inputs.size() - 1));
+      break;
+    case OpKind::BinaryScalar:
+      program.binary_scalar(node.binary, 0, node.scalar);
+      break;
+    default:
+      program.activation(node.activation, 0);
+  }
+}
+
+int fuse_norms(Graph& graph)
+{
+  int fused = 0;
+  Users users = graph.users();
+  for (NodeId id = 0; id < static_cast<NodeId>(graph.size()); ++id) {
+    if (graph.node(id).op != OpKind::RmsNorm) {
+      continue;
+    }
+
+    // norm(x) * w -> norm(x, w), the new norm is visited when we get there
+    if (graph.node(id).inputs.size() == 1) {
+      const NodeId user = single_user(graph, users, id);
+      if (user != NO_NODE) {
+        Node& mul = graph.node(user);
+        const NodeId weight =
+            mul.op == OpKind::Binary && mul.binary == cpu::BinaryOp::Mul
+                ? other_operand(mul, id)
+                : NO_NODE;
+        Node& norm = graph.node(id);
+        if (weight != NO_NODE && mul.shape == norm.shape
+            && graph.node(weight).shape == std::vector<Int>{norm.shape.back()}
+            && is_float(graph.node(weight).dtype))
+        {
+          mul.op = OpKind::RmsNorm;
+          mul.inputs = {norm.inputs[0], weight};
+          mul.scalar = norm.scalar;
+          make_nop(norm);
+          ++fused;
+          users = graph.users();
+          continue;
+        }
+      }
+    }
+
+    /*
+     * h = r + x; norm(h) -> rms_norm_residual at the add: r is updated in
+     * place (h takes its storage) and the norm comes out in the same pass.
+     * Only when nothing reads r after the add and the weight is there.
+     */
+    Node& norm = graph.node(id);
+    const NodeId sum_id = norm.inputs[0];
+    Node& sum = graph.node(sum_id);
+    if (sum.op != OpKind::Binary || sum.binary != cpu::BinaryOp::Add
+        || sum.inputs[0] == sum.inputs[1] || sum.shape != norm.shape
+        || !is_float(sum.dtype)
+        || (norm.inputs.size() > 1 && norm.inputs[1] > sum_id))
+    {
+      continue;
+    }
+    for (const NodeId residual : sum.inputs) {
+      const NodeId in = other_operand(sum, residual);
+      const Node& r = graph.node(residual);
+      if (r.op == OpKind::Input || graph.is_output(residual)
+          || (r.alias != NO_NODE && r.op != OpKind::RmsNormResidual)
+          || has_view(graph, users, residual) || r.shape != sum.shape
+          || graph.node(in).shape != sum.shape
+          || users[residual].back() != sum_id)
+      {
+        continue;
+      }
+      std::vector<NodeId> inputs = {residual, in};
+      if (norm.inputs.size() > 1) {
+        inputs.push_back(norm.inputs[1]);
+      }
+      sum.op = OpKind::RmsNormResidual;
+      sum.inputs = inputs;
+      sum.scalar = norm.scalar;
+      sum.alias = residual;
+      sum.aux = id;
+      make_nop(norm);
+      ++fused;
+      users = graph.users();
+      break;
+    }
+  }
+  return fused;
+}
+
+int fuse_epilogues(Graph& graph)
+{
+  int fused = 0;
+  Users users = graph.users();
+  for (NodeId id = 0; id < static_cast<NodeId>(graph.size()); ++id) {
+    const Node& matmul = graph.node(id);
+    if (matmul.op != OpKind::MatMul || matmul.inputs.size() != 2) {
+      continue;
+    }
+
+    /*
+     * Follow the single readers: bias add, activation, residual add, in
+     * this order and each one optional
+     */
+    enum Stage { START, BIAS, ACTIVATION, RESIDUAL };
+    Stage stage = START;
+    NodeId bias = NO_NODE, residual = NO_NODE;
+    cpu::Activation activation = cpu::Activation::None;
+    std::vector<NodeId> absorbed;
+    NodeId last = id;
+    while (stage != RESIDUAL) {
+      const NodeId user = single_user(graph, users, last);
+      if (user == NO_NODE || graph.node(user).shape != matmul.shape) {
+        break;
+      }
+      const Node& node = graph.node(user);
+      if (node.op == OpKind::Binary && node.binary == cpu::BinaryOp::Add) {
+        const NodeId other = other_operand(node, last);
+        if (other == NO_NODE) {
+          break;
+        }
+        const std::vector<Int>& shape = graph.node(other).shape;
+        if (stage == START && shape == std::vector<Int>{matmul.shape[1]}) {
+          bias = other;
+          stage = BIAS;
+        } else if (shape == matmul.shape) {
+          residual = other;
+          stage = RESIDUAL;
+        } else {
+          break;
+        }
+      } else if (node.op == OpKind::Activation && stage < ACTIVATION) {
+        activation = node.activation;
+        stage = ACTIVATION;
+      } else {
+        break;
+      }
+      absorbed.push_back(last);
+      last = user;
+    }
+    if (last == id) {
+      continue;
+    }
+
+    // The fused matmul runs where the last op was, after all its inputs
+    Node& out = graph.node(last);
+    out.op = OpKind::MatMul;
+    out.inputs = matmul.inputs;
+    out.has_bias = bias != NO_NODE;
+    out.has_residual = residual != NO_NODE;
+    out.activation = activation;
+    if (out.has_bias) {
+      out.inputs.push_back(bias);
+    }
+    if (out.has_residual) {
+      out.inputs.push_back(residual);
+    }
+    for (const NodeId node : absorbed) {
+      make_nop(graph.node(node));
+    }
+    fused += static_cast<int>(absorbed.size());
+    users = graph.users();
+  }
+  return fused;
+}
+
+int fuse_elementwise(Graph& graph)
+{
+  int fused = 0;
+  Users users = graph.users();
+  for (NodeId id = 0; id < static_cast<NodeId>(graph.size()); ++id) {
+    Node& node = graph.node(id);
+    if (!is_elementwise(node.op) || !is_float(node.dtype)) {
+      continue;
+    }
+    cpu::FusedProgram program;
+    std::vector<NodeId> inputs;
+    to_program(node, program, inputs);
+
+    // Inline producers read by this node only, until none is left
+    bool merged = false;
+    for (size_t k = 0; k < inputs.size();) {
+      const NodeId producer_id = inputs[k];
+      Node& producer = graph.node(producer_id);
+      if (!is_elementwise(producer.op) || !is_float(producer.dtype)
+          || producer.shape != node.shape
+          || single_user(graph, users, producer_id) != id)
+      {
+        ++k;
+        continue;
+      }
+      cpu::FusedProgram inner;
+      std::vector<NodeId> inner_inputs;
+      to_program(producer, inner, inner_inputs);
+      std::vector<NodeId> merged_inputs = inputs;
+      merged_inputs.erase(merged_inputs.begin() + k);
+      for (const NodeId input : inner_inputs) {
+        if (index_of(merged_inputs, input) == merged_inputs.size()) {
+          merged_inputs.push_back(input);
+        }
+      }
+      if (merged_inputs.size() > cpu::FUSED_MAX_INPUTS) {
+        ++k;
+        continue;
+      }
+
+      // The producer first, then this node reading its result
+      cpu::FusedProgram merged_program(
+          static_cast<uint16_t>(merged_inputs.size()));
+      std::vector<uint16_t> map;
+      for (const NodeId input : inner_inputs) {
+        map.push_back(index_of(merged_inputs, input));
+      }
+      const uint16_t produced = merged_program.append(inner, map);
+      map.clear();
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        map.push_back(i == k ? produced : index_of(merged_inputs, inputs[i]));
+      }
+      merged_program.append(program, map);
+
+      program = std::move(merged_program);
+      inputs = std::move(merged_inputs);
+      make_nop(producer);
+      merged = true;
+      ++fused;
+      node.inputs = inputs;
+      users = graph.users();
+      k = 0;
+    }
+    if (merged) {
+      program.compact();
+      node.op = OpKind::FusedElementwise;
+      node.program = std::move(program);
+      node.inputs = std::move(inputs);
+    }
+  }
+  return fused;
+}
+}  // namespace
+
+FusionStats fuse(Graph& graph)
+{
+  FusionStats stats;
+  stats.norms = fuse_norms(graph);
+  stats.epilogues = fuse_epilogues(graph);
+  stats.elementwise = fuse_elementwise(graph);
+  LEGRAD_LOG_INFO("Fused {} norms, {} matmul epilogues, {} elementwise ops",
+                  stats.norms, stats.epilogues, stats.elementwise);
+  return stats;
+}
+}  // namespace legrad::graph
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "graph/graph.h"
+
+namespace legrad::graph
+{
+struct FusionStats
+{
+  int norms = 0;  // weight multiplies and residual adds merged into norms
+  int epilogues = 0;  // bias, activation and residual merged into matmuls
+  int elementwise = 0;  // elementwise ops merged into another one
+};
+
+/*
+ * Merge the small memory-bound ops of `graph` into the kernels next to them,
+ * so each value is read and written once instead of once per op:
+ * - RmsNorm followed by a multiply with a [dim] vector becomes a norm with
+ *   that weight, an Add feeding a RmsNorm becomes a RmsNormResidual that
+ *   updates the residual stream in place (when the Add is the last reader
+ *   of the residual)
+ * - MatMul followed by a bias Add, an Activation and a residual Add (each
+ *   one optional, in that order) becomes a MatMul with a GEMM epilogue
+ * - Chains of elementwise ops of the same shape become FusedElementwise
+ *   nodes, as long as the intermediate values have a single reader and at
+ *   most cpu::FUSED_MAX_INPUTS inputs are read
+ * A value marked as an output is never fused away. Node ids stay valid: the
+ * absorbed nodes become Nop.
+ */
+FusionStats fuse(Graph& graph);
+}  // namespace legrad::graph
@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "backend/cpu/loops.h"
+#include "graph.h"
+#include "macros/log.h"
+
+namespace legrad::graph
+{
+namespace
+{
+std::string shape_string(const std::vector<Int>& shape)
+{
+  std::string str = "[";
+  for (size_t i = 0; i < shape.size(); ++i) {
+    str += (i > 0 ? ", " : "") + std::to_string(shape[i]);
+  }
+  return str + "]";
+}
+}  // namespace
+
+NodeId Graph::add_node(Node node)
+{
+  for (const NodeId input : node.inputs) {
+    LEGRAD_CHECK_AND_THROW(input >= 0 && input < static_cast<NodeId>(size()),
+                           std::invalid_argument,
+                           "Node input %{} is not in the graph", input);
+  }
+  nodes_.push_back(std::move(node));
+  return static_cast<NodeId>(nodes_.size() - 1);
+}
+
+NodeId Graph::input(const core::TensorView& view, std::string name)
+{
+  Node node;
+  node.op = OpKind::Input;
+  node.dtype = view.dtype;
+  node.shape.assign(view.shape().begin(), view.shape().end());
+  node.name = std::move(name);
+  node.view = view;
+  return add_node(std::move(node));
+}
+
+NodeId Graph::binary(cpu::BinaryOp op, NodeId a, NodeId b)
+{
+  Node node;
+  node.op = OpKind::Binary;
+  node.binary = op;
+  node.inputs = {a, b};
+  const Node& lhs = nodes_.at(a);
+  const Node& rhs = nodes_.at(b);
+  LEGRAD_CHECK_AND_THROW(lhs.dtype == rhs.dtype, std::invalid_argument,
+                         "BinaryOp {} expects the same dtype, got {} and {}",
+                         cpu::BinaryOpToString(op),
+                         core::TypeInfoToString(lhs.dtype),
+                         core::TypeInfoToString(rhs.dtype));
+  node.dtype = lhs.dtype;
+  node.shape = cpu::broadcast_shapes(lhs.shape, rhs.shape);
+  return add_node(std::move(node));
+}
+
+NodeId Graph::binary_scalar(cpu::BinaryOp op, NodeId a, float scalar)
+{
+  Node node;
+  node.op = OpKind::BinaryScalar;
+  node.binary = op;
+  node.scalar = scalar;
+  node.inputs = {a};
+  node.dtype = nodes_.at(a).dtype;
+  node.shape = nodes_.at(a).shape;
+  return add_node(std::move(node));
+}
+
+NodeId Graph::activation(cpu::Activation act, NodeId x)
+{
+  Node node;
+  node.op = OpKind::Activation;
+  node.activation = act;
+  node.inputs = {x};
+  node.dtype = nodes_.at(x).dtype;
+  node.shape = nodes_.at(x).shape;
+  return add_node(std::move(node));
+}
+
+NodeId Graph::rms_norm(NodeId x, NodeId weight, float eps)
+{
+  Node node;
+  node.op = OpKind::RmsNorm;
+  node.scalar = eps;
+  node.inputs = {x};
+  const Node& in = nodes_.at(x);
+  LEGRAD_CHECK_AND_THROW(!in.shape.empty(), std::invalid_argument,
+                         "RMSNorm expects at least 1 dim, got a scalar", 0);
+  if (weight != NO_NODE) {
+    const Node& w = nodes_.at(weight);
+    LEGRAD_CHECK_AND_THROW(
+        w.shape.size() == 1 && w.shape[0] == in.shape.back(),
+        std::invalid_argument, "RMSNorm weight must be [{}], got {}",
+        in.shape.back(), shape_string(w.shape));
+    node.inputs.push_back(weight);
+  }
+  node.dtype = in.dtype;
+  node.shape = in.shape;
+  return add_node(std::move(node));
+}
+
+NodeId Graph::matmul(NodeId a, NodeId b)
+{
+  Node node;
+  node.op = OpKind::MatMul;
+  node.inputs = {a, b};
+  const Node& lhs = nodes_.at(a);
+  const Node& rhs = nodes_.at(b);
+  LEGRAD_CHECK_AND_THROW(
+      lhs.shape.size() == 2 && rhs.shape.size() == 2
+          && lhs.shape[1] == rhs.shape[0],
+      std::invalid_argument, "MatMul shape mismatch: {} @ {}",
+      shape_string(lhs.shape), shape_string(rhs.shape));
+  node.dtype = lhs.dtype;
+  node.shape = {lhs.shape[0], rhs.shape[1]};
+  return add_node(std::move(node));
+}
+
+NodeId Graph::softmax(NodeId x, float scale)
+{
+  Node node;
+  node.op = OpKind::Softmax;
+  node.scalar = scale;
+  node.inputs = {x};
+  node.dtype = nodes_.at(x).dtype;
+  node.shape = nodes_.at(x).shape;
+  return add_node(std::move(node));
+}
+
+NodeId Graph::rope(NodeId x, size_t pos_dim, const cpu::RopeCache& cache)
+{
+  Node node;
+  node.op = OpKind::Rope;
+  node.inputs = {x};
+  node.dim = static_cast<Int>(pos_dim);
+  node.rope = &cache;
+  const Node& in = nodes_.at(x);
+  LEGRAD_CHECK_AND_THROW(in.shape.size() >= 2 && pos_dim < in.shape.size() - 1,
+                         std::invalid_argument,
+                         "RoPE position dim {} is not a leading dim of {}",
+                         pos_dim, shape_string(in.shape));
+  node.dtype = in.dtype;
+  node.shape = in.shape;
+  return add_node(std::move(node));
+}
+
+NodeId Graph::cache_write(NodeId cache, NodeId src, size_t seq_dim)
+{
+  Node node;
+  node.op = OpKind::CacheWrite;
+  node.inputs = {cache, src};
+  node.dim = static_cast<Int>(seq_dim);
+  node.alias = cache;
+  const Node& dst = nodes_.at(cache);
+  const Node& in = nodes_.at(src);
+  LEGRAD_CHECK_AND_THROW(dst.op == OpKind::Input, std::invalid_argument,
+                         "Cache %{} must be an input", cache);
+  bool shape_ok =
+      dst.shape.size() == in.shape.size() && seq_dim < dst.shape.size();
+  for (size_t d = 0; d < in.shape.size() && shape_ok; ++d) {
+    shape_ok = d == seq_dim ? in.shape[d] <= dst.shape[d]
+                            : in.shape[d] == dst.shape[d];
+  }
+  LEGRAD_CHECK_AND_THROW(shape_ok, std::invalid_argument,
+                         "Cannot write {} into a {} cache along dim {}",
+                         shape_string(in.shape), shape_string(dst.shape),
+                         seq_dim);
+  node.dtype = dst.dtype;
+  node.shape = dst.shape;
+  return add_node(std::move(node));
+}
+
+NodeId Graph::view(NodeId x,
+                   std::vector<Int> shape,
+                   std::vector<Int> stride,
+                   Int offset)
+{
+  Node node;
+  node.op = OpKind::View;
+  node.inputs = {x};
+  node.alias = x;
+  const Node& in = nodes_.at(x);
+  const bool contiguous =
+      in.op == OpKind::Input ? in.view.is_contiguous()
+      : in.op == OpKind::View
+          ? core::TensorView(nullptr, in.dtype, in.shape, in.stride)
+                .is_contiguous()
+          : true;
+  LEGRAD_CHECK_AND_THROW(contiguous && offset >= 0, std::invalid_argument,
+                         "View of %{} needs a contiguous input", x);
+  LEGRAD_CHECK_AND_THROW(shape.size() == stride.size(), std::invalid_argument,
+                         "View has {} dims but {} strides", shape.size(),
+                         stride.size());
+  // Last element reached, every element of the view must be in x
+  Int end = offset + 1;
+  for (size_t d = 0; d < shape.size(); ++d) {
+    LEGRAD_CHECK_AND_THROW(shape[d] >= 0 && stride[d] >= 0,
+                           std::invalid_argument,
+                           "View {} has a negative size or stride",
+                           shape_string(shape));
+    end += shape[d] > 0 ? (shape[d] - 1) * stride[d] : 0;
+  }
+  node.shape = std::move(shape);
+  LEGRAD_CHECK_AND_THROW(node.numel() == 0 || end <= in.numel(),
+                         std::invalid_argument,
+                         "View {} with strides {} goes past the {} elements "
+                         "of %{}",
+                         shape_string(node.shape), shape_string(stride),
+                         in.numel(), x);
+  node.stride = std::move(stride);
+  node.offset = offset;
+  node.dtype = in.dtype;
+  return add_node(std::move(node));
+}
+
+NodeId Graph::attention(NodeId q, NodeId k, NodeId v, float scale, bool causal)
+{
+  Node node;
+  node.op = OpKind::Attention;
+  node.inputs = {q, k, v};
+  node.scalar = scale;
+  node.causal = causal;
+  const Node& query = nodes_.at(q);
+  const Node& value = nodes_.at(v);
+  LEGRAD_CHECK_AND_THROW(
+      (query.shape.size() == 3 || query.shape.size() == 4)
+          && value.shape.size() == query.shape.size()
+          && nodes_.at(k).shape.size() == query.shape.size(),
+      std::invalid_argument,
+      "Attention expects [batch,] heads, seq, dim operands, got q {}",
+      shape_string(query.shape));
+  node.dtype = query.dtype;
+  node.shape = query.shape;
+  node.shape.back() = value.shape.back();
+  return add_node(std::move(node));
+}
+
+void Graph::mark_output(NodeId id)
+{
+  LEGRAD_CHECK_AND_THROW(id >= 0 && id < static_cast<NodeId>(size()),
+                         std::invalid_argument,
+                         "Output %{} is not in the graph", id);
+  if (!is_output(id)) {
+    outputs_.push_back(id);
+  }
+}
+
+bool Graph::is_output(NodeId id) const
+{
+  return std::find(outputs_.begin(), outputs_.end(), id) != outputs_.end();
+}
+
+std::vector<std::vector<NodeId>> Graph::users() const
+{
+  std::vector<std::vector<NodeId>> users(size());
+  for (NodeId id = 0; id < static_cast<NodeId>(size()); ++id) {
+    for (const NodeId input : nodes_[id].inputs) {
+      // A node reading a value twice is one user
+      if (users[input].empty() || users[input].back() != id) {
+        users[input].push_back(id);
+      }
+    }
+  }
+  return users;
+}
+
+std::string Graph::to_string() const
+{
+  std::string str;
+  for (NodeId id = 0; id < static_cast<NodeId>(size()); ++id) {
+    const Node& node = nodes_[id];
+    if (node.op == OpKind::Nop) {
+      continue;
+    }
+    str += "%" + std::to_string(id) + " = " + OpKindToString(node.op);
+    switch (node.op) {
+      case OpKind::Binary:
+      case OpKind::BinaryScalar:
+        str += std::string(".") + cpu::BinaryOpToString(node.binary);
+        break;
+      case OpKind::Activation:
+        str += std::string(".") + cpu::ActivationToString(node.activation);
+        break;
+      default:
+        break;
+    }
+    str += "(";
+    for (size_t i = 0; i < node.inputs.size(); ++i) {
+      str += (i > 0 ? ", %" : "%") + std::to_string(node.inputs[i]);
+    }
+    str += ") " + shape_string(node.shape) + " "
+         + core::TypeInfoToString(node.dtype);
+    if (!node.name.empty()) {
+      str += " \"" + node.name + "\"";
+    }
+    if (node.op == OpKind::Rope || node.op == OpKind::CacheWrite) {
+      str += " dim " + std::to_string(node.dim);
+    }
+    if (node.op == OpKind::MatMul && node.activation != cpu::Activation::None)
+    {
+      str += std::string(" ") + cpu::ActivationToString(node.activation);
+    }
+    if (node.op == OpKind::FusedElementwise) {
+      str += " {" + node.program.to_string() + "}";
+    }
+    if (node.aux != NO_NODE) {
+      str += " norm -> %" + std::to_string(node.aux);
+    }
+    if (node.alias != NO_NODE) {
+      str += " in place of %" + std::to_string(node.alias);
+    }
+    if (is_output(id)) {
+      str += " output";
+    }
+    str += "\n";
+  }
+  return str;
+}
+}  // namespace legrad::graph
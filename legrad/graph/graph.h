@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "backend/cpu/elementwise.h"
+#include "backend/cpu/fused.h"
+#include "backend/cpu/rope.h"
+#include "core/dtype.h"
+#include "core/tensor_view.h"
+#include "internal/enum_impl.h"
+
+namespace legrad::graph
+{
+/*
+ * Ops of a graph node. Fusion (see fusion.h) turns chains of them into:
+ * - FusedElementwise: a cpu::FusedProgram over the node inputs
+ * - RmsNormResidual: value = residual + in, written in place of the
+ *   residual, and its norm written to the value of node `aux`
+ * - MatMul with an epilogue: bias, activation and residual inputs
+ * - Nop: absorbed into another node, its value (if any) is written there
+ * View is its input with another shape and strides, no op runs for it.
+ * Rope and CacheWrite use the positions of the step being run, Attention
+ * over a CacheWrite the keys cached so far (see Executor).
+ */
+LEGRAD_ENUM(OpKind,
+            uint8_t,
+            Input,
+            Nop,
+            Input,
+            Binary,
+            BinaryScalar,
+            Activation,
+            RmsNorm,
+            RmsNormResidual,
+            MatMul,
+            Softmax,
+            Rope,
+            CacheWrite,
+            Attention,
+            View,
+            FusedElementwise,
+            Nop,
+            COUNT)
+
+using NodeId = int32_t;
+constexpr NodeId NO_NODE = -1;
+
+struct Node
+{
+  OpKind op = OpKind::Input;
+  std::vector<NodeId> inputs;
+  core::TypeInfo dtype = core::TypeInfo::Float32;
+  std::vector<Int> shape;
+  std::string name;
+
+  // Input: the tensor itself
+  core::TensorView view;
+
+  // Attributes, each op reads its own
+  cpu::BinaryOp binary = cpu::BinaryOp::Add;
+  cpu::Activation activation = cpu::Activation::None;  // MatMul epilogue too
+  float scalar = 0.0f;  // BinaryScalar, Softmax/Attention scale, RMSNorm eps
+  bool has_bias = false;  // MatMul: inputs {a, b, [bias], [residual]}
+  bool has_residual = false;
+  cpu::FusedProgram program;  // FusedElementwise
+  NodeId aux = NO_NODE;  // RmsNormResidual: the node of the norm
+  NodeId alias = NO_NODE;  // the value lives in the storage of this node
+  Int dim = 0;  // Rope, CacheWrite: the dim of the tokens
+  const cpu::RopeCache* rope = nullptr;
+  bool causal = false;  // Attention
+  std::vector<Int> stride;  // View, in elements of the input
+  Int offset = 0;  // View: first element of the input
+
+  Int numel() const
+  {
+    Int n = 1;
+    for (const Int size : shape) {
+      n *= size;
+    }
+    return n;
+  }
+};
+
+/*
+ * A forward pass as a graph: nodes are ops on tensors and their inputs are
+ * earlier nodes, so the order of the nodes is an execution order. Build it
+ * with the op methods (shapes and dtypes are checked and inferred there),
+ * mark the values to keep with mark_output, fuse it and run it with an
+ * Executor:
+ *
+ *   Graph g;
+ *   auto x = g.input(hidden, "x");
+ *   auto h = g.add(x, g.matmul(g.rms_norm(x, g.input(norm_w), eps), wq));
+ *   g.mark_output(h);
+ *   fuse(g);
+ *   Executor exec(g, &allocator);
+ *   exec.run();
+ */
+class Graph
+{
+public:
+  // An external tensor (weights, activations), only cache_write writes it
+  NodeId input(const core::TensorView& view, std::string name = "");
+
+  NodeId binary(cpu::BinaryOp op, NodeId a, NodeId b);
+  NodeId binary_scalar(cpu::BinaryOp op, NodeId a, float scalar);
+  NodeId activation(cpu::Activation act, NodeId x);
+  // weight is NO_NODE for a norm without weight
+  NodeId rms_norm(NodeId x, NodeId weight, float eps);
+  // 2-D [M, K] @ [K, N]
+  NodeId matmul(NodeId a, NodeId b);
+  NodeId softmax(NodeId x, float scale = 1.0f);
+  // Rotate the tokens of dim `pos_dim` of x, they are at the step positions
+  NodeId rope(NodeId x, size_t pos_dim, const cpu::RopeCache& cache);
+  /*
+   * Store the tokens of `src` in `cache` (an input, e.g. [kv_heads, max_len,
+   * head_dim]) at the step positions along `seq_dim`. Its value is the cache,
+   * an attention reading it sees the first kv_len keys of the step.
+   */
+  NodeId cache_write(NodeId cache, NodeId src, size_t seq_dim);
+  /*
+   * `x` seen with another shape and element strides from element `offset`
+   * (a reshape, a permute, Q out of a fused QKV projection), x must be a
+   * contiguous value
+   */
+  NodeId view(NodeId x,
+              std::vector<Int> shape,
+              std::vector<Int> stride,
+              Int offset = 0);
+  // [batch,] heads, seq, dim operands, see cpu::attention
+  NodeId attention(NodeId q, NodeId k, NodeId v, float scale, bool causal);
+
+  NodeId add(NodeId a, NodeId b) { return binary(cpu::BinaryOp::Add, a, b); }
+  NodeId mul(NodeId a, NodeId b) { return binary(cpu::BinaryOp::Mul, a, b); }
+
+  // Keep the value of `id` after a run (an Executor can read it)
+  void mark_output(NodeId id);
+  bool is_output(NodeId id) const;
+  const std::vector<NodeId>& outputs() const { return outputs_; }
+
+  size_t size() const { return nodes_.size(); }
+  const Node& node(NodeId id) const { return nodes_.at(id); }
+  Node& node(NodeId id) { return nodes_.at(id); }
+
+  // Nodes reading the value of each node, in order
+  std::vector<std::vector<NodeId>> users() const;
+
+  // One line per node, Nop nodes are skipped
+  std::string to_string() const;
+
+private:
+  NodeId add_node(Node node);
+
+  std::vector<Node> nodes_;
+  std::vector<NodeId> outputs_;
+};
+}  // namespace legrad::graph
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "macros/log.h"
+#include "planner.h"
+
+namespace legrad::graph
+{
+namespace
+{
+struct Block
+{
+  size_t offset;
+  size_t bytes;
+  NodeId first;
+  NodeId last;
+};
+
+size_t round_up(size_t nbytes, size_t multiple)
+{
+  return (nbytes + multiple - 1) / multiple * multiple;
+}
+}  // namespace
+
+MemoryPlan plan_memory(const Graph& graph, size_t alignment)
+{
+  LEGRAD_CHECK_AND_THROW(
+      alignment > 0 && (alignment & (alignment - 1)) == 0,
+      std::invalid_argument, "Alignment must be a power of 2, got {}",
+      alignment);
+  const NodeId size = static_cast<NodeId>(graph.size());
+  const auto users = graph.users();
+
+  // Lifetime of every value, then of the storage of the alias roots
+  std::vector<NodeId> first(size), last(size);
+  std::vector<bool> written(size, false);
+  for (NodeId id = 0; id < size; ++id) {
+    const Node& node = graph.node(id);
+    first[id] = id;
+    last[id] = graph.is_output(id) ? size
+             : users[id].empty()   ? id
+                                   : users[id].back();
+    written[id] = written[id] || node.op != OpKind::Nop;
+    if (node.aux != NO_NODE) {
+      // Fusion keeps the written value after its writer
+      first[node.aux] = std::min(first[node.aux], id);
+      written[node.aux] = true;
+    }
+  }
+  std::vector<NodeId> root(size);
+  for (NodeId id = 0; id < size; ++id) {
+    const NodeId alias = graph.node(id).alias;
+    root[id] = alias == NO_NODE ? id : root[alias];
+    first[root[id]] = std::min(first[root[id]], first[id]);
+    last[root[id]] = std::max(last[root[id]], last[id]);
+  }
+
+  std::vector<NodeId> order;
+  for (NodeId id = 0; id < size; ++id) {
+    const Node& node = graph.node(id);
+    if (written[id] && root[id] == id && node.op != OpKind::Input) {
+      order.push_back(id);
+    }
+  }
+  auto nbytes = [&](NodeId id)
+  {
+    const Node& node = graph.node(id);
+    return round_up(node.numel() * core::type_size(node.dtype), alignment);
+  };
+  std::stable_sort(order.begin(), order.end(),
+                   [&](NodeId a, NodeId b) { return nbytes(a) > nbytes(b); });
+
+  MemoryPlan plan;
+  plan.offsets.assign(size, NO_OFFSET);
+  std::vector<Block> placed;
+  std::vector<const Block*> live;
+  for (const NodeId id : order) {
+    const size_t bytes = nbytes(id);
+    live.clear();
+    for (const Block& block : placed) {
+      if (block.first <= last[id] && first[id] <= block.last) {
+        live.push_back(&block);
+      }
+    }
+    std::sort(live.begin(), live.end(), [](const Block* a, const Block* b)
+              { return a->offset < b->offset; });
+    // Lowest gap between the blocks alive at the same time
+    size_t offset = 0;
+    for (const Block* block : live) {
+      if (offset + bytes <= block->offset) {
+        break;
+      }
+      offset = std::max(offset, block->offset + block->bytes);
+    }
+    placed.push_back({offset, bytes, first[id], last[id]});
+    plan.offsets[id] = offset;
+    plan.bytes = std::max(plan.bytes, offset + bytes);
+  }
+  LEGRAD_LOG_DEBUG("Memory plan: {} values in {} KiB", order.size(),
+                   plan.bytes / 1024);
+  return plan;
+}
+}  // namespace legrad::graph
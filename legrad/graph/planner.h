@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "graph/graph.h"
+
+namespace legrad::graph
+{
+constexpr size_t NO_OFFSET = SIZE_MAX;
+
+// Where each value of a graph lives in one arena
+struct MemoryPlan
+{
+  // Per node, NO_OFFSET for inputs, values computed in place and Nop nodes
+  std::vector<size_t> offsets;
+  size_t bytes = 0;
+};
+
+/*
+ * Offsets of the values of `graph` in a single arena. A value lives from the
+ * node writing it to its last reader (to the end for outputs), two values
+ * share bytes when their lifetimes do not overlap, so the arena is about the
+ * size of the widest point of the graph instead of the sum of its values.
+ * A value computed in place (alias) extends the lifetime of the storage it
+ * reuses. Greedy: the largest values first, each one at the lowest offset
+ * (a multiple of `alignment`) where it fits.
+ */
+MemoryPlan plan_memory(const Graph& graph, size_t alignment = 64);
+}  // namespace legrad::graph
@@ -1,11 +1,15 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <istream>
 #include <map>
+#include <stdexcept>
 #include <string>
 #include <type_traits>
+#include <vector>
 
 #include "gguf_def.h"
 #include "macros/expr.h"